@@ -0,0 +1,33 @@
+#ifndef IPOPT_OPTIONS_H
+#define IPOPT_OPTIONS_H
+
+#include "coin-or/IpIpoptApplication.hpp"
+
+#include "trots.h"
+
+//IPOPT options shared by the serial and the MPI driver.
+
+//An IPOPT application with the options used for all TROTS solves. Options can still be changed before Initialize.
+inline Ipopt::SmartPtr<Ipopt::IpoptApplication> make_ipopt_application(HessianMode hessian_mode, int max_iter) {
+    Ipopt::SmartPtr<Ipopt::IpoptApplication> app = IpoptApplicationFactory();
+    if (hessian_mode == HessianMode::LimitedMemory)
+        app->Options()->SetStringValue("hessian_approximation", "limited-memory");
+    app->Options()->SetStringValue("mu_strategy", "adaptive");
+    app->Options()->SetStringValue("adaptive_mu_globalization", "kkt-error");
+    app->Options()->SetIntegerValue("max_iter", max_iter);
+    app->Options()->SetNumericValue("tol", 1e-9);
+    return app;
+}
+
+//Tells IPOPT to start from the given multipliers too, and to not push the warm start point far into the interior.
+inline void set_warm_start_options(Ipopt::OptionsList& options, double mu_init) {
+    options.SetStringValue("warm_start_init_point", "yes");
+    options.SetNumericValue("warm_start_bound_push", 1e-9);
+    options.SetNumericValue("warm_start_bound_frac", 1e-9);
+    options.SetNumericValue("warm_start_slack_bound_push", 1e-9);
+    options.SetNumericValue("warm_start_slack_bound_frac", 1e-9);
+    options.SetNumericValue("warm_start_mult_bound_push", 1e-9);
+    options.SetNumericValue("mu_init", mu_init);
+}
+
+#endif
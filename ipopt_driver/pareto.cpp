@@ -0,0 +1,318 @@
+#include "pareto.h"
+
+#include "view_solves.h"
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+namespace {
+    enum class AxisTarget { Weight, ObjRhs, Rhs };
+
+    //A setting that is varied over [lo, hi]. Points store their position on each axis as a coordinate in [0, 1],
+    //which maps linearly, or with log_scale geometrically, to the value of the setting.
+    struct Axis {
+        AxisTarget target;
+        int idx;
+        double lo;
+        double hi;
+        int num_steps;
+        bool log_scale;
+
+        double value_at(double coord) const {
+            if (this->log_scale)
+                return this->lo * std::pow(this->hi / this->lo, coord);
+            return this->lo + coord * (this->hi - this->lo);
+        }
+
+        std::string name() const {
+            const char* target_name = this->target == AxisTarget::Weight ? "weight"
+                                    : this->target == AxisTarget::ObjRhs ? "obj_rhs" : "rhs";
+            return std::string(target_name) + "[" + std::to_string(this->idx) + "]";
+        }
+    };
+
+    struct ParetoPoint {
+        std::vector<double> coords;
+        //Index of the point the solve was warm started from, -1 for a cold start
+        int warm_start_from = -1;
+        bool solved = false;
+        ViewSolveResult result;
+        //Unweighted objective values, in the order of TROTSProblem::objective_entries
+        std::vector<double> obj_vals;
+        std::vector<double> cons_vals;
+    };
+
+    //Parses "<idx>:<lo>:<hi>:<steps>[:log],..." for the entries selected by target.
+    std::vector<Axis> parse_axes(const std::string& spec, AxisTarget target, size_t num_entries,
+                                 const std::string& option) {
+        std::vector<Axis> axes;
+        std::istringstream stream{spec};
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            std::vector<std::string> fields;
+            std::istringstream item_stream{item};
+            for (std::string field; std::getline(item_stream, field, ':');)
+                fields.push_back(field);
+            if (fields.size() != 4 && !(fields.size() == 5 && fields[4] == "log"))
+                throw std::invalid_argument("Expected <index>:<lo>:<hi>:<steps>[:log] in --" + option + ", got " + item);
+
+            Axis axis{target, std::stoi(fields[0]), std::stod(fields[1]), std::stod(fields[2]),
+                      std::stoi(fields[3]), fields.size() == 5};
+            if (axis.idx < 0 || static_cast<size_t>(axis.idx) >= num_entries)
+                throw std::invalid_argument("Index " + fields[0] + " in --" + option + " is out of range");
+            if (axis.num_steps < 1 || (axis.log_scale && (axis.lo <= 0.0 || axis.hi <= 0.0)))
+                throw std::invalid_argument("Invalid range " + item + " in --" + option);
+            axes.push_back(axis);
+        }
+        return axes;
+    }
+
+    std::vector<std::vector<double>> make_grid(const std::vector<Axis>& axes) {
+        std::vector<std::vector<double>> grid{{}};
+        for (const Axis& axis : axes) {
+            std::vector<std::vector<double>> next;
+            for (const std::vector<double>& coords : grid) {
+                for (int k = 0; k < axis.num_steps; ++k) {
+                    next.push_back(coords);
+                    next.back().push_back(axis.num_steps > 1 ? k / static_cast<double>(axis.num_steps - 1) : 0.0);
+                }
+            }
+            grid = std::move(next);
+        }
+        return grid;
+    }
+
+    double coord_distance(const std::vector<double>& a, const std::vector<double>& b) {
+        double sum = 0.0;
+        for (size_t i = 0; i < a.size(); ++i)
+            sum += (a[i] - b[i]) * (a[i] - b[i]);
+        return std::sqrt(sum);
+    }
+
+    //The solved point closest to coords, or -1 if none is solved yet
+    int nearest_solved(const std::vector<ParetoPoint>& points, const std::vector<double>& coords) {
+        int nearest = -1;
+        double min_dist = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (!points[i].result.final_state.has_value())
+                continue;
+            const double dist = coord_distance(points[i].coords, coords);
+            if (dist < min_dist) {
+                min_dist = dist;
+                nearest = static_cast<int>(i);
+            }
+        }
+        return nearest;
+    }
+
+    void solve_point(const TROTSProblem& base, const std::vector<Axis>& axes, ParetoPoint& point,
+                     const std::optional<SolverState>& warm_start, const CommandLineArgs& args,
+                     const std::filesystem::path& output_path) {
+        auto view = std::make_shared<TROTSProblem>(base.make_view());
+        for (size_t a = 0; a < axes.size(); ++a) {
+            const double value = axes[a].value_at(point.coords[a]);
+            switch (axes[a].target) {
+                case AxisTarget::Weight: view->objective_entries[axes[a].idx].set_weight(value); break;
+                case AxisTarget::ObjRhs: view->objective_entries[axes[a].idx].set_rhs(value); break;
+                case AxisTarget::Rhs: view->constraint_entries[axes[a].idx].set_rhs(value); break;
+            }
+        }
+
+        point.result = solve_view(view, warm_start, args, output_path);
+        if (point.result.final_state.has_value()) {
+            const double* x = point.result.final_state->x.data();
+            for (const TROTSEntry& entry : view->objective_entries)
+                point.obj_vals.push_back(entry.calc_value(x));
+            point.cons_vals.resize(view->get_num_constraints());
+            view->calc_constraints(x, point.cons_vals.data());
+        }
+    }
+
+    //Midpoints between neighbouring solved points, ordered by how far apart the objective values of the two
+    //points are, each objective scaled by its range over all solved points. The neighbours of a point are the
+    //solved points at the smallest distance from it, i.e. its neighbours along each axis on a regular grid.
+    std::vector<std::vector<double>> refinement_candidates(const std::vector<ParetoPoint>& points) {
+        std::vector<int> solved;
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (!points[i].obj_vals.empty())
+                solved.push_back(static_cast<int>(i));
+        }
+        if (solved.size() < 2)
+            return {};
+
+        const size_t num_objs = points[solved[0]].obj_vals.size();
+        std::vector<double> scale(num_objs);
+        for (size_t k = 0; k < num_objs; ++k) {
+            double lo = std::numeric_limits<double>::infinity();
+            double hi = -lo;
+            for (const int i : solved) {
+                lo = std::min(lo, points[i].obj_vals[k]);
+                hi = std::max(hi, points[i].obj_vals[k]);
+            }
+            scale[k] = hi > lo ? 1.0 / (hi - lo) : 0.0;
+        }
+
+        std::vector<std::pair<double, std::vector<double>>> scored;
+        for (const int i : solved) {
+            double min_dist = std::numeric_limits<double>::infinity();
+            for (const int j : solved) {
+                if (j != i)
+                    min_dist = std::min(min_dist, coord_distance(points[i].coords, points[j].coords));
+            }
+            for (const int j : solved) {
+                //Every pair once, and only pairs of neighbours
+                if (j <= i || coord_distance(points[i].coords, points[j].coords) > 1.01 * min_dist)
+                    continue;
+                double obj_dist = 0.0;
+                for (size_t k = 0; k < num_objs; ++k) {
+                    const double diff = (points[i].obj_vals[k] - points[j].obj_vals[k]) * scale[k];
+                    obj_dist += diff * diff;
+                }
+                std::vector<double> mid(points[i].coords.size());
+                for (size_t a = 0; a < mid.size(); ++a)
+                    mid[a] = 0.5 * (points[i].coords[a] + points[j].coords[a]);
+                scored.emplace_back(obj_dist, std::move(mid));
+            }
+        }
+        std::stable_sort(scored.begin(), scored.end(),
+                         [](const auto& a, const auto& b) { return a.first > b.first; });
+
+        std::vector<std::vector<double>> candidates;
+        for (auto& [score, coords] : scored)
+            candidates.push_back(std::move(coords));
+        return candidates;
+    }
+
+    void write_front(const std::filesystem::path& path, const std::vector<ParetoPoint>& points,
+                     const std::vector<Axis>& axes, const TROTSProblem& base) {
+        std::ofstream file{path};
+        file << "point";
+        for (const Axis& axis : axes)
+            file << "," << axis.name();
+        file << ",status,iterations,seconds,warm_start_from";
+        for (const TROTSEntry& entry : base.objective_entries)
+            file << ",obj:" << entry.get_roi_name() << " (" << function_type_name(entry.function_type()) << ")";
+        for (const TROTSEntry& entry : base.constraint_entries)
+            file << ",cons:" << entry.get_roi_name() << " (" << function_type_name(entry.function_type()) << ")";
+        file << "\n" << std::setprecision(10);
+
+        for (size_t i = 0; i < points.size(); ++i) {
+            const ParetoPoint& point = points[i];
+            file << i;
+            for (size_t a = 0; a < axes.size(); ++a)
+                file << "," << axes[a].value_at(point.coords[a]);
+            const ViewSolveResult& result = point.result;
+            file << "," << (result.error.empty() ? std::to_string(result.status) : "error")
+                 << "," << result.iterations << "," << result.seconds << "," << point.warm_start_from;
+            for (const double val : point.obj_vals)
+                file << "," << val;
+            for (const double val : point.cons_vals)
+                file << "," << val;
+            file << "\n";
+        }
+    }
+}
+
+//Points are solved in waves of up to num_parallel concurrent solves. Each wave takes the pending points closest
+//to the points solved so far, so that every solve has a near neighbour to warm start from. Only the first point
+//(the one closest to the centre of the grid) is solved from a cold start.
+int run_pareto_exploration(const CommandLineArgs& args) {
+    const TROTSProblem base = load_trots_problem(args.positional[0], args.get("cache", ""));
+    std::vector<Axis> axes = parse_axes(args.get("weights", ""), AxisTarget::Weight,
+                                        base.objective_entries.size(), "weights");
+    for (const Axis& axis : parse_axes(args.get("obj_rhs", ""), AxisTarget::ObjRhs,
+                                       base.objective_entries.size(), "obj_rhs"))
+        axes.push_back(axis);
+    for (const Axis& axis : parse_axes(args.get("rhs", ""), AxisTarget::Rhs,
+                                       base.constraint_entries.size(), "rhs"))
+        axes.push_back(axis);
+    if (axes.empty()) {
+        std::cerr << "--pareto needs at least one of --weights, --obj_rhs and --rhs\n";
+        return -1;
+    }
+
+    std::vector<ParetoPoint> points;
+    for (std::vector<double>& coords : make_grid(axes)) {
+        points.emplace_back();
+        points.back().coords = std::move(coords);
+    }
+    const size_t max_points = std::max<size_t>(points.size(), args.get_int("pareto_points", 0));
+    const std::string output_prefix = args.get("output", "pareto_");
+
+    const SolveParallelism parallelism = split_solve_threads(args, std::numeric_limits<int>::max());
+
+    //The first wave is the single point closest to the centre
+    const std::vector<double> centre(axes.size(), 0.5);
+    std::vector<int> wave{0};
+    for (size_t i = 1; i < points.size(); ++i) {
+        if (coord_distance(points[i].coords, centre) < coord_distance(points[wave[0]].coords, centre))
+            wave[0] = static_cast<int>(i);
+    }
+
+    while (!wave.empty()) {
+        std::vector<std::optional<SolverState>> warm_starts;
+        for (const int i : wave) {
+            points[i].warm_start_from = nearest_solved(points, points[i].coords);
+            warm_starts.push_back(points[i].warm_start_from >= 0
+                                  ? points[points[i].warm_start_from].result.final_state : std::nullopt);
+        }
+
+        run_concurrent_solves(static_cast<int>(wave.size()), parallelism, [&](int w) {
+            ParetoPoint& point = points[wave[w]];
+            try {
+                solve_point(base, axes, point, warm_starts[w], args, output_prefix + std::to_string(wave[w]) + ".bin");
+            }
+            catch (const std::exception& e) {
+                point.result.error = e.what();
+            }
+        });
+        for (const int i : wave) {
+            points[i].solved = true;
+            const ViewSolveResult& result = points[i].result;
+            std::cerr << "Point " << i << ": " << (result.error.empty() ? "" : result.error + " ")
+                      << result.iterations << " iterations in " << result.seconds << " s"
+                      << (points[i].warm_start_from >= 0 ? ", warm started from point "
+                                                           + std::to_string(points[i].warm_start_from) : "")
+                      << "\n";
+        }
+
+        //The next wave: the pending grid points closest to the solved ones, then refinements
+        std::vector<std::pair<double, int>> pending;
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (!points[i].solved) {
+                const int nearest = nearest_solved(points, points[i].coords);
+                const double dist = nearest >= 0 ? coord_distance(points[i].coords, points[nearest].coords)
+                                                 : std::numeric_limits<double>::infinity();
+                pending.emplace_back(dist, static_cast<int>(i));
+            }
+        }
+        std::stable_sort(pending.begin(), pending.end());
+        wave.clear();
+        for (size_t k = 0; k < pending.size() && wave.size() < static_cast<size_t>(parallelism.num_parallel); ++k)
+            wave.push_back(pending[k].second);
+
+        if (wave.empty() && points.size() < max_points) {
+            for (std::vector<double>& coords : refinement_candidates(points)) {
+                if (points.size() >= max_points || wave.size() >= static_cast<size_t>(parallelism.num_parallel))
+                    break;
+                bool is_new = true;
+                for (const ParetoPoint& point : points)
+                    is_new = is_new && coord_distance(point.coords, coords) > 1e-9;
+                if (!is_new)
+                    continue;
+                wave.push_back(static_cast<int>(points.size()));
+                points.emplace_back();
+                points.back().coords = std::move(coords);
+            }
+        }
+    }
+
+    write_front(output_prefix + "front.csv", points, axes, base);
+    std::cout << "Solved " << points.size() << " points, results in " << output_prefix << "front.csv\n";
+    print_memory_usage("Memory use of the exploration");
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef PARETO_H
+#define PARETO_H
+
+#include "util.h"
+
+//Explores the trade-offs of the problem in args.positional[0] over a grid of objective weights and right hand
+//sides, refined adaptively where the objective values change the most between neighbouring settings.
+//Every solve after the first is warm started from the nearest setting solved before. See README.md for the options.
+int run_pareto_exploration(const CommandLineArgs& args);
+
+#endif
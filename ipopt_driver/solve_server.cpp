@@ -0,0 +1,290 @@
+#include "solve_server.h"
+
+#include "telemetry.h"
+#include "trots_ipopt.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    //A problem kept in memory between solves. The weights and right hand sides as read from the file
+    //are kept too, since every job starts from them before applying its own overrides.
+    struct ResidentCase {
+        std::shared_ptr<TROTSProblem> problem;
+        std::vector<double> obj_weights;
+        std::vector<double> obj_rhs;
+        std::vector<double> cons_rhs;
+        //The final state of the latest solve, used by --warm_start=last
+        std::optional<SolverState> last_state;
+    };
+
+    //Closes a file descriptor when going out of scope
+    class FileDescriptor {
+    public:
+        explicit FileDescriptor(int fd) : fd{fd} {}
+        FileDescriptor(const FileDescriptor&) = delete;
+        FileDescriptor& operator=(const FileDescriptor&) = delete;
+        ~FileDescriptor() {
+            if (this->fd >= 0)
+                close(this->fd);
+        }
+        int get() const noexcept { return this->fd; }
+    private:
+        int fd;
+    };
+
+    ResidentCase load_case(const std::filesystem::path& mat_path, const std::filesystem::path& cache_dir) {
+        const std::filesystem::path cache_path = cache_dir.empty()
+            ? std::filesystem::path{}
+            : cache_dir / (mat_path.stem().string() + ".trotscache");
+
+        ResidentCase resident;
+        resident.problem = std::make_shared<TROTSProblem>(load_trots_problem(mat_path, cache_path));
+        for (const TROTSEntry& entry : resident.problem->objective_entries) {
+            resident.obj_weights.push_back(entry.get_weight());
+            resident.obj_rhs.push_back(entry.get_rhs());
+        }
+        for (const TROTSEntry& entry : resident.problem->constraint_entries)
+            resident.cons_rhs.push_back(entry.get_rhs());
+        return resident;
+    }
+
+    //Parses "<idx>:<value>,<idx>:<value>,...", with indexes below num_entries.
+    std::vector<std::pair<int, double>> parse_overrides(const std::string& str, size_t num_entries,
+                                                        const std::string& option) {
+        std::vector<std::pair<int, double>> overrides;
+        std::istringstream stream{str};
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            const size_t colon_pos = item.find(':');
+            if (colon_pos == std::string::npos)
+                throw std::invalid_argument("Expected <index>:<value> in --" + option + ", got " + item);
+            const int idx = std::stoi(item.substr(0, colon_pos));
+            if (idx < 0 || static_cast<size_t>(idx) >= num_entries)
+                throw std::invalid_argument("Index " + std::to_string(idx) + " in --" + option + " is out of range");
+            overrides.emplace_back(idx, std::stod(item.substr(colon_pos + 1)));
+        }
+        return overrides;
+    }
+
+    //Restores the weights and right hand sides of the file, then applies the overrides of the job.
+    void apply_overrides(ResidentCase& resident, const CommandLineArgs& job) {
+        std::vector<TROTSEntry>& objectives = resident.problem->objective_entries;
+        std::vector<TROTSEntry>& constraints = resident.problem->constraint_entries;
+        for (size_t i = 0; i < objectives.size(); ++i) {
+            objectives[i].set_weight(resident.obj_weights[i]);
+            objectives[i].set_rhs(resident.obj_rhs[i]);
+        }
+        for (size_t i = 0; i < constraints.size(); ++i)
+            constraints[i].set_rhs(resident.cons_rhs[i]);
+
+        for (const auto& [idx, val] : parse_overrides(job.get("weight", ""), objectives.size(), "weight"))
+            objectives[idx].set_weight(val);
+        for (const auto& [idx, val] : parse_overrides(job.get("obj_rhs", ""), objectives.size(), "obj_rhs"))
+            objectives[idx].set_rhs(val);
+        for (const auto& [idx, val] : parse_overrides(job.get("rhs", ""), constraints.size(), "rhs"))
+            constraints[idx].set_rhs(val);
+    }
+
+    //Runs one solve job and returns the response lines.
+    std::string run_solve_job(ResidentCase& resident, const CommandLineArgs& job) {
+        const auto start_time = std::chrono::steady_clock::now();
+        apply_overrides(resident, job);
+
+        const HessianMode hessian_mode = parse_hessian_mode(job.get("hessian", "limited-memory"));
+        TROTS_ipopt* trots_ipopt = new TROTS_ipopt(resident.problem, hessian_mode);
+        Ipopt::SmartPtr<Ipopt::TNLP> trots_nlp = trots_ipopt;
+
+        SolverOutputPaths output_paths;
+        output_paths.solution_path = job.get("output", "");
+        output_paths.state_path = job.get("save_state", "");
+        trots_ipopt->set_output_paths(output_paths);
+        trots_ipopt->set_warmup_iters(job.get_int("warmup_iters", 0));
+        if (job.has("telemetry"))
+            trots_ipopt->set_telemetry(std::make_unique<Telemetry>(job.get("telemetry", "")));
+
+        const std::string warm_start = job.get("warm_start", "");
+        if (warm_start == "last") {
+            if (!resident.last_state.has_value())
+                throw std::invalid_argument("--warm_start=last, but the case has not been solved yet");
+            trots_ipopt->set_warm_start(*resident.last_state);
+        }
+        else if (!warm_start.empty()) {
+            trots_ipopt->set_warm_start(SolverState::load(warm_start));
+        }
+
+        Ipopt::SmartPtr<Ipopt::IpoptApplication> app = make_ipopt_application(hessian_mode,
+                                                                              job.get_int("max_iter", 20000));
+        if (!warm_start.empty())
+            set_warm_start_options(*app->Options(), job.get_double("mu_init", 1e-6));
+        if (job.has("tol"))
+            app->Options()->SetNumericValue("tol", job.get_double("tol", 1e-9));
+        if (job.has("print_level"))
+            app->Options()->SetIntegerValue("print_level", job.get_int("print_level", 5));
+        //Any other IPOPT option, as --ipopt.<name>=<value>. IPOPT parses these as it would an options file.
+        for (const auto& [name, value] : job.named) {
+            if (name.rfind("ipopt.", 0) != 0)
+                continue;
+            std::istringstream option{name.substr(6) + " " + value};
+            if (!app->Options()->ReadFromStream(*app->Jnlst(), option))
+                throw std::invalid_argument("Invalid IPOPT option " + name.substr(6));
+        }
+
+        if (app->Initialize() != Ipopt::Solve_Succeeded)
+            throw std::runtime_error("Failed to initialize IPOPT");
+        const Ipopt::ApplicationReturnStatus status = app->OptimizeTNLP(trots_nlp);
+        if (trots_ipopt->get_final_state().has_value())
+            resident.last_state = trots_ipopt->get_final_state();
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+        std::ostringstream response;
+        response << std::setprecision(17);
+        if (job.has("return_x") && resident.last_state.has_value()) {
+            response << "x";
+            for (const double x_i : resident.last_state->x)
+                response << " " << x_i;
+            response << "\n";
+        }
+        response << "ok status=" << status;
+        if (Ipopt::IsValid(app->Statistics())) {
+            response << " objective=" << app->Statistics()->FinalObjective()
+                     << " iterations=" << app->Statistics()->IterationCount();
+        }
+        response << " seconds=" << std::setprecision(6) << elapsed.count() << "\n";
+        return response.str();
+    }
+
+    //Handles one request line. Sets shutdown if the server should stop after responding.
+    std::string handle_request(const std::string& line, std::map<std::string, ResidentCase>& cases, bool& shutdown) {
+        std::vector<std::string> tokens;
+        std::istringstream stream{line};
+        for (std::string token; stream >> token;)
+            tokens.push_back(token);
+        if (tokens.empty())
+            return "";
+
+        const std::string command = tokens[0];
+        const CommandLineArgs request = parse_command_line(std::vector<std::string>(tokens.cbegin() + 1, tokens.cend()));
+        try {
+            if (command == "list") {
+                std::ostringstream response;
+                for (const auto& [case_id, resident] : cases) {
+                    response << "case " << case_id << " vars=" << resident.problem->get_num_vars()
+                             << " objectives=" << resident.problem->objective_entries.size()
+                             << " constraints=" << resident.problem->get_num_constraints() << "\n";
+                }
+                response << "ok\n";
+                return response.str();
+            }
+            if (command == "shutdown") {
+                shutdown = true;
+                return "ok\n";
+            }
+            if (command == "solve") {
+                if (request.positional.size() != 1)
+                    return "error Usage: solve <case_id> [options]\n";
+                auto it = cases.find(request.positional[0]);
+                if (it == cases.end())
+                    return "error Unknown case " + request.positional[0] + "\n";
+                return run_solve_job(it->second, request);
+            }
+            return "error Unknown command " + command + "\n";
+        }
+        catch (const std::exception& e) {
+            return std::string{"error "} + e.what() + "\n";
+        }
+    }
+
+    bool send_all(int fd, const std::string& msg) {
+        size_t sent = 0;
+        while (sent < msg.size()) {
+            //A client that disconnects must not kill the server with SIGPIPE
+            const ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+            if (n < 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+}
+
+int run_solve_server(const CommandLineArgs& args) {
+    const std::string socket_path = args.get("serve", "");
+    const std::filesystem::path cache_dir = args.get("cache_dir", "");
+
+    std::map<std::string, ResidentCase> cases;
+    for (const std::string& mat_path_str : args.positional) {
+        const std::filesystem::path mat_path{mat_path_str};
+        const std::string case_id = mat_path.stem().string();
+        if (cases.count(case_id) > 0) {
+            std::cerr << "Two problems have the case ID " << case_id << "\n";
+            return -1;
+        }
+        cases.emplace(case_id, load_case(mat_path, cache_dir));
+        std::cerr << "Loaded case " << case_id << "\n";
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Invalid socket path: " << socket_path << "\n";
+        return -1;
+    }
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    const FileDescriptor server{socket(AF_UNIX, SOCK_STREAM, 0)};
+    //A socket file left behind by a previous server would make bind fail.
+    unlink(socket_path.c_str());
+    if (server.get() < 0 || bind(server.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || listen(server.get(), 8) < 0) {
+        std::cerr << "Could not listen on " << socket_path << ": " << std::strerror(errno) << "\n";
+        return -1;
+    }
+    std::cerr << "Listening on " << socket_path << "\n";
+
+    //Jobs are run one at a time, since the evaluation workspaces of a problem are shared by all solves.
+    bool shutdown = false;
+    while (!shutdown) {
+        const FileDescriptor client{accept(server.get(), nullptr, nullptr)};
+        if (client.get() < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << "\n";
+            break;
+        }
+
+        //A connection can send any number of newline terminated requests
+        std::string buffer;
+        char chunk[4096];
+        bool connected = true;
+        while (connected && !shutdown) {
+            const ssize_t n = recv(client.get(), chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                break;
+            buffer.append(chunk, n);
+            size_t newline_pos;
+            while (!shutdown && (newline_pos = buffer.find('\n')) != std::string::npos) {
+                const std::string line = buffer.substr(0, newline_pos);
+                buffer.erase(0, newline_pos + 1);
+                const std::string response = handle_request(line, cases, shutdown);
+                if (!response.empty() && !send_all(client.get(), response)) {
+                    connected = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    unlink(socket_path.c_str());
+    return 0;
+}
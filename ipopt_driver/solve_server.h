@@ -0,0 +1,10 @@
+#ifndef SOLVE_SERVER_H
+#define SOLVE_SERVER_H
+
+#include "util.h"
+
+//Loads the problems in args.positional once, and then solves them on request over the Unix domain
+//socket at args.get("serve"). See README.md for the protocol. Returns when a client sends "shutdown".
+int run_solve_server(const CommandLineArgs& args);
+
+#endif
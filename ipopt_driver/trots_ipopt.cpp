@@ -1,8 +1,15 @@
+#include "pareto.h"
+#include "solve_server.h"
+#include "starting_point.h"
+#include "telemetry.h"
 #include "trots_ipopt.h"
 #include "util.h"
+#include "weight_sweep.h"
 
 #include "coin-or/IpIpoptApplication.hpp"
 
+#include <limits>
+
 namespace {
     int max_iter = 20000;
 
@@ -12,7 +19,7 @@ namespace {
             x[i] = 100.0;
         }
         double obj_val;
-        tnlp->eval_f(n, &x[0], false, obj_val);
+        tnlp->eval_f(n, &x[0], true, obj_val);
         std::vector<double> cons_vals(m);
         tnlp->eval_g(n, &x[0], false, m, &cons_vals[0]);
         std::cout << "Obj_val: " << obj_val << "\n";
@@ -21,8 +28,14 @@ namespace {
     }
 }
 
-TROTS_ipopt::TROTS_ipopt(TROTSProblem&& problem) {
-    this->problem = std::make_unique<TROTSProblem>(std::move(problem));
+TROTS_ipopt::TROTS_ipopt(TROTSProblem&& problem, HessianMode hessian_mode) :
+    TROTS_ipopt(std::make_shared<TROTSProblem>(std::move(problem)), hessian_mode)
+{
+}
+
+TROTS_ipopt::TROTS_ipopt(std::shared_ptr<TROTSProblem> problem, HessianMode hessian_mode) :
+    problem{std::move(problem)}, hessian_mode{hessian_mode}
+{
 }
 
 bool TROTS_ipopt::get_nlp_info(
@@ -33,7 +46,16 @@ bool TROTS_ipopt::get_nlp_info(
     m = this->problem->get_num_constraints();
 
     nnz_jac_g = this->problem->get_nnz_jac_cons();
-    nnz_h_lag = n * n / 2; //Dense but symmetric
+    //Dense but symmetric, only the lower triangle is given to IPOPT. Not used with the limited-memory approximation.
+    nnz_h_lag = 0;
+    if (this->hessian_mode != HessianMode::LimitedMemory) {
+        const long long nnz_h = this->problem->get_nnz_hessian();
+        if (nnz_h > std::numeric_limits<int>::max()) {
+            std::cerr << "Too many variables to form the dense Hessian, use the limited-memory approximation\n";
+            return false;
+        }
+        nnz_h_lag = static_cast<int>(nnz_h);
+    }
     index_style = C_STYLE;
 
     return true;
@@ -50,10 +72,7 @@ bool TROTS_ipopt::get_bounds_info(int n, double* x_l, double* x_u, int m, double
     }
 
     for (int i = 0; i < m; ++i) {
-        const TROTSEntry& cons_entry = this->problem->constraint_entries[i];
-        if (cons_entry.is_minimisation() ||
-            cons_entry.function_type() == FunctionType::Min ||
-            cons_entry.function_type() == FunctionType::Max) {
+        if (this->problem->constraint_is_upper_bound(i)) {
             g_l[i] = neg_inf;
             g_u[i] = 0.0;
         } else {
@@ -70,67 +89,95 @@ bool TROTS_ipopt::get_starting_point(
     int n, bool init_x, double* x, bool init_z, double* z_l, double* z_u,
     int m, bool init_lambda, double* lambda) {
 
-    if (init_x) {
+    if (this->warm_start.has_value() && !this->warm_start->matches(n, m)) {
+        std::cerr << "Warm start state does not match the problem dimensions\n";
+        return false;
+    }
+
+    if (init_x && this->warm_start.has_value()) {
+        std::copy(this->warm_start->x.cbegin(), this->warm_start->x.cend(), x);
+    }
+    else if (init_x) {
         //The initialization of the primal variables is based on the goal of
         //making the LTCP objectives not too large to start with.
         //We use the "simple" initialization strategy described in
-        //https://doi.org/10.1007/s10589-017-9919-4
-
-        std::vector<TROTSEntry> LTCP_entries;
-        std::copy_if(this->problem->objective_entries.cbegin(), this->problem->objective_entries.cend(),
-                     std::back_inserter(LTCP_entries),
-                     [](const TROTSEntry& e){ return e.function_type() == FunctionType::LTCP; });
-
+        //https://doi.org/10.1007/s10589-017-9919-4, but solve for the scale directly.
         for (int i = 0; i < n; ++i) {
             x[i] = 100.0;
         }
+        const double scale = calc_LTCP_scale_factor(this->problem->objective_entries, x, 1500.0);
+        for (int i = 0; i < n; ++i) {
+            x[i] *= scale;
+        }
 
-        const auto compute_obj_val = [x](const TROTSEntry& e) -> double {
-            return e.calc_value(x);
-        };
-        std::vector<double> LTCP_vals(LTCP_entries.size());
-        std::transform(LTCP_entries.cbegin(), LTCP_entries.cend(),
-                       LTCP_vals.begin(), compute_obj_val);
-        while (std::any_of(LTCP_vals.cbegin(), LTCP_vals.cend(), [](double v){ return v > 1500.0; })) {
-            for (int i = 0; i < n; ++i) {
-                x[i] *= 1.5;
-            }
-            std::transform(LTCP_entries.cbegin(), LTCP_entries.cend(),
-                           LTCP_vals.begin(), compute_obj_val);
+        if (this->warmup_iters > 0) {
+            const auto obj = [this, n](const double* x_k) {
+                double val;
+                this->eval_f(n, x_k, true, val);
+                return val;
+            };
+            const auto grad = [this, n](const double* x_k, double* grad_k) {
+                this->eval_grad_f(n, x_k, false, grad_k);
+            };
+            projected_gradient_warmup(n, x, this->warmup_iters, obj, grad);
         }
         std::cout << "Initial x: " << x[0] << std::endl;
     }
 
+    if (init_z && this->warm_start.has_value()) {
+        std::copy(this->warm_start->z_l.cbegin(), this->warm_start->z_l.cend(), z_l);
+        std::copy(this->warm_start->z_u.cbegin(), this->warm_start->z_u.cend(), z_u);
+    }
     //We have no bounds, so these probably don't matter, set them to zero in case.
-    if (init_z) {
+    else if (init_z) {
         for (int i = 0; i < n; ++i) {
             z_l[i] = 0.0;
             z_u[i] = 0.0;
         }
     }
 
-    if (init_lambda) {
+    if (init_lambda && this->warm_start.has_value()) {
+        std::copy(this->warm_start->lambda.cbegin(), this->warm_start->lambda.cend(), lambda);
+    }
+    else if (init_lambda) {
         //TODO: smarter initalization
         for (int i = 0; i < m; ++i) {
             lambda[i] = 1.0;
         }
     }
 
+    //The doses stored in the entries no longer correspond to any point IPOPT knows about.
+    this->dose_cache.invalidate();
     return true;
 }
 
 bool TROTS_ipopt::eval_f(int n, const double* x, bool new_x, double& obj_val) {
-    obj_val = this->problem->calc_objective(x);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalF,
+                              !new_x && this->dose_cache.obj_doses_valid};
+    if (new_x)
+        this->dose_cache.invalidate();
+    obj_val = this->problem->calc_objective(x, this->dose_cache.obj_doses_valid);
+    this->dose_cache.obj_doses_valid = true;
     return true;
 }
 
 bool TROTS_ipopt::eval_grad_f(int n, const double* x, bool new_x, double* grad_f) {
-    this->problem->calc_obj_gradient(x, grad_f);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalGradF,
+                              !new_x && this->dose_cache.obj_doses_valid};
+    if (new_x)
+        this->dose_cache.invalidate();
+    this->problem->calc_obj_gradient(x, grad_f, this->dose_cache.obj_doses_valid);
+    this->dose_cache.obj_doses_valid = true;
     return true;
 }
 
 bool TROTS_ipopt::eval_g(int n, const double* x, bool new_x, int m, double* g) {
-    this->problem->calc_constraints(x, g);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalG,
+                              !new_x && this->dose_cache.cons_doses_valid};
+    if (new_x)
+        this->dose_cache.invalidate();
+    this->problem->calc_constraints(x, g, this->dose_cache.cons_doses_valid);
+    this->dose_cache.cons_doses_valid = true;
     return true;
 }
 
@@ -139,67 +186,161 @@ bool TROTS_ipopt::eval_jac_g(int n, const double* x, bool new_x,
 
     if (vals == nullptr) {
         assert(irow != nullptr && icol != nullptr);
-        int i = 0;
-        for (int row = 0; row < this->problem->get_num_constraints(); ++row) {
-            std::vector<int> cols = this->problem->constraint_entries[row].get_grad_nonzero_idxs();
-            for (int col : cols) {
+        const std::vector<int>& row_offsets = this->problem->get_jac_row_offsets();
+        const std::vector<int>& col_idxs = this->problem->get_jac_col_idxs();
+        for (int row = 0; row < m; ++row) {
+            for (int i = row_offsets[row]; i < row_offsets[row + 1]; ++i) {
                 irow[i] = row;
-                icol[i] = col;
-                ++i;
+                icol[i] = col_idxs[i];
             }
         }
         return true;
     }
 
-    this->problem->calc_jacobian_vals(x, vals);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalJacG,
+                              !new_x && this->dose_cache.cons_doses_valid};
+    if (new_x)
+        this->dose_cache.invalidate();
+    this->problem->calc_jacobian_vals(x, vals, this->dose_cache.cons_doses_valid);
+    this->dose_cache.cons_doses_valid = true;
     return true;
 }
 
 
+bool TROTS_ipopt::eval_h(int n, const double* x, bool new_x, double obj_factor,
+                         int m, const double* lambda, bool new_lambda,
+                         int nnz_h, int* irow, int* icol, double* vals) {
+    if (this->hessian_mode == HessianMode::LimitedMemory)
+        return false;
+
+    if (vals == nullptr) {
+        assert(irow != nullptr && icol != nullptr);
+        //Dense lower triangle, in the same packed order that TROTSProblem::calc_dense_hessian uses
+        int idx = 0;
+        for (int row = 0; row < n; ++row) {
+            for (int col = 0; col <= row; ++col) {
+                irow[idx] = row;
+                icol[idx] = col;
+                ++idx;
+            }
+        }
+        return true;
+    }
+
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalH,
+                              !new_x && this->dose_cache.obj_doses_valid && this->dose_cache.cons_doses_valid};
+    if (new_x)
+        this->dose_cache.invalidate();
+    this->problem->calc_dense_hessian(x, obj_factor, lambda, vals, this->hessian_mode, this->dose_cache);
+    this->dose_cache.obj_doses_valid = true;
+    this->dose_cache.cons_doses_valid = true;
+    return true;
+}
+
 void TROTS_ipopt::finalize_solution(Ipopt::SolverReturn status, int n,
     const double* x, const double* z_l, const double* z_u,
     int m, const double* g, const double* lambda, double obj,
     const Ipopt::IpoptData* ip_data, Ipopt::IpoptCalculatedQuantities* ip_cq) {
 
     //Output to file: reuse code for dumping std::vector arrays to file
-    std::vector<double> x_vec;
-    x_vec.reserve(n);
-    for (int i = 0; i < n; ++i) {
-        x_vec.push_back(x[i]);
+    if (!this->output_paths.solution_path.empty()) {
+        std::vector<double> x_vec(x, x + n);
+        dump_vector_to_file(x_vec, this->output_paths.solution_path);
     }
 
-    dump_vector_to_file(x_vec, "mod_rhs_new.bin");
+    this->final_state = SolverState{{x, x + n}, {z_l, z_l + n}, {z_u, z_u + n}, {lambda, lambda + m}};
+    if (!this->output_paths.state_path.empty()) {
+        this->final_state->save(this->output_paths.state_path);
+    }
 
     std::cout << "IPOPT finalize_solution called\n";
     std::cout << "Exit status: " << status << "\n";
 }
 
+bool TROTS_ipopt::intermediate_callback(Ipopt::AlgorithmMode mode, int iter, double obj_value,
+                                        double inf_pr, double inf_du, double mu, double d_norm,
+                                        double regularization_size, double alpha_du, double alpha_pr,
+                                        int ls_trials, const Ipopt::IpoptData* ip_data,
+                                        Ipopt::IpoptCalculatedQuantities* ip_cq) {
+    if (this->telemetry) {
+        this->telemetry->write_iteration(iter, obj_value, inf_pr, inf_du, mu,
+                                         collect_entry_telemetry(*this->problem));
+    }
+
+    const SolverOutputPaths& paths = this->output_paths;
+    //The iterate of the restoration phase is not a point of our problem, only checkpoint regular iterations.
+    if (paths.checkpoint_path.empty() || paths.checkpoint_interval <= 0 ||
+        iter == 0 || iter % paths.checkpoint_interval != 0 || mode != Ipopt::RegularMode) {
+        return true;
+    }
+
+    const int n = this->problem->get_num_vars();
+    const int m = this->problem->get_num_constraints();
+    SolverState state{std::vector<double>(n), std::vector<double>(n), std::vector<double>(n), std::vector<double>(m)};
+    if (this->get_curr_iterate(ip_data, ip_cq, false, n, state.x.data(), state.z_l.data(), state.z_u.data(),
+                               m, nullptr, state.lambda.data())) {
+        state.save(paths.checkpoint_path);
+    }
+    return true;
+}
+
 int ipopt_main_func(int argc, char* argv[]) {
-    if (argc < 2 || argc > 3)  {
+    const CommandLineArgs args = parse_command_line(argc, argv);
+    if (args.has("serve") && !args.positional.empty())
+        return run_solve_server(args);
+    if (args.positional.empty() || args.positional.size() > 2)  {
         std::cerr << "Incorrect number of arguments\n";
-        std::cerr << "Usage: ./program <mat_file_path>\n";
-        std::cerr << "\t./program <mat_file_path> <max_iters>\n";
+        std::cerr << "Usage: ./program <mat_file_path> [options]\n";
+        std::cerr << "\t./program <mat_file_path> <max_iters> [options]\n";
+        std::cerr << "\t./program --serve=<socket_path> <mat_file_path>... [--cache_dir=<dir>]\n";
+        std::cerr << "\t./program <mat_file_path> [max_iters] --sweep=<weights_file> [--parallel_solves=<n>]\n";
+        std::cerr << "\t./program <mat_file_path> [max_iters] --pareto --weights=<i>:<lo>:<hi>:<steps>[:log],...\n";
+        std::cerr << "Options:\n";
+        std::cerr << "\t--hessian=limited-memory|exact|gauss-newton\n";
+        std::cerr << "\t--output=<file> (default mod_rhs_new.bin)\n";
+        std::cerr << "\t--save_state=<file>\n";
+        std::cerr << "\t--warm_start=<state_file> [--mu_init=<value>]\n";
+        std::cerr << "\t--checkpoint=<state_file> [--checkpoint_interval=<iters>]\n";
+        std::cerr << "\t--warmup_iters=<iters>\n";
+        std::cerr << "\t--telemetry=<file.csv|file.jsonl>\n";
+        std::cerr << "\t--cache=<file>\n";
         return -1;
     }
 
-    std::string path_str{argv[1]};
-    std::filesystem::path path{path_str};
+    if (args.has("sweep"))
+        return run_weight_sweep(args);
+    if (args.has("pareto"))
+        return run_pareto_exploration(args);
 
-    if (argc == 3) {
-        max_iter = std::atoi(argv[2]);
+    std::filesystem::path path{args.positional[0]};
+
+    if (args.positional.size() == 2) {
+        max_iter = std::stoi(args.positional[1]);
     }
+    const HessianMode hessian_mode = parse_hessian_mode(args.get("hessian", "limited-memory"));
 
-    TROTSProblem trots_problem{TROTSMatFileData{path}};
+    TROTSProblem trots_problem = load_trots_problem(path, args.get("cache", ""));
     const int n = trots_problem.get_num_vars();
     const int m = trots_problem.get_num_constraints();
-    Ipopt::SmartPtr<Ipopt::TNLP> trots_nlp = new TROTS_ipopt(std::move(trots_problem));
+    TROTS_ipopt* trots_ipopt = new TROTS_ipopt(std::move(trots_problem), hessian_mode);
+    Ipopt::SmartPtr<Ipopt::TNLP> trots_nlp = trots_ipopt;
+
+    SolverOutputPaths output_paths;
+    output_paths.solution_path = args.get("output", "mod_rhs_new.bin");
+    output_paths.state_path = args.get("save_state", "");
+    output_paths.checkpoint_path = args.get("checkpoint", "");
+    output_paths.checkpoint_interval = args.get_int("checkpoint_interval", 50);
+    trots_ipopt->set_output_paths(output_paths);
+    if (args.has("warm_start"))
+        trots_ipopt->set_warm_start(SolverState::load(args.get("warm_start", "")));
+    trots_ipopt->set_warmup_iters(args.get_int("warmup_iters", 0));
+    if (args.has("telemetry"))
+        trots_ipopt->set_telemetry(std::make_unique<Telemetry>(args.get("telemetry", "")));
+
     calc_values_test(trots_nlp, n, m);
-    Ipopt::SmartPtr<Ipopt::IpoptApplication> app = IpoptApplicationFactory();
-    app->Options()->SetStringValue("hessian_approximation", "limited-memory");
-    app->Options()->SetStringValue("mu_strategy", "adaptive");
-    app->Options()->SetStringValue("adaptive_mu_globalization", "kkt-error");
-    app->Options()->SetIntegerValue("max_iter", max_iter);
-    app->Options()->SetNumericValue("tol", 1e-9);
+    Ipopt::SmartPtr<Ipopt::IpoptApplication> app = make_ipopt_application(hessian_mode, max_iter);
+    if (args.has("warm_start"))
+        set_warm_start_options(*app->Options(), args.get_double("mu_init", 1e-6));
     //app->Options()->SetStringValue("print_timing_statistics", "yes");
     //app->Options()->SetStringValue("derivative_test", "first-order");
     //app->Options()->SetNumericValue("derivative_test_perturbation", 1e-12);
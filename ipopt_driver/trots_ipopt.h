@@ -2,14 +2,21 @@
 #define TROTS_IPOPT_H
 
 #include <memory>
+#include <optional>
 
+#include "coin-or/IpIpoptApplication.hpp"
 #include "coin-or/IpTNLP.hpp"
 
+#include "ipopt_options.h"
+#include "solver_state.h"
+#include "telemetry.h"
 #include "trots.h"
 
 class TROTS_ipopt : public Ipopt::TNLP {
 public:
-    TROTS_ipopt(TROTSProblem&& prob);
+    TROTS_ipopt(TROTSProblem&& prob, HessianMode hessian_mode = HessianMode::LimitedMemory);
+    //Shares the problem with the caller, so that it can be solved again after this object is gone.
+    TROTS_ipopt(std::shared_ptr<TROTSProblem> prob, HessianMode hessian_mode = HessianMode::LimitedMemory);
 
     bool get_nlp_info(
         int& n, int& m, int& nnz_jac_g, int& nnz_h_lag,
@@ -24,12 +31,37 @@ public:
     bool eval_g(int n, const double* x, bool new_x, int m, double* g) override;
     bool eval_jac_g(int n, const double* x, bool new_x,
                     int m, int nnz_jac, int* irow, int* icol, double* vals) override;
+    bool eval_h(int n, const double* x, bool new_x, double obj_factor,
+                int m, const double* lambda, bool new_lambda,
+                int nnz_h, int* irow, int* icol, double* vals) override;
     void finalize_solution(Ipopt::SolverReturn status, int n,
                            const double* x, const double* z_l, const double* z_u,
                            int m, const double* g, const double* lambda, double obj,
                            const Ipopt::IpoptData* ip_data, Ipopt::IpoptCalculatedQuantities* ip_cq) override;
+    bool intermediate_callback(Ipopt::AlgorithmMode mode, int iter, double obj_value,
+                               double inf_pr, double inf_du, double mu, double d_norm,
+                               double regularization_size, double alpha_du, double alpha_pr,
+                               int ls_trials, const Ipopt::IpoptData* ip_data,
+                               Ipopt::IpoptCalculatedQuantities* ip_cq) override;
+
+    //Start from a previously saved primal-dual state instead of the heuristic starting point.
+    void set_warm_start(SolverState state) { this->warm_start = std::move(state); }
+    void set_output_paths(SolverOutputPaths paths) { this->output_paths = std::move(paths); }
+    //Number of projected gradient iterations run on the heuristic starting point before IPOPT takes over.
+    void set_warmup_iters(int iters) { this->warmup_iters = iters; }
+    //Write per-iteration performance data, see telemetry.h.
+    void set_telemetry(std::unique_ptr<Telemetry> telemetry) { this->telemetry = std::move(telemetry); }
+    //The primal-dual state passed to finalize_solution, empty before that.
+    const std::optional<SolverState>& get_final_state() const noexcept { return this->final_state; }
 private:
-    std::unique_ptr<TROTSProblem> problem;
+    std::shared_ptr<TROTSProblem> problem;
+    DoseCacheState dose_cache;
+    HessianMode hessian_mode;
+    std::optional<SolverState> warm_start;
+    SolverOutputPaths output_paths;
+    int warmup_iters = 0;
+    std::unique_ptr<Telemetry> telemetry;
+    std::optional<SolverState> final_state;
 };
 
 int ipopt_main_func(int argc, char* argv[]);
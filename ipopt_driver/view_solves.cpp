@@ -0,0 +1,70 @@
+#include "view_solves.h"
+
+#include "trots_ipopt.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+ViewSolveResult solve_view(std::shared_ptr<TROTSProblem> view, const std::optional<SolverState>& warm_start,
+                           const CommandLineArgs& args, const std::filesystem::path& output_path) {
+    const auto start_time = std::chrono::steady_clock::now();
+    ViewSolveResult result;
+
+    const HessianMode hessian_mode = parse_hessian_mode(args.get("hessian", "limited-memory"));
+    TROTS_ipopt* trots_ipopt = new TROTS_ipopt(std::move(view), hessian_mode);
+    Ipopt::SmartPtr<Ipopt::TNLP> trots_nlp = trots_ipopt;
+    SolverOutputPaths output_paths;
+    output_paths.solution_path = output_path;
+    trots_ipopt->set_output_paths(output_paths);
+    if (warm_start.has_value())
+        trots_ipopt->set_warm_start(*warm_start);
+    else
+        trots_ipopt->set_warmup_iters(args.get_int("warmup_iters", 0));
+
+    const int max_iter = args.positional.size() > 1 ? std::stoi(args.positional[1]) : 20000;
+    Ipopt::SmartPtr<Ipopt::IpoptApplication> app = make_ipopt_application(hessian_mode, max_iter);
+    if (warm_start.has_value())
+        set_warm_start_options(*app->Options(), args.get_double("mu_init", 1e-6));
+    app->Options()->SetIntegerValue("print_level", args.get_int("print_level", 0));
+    if (args.has("linear_solver"))
+        app->Options()->SetStringValue("linear_solver", args.get("linear_solver", ""));
+
+    if (app->Initialize() != Ipopt::Solve_Succeeded) {
+        result.error = "Failed to initialize IPOPT";
+        return result;
+    }
+    result.status = app->OptimizeTNLP(trots_nlp);
+    if (Ipopt::IsValid(app->Statistics())) {
+        result.objective = app->Statistics()->FinalObjective();
+        result.iterations = app->Statistics()->IterationCount();
+    }
+    result.final_state = trots_ipopt->get_final_state();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+SolveParallelism split_solve_threads(const CommandLineArgs& args, int max_solves) {
+    const int num_hw_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const int num_parallel = std::max(1, std::min(args.get_int("parallel_solves", num_hw_threads), max_solves));
+    return {num_parallel, std::max(1, num_hw_threads / num_parallel)};
+}
+
+void run_concurrent_solves(int num_solves, const SolveParallelism& parallelism, const std::function<void(int)>& solve) {
+    std::atomic<int> next_solve{0};
+    const auto worker = [&]() {
+        set_local_num_threads(parallelism.threads_per_solve);
+        for (int k = next_solve++; k < num_solves; k = next_solve++)
+            solve(k);
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(parallelism.num_parallel);
+    for (int t = 0; t < std::min(parallelism.num_parallel, num_solves); ++t)
+        workers.emplace_back(worker);
+    for (std::thread& thread : workers)
+        thread.join();
+}
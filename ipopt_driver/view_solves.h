@@ -0,0 +1,50 @@
+#ifndef VIEW_SOLVES_H
+#define VIEW_SOLVES_H
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "coin-or/IpIpoptApplication.hpp"
+
+#include "solver_state.h"
+#include "trots.h"
+#include "util.h"
+
+//Solves of views of one problem (see TROTSProblem::make_view) that run at the same time,
+//shared by the weight sweep and the Pareto exploration.
+
+struct ViewSolveResult {
+    Ipopt::ApplicationReturnStatus status = Ipopt::Internal_Error;
+    double objective = 0.0;
+    int iterations = 0;
+    double seconds = 0.0;
+    //The primal-dual state at the end of the solve, e.g. to warm start other solves from
+    std::optional<SolverState> final_state;
+    //Set if the solve could not be run at all
+    std::string error;
+};
+
+//Solves view with the IPOPT options in args (max_iter from args.positional[1], --hessian, --print_level,
+//--linear_solver, --mu_init) and writes the solution to output_path. The solve is warm started from warm_start
+//if given, and runs --warmup_iters projected gradient iterations otherwise.
+//The IPOPT output is off unless --print_level is given, since the output of concurrent solves would be interleaved.
+ViewSolveResult solve_view(std::shared_ptr<TROTSProblem> view, const std::optional<SolverState>& warm_start,
+                           const CommandLineArgs& args, const std::filesystem::path& output_path);
+
+struct SolveParallelism {
+    int num_parallel;
+    int threads_per_solve;
+};
+
+//--parallel_solves solves at a time, by default one per hardware thread, but at most max_solves.
+//The hardware threads are split evenly between them.
+SolveParallelism split_solve_threads(const CommandLineArgs& args, int max_solves);
+
+//Runs solve(0), ..., solve(num_solves - 1) on parallelism.num_parallel threads, each of which uses
+//parallelism.threads_per_solve threads for its solves. solve must not throw.
+void run_concurrent_solves(int num_solves, const SolveParallelism& parallelism, const std::function<void(int)>& solve);
+
+#endif
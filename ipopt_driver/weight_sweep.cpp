@@ -0,0 +1,77 @@
+#include "weight_sweep.h"
+
+#include "view_solves.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+    //One weight vector per line, with a weight for each active objective in the order of
+    //TROTSProblem::objective_entries. Empty lines and lines starting with # are skipped.
+    std::vector<std::vector<double>> read_weight_vectors(const std::filesystem::path& path, size_t num_objectives) {
+        std::ifstream file{path};
+        if (!file)
+            throw std::runtime_error("Could not open weight file " + path.string() + "\n");
+
+        std::vector<std::vector<double>> weight_vectors;
+        std::string line;
+        int line_num = 0;
+        while (std::getline(file, line)) {
+            ++line_num;
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::istringstream stream{line};
+            std::vector<double> weights;
+            for (double weight; stream >> weight;)
+                weights.push_back(weight);
+            if (weights.size() != num_objectives) {
+                throw std::runtime_error("Line " + std::to_string(line_num) + " of " + path.string() + " has "
+                                         + std::to_string(weights.size()) + " weights, the problem has "
+                                         + std::to_string(num_objectives) + " objectives\n");
+            }
+            weight_vectors.push_back(std::move(weights));
+        }
+        return weight_vectors;
+    }
+}
+
+int run_weight_sweep(const CommandLineArgs& args) {
+    const TROTSProblem base = load_trots_problem(args.positional[0], args.get("cache", ""));
+    const std::vector<std::vector<double>> weight_vectors = read_weight_vectors(args.get("sweep", ""),
+                                                                                base.objective_entries.size());
+    const int num_variants = static_cast<int>(weight_vectors.size());
+    const std::string output_prefix = args.get("output", "sweep_");
+
+    const SolveParallelism parallelism = split_solve_threads(args, num_variants);
+    std::cerr << "Solving " << num_variants << " weight vectors, " << parallelism.num_parallel << " at a time with "
+              << parallelism.threads_per_solve << " threads each\n";
+
+    std::vector<ViewSolveResult> results(num_variants);
+    run_concurrent_solves(num_variants, parallelism, [&](int k) {
+        try {
+            auto view = std::make_shared<TROTSProblem>(base.make_view());
+            for (size_t i = 0; i < weight_vectors[k].size(); ++i)
+                view->objective_entries[i].set_weight(weight_vectors[k][i]);
+            results[k] = solve_view(std::move(view), std::nullopt, args, output_prefix + std::to_string(k) + ".bin");
+        }
+        catch (const std::exception& e) {
+            results[k].error = e.what();
+        }
+    });
+
+    int num_failed = 0;
+    for (int k = 0; k < num_variants; ++k) {
+        const ViewSolveResult& result = results[k];
+        std::cout << "Weight vector " << k << ": ";
+        if (!result.error.empty()) {
+            std::cout << "failed: " << result.error << "\n";
+            ++num_failed;
+            continue;
+        }
+        std::cout << "status " << result.status << ", objective " << result.objective << ", "
+                  << result.iterations << " iterations, " << result.seconds << " s\n";
+    }
+    print_memory_usage("Memory use of the sweep");
+    return num_failed == 0 ? 0 : -1;
+}
@@ -0,0 +1,11 @@
+#ifndef WEIGHT_SWEEP_H
+#define WEIGHT_SWEEP_H
+
+#include "util.h"
+
+//Solves the problem in args.positional[0] once for every weight vector in the file args.get("sweep").
+//Several solves run at the same time, each on a view of a single copy of the problem, so the memory use
+//grows with the number of dose matrices and not with the number of weight vectors. See README.md for the options.
+int run_weight_sweep(const CommandLineArgs& args);
+
+#endif
@@ -0,0 +1,315 @@
+#include <mpi.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#ifdef USE_MKL
+#include "MKL_sparse_matrix.h"
+#else
+#include "EigenSparseMat.h"
+#endif
+
+#include "data_distribution.h"
+#include "rank_local_data.h"
+#include "shared_matrices.h"
+#include "sparse_matrix_transfers.h"
+#include "TROTSEntry.h"
+#include "trots.h"
+#include "trots_entry_transfers.h"
+
+//Deterministic checks of the wire format of entries, the node shared dose matrices and the joint distribution
+//of entries over ranks. Run with any number of ranks, each rank prints its failed checks and exits with their number.
+
+namespace {
+    int num_failures = 0;
+
+    void check(bool ok, const std::string& what) {
+        if (!ok) {
+            ++num_failures;
+            int rank;
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            std::cout << "Rank " << rank << " FAILED: " << what << "\n";
+        }
+    }
+
+    constexpr int num_vars = 30;
+
+    //A dose matrix with a pattern and values that only depend on data_id, so that all ranks make the same one
+    std::unique_ptr<SparseMatrix<double>> make_dose_matrix(int data_id) {
+        const int rows = 20 + 7 * data_id;
+        std::vector<double> vals;
+        std::vector<int> col_idxs;
+        std::vector<int> row_ptrs{0};
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < num_vars; ++col) {
+                if ((row + 2 * col + data_id) % 5 == 0) {
+                    col_idxs.push_back(col);
+                    vals.push_back(0.1 + 0.01 * col + 0.001 * data_id);
+                }
+            }
+            row_ptrs.push_back(static_cast<int>(col_idxs.size()));
+        }
+#ifdef USE_MKL
+        return MKL_sparse_matrix<double>::from_CSR_mat(vals.size(), rows, num_vars,
+                                                       vals.data(), col_idxs.data(), row_ptrs.data());
+#else
+        return EigenSparseMat<double>::from_CSR_mat(static_cast<int>(vals.size()), rows, num_vars,
+                                                    vals.data(), col_idxs.data(), row_ptrs.data());
+#endif
+    }
+
+    TROTSEntry make_entry(int data_id, FunctionType type, bool is_cons, std::vector<double> func_params,
+                          const RowPartInfo& row_part = {}) {
+        TROTSEntryInfo info{};
+        info.id = data_id;
+        info.num_vars = num_vars;
+        info.type = static_cast<int32_t>(type);
+        info.active = 1;
+        info.minimise = type != FunctionType::Min;
+        info.is_cons = is_cons;
+        info.rhs = 0.5 * data_id;
+        info.weight = 1.0 + data_id;
+        info.c = 0.25 * data_id;
+        std::vector<int> grad_nonzero_idxs;
+        for (int i = data_id % 3; i < num_vars; i += 3)
+            grad_nonzero_idxs.push_back(i);
+        return TROTSEntry{info, "roi_" + std::to_string(data_id), std::move(func_params),
+                          std::move(grad_nonzero_idxs), row_part};
+    }
+
+    bool same_entry(const TROTSEntry& a, const TROTSEntry& b) {
+        const TROTSEntryInfo a_info = a.get_info();
+        const TROTSEntryInfo b_info = b.get_info();
+        const RowPartInfo a_part = a.get_row_part_info();
+        const RowPartInfo b_part = b.get_row_part_info();
+        return a_info.id == b_info.id && a_info.num_vars == b_info.num_vars && a_info.type == b_info.type
+               && a_info.active == b_info.active && a_info.minimise == b_info.minimise
+               && a_info.is_cons == b_info.is_cons && a_info.rhs == b_info.rhs && a_info.weight == b_info.weight
+               && a_info.c == b_info.c
+               && a_part.total_voxels == b_part.total_voxels && a_part.split_group == b_part.split_group
+               && a.get_roi_name() == b.get_roi_name() && a.get_func_params() == b.get_func_params()
+               && a.get_grad_nonzero_idxs() == b.get_grad_nonzero_idxs();
+    }
+
+    //pack_entries followed by unpack_entries gives back the same entries, including those without
+    //parameters and the fields of row parts
+    void check_entry_wire_format() {
+        const std::vector<TROTSEntry> entries{
+            make_entry(1, FunctionType::LTCP, false, {60.0, 0.5}),
+            make_entry(2, FunctionType::Mean, true, {}),
+            make_entry(3, FunctionType::gEUD, false, {8.0}, RowPartInfo{1234, 2}),
+            make_entry(4, FunctionType::Max, true, {}, RowPartInfo{99, -1}),
+        };
+        std::vector<const TROTSEntry*> entry_ptrs;
+        for (const TROTSEntry& entry : entries)
+            entry_ptrs.push_back(&entry);
+
+        const std::vector<TROTSEntry> received = unpack_entries(pack_entries(entry_ptrs));
+        check(received.size() == entries.size(), "unpacked as many entries as were packed");
+        for (size_t i = 0; i < std::min(received.size(), entries.size()); ++i)
+            check(same_entry(received[i], entries[i]), "entry " + std::to_string(i) + " survives the wire format");
+
+        check(unpack_entries(pack_entries({})).empty(), "an empty list of entries survives the wire format");
+    }
+
+    double sum_of_values(const std::vector<TROTSEntry>& entries, const std::vector<double>& x) {
+        double sum = 0.0;
+        for (const TROTSEntry& entry : entries)
+            sum += entry.calc_value(x.data());
+        return sum;
+    }
+
+    //Whether ptr points into the segment of any rank of the node in window
+    bool in_window(MPI_Win window, MPI_Comm node_comm, const void* ptr) {
+        int node_size;
+        MPI_Comm_size(node_comm, &node_size);
+        for (int node_rank = 0; node_rank < node_size; ++node_rank) {
+            MPI_Aint size;
+            int disp_unit;
+            char* base = nullptr;
+            MPI_Win_shared_query(window, node_rank, &size, &disp_unit, &base);
+            const char* bytes = static_cast<const char*>(ptr);
+            if (size > 0 && bytes >= base && bytes < base + size)
+                return true;
+        }
+        return false;
+    }
+
+    //Matrix 1 is needed by all ranks, matrix 2 by the even ranks, the mean vector 3 by all ranks and one matrix by
+    //each rank alone. Rank 0 sends them from a problem with all of them.
+    //Matrix 1 is stored once per node, in the segment of the lowest rank of the node. The matrices needed by a
+    //single rank of a node stay private, and the entries have the same values as on private copies.
+    void check_shared_matrices() {
+        int rank, num_ranks;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+        const auto needed_data_ids = [](int r) {
+            std::vector<int> data_ids{1, 3, 4 + r};
+            if (r % 2 == 0)
+                data_ids.push_back(2);
+            return data_ids;
+        };
+        const auto make_data_entry = [](int data_id) {
+            return data_id == 3 ? make_entry(data_id, FunctionType::Mean, false, {})
+                                : make_entry(data_id, FunctionType::LTCP, false, {1.5, 0.8});
+        };
+        const std::vector<double> mean_vec(num_vars, 0.5);
+
+        //Objective data_id - 1 is on data data_id
+        TROTSProblem problem;
+        std::vector<std::unordered_set<int>> rank_data_ids;
+        if (rank == 0) {
+            TROTSProblem::DoseMatrixStore matrices;
+            std::vector<TROTSEntry> entries;
+            for (int data_id = 1; data_id <= 3 + num_ranks; ++data_id) {
+                if (data_id == 3)
+                    matrices.emplace_back(mean_vec);
+                else
+                    matrices.emplace_back(make_dose_matrix(data_id));
+                entries.push_back(make_data_entry(data_id));
+            }
+            problem = TROTSProblem{num_vars, std::move(matrices), std::move(entries), {}};
+            for (int r = 0; r < num_ranks; ++r) {
+                const std::vector<int> data_ids = needed_data_ids(r);
+                rank_data_ids.emplace_back(data_ids.cbegin(), data_ids.cend());
+            }
+        }
+
+        LocalData local_data;
+        local_data.num_vars = num_vars;
+        MPI_Win window = distribute_shared_matrices(rank == 0 ? &problem : nullptr,
+                                                    rank == 0 ? &rank_data_ids : nullptr, local_data);
+        //As in main, rank 0 takes what it needs by itself from the problem. The other ranks receive their entries.
+        if (rank == 0) {
+            std::vector<int> entry_idxs;
+            for (const int data_id : needed_data_ids(rank))
+                entry_idxs.push_back(data_id - 1);
+            keep_local_matrices(problem, entry_idxs, {}, local_data);
+        }
+        else {
+            for (const int data_id : needed_data_ids(rank))
+                local_data.obj_entries.push_back(make_data_entry(data_id));
+        }
+
+        MPI_Comm node_comm;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+        int node_size;
+        MPI_Comm_size(node_comm, &node_size);
+        std::vector<int> node_ranks(node_size);
+        MPI_Allgather(&rank, 1, MPI_INT, node_ranks.data(), 1, MPI_INT, node_comm);
+        const int num_even = static_cast<int>(std::count_if(node_ranks.cbegin(), node_ranks.cend(),
+                                                            [](int r) { return r % 2 == 0; }));
+
+        const bool have_all = local_data.matrices.count(1) && local_data.matrices.count(4 + rank)
+                              && local_data.matrices.count(2) == (rank % 2 == 0) && local_data.mean_vecs.count(3);
+        check(have_all, "every rank has the data it needs");
+        if (have_all) {
+            if (node_size > 1) {
+                MPI_Aint size;
+                int disp_unit;
+                char* owner_base = nullptr;
+                MPI_Win_shared_query(window, 0, &size, &disp_unit, &owner_base);
+                const char* data = reinterpret_cast<const char*>(local_data.matrices.at(1)->get_data_ptr());
+                check(data >= owner_base && data < owner_base + size,
+                      "matrix 1 is in the segment of the lowest rank of the node");
+            }
+            check(!in_window(window, node_comm, local_data.matrices.at(4 + rank)->get_data_ptr()),
+                  "a matrix needed by one rank stays private");
+            if (rank % 2 == 0) {
+                check(in_window(window, node_comm, local_data.matrices.at(2)->get_data_ptr()) == (num_even > 1),
+                      "matrix 2 is shared exactly when several ranks of the node need it");
+            }
+            check(local_data.mean_vecs.at(3) == mean_vec, "the mean vector arrives intact");
+
+            init_local_data(local_data);
+            const std::vector<double> x(num_vars, 1.0);
+            const double shared_value = sum_of_values(local_data.obj_entries, x);
+
+            LocalData private_data;
+            private_data.num_vars = num_vars;
+            for (const int data_id : needed_data_ids(rank)) {
+                if (data_id == 3)
+                    private_data.mean_vecs[data_id] = mean_vec;
+                else
+                    private_data.matrices[data_id] = make_dose_matrix(data_id);
+                private_data.obj_entries.push_back(make_data_entry(data_id));
+            }
+            init_local_data(private_data);
+            check(shared_value == sum_of_values(private_data.obj_entries, x),
+                  "entries have the same values on shared matrices");
+        }
+
+        MPI_Comm_free(&node_comm);
+        local_data.obj_entries.clear();
+        local_data.matrices.clear();
+        MPI_Win_free(&window);
+    }
+
+    //Every entry is placed on exactly one rank, and the entries of a dose matrix are placed together.
+    //The matrices are small compared to the load of a rank, so no group of entries has to be split.
+    void check_joint_distribution() {
+        const int num_ranks = 3;
+        std::vector<std::unique_ptr<SparseMatrix<double>>> matrices;
+        std::vector<TROTSEntry> obj_entries;
+        std::vector<TROTSEntry> cons_entries;
+        for (int data_id = 1; data_id <= 12; ++data_id) {
+            matrices.push_back(make_dose_matrix(data_id));
+            obj_entries.push_back(make_entry(data_id, FunctionType::LTCP, false, {1.5, 0.8}));
+            obj_entries.back().set_matrix_ptr(matrices.back().get());
+            if (data_id % 2 == 0) {
+                cons_entries.push_back(make_entry(data_id, FunctionType::Max, true, {}));
+                cons_entries.back().set_matrix_ptr(matrices.back().get());
+            }
+        }
+        const auto [obj_distrib, cons_distrib] = get_joint_rank_distribution(obj_entries, cons_entries,
+                                                                             num_ranks, 0.5);
+        check(obj_distrib.size() == num_ranks && cons_distrib.size() == num_ranks,
+              "joint distribution has a list per rank");
+
+        std::vector<int> obj_rank(obj_entries.size(), -1);
+        std::vector<int> cons_rank(cons_entries.size(), -1);
+        bool each_once = true;
+        for (int rank = 0; rank < static_cast<int>(obj_distrib.size()); ++rank) {
+            for (const int idx : obj_distrib[rank]) {
+                each_once = each_once && obj_rank[idx] == -1;
+                obj_rank[idx] = rank;
+            }
+            for (const int idx : cons_distrib[rank]) {
+                each_once = each_once && cons_rank[idx] == -1;
+                cons_rank[idx] = rank;
+            }
+        }
+        each_once = each_once && std::count(obj_rank.begin(), obj_rank.end(), -1) == 0
+                    && std::count(cons_rank.begin(), cons_rank.end(), -1) == 0;
+        check(each_once, "joint distribution places every entry on exactly one rank");
+
+        bool together = true;
+        for (size_t j = 0; j < cons_entries.size(); ++j) {
+            for (size_t i = 0; i < obj_entries.size(); ++i) {
+                if (obj_entries[i].get_id() == cons_entries[j].get_id())
+                    together = together && obj_rank[i] == cons_rank[j];
+            }
+        }
+        check(together, "joint distribution places the entries of a dose matrix on one rank");
+    }
+}
+
+int main(int argc, char* argv[]) {
+    MPI_Init(&argc, &argv);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if (rank == 0) {
+        check_entry_wire_format();
+        check_joint_distribution();
+    }
+    check_shared_matrices();
+
+    if (num_failures == 0 && rank == 0)
+        std::cout << "All checks passed\n";
+    MPI_Finalize();
+    return num_failures;
+}
@@ -1,7 +1,12 @@
 #include <algorithm>
 #include <cmath>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <numeric>
+#include <sstream>
+#include <stdexcept>
 #include <tuple>
 
 #include <mpi.h>
@@ -61,43 +66,296 @@ get_obj_cons_rank_idxs(const TROTSProblem& problem) {
     return std::make_tuple(obj_ranks, cons_ranks);
 }
 
-//The return value is a partitioning of TROTSEntries of roughly equal size.
+double CostModel::entry_cost(const TROTSEntry& entry) const {
+    double rate = this->seconds_per_nnz[static_cast<int>(entry.function_type())];
+    if (rate <= 0.0) {
+        double rate_sum = 0.0;
+        int num_known = 0;
+        for (const double known_rate : this->seconds_per_nnz) {
+            if (known_rate > 0.0) {
+                rate_sum += known_rate;
+                ++num_known;
+            }
+        }
+        rate = num_known > 0 ? rate_sum / num_known : 1.0;
+    }
+    return rate * entry.get_nnz();
+}
+
+CostModel CostModel::fit(const std::vector<const TROTSEntry*>& entries, const std::vector<double>& entry_seconds) {
+    std::array<double, num_types> seconds{};
+    std::array<double, num_types> nnz{};
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const int type = static_cast<int>(entries[i]->function_type());
+        seconds[type] += entry_seconds[i];
+        nnz[type] += entries[i]->get_nnz();
+    }
+
+    CostModel model;
+    for (int type = 0; type < num_types; ++type) {
+        if (nnz[type] > 0.0 && seconds[type] > 0.0)
+            model.seconds_per_nnz[type] = seconds[type] / nnz[type];
+    }
+    return model;
+}
+
+void CostModel::save(const std::filesystem::path& path) const {
+    std::ofstream out{path};
+    if (!out)
+        throw std::runtime_error("Could not open cost model file " + path.string() + " for writing\n");
+    out << "#function_type seconds_per_nnz\n" << std::setprecision(17);
+    for (int type = 0; type < num_types; ++type) {
+        if (this->seconds_per_nnz[type] > 0.0)
+            out << function_type_name(static_cast<FunctionType>(type)) << " " << this->seconds_per_nnz[type] << "\n";
+    }
+    if (!out)
+        throw std::runtime_error("Failed to write cost model file " + path.string() + "\n");
+}
+
+CostModel CostModel::load(const std::filesystem::path& path) {
+    std::ifstream in{path};
+    if (!in)
+        throw std::runtime_error("Could not open cost model file " + path.string() + "\n");
+    CostModel model;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream stream{line};
+        std::string type_name;
+        double rate;
+        if (!(stream >> type_name >> rate))
+            throw std::runtime_error("Invalid line in cost model file " + path.string() + ": " + line + "\n");
+        for (int type = 0; type < num_types; ++type) {
+            if (type_name == function_type_name(static_cast<FunctionType>(type)))
+                model.seconds_per_nnz[type] = rate;
+        }
+    }
+    return model;
+}
+
 std::vector<std::vector<int>>
-get_rank_distribution(const std::vector<TROTSEntry>& entries, int num_ranks) {
-    std::vector<std::vector<int>> buckets;
-    for (int i = 0; i < num_ranks; ++i)
-        buckets.emplace_back();
-
-    std::vector<int> entry_idxs(entries.size());
-    std::iota(entry_idxs.begin(), entry_idxs.end(), 0);
-
-    const auto comparison_func = [&entries](int entry_a, int entry_b) -> bool {
-        return entries[entry_a].get_nnz() > entries[entry_b].get_nnz();
-    };
-
-    //Sort the entry_idx array by the nnz of the corresponding TROTSEntry
-    //(In descending order)
-    std::sort(entry_idxs.begin(), entry_idxs.end(), comparison_func);
-
-    const auto compare_nnz_sums =
-        [&entries](const std::vector<int>& a,
-                   const std::vector<int>& b) -> bool {
-        int a_nnz_sum = 0;
-        for (int i : a)
-            a_nnz_sum += entries[i].get_nnz();
-        int b_nnz_sum = 0;
-        for (int i : b)
-            b_nnz_sum += entries[i].get_nnz();
-
-        return a_nnz_sum < b_nnz_sum;
-    };
-
-    //greedy distribution: loop over all indexes, except the first one (belonging to rank 0) and put the next entry into the currently
-    //smallest bucket
-    for (int idx : entry_idxs) {
-        auto min_elem_it = std::min_element(buckets.begin() + 1, buckets.end(), compare_nnz_sums);
-        min_elem_it->push_back(idx);
+distribute_costs(const std::vector<double>& costs, int num_ranks, double rank0_share,
+                 const std::vector<double>& base_loads) {
+    std::vector<std::vector<int>> buckets(num_ranks);
+
+    std::vector<int> item_idxs(costs.size());
+    std::iota(item_idxs.begin(), item_idxs.end(), 0);
+    //Sort the items by cost, in descending order
+    std::sort(item_idxs.begin(), item_idxs.end(), [&costs](int a, int b) { return costs[a] > costs[b]; });
+
+    //How much work each rank takes relative to the others. With a single rank, rank 0 has to do everything.
+    std::vector<double> capacities(num_ranks, 1.0);
+    capacities[0] = num_ranks == 1 ? 1.0 : std::clamp(rank0_share, 0.0, 1.0);
+    std::vector<double> loads = base_loads.empty() ? std::vector<double>(num_ranks, 0.0) : base_loads;
+
+    //greedy distribution: loop over all indexes and put the next item into the bucket that is the least full
+    //after adding it, relative to its capacity. Buckets without capacity (rank 0 by default) are left empty.
+    for (int idx : item_idxs) {
+        int best_bucket = -1;
+        double best_load = 0.0;
+        for (int i = 0; i < num_ranks; ++i) {
+            if (capacities[i] <= 0.0)
+                continue;
+            const double load = (loads[i] + costs[idx]) / capacities[i];
+            if (best_bucket < 0 || load < best_load) {
+                best_bucket = i;
+                best_load = load;
+            }
+        }
+        buckets[best_bucket].push_back(idx);
+        loads[best_bucket] += costs[idx];
+    }
+
+    return buckets;
+}
+
+std::vector<std::vector<int>>
+distribute_costs_by_data(const std::vector<double>& costs, const std::vector<int>& data_ids, int num_ranks,
+                         double rank0_share, const std::vector<double>& base_loads,
+                         const std::vector<std::unordered_set<int>>& held_data) {
+    std::vector<double> capacities(num_ranks, 1.0);
+    capacities[0] = num_ranks == 1 ? 1.0 : std::clamp(rank0_share, 0.0, 1.0);
+    std::vector<double> loads = base_loads.empty() ? std::vector<double>(num_ranks, 0.0) : base_loads;
+    std::vector<std::unordered_set<int>> rank_data = held_data.empty()
+        ? std::vector<std::unordered_set<int>>(num_ranks) : held_data;
+    //The load of each rank, relative to its capacity, if the work was spread perfectly
+    const double target_load = (std::accumulate(costs.cbegin(), costs.cend(), 0.0)
+                                + std::accumulate(loads.cbegin(), loads.cend(), 0.0))
+                               / std::accumulate(capacities.cbegin(), capacities.cend(), 0.0);
+
+    std::map<int, std::vector<int>> items_by_data;
+    for (size_t i = 0; i < costs.size(); ++i)
+        items_by_data[data_ids[i]].push_back(static_cast<int>(i));
+    std::vector<std::vector<int>> groups;
+    std::vector<double> group_costs;
+    for (const auto& [data_id, items] : items_by_data) {
+        double cost = 0.0;
+        for (int idx : items)
+            cost += costs[idx];
+        //A group larger than the load of a full rank would become the slowest rank
+        if (cost <= target_load) {
+            groups.push_back(items);
+            group_costs.push_back(cost);
+        }
+        else {
+            for (int idx : items) {
+                groups.push_back({idx});
+                group_costs.push_back(costs[idx]);
+            }
+        }
+    }
+    std::vector<int> group_idxs(groups.size());
+    std::iota(group_idxs.begin(), group_idxs.end(), 0);
+    std::sort(group_idxs.begin(), group_idxs.end(),
+              [&group_costs](int a, int b) { return group_costs[a] > group_costs[b]; });
+
+    std::vector<std::vector<int>> buckets(num_ranks);
+    for (int group : group_idxs) {
+        const int data_id = data_ids[groups[group].front()];
+        const double cost = group_costs[group];
+        int best_bucket = -1;
+        double best_load = 0.0;
+        int data_bucket = -1;
+        double data_load = 0.0;
+        for (int i = 0; i < num_ranks; ++i) {
+            if (capacities[i] <= 0.0)
+                continue;
+            const double load = (loads[i] + cost) / capacities[i];
+            if (best_bucket < 0 || load < best_load) {
+                best_bucket = i;
+                best_load = load;
+            }
+            if (rank_data[i].count(data_id) > 0 && (data_bucket < 0 || load < data_load)) {
+                data_bucket = i;
+                data_load = load;
+            }
+        }
+        //The matrix is already on data_bucket, so only place the group elsewhere to keep the loads even
+        const int bucket = data_bucket >= 0 && (data_load <= target_load || data_load <= best_load)
+                         ? data_bucket : best_bucket;
+        buckets[bucket].insert(buckets[bucket].end(), groups[group].cbegin(), groups[group].cend());
+        loads[bucket] += cost;
+        rank_data[bucket].insert(data_id);
     }
 
+    for (std::vector<int>& bucket : buckets)
+        std::sort(bucket.begin(), bucket.end());
     return buckets;
 }
+
+namespace {
+    std::vector<double> entry_costs(const std::vector<TROTSEntry>& entries, const CostModel* cost_model) {
+        std::vector<double> costs;
+        costs.reserve(entries.size());
+        for (const TROTSEntry& entry : entries)
+            costs.push_back(cost_model != nullptr ? cost_model->entry_cost(entry) : entry.get_nnz());
+        return costs;
+    }
+}
+
+//The return value is a partitioning of TROTSEntries of roughly equal size.
+std::vector<std::vector<int>>
+get_rank_distribution(const std::vector<TROTSEntry>& entries, int num_ranks, double rank0_share,
+                      const CostModel* cost_model) {
+    return distribute_costs(entry_costs(entries, cost_model), num_ranks, rank0_share);
+}
+
+std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>>
+get_joint_rank_distribution(const std::vector<TROTSEntry>& obj_entries, const std::vector<TROTSEntry>& cons_entries,
+                            int num_ranks, double rank0_share, const CostModel* cost_model) {
+    //The constraints follow the objectives in the items
+    std::vector<double> costs = entry_costs(obj_entries, cost_model);
+    const std::vector<double> cons_costs = entry_costs(cons_entries, cost_model);
+    costs.insert(costs.end(), cons_costs.cbegin(), cons_costs.cend());
+    std::vector<int> data_ids;
+    for (const auto* entries : {&obj_entries, &cons_entries}) {
+        for (const TROTSEntry& entry : *entries)
+            data_ids.push_back(entry.get_id());
+    }
+
+    const int num_obj = static_cast<int>(obj_entries.size());
+    std::vector<std::vector<int>> obj_distrib(num_ranks);
+    std::vector<std::vector<int>> cons_distrib(num_ranks);
+    const std::vector<std::vector<int>> buckets = distribute_costs_by_data(costs, data_ids, num_ranks, rank0_share);
+    for (int rank = 0; rank < num_ranks; ++rank) {
+        for (int idx : buckets[rank]) {
+            if (idx < num_obj)
+                obj_distrib[rank].push_back(idx);
+            else
+                cons_distrib[rank].push_back(idx - num_obj);
+        }
+    }
+    return {obj_distrib, cons_distrib};
+}
+
+std::vector<RowSplit> plan_row_splits(const TROTSProblem& problem, int num_ranks, double rank0_share, bool split_gEUD) {
+    const double total_capacity = num_ranks == 1 ? 1.0 : num_ranks - 1 + std::clamp(rank0_share, 0.0, 1.0);
+    double total_nnz = 0.0;
+    for (const TROTSEntry& entry : problem.objective_entries)
+        total_nnz += entry.get_nnz();
+    const double rank_nnz = total_nnz / total_capacity;
+
+    std::vector<RowSplit> row_splits;
+    int num_split_groups = 0;
+    for (int i = 0; i < static_cast<int>(problem.objective_entries.size()); ++i) {
+        const TROTSEntry& entry = problem.objective_entries[i];
+        const FunctionType type = entry.function_type();
+        const bool splittable = type == FunctionType::Max || type == FunctionType::Min
+                             || type == FunctionType::LTCP || (type == FunctionType::gEUD && split_gEUD);
+        if (!splittable || entry.get_nnz() <= rank_nnz)
+            continue;
+
+        const int num_parts = std::min(num_ranks, static_cast<int>(std::ceil(entry.get_nnz() / rank_nnz)));
+        if (num_parts < 2)
+            continue;
+        std::cout << "Splitting objective " << entry.get_roi_name() << " (" << entry.get_nnz() << " nnz) into "
+                  << num_parts << " row blocks\n";
+        const int split_group = type == FunctionType::gEUD ? num_split_groups++ : -1;
+        row_splits.push_back({i, num_parts, split_group});
+    }
+    return row_splits;
+}
+
+int apply_row_splits(TROTSProblem& problem, const std::vector<RowSplit>& row_splits) {
+    //The parts are appended to the entries, so the indexes of the planned entries stay valid
+    int num_split_groups = 0;
+    for (const RowSplit& split : row_splits) {
+        problem.split_objective_rows(split.entry_idx, split.num_parts, split.split_group);
+        num_split_groups = std::max(num_split_groups, split.split_group + 1);
+    }
+    return num_split_groups;
+}
+
+void broadcast_row_splits(std::vector<RowSplit>& row_splits) {
+    static_assert(sizeof(RowSplit) == 3 * sizeof(int));
+    int num_splits = static_cast<int>(row_splits.size());
+    MPI_Bcast(&num_splits, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    row_splits.resize(num_splits);
+    MPI_Bcast(row_splits.data(), 3 * num_splits, MPI_INT, 0, MPI_COMM_WORLD);
+}
+
+std::vector<std::vector<int>> broadcast_distribution(const std::vector<std::vector<int>>* distrib, int num_ranks) {
+    //The number of entries of each rank, followed by the indexes
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    std::vector<int> flat;
+    if (rank == 0) {
+        for (const std::vector<int>& idxs : *distrib)
+            flat.push_back(static_cast<int>(idxs.size()));
+        for (const std::vector<int>& idxs : *distrib)
+            flat.insert(flat.end(), idxs.cbegin(), idxs.cend());
+    }
+    int size = static_cast<int>(flat.size());
+    MPI_Bcast(&size, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    flat.resize(size);
+    MPI_Bcast(flat.data(), size, MPI_INT, 0, MPI_COMM_WORLD);
+
+    std::vector<std::vector<int>> result(num_ranks);
+    int pos = num_ranks;
+    for (int r = 0; r < num_ranks; ++r) {
+        result[r].assign(flat.cbegin() + pos, flat.cbegin() + pos + flat[r]);
+        pos += flat[r];
+    }
+    return result;
+}
@@ -1,18 +1,89 @@
 #ifndef DATA_DISTRIBUTION_H
 #define DATA_DISTRIBUTION_H
 
+#include <array>
+#include <filesystem>
 #include <vector>
 #include <tuple>
+#include <unordered_set>
+#include <utility>
 
 #include <mpi.h>
 
 #include "trots.h"
 
+//The cost of evaluating an entry, in seconds per non-zero of its dose matrix (or element of its mean vector),
+//for each function type. The cost per non-zero differs a lot between types, e.g. LTCP and gEUD evaluate
+//exp / pow for every voxel. Fitted from the times measured during a run, and saved for later runs.
+struct CostModel {
+    static constexpr int num_types = static_cast<int>(FunctionType::Chain) + 1;
+    //0 for the types without measurements
+    std::array<double, num_types> seconds_per_nnz{};
+
+    //Types without measurements get the average of the others. Without any measurements, the cost is the nnz.
+    double entry_cost(const TROTSEntry& entry) const;
+    //entry_seconds[i] is the time measured for entries[i], all over the same evaluations
+    static CostModel fit(const std::vector<const TROTSEntry*>& entries, const std::vector<double>& entry_seconds);
+    //One line "<function type> <seconds per nnz>" per measured type. Throws std::runtime_error on failure.
+    void save(const std::filesystem::path& path) const;
+    static CostModel load(const std::filesystem::path& path);
+};
+
+//Share of rank 0 in the initial distribution, unless given with --rank0_share
+constexpr double default_rank0_share = 0.5;
+
+//Greedy assignment of items with the given costs to ranks, the most expensive first, each to the rank with the
+//least load after adding it relative to its capacity. Rank 0 also runs IPOPT, so it only has rank0_share
+//(between 0 and 1) of the capacity of each of the other ranks. base_loads, if not empty, is work the ranks have already.
+//Return value: map from MPI rank to list of indexes of the items belonging to that rank.
+std::vector<std::vector<int>>
+distribute_costs(const std::vector<double>& costs, int num_ranks, double rank0_share,
+                 const std::vector<double>& base_loads = {});
+
+//As distribute_costs, for items that use the dose matrices with the given data ids, so that each matrix is stored
+//and sent to as few ranks as possible. The items with the same data id are placed together, unless they cost more
+//than the average load of a rank, in which case they are placed one by one. held_data, if not empty, holds the data ids
+//each rank has already. An item (group) goes to a rank that holds its data if that keeps the rank within the average
+//load, and to the least loaded rank as in distribute_costs otherwise.
+std::vector<std::vector<int>>
+distribute_costs_by_data(const std::vector<double>& costs, const std::vector<int>& data_ids, int num_ranks,
+                         double rank0_share, const std::vector<double>& base_loads = {},
+                         const std::vector<std::unordered_set<int>>& held_data = {});
+
 //Distributes the terms of the TROTSProblem (roughly) evenly between MPI ranks so that
-//the workload is even.
+//the workload is even, see distribute_costs. The cost of an entry is its nnz, or given by cost_model.
 //Return value: map from MPI rank to list of indexes of the terms in the TROTSProblem belonging to that rank.
 std::vector<std::vector<int>>
-get_rank_distribution(const std::vector<TROTSEntry>& entries, int num_ranks);
+get_rank_distribution(const std::vector<TROTSEntry>& entries, int num_ranks,
+                      double rank0_share = default_rank0_share, const CostModel* cost_model = nullptr);
+
+//Distributes the objective and constraint entries together with distribute_costs_by_data, so that e.g. an objective
+//and a constraint on the same ROI share one copy of its dose matrix. The loads are balanced for evaluating
+//the objectives and constraints in the same round. Returns the distributions of the objective and of the constraint entries.
+std::pair<std::vector<std::vector<int>>, std::vector<std::vector<int>>>
+get_joint_rank_distribution(const std::vector<TROTSEntry>& obj_entries, const std::vector<TROTSEntry>& cons_entries,
+                            int num_ranks, double rank0_share = default_rank0_share,
+                            const CostModel* cost_model = nullptr);
+
+//Split of objective entry_idx into num_parts row parts, see TROTSProblem::split_objective_rows
+struct RowSplit {
+    int entry_idx;
+    int num_parts;
+    int split_group;
+};
+
+//Plans to split each objective entry with more non-zeros than the average load of a rank into row parts,
+//so that a single large ROI does not limit how evenly get_rank_distribution can spread the work.
+//Only Max, Min, LTCP and, with split_gEUD, gEUD entries are split. The parts of each gEUD entry get their own split group.
+std::vector<RowSplit> plan_row_splits(const TROTSProblem& problem, int num_ranks, double rank0_share, bool split_gEUD);
+
+//Splits the entries of problem as planned. Returns the number of split groups.
+int apply_row_splits(TROTSProblem& problem, const std::vector<RowSplit>& row_splits);
+
+//Sends the row splits / a distribution (as returned by get_rank_distribution) from rank 0 to all ranks.
+//Collective over all ranks, the distribution is only read on rank 0, the other ranks pass nullptr.
+void broadcast_row_splits(std::vector<RowSplit>& row_splits);
+std::vector<std::vector<int>> broadcast_distribution(const std::vector<std::vector<int>>* distrib, int num_ranks);
 
 //No longer used functions
 /*std::tuple<std::vector<int>, std::vector<int>>
@@ -0,0 +1,155 @@
+#include "entry_migration.h"
+
+#include <array>
+#include <cassert>
+#include <deque>
+#include <map>
+#include <unordered_set>
+
+#include "data_distribution.h"
+#include "globals.h"
+#include "rank_local_data.h"
+#include "sparse_matrix_transfers.h"
+#include "trots_entry_transfers.h"
+
+#ifdef USE_MKL
+#include "MKL_sparse_matrix.h"
+#else
+#include "EigenSparseMat.h"
+#endif
+
+namespace {
+    //An entry on its way to another rank. The header is the data id, whether the data is a mean vector,
+    //and the rows, columns and non-zeros of the matrix.
+    struct OutgoingEntry {
+        std::vector<char> entry_bytes;
+        std::array<int, 5> header;
+    };
+
+    void send_entry(const TROTSEntry& entry, const LocalData& local_data, int dest,
+                    std::deque<OutgoingEntry>& outgoing, std::vector<MPI_Request>& requests) {
+        OutgoingEntry& out = outgoing.emplace_back();
+        out.entry_bytes = pack_entries({&entry});
+
+        const int data_id = entry.get_id();
+        const auto vec_it = local_data.mean_vecs.find(data_id);
+        if (vec_it != local_data.mean_vecs.end()) {
+            out.header = {data_id, 1, 1, static_cast<int>(vec_it->second.size()),
+                          static_cast<int>(vec_it->second.size())};
+        } else {
+            const SparseMatrix<double>& mat = *local_data.matrices.at(data_id);
+            out.header = {data_id, 0, mat.get_rows(), mat.get_cols(), mat.get_nnz()};
+        }
+
+        const auto isend = [&](const void* buf, int count, MPI_Datatype type, MPIMessageTags tag) {
+            requests.emplace_back();
+            MPI_Isend(buf, count, type, dest, tag, MPI_COMM_WORLD, &requests.back());
+        };
+        isend(out.entry_bytes.data(), static_cast<int>(out.entry_bytes.size()), MPI_BYTE, TROTS_ENTRY_TAG);
+        isend(out.header.data(), static_cast<int>(out.header.size()), MPI_INT, MIGRATION_HEADER_TAG);
+        if (out.header[1]) {
+            isend(vec_it->second.data(), out.header[4], MPI_DOUBLE, VEC_DATA_TAG);
+        } else {
+            //The matrix stays alive until the sends are complete, it is only freed afterwards
+            const SparseMatrix<double>& mat = *local_data.matrices.at(data_id);
+            isend(mat.get_data_ptr(), out.header[4], MPI_DOUBLE, CSR_DATA_TAG);
+            isend(mat.get_col_inds(), out.header[4], MPI_INT, CSR_COL_INDS_TAG);
+            isend(mat.get_row_ptrs(), out.header[2] + 1, MPI_INT, CSR_ROW_PTRS_TAG);
+        }
+    }
+
+    TROTSEntry recv_entry(LocalData& local_data, int source) {
+        const int num_bytes = probe_message_size(TROTS_ENTRY_TAG, MPI_COMM_WORLD, MPI_BYTE, source);
+        std::vector<char> bytes(num_bytes);
+        MPI_Recv(bytes.data(), num_bytes, MPI_BYTE, source, TROTS_ENTRY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        TROTSEntry entry = std::move(unpack_entries(bytes).front());
+
+        std::array<int, 5> header;
+        MPI_Recv(header.data(), static_cast<int>(header.size()), MPI_INT, source, MIGRATION_HEADER_TAG,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        const int data_id = header[0];
+        const int rows = header[2];
+        const int cols = header[3];
+        const int nnz = header[4];
+        //The data always has to be received, even if this rank has it already for another entry
+        if (header[1]) {
+            std::vector<double> vec(nnz);
+            MPI_Recv(vec.data(), nnz, MPI_DOUBLE, source, VEC_DATA_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            local_data.mean_vecs.emplace(data_id, std::move(vec));
+        } else {
+            std::vector<double> vals(nnz);
+            std::vector<int> col_idxs(nnz);
+            std::vector<int> row_ptrs(rows + 1);
+            MPI_Recv(vals.data(), nnz, MPI_DOUBLE, source, CSR_DATA_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Recv(col_idxs.data(), nnz, MPI_INT, source, CSR_COL_INDS_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Recv(row_ptrs.data(), rows + 1, MPI_INT, source, CSR_ROW_PTRS_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (local_data.matrices.count(data_id) == 0) {
+#ifdef USE_MKL
+                local_data.matrices.emplace(data_id, MKL_sparse_matrix<double>::from_CSR_mat(
+                    nnz, rows, cols, vals.data(), col_idxs.data(), row_ptrs.data()));
+#else
+                local_data.matrices.emplace(data_id, EigenSparseMat<double>::from_CSR_mat(
+                    nnz, rows, cols, vals.data(), col_idxs.data(), row_ptrs.data()));
+#endif
+            }
+        }
+        return entry;
+    }
+}
+
+void migrate_obj_entries(LocalData& local_data,
+                         const std::vector<std::vector<int>>* old_distrib,
+                         const std::vector<std::vector<int>>* new_distrib) {
+    int rank, num_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+    const std::vector<std::vector<int>> old_idxs = broadcast_distribution(old_distrib, num_ranks);
+    const std::vector<std::vector<int>> new_idxs = broadcast_distribution(new_distrib, num_ranks);
+
+    //Owner before and after, by index in the objective entries of the problem
+    std::map<int, int> old_owner;
+    std::map<int, int> new_owner;
+    for (int r = 0; r < num_ranks; ++r) {
+        for (int idx : old_idxs[r])
+            old_owner[idx] = r;
+        for (int idx : new_idxs[r])
+            new_owner[idx] = r;
+    }
+    assert(old_owner.size() == new_owner.size());
+
+    //Every pair of ranks sends and receives its entries in the order of their indexes, which keeps
+    //the messages of each entry matched. All sends are posted first, so no rank waits on another to receive.
+    std::map<int, TROTSEntry> entries;
+    for (size_t i = 0; i < old_idxs[rank].size(); ++i)
+        entries.emplace(old_idxs[rank][i], std::move(local_data.obj_entries[i]));
+    std::deque<OutgoingEntry> outgoing;
+    std::vector<MPI_Request> requests;
+    for (const auto& [idx, owner] : old_owner) {
+        if (owner == rank && new_owner[idx] != rank)
+            send_entry(entries.at(idx), local_data, new_owner[idx], outgoing, requests);
+    }
+    for (const auto& [idx, owner] : new_owner) {
+        if (owner == rank && old_owner[idx] != rank)
+            entries.emplace(idx, recv_entry(local_data, old_owner[idx]));
+    }
+    MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
+
+    local_data.obj_entries.clear();
+    for (int idx : new_idxs[rank])
+        local_data.obj_entries.push_back(std::move(entries.at(idx)));
+
+    //Free the data that only the entries sent away used
+    std::unordered_set<int> used_ids;
+    for (const auto* group : {&local_data.obj_entries, &local_data.cons_entries}) {
+        for (const TROTSEntry& entry : *group)
+            used_ids.insert(entry.get_id());
+    }
+    for (auto it = local_data.matrices.begin(); it != local_data.matrices.end();)
+        it = used_ids.count(it->first) > 0 ? std::next(it) : local_data.matrices.erase(it);
+    for (auto it = local_data.mean_vecs.begin(); it != local_data.mean_vecs.end();)
+        it = used_ids.count(it->first) > 0 ? std::next(it) : local_data.mean_vecs.erase(it);
+
+    init_local_data(local_data);
+    //The entries that arrived have no doses
+    local_data.obj_dose_iterate = -1;
+}
@@ -0,0 +1,17 @@
+#ifndef ENTRY_MIGRATION_H
+#define ENTRY_MIGRATION_H
+
+#include <vector>
+
+struct LocalData;
+
+//Moves objective entries between the ranks during the solve, from the distribution old_distrib to new_distrib
+//(both as returned by get_rank_distribution). Each entry that changes rank is sent with its dose matrix, matrices
+//no rank entry uses any more are freed, and local_data is set up again with init_local_data. The objective
+//entries of each rank end up in the order of new_distrib.
+//Collective over all ranks. The distributions are only read on rank 0, the other ranks pass nullptr.
+void migrate_obj_entries(LocalData& local_data,
+                         const std::vector<std::vector<int>>* old_distrib,
+                         const std::vector<std::vector<int>>* new_distrib);
+
+#endif
@@ -16,7 +16,23 @@ enum MPIMessageTags {
     CSR_ROW_PTRS_TAG,
     CSR_NUM_COLS_TAG,
     TROTS_ENTRY_TAG,
-    NUM_ENTRIES_TAG
+    MIGRATION_HEADER_TAG
+};
+
+//Operations rank 0 can request from the other ranks in compute_vals_mpi
+enum EvalOp {
+    EVAL_OBJ_OP,
+    EVAL_CONS_OP,
+    EVAL_HESS_OP,
+    EVAL_STATS_OP,
+    //Objective, objective gradient, constraints and Jacobian at once
+    EVAL_ALL_OP,
+    //The scale of x for the starting point, see calc_LTCP_scale_factor
+    EVAL_LTCP_SCALE_OP,
+    //Objective entries move between the ranks, see migrate_obj_entries
+    EVAL_REBALANCE_OP,
+    //The optimization is done, the other ranks leave compute_vals_mpi
+    EVAL_DONE_OP
 };
 
 #endif
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <filesystem>
+#include <optional>
+#include <tuple>
 #include <unordered_set>
 
 #include "coin-or/IpIpoptApplication.hpp"
@@ -9,7 +11,9 @@
 
 #include "data_distribution.h"
 #include "globals.h"
+#include "ipopt_options.h"
 #include "rank_local_data.h"
+#include "shared_matrices.h"
 #include "sparse_matrix_transfers.h"
 #include "trots.h"
 #include "test_distrib.h"
@@ -77,7 +81,7 @@ namespace {
             x[i] = 100.0;
         }
         double obj_val;
-        tnlp->eval_f(n, &x[0], false, obj_val);
+        tnlp->eval_f(n, &x[0], true, obj_val);
         std::vector<double> cons_vals(m);
         tnlp->eval_g(n, &x[0], false, m, &cons_vals[0]);
         std::cout << "Obj_val: " << obj_val << "\n";
@@ -99,69 +103,156 @@ int main(int argc, char* argv[]) {
     std::vector<std::vector<int>> rank_distrib_cons;
     TROTSProblem trots_problem;
     LocalData rank_local_data;
+    const CommandLineArgs args = parse_command_line(argc, argv);
+    const std::filesystem::path cache_path = args.get("cache", "");
+    const bool per_rank_loading = !cache_path.empty();
+    HessianMode hessian_mode = HessianMode::LimitedMemory;
     if (world_rank == 0) {
-        if (argc < 2 || argc > 3) {
-            std::cerr << "Usage: ./program <mat_file>\n"
-                      << "\t./program <mat_file> <max_iters>\n";
-            return -1;
+        if (args.positional.empty() || args.positional.size() > 2) {
+            std::cerr << "Usage: ./program <mat_file> [options]\n"
+                      << "\t./program <mat_file> <max_iters> [options]\n"
+                      << "Options:\n"
+                      << "\t--hessian=limited-memory|exact|gauss-newton\n"
+                      << "\t--output=<file> (default out_mpi.bin)\n"
+                      << "\t--save_state=<file>\n"
+                      << "\t--warm_start=<state_file> [--mu_init=<value>]\n"
+                      << "\t--checkpoint=<state_file> [--checkpoint_interval=<iters>]\n"
+                      << "\t--warmup_iters=<iters>\n"
+                      << "\t--telemetry=<file.csv|file.jsonl>\n"
+                      << "\t--cache=<file>\n"
+                      << "\t--separate_evals\n"
+                      << "\t--rank0_share=<fraction> (default 0.5)\n"
+                      << "\t--no_row_split\n"
+                      << "\t--rebalance_iter=<iter> (default 0, disabled)\n"
+                      << "\t--cost_model=<file>\n"
+                      << "\t--shared_matrices\n";
+            MPI_Abort(MPI_COMM_WORLD, -1);
         }
 
-        std::string path_str{argv[1]};
-        std::filesystem::path path{path_str};
+        std::filesystem::path path{args.positional[0]};
 
-        if (argc == 3)
-            max_iters = std::atoi(argv[2]);
+        if (args.positional.size() == 2)
+            max_iters = std::stoi(args.positional[1]);
+        hessian_mode = parse_hessian_mode(args.get("hessian", "limited-memory"));
 
-        trots_problem = std::move(TROTSProblem{TROTSMatFileData{path}});
+        //With a cache, every rank maps it and takes its own matrices from it, so rank 0 only makes sure it is current.
+        //Otherwise rank 0 loads the whole problem and sends the matrices to the other ranks.
+        if (!per_rank_loading) {
+            if (num_ranks > 1) {
+                std::cerr << "Warning: without --cache, rank 0 loads the whole problem and sends the dose matrices"
+                             " to the other ranks one by one. Pass --cache=<file> to let every rank load its own.\n";
+            }
+            trots_problem = load_trots_problem(path, "");
+        }
+        else if (!TROTSProblem::cache_is_current(cache_path, path))
+            load_trots_problem(path, cache_path);
+    }
+    if (per_rank_loading) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        trots_problem = TROTSProblem::from_cache(cache_path);
+    }
 
+    //Objectives too large for one rank are split into row blocks. The exact Hessian of a split gEUD
+    //would need all of its voxels on one rank, so those are only split with the limited-memory Hessian.
+    //The blocks are views of the matrices, so splitting reads no matrix data and each rank can repeat the plan of rank 0.
+    std::vector<RowSplit> row_splits;
+    if (world_rank == 0) {
         rank_local_data.num_vars = trots_problem.get_num_vars();
-
+        if (!args.has("no_row_split")) {
+            row_splits = plan_row_splits(trots_problem, num_ranks,
+                                         args.get_double("rank0_share", default_rank0_share),
+                                         hessian_mode == HessianMode::LimitedMemory);
+        }
     }
+    if (per_rank_loading)
+        broadcast_row_splits(row_splits);
+    if (world_rank == 0 || per_rank_loading)
+        rank_local_data.num_split_groups = apply_row_splits(trots_problem, row_splits);
 
     MPI_Bcast(&rank_local_data.num_vars, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&rank_local_data.num_split_groups, 1, MPI_INT, 0, MPI_COMM_WORLD);
     if (world_rank == 0) {
-        int num_ranks = 0;
-        MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
-
-        //Get a roughly even distribution of the matrices between the ranks, excluding rank 0
-        rank_distrib_obj = get_rank_distribution(trots_problem.objective_entries, num_ranks);
-        assert(rank_distrib_obj[0].empty());
+        //Get a roughly even distribution of the matrices between the ranks, with a smaller share for rank 0.
+        //The work is estimated from the nnz, or by a cost model saved by an earlier run.
+        const double rank0_share = args.get_double("rank0_share", default_rank0_share);
+        std::optional<CostModel> cost_model;
+        const std::string cost_model_path = args.get("cost_model", "");
+        if (!cost_model_path.empty() && std::filesystem::exists(cost_model_path))
+            cost_model = CostModel::load(cost_model_path);
+        const CostModel* cost_model_ptr = cost_model.has_value() ? &cost_model.value() : nullptr;
+        //The objectives and constraints are distributed together, so that the entries of a dose matrix share it,
+        //unless they are evaluated in separate rounds, each of which has to be balanced by itself.
+        if (args.has("separate_evals")) {
+            rank_distrib_obj = get_rank_distribution(trots_problem.objective_entries, num_ranks, rank0_share,
+                                                     cost_model_ptr);
+            rank_distrib_cons = get_rank_distribution(trots_problem.constraint_entries, num_ranks, rank0_share,
+                                                      cost_model_ptr);
+        }
+        else {
+            std::tie(rank_distrib_obj, rank_distrib_cons) = get_joint_rank_distribution(
+                trots_problem.objective_entries, trots_problem.constraint_entries, num_ranks, rank0_share,
+                cost_model_ptr);
+        }
         for (int i = 0; i < rank_distrib_obj.size();++i) {
             const auto& v = rank_distrib_obj[i];
             std::cout << "Rank " << i << " obj entries\n";
             print_vector(v);
         }
-        rank_distrib_cons = get_rank_distribution(trots_problem.constraint_entries, num_ranks);
-        assert(rank_distrib_cons[0].empty());
         for (int i = 0; i < rank_distrib_cons.size();++i) {
             const auto& v = rank_distrib_cons[i];
             std::cout << "Rank " << i << " cons entries\n";
             print_vector(v);
         }
-
         //dump_distrib_data_to_file(rank_distrib_obj, rank_distrib_cons, trots_problem);
-        distribute_sparse_matrices_send(trots_problem, rank_distrib_obj, rank_distrib_cons);
     }
 
-    if (world_rank != 0)
-        receive_sparse_matrices(rank_local_data);
-
-    /*MPI_Barrier(MPI_COMM_WORLD);
-    for (int i = 0; i < num_ranks; ++i) {
-        show_rank_local_data(i, rank_local_data);
-        MPI_Barrier(MPI_COMM_WORLD);
-    }*/
-    if (world_rank == 0) {
-        distribute_trots_entries_send(
-            trots_problem.objective_entries,
-            trots_problem.constraint_entries,
-            rank_distrib_obj,
-            rank_distrib_cons);
+    //With a cache, the ranks of a node already share the pages of the mapped matrices, so --shared_matrices
+    //has no effect then.
+    MPI_Win node_matrix_window = MPI_WIN_NULL;
+    if (per_rank_loading) {
+        //Only the plan is sent. The pages of the mapped matrices of other ranks are never read.
+        rank_distrib_obj = broadcast_distribution(world_rank == 0 ? &rank_distrib_obj : nullptr, num_ranks);
+        rank_distrib_cons = broadcast_distribution(world_rank == 0 ? &rank_distrib_cons : nullptr, num_ranks);
+        keep_local_matrices(trots_problem, rank_distrib_obj[world_rank], rank_distrib_cons[world_rank],
+                            rank_local_data);
+        if (world_rank != 0)
+            trots_problem = TROTSProblem();
     }
+    else {
+        //With --shared_matrices, each matrix that several ranks of a node need is received once per node
+        if (args.has("shared_matrices")) {
+            std::vector<std::unordered_set<int>> rank_data_ids;
+            if (world_rank == 0)
+                rank_data_ids = get_rank_data_ids(trots_problem, rank_distrib_obj, rank_distrib_cons);
+            node_matrix_window = distribute_shared_matrices(world_rank == 0 ? &trots_problem : nullptr,
+                                                            world_rank == 0 ? &rank_data_ids : nullptr,
+                                                            rank_local_data);
+        }
+        else if (world_rank == 0) {
+            distribute_sparse_matrices_send(trots_problem, rank_distrib_obj, rank_distrib_cons);
+        }
+        else {
+            receive_sparse_matrices(rank_local_data);
+        }
 
-    if (world_rank != 0) {
-        recv_trots_entries(rank_local_data);
+        /*MPI_Barrier(MPI_COMM_WORLD);
+        for (int i = 0; i < num_ranks; ++i) {
+            show_rank_local_data(i, rank_local_data);
+            MPI_Barrier(MPI_COMM_WORLD);
+        }*/
+        if (world_rank == 0) {
+            distribute_trots_entries_send(
+                trots_problem.objective_entries,
+                trots_problem.constraint_entries,
+                rank_distrib_obj,
+                rank_distrib_cons);
+            keep_local_matrices(trots_problem, rank_distrib_obj[0], rank_distrib_cons[0], rank_local_data);
+        }
+        else {
+            recv_trots_entries(rank_local_data);
+        }
     }
+
     MPI_Barrier(MPI_COMM_WORLD);
     init_local_data(rank_local_data);
     MPI_Barrier(MPI_COMM_WORLD);
@@ -169,25 +260,44 @@ int main(int argc, char* argv[]) {
 
     if (world_rank == 0) {
         const int num_cons = trots_problem.get_num_constraints();
-        Ipopt::SmartPtr<Ipopt::TNLP> tnlp =
-            new TROTS_ipopt_mpi(std::move(trots_problem), rank_distrib_cons, std::move(rank_local_data));
-
-        Ipopt::SmartPtr<Ipopt::IpoptApplication> app = new Ipopt::IpoptApplication();
-        app->Options()->SetStringValue("hessian_approximation", "limited-memory");
-        app->Options()->SetStringValue("mu_strategy", "adaptive");
-        app->Options()->SetStringValue("adaptive_mu_globalization", "kkt-error");
+        TROTS_ipopt_mpi* trots_ipopt =
+            new TROTS_ipopt_mpi(std::move(trots_problem), rank_distrib_obj, rank_distrib_cons,
+                                std::move(rank_local_data), hessian_mode);
+        Ipopt::SmartPtr<Ipopt::TNLP> tnlp = trots_ipopt;
+
+        SolverOutputPaths output_paths;
+        output_paths.solution_path = args.get("output", "out_mpi.bin");
+        output_paths.state_path = args.get("save_state", "");
+        output_paths.checkpoint_path = args.get("checkpoint", "");
+        output_paths.checkpoint_interval = args.get_int("checkpoint_interval", 50);
+        trots_ipopt->set_output_paths(output_paths);
+        if (args.has("warm_start"))
+            trots_ipopt->set_warm_start(SolverState::load(args.get("warm_start", "")));
+        trots_ipopt->set_warmup_iters(args.get_int("warmup_iters", 0));
+        trots_ipopt->set_combined_eval(!args.has("separate_evals"));
+        RebalanceOptions rebalance_options;
+        rebalance_options.iter = args.get_int("rebalance_iter", 0);
+        rebalance_options.cost_model_path = args.get("cost_model", "");
+        trots_ipopt->set_rebalance_options(rebalance_options);
+        if (args.has("telemetry"))
+            trots_ipopt->set_telemetry(std::make_unique<Telemetry>(args.get("telemetry", "")));
+
+        Ipopt::SmartPtr<Ipopt::IpoptApplication> app = make_ipopt_application(hessian_mode, max_iters);
         app->Options()->SetStringValue("print_timing_statistics", "yes");
         //app->Options()->SetStringValue("derivative_test", "first-order");
-        app->Options()->SetIntegerValue("max_iter", max_iters);
-        app->Options()->SetNumericValue("tol", 1e-9);
+        if (args.has("warm_start"))
+            set_warm_start_options(*app->Options(), args.get_double("mu_init", 1e-6));
         app->Initialize();
         app->OptimizeTNLP(tnlp);
         //Finally, get the objective and constraint ranks out of their infinite loops
-        compute_vals_mpi(true, nullptr, nullptr, false, nullptr, rank_local_data, std::nullopt, true);
+        trots_ipopt->stop_workers();
     } else {
-        compute_vals_mpi(true, nullptr, nullptr, false, nullptr, rank_local_data, std::nullopt, false);
+        //The other ranks serve evaluation requests until rank 0 calls stop_workers
+        compute_vals_mpi(EvalCommand{}, nullptr, nullptr, nullptr, rank_local_data, std::nullopt);
     }
 
+    if (node_matrix_window != MPI_WIN_NULL)
+        MPI_Win_free(&node_matrix_window);
     MPI_Finalize();
     return 0;
 }
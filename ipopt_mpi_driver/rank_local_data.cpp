@@ -1,8 +1,10 @@
 #include "rank_local_data.h"
 
+#include <algorithm>
 #include <cassert>
 
 #include "TROTSEntry.h"
+#include "trots_ipopt_mpi.h"
 
 namespace {
     void set_matrix_reference(TROTSEntry& entry, LocalData& data) {
@@ -26,16 +28,53 @@ namespace {
 }
 
 void init_local_data(LocalData& data) {
-    data.x_buffer.resize(data.num_vars);
+    data.command_buffer.resize(EvalCommand::num_fields + data.num_vars);
     data.grad_tmp.resize(data.num_vars);
     data.local_jac_nnz = 0;
+    std::vector<const TROTSEntry*> obj_entry_ptrs;
+    int max_grad_nnz = 0;
     for (TROTSEntry& entry : data.obj_entries) {
         set_matrix_reference(entry, data);
+        obj_entry_ptrs.push_back(&entry);
+        max_grad_nnz = std::max(max_grad_nnz, entry.get_grad_nnz());
+    }
+
+    data.obj_grad_idxs = grad_nonzero_union(obj_entry_ptrs, data.num_vars);
+    data.obj_grad_buffer.resize(data.obj_grad_idxs.size());
+    data.entry_grad_buffer.resize(max_grad_nnz);
+    data.obj_grad_positions.clear();
+    for (const TROTSEntry& entry : data.obj_entries) {
+        std::vector<int> positions;
+        positions.reserve(entry.get_grad_nnz());
+        for (int idx : entry.get_grad_nonzero_idxs()) {
+            const auto it = std::lower_bound(data.obj_grad_idxs.cbegin(), data.obj_grad_idxs.cend(), idx);
+            positions.push_back(static_cast<int>(it - data.obj_grad_idxs.cbegin()));
+        }
+        data.obj_grad_positions.push_back(std::move(positions));
     }
 
     for (TROTSEntry& entry : data.cons_entries) {
         data.local_jac_nnz += entry.get_grad_nnz();
         set_matrix_reference(entry, data);
     }
+    data.jac_buffer.resize(data.local_jac_nnz);
+    data.combined_buffer.resize(1 + data.obj_grad_idxs.size() + data.cons_entries.size() + data.local_jac_nnz);
+}
+
+std::vector<int> grad_nonzero_union(const std::vector<const TROTSEntry*>& entries, int num_vars) {
+    std::vector<char> touched(num_vars, 0);
+    for (const TROTSEntry* entry : entries) {
+        for (int idx : entry->get_grad_nonzero_idxs())
+            touched[idx] = 1;
+    }
+    std::vector<int> idxs;
+    for (int i = 0; i < num_vars; ++i) {
+        if (touched[i])
+            idxs.push_back(i);
+    }
+    return idxs;
 }
 
+const double* LocalData::command_x() const {
+    return this->command_buffer.data() + EvalCommand::num_fields;
+}
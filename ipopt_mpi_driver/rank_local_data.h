@@ -5,6 +5,8 @@
 #include <vector>
 #include <unordered_map>
 
+#include <mpi.h>
+
 #include "SparseMat.h"
 #include "TROTSEntry.h"
 
@@ -19,13 +21,45 @@ struct LocalData {
 
     int local_jac_nnz;
 
-    std::vector<double> x_buffer;
+    //Receives the commands broadcast by rank 0, EvalCommand::num_fields values followed by x.
+    //On rank 0, command_request is the broadcast of the last command, which may still be in flight.
+    std::vector<double> command_buffer;
+    MPI_Request command_request = MPI_REQUEST_NULL;
+    //Iterate ID of the command the doses of the local objective / constraint entries were computed for
+    long long obj_dose_iterate = -1;
+    long long cons_dose_iterate = -1;
     std::vector<double> grad_tmp;
+    //Sorted union of the gradient non-zeros of obj_entries, only these elements of the objective gradient
+    //are sent to rank 0. obj_grad_positions[i][j] is the index in obj_grad_idxs of the j:th gradient
+    //non-zero of obj_entries[i].
+    std::vector<int> obj_grad_idxs;
+    std::vector<std::vector<int>> obj_grad_positions;
+    //The local objective gradient at obj_grad_idxs, and the sparse gradient of a single entry
+    std::vector<double> obj_grad_buffer;
+    std::vector<double> entry_grad_buffer;
+    //What is sent for EVAL_ALL_OP: the local objective value, obj_grad_buffer, the local constraint values
+    //and the local Jacobian values
+    std::vector<double> combined_buffer;
+    //Values of the local part of the constraint Jacobian, local_jac_nnz elements
+    std::vector<double> jac_buffer;
+    //Partial dense Hessian of the local entries and their multipliers, only allocated when the exact Hessian is used.
+    std::vector<double> hess_buffer;
+    std::vector<double> cons_lambda;
     int num_vars;
+    //Number of gEUD entries that were split into row parts over the ranks (see plan_row_splits),
+    //and the power sums of their parts on this rank, indexed by split group
+    int num_split_groups = 0;
+    std::vector<double> split_sums;
+
+    //The iterate of the last command
+    const double* command_x() const;
 };
 
 
 
 void init_local_data(LocalData& data);
 
+//The sorted union of the gradient non-zeros of the entries
+std::vector<int> grad_nonzero_union(const std::vector<const TROTSEntry*>& entries, int num_vars);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "shared_matrices.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "data_distribution.h"
+#include "globals.h"
+#include "rank_local_data.h"
+#include "trots.h"
+
+#ifdef USE_MKL
+#include "MKL_sparse_matrix.h"
+#else
+#include "EigenSparseMat.h"
+#endif
+
+namespace {
+    //Data id, whether it is a mean vector, rows (or length of the mean vector), columns and nnz of each matrix,
+    //as broadcast by rank 0
+    constexpr int fields_per_matrix = 5;
+
+    struct MatrixDims {
+        bool is_vec;
+        int rows;
+        int cols;
+        int nnz;
+    };
+
+    MPI_Aint align(MPI_Aint bytes) {
+        constexpr MPI_Aint alignment = 64;
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    //Bytes of the CSR arrays of a matrix in the window: values, column indexes and row pointers, each aligned
+    MPI_Aint csr_bytes(const MatrixDims& dims) {
+        return align(sizeof(double) * static_cast<MPI_Aint>(dims.nnz))
+               + align(sizeof(int) * static_cast<MPI_Aint>(dims.nnz))
+               + align(sizeof(int) * static_cast<MPI_Aint>(dims.rows + 1));
+    }
+
+    struct CSRArrays {
+        double* vals;
+        int* col_idxs;
+        int* row_ptrs;
+    };
+
+    CSRArrays csr_arrays(char* base, const MatrixDims& dims) {
+        CSRArrays arrays;
+        arrays.vals = reinterpret_cast<double*>(base);
+        base += align(sizeof(double) * static_cast<MPI_Aint>(dims.nnz));
+        arrays.col_idxs = reinterpret_cast<int*>(base);
+        base += align(sizeof(int) * static_cast<MPI_Aint>(dims.nnz));
+        arrays.row_ptrs = reinterpret_cast<int*>(base);
+        return arrays;
+    }
+
+    void send_data(const TROTSProblem& trots_problem, int data_id, int rank) {
+        const auto& data = trots_problem.get_mat_by_data_id(data_id);
+        if (const auto* vec = std::get_if<std::vector<double>>(&data)) {
+            MPI_Send(vec->data(), static_cast<int>(vec->size()), MPI_DOUBLE, rank, VEC_DATA_TAG, MPI_COMM_WORLD);
+            return;
+        }
+        const SparseMatrix<double>& mat = *std::get<std::unique_ptr<SparseMatrix<double>>>(data);
+        MPI_Send(mat.get_data_ptr(), mat.get_nnz(), MPI_DOUBLE, rank, CSR_DATA_TAG, MPI_COMM_WORLD);
+        MPI_Send(mat.get_col_inds(), mat.get_nnz(), MPI_INT, rank, CSR_COL_INDS_TAG, MPI_COMM_WORLD);
+        MPI_Send(mat.get_row_ptrs(), mat.get_rows() + 1, MPI_INT, rank, CSR_ROW_PTRS_TAG, MPI_COMM_WORLD);
+    }
+
+    void recv_csr(const CSRArrays& arrays, const MatrixDims& dims) {
+        MPI_Recv(arrays.vals, dims.nnz, MPI_DOUBLE, 0, CSR_DATA_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(arrays.col_idxs, dims.nnz, MPI_INT, 0, CSR_COL_INDS_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(arrays.row_ptrs, dims.rows + 1, MPI_INT, 0, CSR_ROW_PTRS_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+}
+
+MPI_Win distribute_shared_matrices(const TROTSProblem* trots_problem,
+                                   const std::vector<std::unordered_set<int>>* rank_data_ids,
+                                   LocalData& local_data) {
+    int world_rank, num_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+    //Rank 0 sends the data ids of every rank, in ascending order, and the dimensions of their data
+    std::vector<std::vector<int>> sorted_data_ids;
+    std::vector<int> fields;
+    if (world_rank == 0) {
+        std::set<int> all_data_ids;
+        for (const std::unordered_set<int>& data_ids : *rank_data_ids) {
+            sorted_data_ids.emplace_back(data_ids.cbegin(), data_ids.cend());
+            std::sort(sorted_data_ids.back().begin(), sorted_data_ids.back().end());
+            all_data_ids.insert(data_ids.cbegin(), data_ids.cend());
+        }
+        for (const int data_id : all_data_ids) {
+            const auto& data = trots_problem->get_mat_by_data_id(data_id);
+            if (const auto* vec = std::get_if<std::vector<double>>(&data)) {
+                fields.insert(fields.end(), {data_id, 1, static_cast<int>(vec->size()), 0, 0});
+            }
+            else {
+                const SparseMatrix<double>& mat = *std::get<std::unique_ptr<SparseMatrix<double>>>(data);
+                fields.insert(fields.end(), {data_id, 0, mat.get_rows(), mat.get_cols(), mat.get_nnz()});
+            }
+        }
+    }
+    const std::vector<std::vector<int>> data_ids_of_rank =
+        broadcast_distribution(world_rank == 0 ? &sorted_data_ids : nullptr, num_ranks);
+    int num_fields = static_cast<int>(fields.size());
+    MPI_Bcast(&num_fields, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    fields.resize(num_fields);
+    MPI_Bcast(fields.data(), num_fields, MPI_INT, 0, MPI_COMM_WORLD);
+    std::map<int, MatrixDims> dims;
+    for (int i = 0; i < num_fields; i += fields_per_matrix)
+        dims[fields[i]] = {fields[i + 1] != 0, fields[i + 2], fields[i + 3], fields[i + 4]};
+
+    //The ranks of a node are numbered in the order of their world ranks, so they all have the same lowest world rank.
+    //Every rank learns the node of every other rank, since rank 0 sends to all of them.
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &node_comm);
+    int node_size;
+    MPI_Comm_size(node_comm, &node_size);
+    std::vector<int> node_world_ranks(node_size);
+    MPI_Allgather(&world_rank, 1, MPI_INT, node_world_ranks.data(), 1, MPI_INT, node_comm);
+    std::vector<int> node_of_rank(num_ranks);
+    MPI_Allgather(&node_world_ranks[0], 1, MPI_INT, node_of_rank.data(), 1, MPI_INT, MPI_COMM_WORLD);
+
+    //Every rank computes the same plan: a matrix that more than one rank of a node needs is owned by the lowest
+    //of them, and stored in its segment in the order of the data ids. Mean vectors are small and stay private.
+    std::map<std::pair<int, int>, std::vector<int>> holders;
+    for (int rank = 0; rank < num_ranks; ++rank) {
+        for (const int data_id : data_ids_of_rank[rank]) {
+            if (!dims.at(data_id).is_vec)
+                holders[{node_of_rank[rank], data_id}].push_back(rank);
+        }
+    }
+    //World rank of the owner of a matrix on the node of rank, or -1 if rank is the only one there that needs it
+    const auto owner_of = [&](int rank, int data_id) {
+        if (dims.at(data_id).is_vec)
+            return -1;
+        const std::vector<int>& ranks = holders.at({node_of_rank[rank], data_id});
+        return ranks.size() > 1 ? ranks.front() : -1;
+    };
+    std::map<int, MPI_Aint> offsets;
+    std::map<int, MPI_Aint> segment_bytes;
+    MPI_Aint saved_bytes = 0;
+    for (const auto& [node_and_id, ranks] : holders) {
+        if (node_and_id.first != node_world_ranks[0] || ranks.size() < 2)
+            continue;
+        const MatrixDims& mat_dims = dims.at(node_and_id.second);
+        offsets[node_and_id.second] = segment_bytes[ranks.front()];
+        segment_bytes[ranks.front()] += csr_bytes(mat_dims);
+        saved_bytes += (ranks.size() - 1) * csr_bytes(mat_dims);
+    }
+
+    char* segment = nullptr;
+    MPI_Win window;
+    MPI_Win_allocate_shared(segment_bytes[world_rank], 1, MPI_INFO_NULL, node_comm, &segment, &window);
+    MPI_Comm_free(&node_comm);
+
+    //Each rank gets the matrices it owns and those it needs by itself, in the order of its data ids
+    if (world_rank == 0) {
+        for (int rank = 0; rank < num_ranks; ++rank) {
+            for (const int data_id : data_ids_of_rank[rank]) {
+                const int owner = owner_of(rank, data_id);
+                if (owner != -1 && owner != rank)
+                    continue;
+                if (rank != 0) {
+                    send_data(*trots_problem, data_id, rank);
+                    continue;
+                }
+                if (owner == 0) {
+                    const SparseMatrix<double>& mat =
+                        *std::get<std::unique_ptr<SparseMatrix<double>>>(trots_problem->get_mat_by_data_id(data_id));
+                    const CSRArrays arrays = csr_arrays(segment + offsets.at(data_id), dims.at(data_id));
+                    std::copy_n(mat.get_data_ptr(), mat.get_nnz(), arrays.vals);
+                    std::copy_n(mat.get_col_inds(), mat.get_nnz(), arrays.col_idxs);
+                    std::copy_n(mat.get_row_ptrs(), mat.get_rows() + 1, arrays.row_ptrs);
+                }
+            }
+        }
+    }
+    else {
+        for (const int data_id : data_ids_of_rank[world_rank]) {
+            const MatrixDims& mat_dims = dims.at(data_id);
+            const int owner = owner_of(world_rank, data_id);
+            if (mat_dims.is_vec) {
+                std::vector<double> vec(mat_dims.rows);
+                MPI_Recv(vec.data(), mat_dims.rows, MPI_DOUBLE, 0, VEC_DATA_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                local_data.mean_vecs.insert({data_id, std::move(vec)});
+            }
+            else if (owner == world_rank) {
+                recv_csr(csr_arrays(segment + offsets.at(data_id), mat_dims), mat_dims);
+            }
+            else if (owner == -1) {
+                std::vector<double> vals(mat_dims.nnz);
+                std::vector<int> col_idxs(mat_dims.nnz);
+                std::vector<int> row_ptrs(mat_dims.rows + 1);
+                recv_csr({vals.data(), col_idxs.data(), row_ptrs.data()}, mat_dims);
+#ifdef USE_MKL
+                local_data.matrices[data_id] = MKL_sparse_matrix<double>::from_CSR_mat(
+                    mat_dims.nnz, mat_dims.rows, mat_dims.cols, vals.data(), col_idxs.data(), row_ptrs.data());
+#else
+                local_data.matrices[data_id] = EigenSparseMat<double>::from_CSR_mat(
+                    mat_dims.nnz, mat_dims.rows, mat_dims.cols, vals.data(), col_idxs.data(), row_ptrs.data());
+#endif
+            }
+        }
+    }
+    //Makes the arrays of the owners visible to the other ranks of the node
+    MPI_Win_fence(0, window);
+
+    //The window is freed by the caller, after the last use of the views. The owner given to the views only marks
+    //their arrays as external, so that they are not freed with the matrices.
+    const auto window_token = std::make_shared<const MPI_Win>(window);
+    for (const int data_id : data_ids_of_rank[world_rank]) {
+        const int owner = owner_of(world_rank, data_id);
+        if (owner == -1)
+            continue;
+        const int owner_node_rank = static_cast<int>(
+            std::find(node_world_ranks.cbegin(), node_world_ranks.cend(), owner) - node_world_ranks.cbegin());
+        MPI_Aint size;
+        int disp_unit;
+        char* base = nullptr;
+        MPI_Win_shared_query(window, owner_node_rank, &size, &disp_unit, &base);
+        const MatrixDims& mat_dims = dims.at(data_id);
+        const CSRArrays arrays = csr_arrays(base + offsets.at(data_id), mat_dims);
+#ifdef USE_MKL
+        local_data.matrices[data_id] = MKL_sparse_matrix<double>::from_mapped_CSR(
+            mat_dims.nnz, mat_dims.rows, mat_dims.cols, arrays.vals, arrays.col_idxs, arrays.row_ptrs, window_token);
+#else
+        local_data.matrices[data_id] = EigenSparseMat<double>::from_mapped_CSR(
+            mat_dims.nnz, mat_dims.rows, mat_dims.cols, arrays.vals, arrays.col_idxs, arrays.row_ptrs, window_token);
+#endif
+    }
+
+    if (world_rank == 0) {
+        std::cout << "Shared " << offsets.size() << " dose matrices between the ranks of node 0, saving "
+                  << saved_bytes / (1024.0 * 1024.0) << " MB\n";
+    }
+    return window;
+}
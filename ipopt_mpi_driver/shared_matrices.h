@@ -0,0 +1,26 @@
+#ifndef SHARED_MATRICES_H
+#define SHARED_MATRICES_H
+
+#include <unordered_set>
+#include <vector>
+
+#include <mpi.h>
+
+class TROTSProblem;
+struct LocalData;
+
+//Sends the dose matrices from rank 0 to the ranks that need them, as distribute_sparse_matrices_send and
+//receive_sparse_matrices, but stores each matrix that several ranks of a node need only once per node.
+//The lowest of these ranks receives it straight into its segment of an MPI-3 shared memory window, and every rank
+//of the node that needs it gets a read-only view of those arrays in local_data.matrices. The other ranks of the node
+//never receive the matrix, so no rank holds a private copy of it next to the shared one.
+//rank_data_ids[r] are the data ids rank r needs. trots_problem and rank_data_ids are only read on rank 0, the other
+//ranks pass nullptr. The matrices rank 0 needs by itself stay in trots_problem, for keep_local_matrices.
+//Call before init_local_data, which points the entries to the views.
+//Collective over all ranks. Returns the window, which has to be freed with MPI_Win_free before MPI_Finalize, when
+//the matrices are no longer used.
+MPI_Win distribute_shared_matrices(const TROTSProblem* trots_problem,
+                                   const std::vector<std::unordered_set<int>>* rank_data_ids,
+                                   LocalData& local_data);
+
+#endif
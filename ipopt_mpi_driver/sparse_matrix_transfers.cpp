@@ -14,15 +14,15 @@
 #include "EigenSparseMat.h"
 #endif
 
-namespace {
-    int probe_message_size(enum MPIMessageTags tag, MPI_Comm communicator, MPI_Datatype type, int rank) {
-        MPI_Status status;
-        MPI_Probe(rank, tag, communicator, &status);
-        int size;
-        MPI_Get_count(&status, type, &size);
-        return size;
-    }
+int probe_message_size(enum MPIMessageTags tag, MPI_Comm communicator, MPI_Datatype type, int rank) {
+    MPI_Status status;
+    MPI_Probe(rank, tag, communicator, &status);
+    int size;
+    MPI_Get_count(&status, type, &size);
+    return size;
+}
 
+namespace {
     void distribute_matrices(const TROTSProblem& trots_problem, MPI_Comm communicator,
                              const std::vector<std::unordered_set<int>>& rank_data_id_distribution) {
         //NOTE: We exclude rank 0 here to avoid deadlock problems.
@@ -130,19 +130,12 @@ namespace {
     }
 }
 
-void distribute_sparse_matrices_send(
-        TROTSProblem& trots_problem,
+std::vector<std::unordered_set<int>> get_rank_data_ids(
+        const TROTSProblem& trots_problem,
         const std::vector<std::vector<int>>& rank_distrib_obj,
         const std::vector<std::vector<int>>& rank_distrib_cons) {
-    //Check that we're rank 0
-    int world_rank = 1;
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
-    int num_ranks = 0;
-    MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
-    assert(world_rank == 0);
-
-    //Step 1: post the sends for the data matrices to the correct ranks.
     //Figure out which matrix goes where
+    const int num_ranks = static_cast<int>(rank_distrib_obj.size());
     std::vector<std::unordered_set<int>> data_id_buckets(num_ranks);
     for (int i = 0; i < num_ranks; ++i) {
         const std::vector<int>& entry_idxs = rank_distrib_obj[i];
@@ -158,11 +151,49 @@ void distribute_sparse_matrices_send(
             data_id_buckets[i].insert(data_id);
         }
     }
+    return data_id_buckets;
+}
 
-    //Post the sends for the data matrices
-    distribute_matrices(trots_problem, MPI_COMM_WORLD, data_id_buckets);
+void distribute_sparse_matrices_send(
+        TROTSProblem& trots_problem,
+        const std::vector<std::vector<int>>& rank_distrib_obj,
+        const std::vector<std::vector<int>>& rank_distrib_cons) {
+    //Check that we're rank 0
+    int world_rank = 1;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    assert(world_rank == 0);
+
+    //Post the sends for the data matrices to the correct ranks
+    distribute_matrices(trots_problem, MPI_COMM_WORLD,
+                        get_rank_data_ids(trots_problem, rank_distrib_obj, rank_distrib_cons));
 }
 
 void receive_sparse_matrices(LocalData& local_data) {
     recv_matrices_for_comm(local_data, MPI_COMM_WORLD);
-}
\ No newline at end of file
+}
+
+void keep_local_matrices(
+        TROTSProblem& trots_problem,
+        const std::vector<int>& obj_entry_idxs,
+        const std::vector<int>& cons_entry_idxs,
+        LocalData& local_data) {
+    std::unordered_set<int> data_ids;
+    for (const int entry_idx : obj_entry_idxs) {
+        local_data.obj_entries.push_back(trots_problem.objective_entries[entry_idx]);
+        data_ids.insert(trots_problem.objective_entries[entry_idx].get_id());
+    }
+    for (const int entry_idx : cons_entry_idxs) {
+        local_data.cons_entries.push_back(trots_problem.constraint_entries[entry_idx]);
+        data_ids.insert(trots_problem.constraint_entries[entry_idx].get_id());
+    }
+
+    //The problem does not need the matrices any more, so they can be taken out of it instead of copied
+    for (const int data_id : data_ids) {
+        auto& data = trots_problem.get_mat_by_data_id(data_id);
+        if (std::holds_alternative<std::vector<double>>(data))
+            local_data.mean_vecs.insert({data_id, std::move(std::get<std::vector<double>>(data))});
+        else
+            local_data.matrices.insert({data_id, std::move(std::get<std::unique_ptr<SparseMatrix<double>>>(data))});
+    }
+    trots_problem.clear_mat_data();
+}
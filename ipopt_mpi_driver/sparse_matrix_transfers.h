@@ -1,13 +1,34 @@
 #ifndef SPARSE_MATRIX_TRANSFERS_H
 #define SPARSE_MATRIX_TRANSFERS_H
 
+#include <unordered_set>
+#include <vector>
+
+#include "globals.h"
+
 
 class TROTSProblem;
 class LocalData;
 
+//Waits for a message with the given tag from rank and returns its number of elements of type
+int probe_message_size(enum MPIMessageTags tag, MPI_Comm communicator, MPI_Datatype type, int rank);
+//The data ids of the dose matrices and mean vectors each rank needs for its entries of the distribution
+std::vector<std::unordered_set<int>> get_rank_data_ids(
+    const TROTSProblem& trots_problem,
+    const std::vector<std::vector<int>>& rank_distrib_obj,
+    const std::vector<std::vector<int>>& rank_distrib_cons);
 void distribute_sparse_matrices_send(
     TROTSProblem& trots_problem,
     const std::vector<std::vector<int>>& rank_distrib_obj,
     const std::vector<std::vector<int>>& rank_distrib_cons);
 void receive_sparse_matrices(LocalData& local_data);
+//Moves the matrices of the given entries into local_data, together with copies of the entries, and frees
+//all other matrices of the problem. Used by rank 0 after distribute_sparse_matrices_send, and by every rank
+//when each loads the problem itself. Matrices local_data has already, such as the node shared views of
+//distribute_shared_matrices, are kept.
+void keep_local_matrices(
+    TROTSProblem& trots_problem,
+    const std::vector<int>& obj_entry_idxs,
+    const std::vector<int>& cons_entry_idxs,
+    LocalData& local_data);
 #endif
\ No newline at end of file
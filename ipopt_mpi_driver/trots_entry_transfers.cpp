@@ -1,66 +1,109 @@
-#include <sstream>
-
-#include <iostream>
-
-#include <boost/archive/basic_binary_oarchive.hpp>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
 
 #include "rank_local_data.h"
+#include "sparse_matrix_transfers.h"
 #include "TROTSEntry.h"
 #include "trots_entry_transfers.h"
 #include "globals.h"
 
 namespace {
-    int probe_message_size(enum MPIMessageTags tag, MPI_Comm communicator, MPI_Datatype type, int rank) {
-        MPI_Status status;
-        MPI_Probe(rank, tag, communicator, &status);
-        int size;
-        MPI_Get_count(&status, type, &size);
-        return size;
+    //The fixed size part of an entry. The variable length fields follow in separate arrays
+    //for all entries, in the order of the descriptors.
+    struct EntryDescriptor {
+        TROTSEntryInfo info;
+        RowPartInfo row_part;
+        uint32_t name_len;
+        uint32_t num_params;
+        uint32_t num_grad_idxs;
+        uint32_t padding;
+    };
+    static_assert(std::is_trivially_copyable_v<EntryDescriptor>);
+
+    template <typename T>
+    void append(std::vector<char>& buf, const T* data, size_t count) {
+        const char* bytes = reinterpret_cast<const char*>(data);
+        buf.insert(buf.end(), bytes, bytes + sizeof(T) * count);
     }
 
-    void distribute_trots_entries_comm(
-            const std::vector<TROTSEntry>& entries,
-            const std::vector<std::vector<int>>& rank_distrib,
-            MPI_Comm communicator) {
-        for (int rank = 1; rank < rank_distrib.size(); ++rank) {
-            const std::vector<int>& entries_for_rank = rank_distrib[rank];
-            const int num_entries = static_cast<int>(entries_for_rank.size());
-            MPI_Send(&num_entries, 1, MPI_INT, rank, NUM_ENTRIES_TAG, communicator);
-            for (int entry_idx : entries_for_rank) {
-                std::ostringstream stream;
-                boost::archive::binary_oarchive o_archive(stream);
-                o_archive << entries[entry_idx];
-                const std::string str = stream.str();
-                //Avoid problems with null-termination by copying the characters of the string
-                std::vector<char> char_buf(str.begin(), str.end());
-                MPI_Send(static_cast<const void*>(&char_buf[0]), char_buf.size(),
-                         MPI_CHAR, rank, TROTS_ENTRY_TAG, communicator);
-            }
+    //Reads arrays from a packed buffer in order, with bounds checks
+    class BufferReader {
+    public:
+        explicit BufferReader(const std::vector<char>& buf) : buf{buf} {}
+
+        template <typename T>
+        void read(T* out, size_t count) {
+            const size_t num_bytes = sizeof(T) * count;
+            if (this->pos + num_bytes > this->buf.size())
+                throw std::runtime_error("Truncated TROTSEntry buffer\n");
+            std::memcpy(static_cast<void*>(out), this->buf.data() + this->pos, num_bytes);
+            this->pos += num_bytes;
         }
+
+    private:
+        const std::vector<char>& buf;
+        size_t pos = 0;
+    };
+}
+
+std::vector<char> pack_entries(const std::vector<const TROTSEntry*>& entries) {
+    std::vector<EntryDescriptor> descriptors;
+    descriptors.reserve(entries.size());
+    for (const TROTSEntry* entry : entries) {
+        EntryDescriptor descriptor{};
+        descriptor.info = entry->get_info();
+        descriptor.row_part = entry->get_row_part_info();
+        descriptor.name_len = static_cast<uint32_t>(entry->get_roi_name().size());
+        descriptor.num_params = static_cast<uint32_t>(entry->get_func_params().size());
+        descriptor.num_grad_idxs = static_cast<uint32_t>(entry->get_grad_nnz());
+        descriptors.push_back(descriptor);
     }
 
-    void recv_entries_for_comm(LocalData& data, MPI_Comm comm, bool objective_entries) {
-        int num_entries = 0;
-        MPI_Recv(&num_entries, 1, MPI_INT, 0, NUM_ENTRIES_TAG, comm, MPI_STATUS_IGNORE);
-        for (int i = 0; i < num_entries; ++i) {
-            int num_bytes = probe_message_size(TROTS_ENTRY_TAG, comm, MPI_CHAR, 0);
-            std::vector<char> buf(num_bytes);
-            MPI_Recv(&buf[0], num_bytes, MPI_CHAR, 0, TROTS_ENTRY_TAG, comm, MPI_STATUS_IGNORE);
-
-            std::string str_buf(buf.cbegin(), buf.cend());
-            std::istringstream istream(std::move(str_buf));
-            boost::archive::binary_iarchive iarchive(istream);
-            TROTSEntry new_entry;
-            iarchive >> new_entry;
-
-            if (objective_entries)
-                data.obj_entries.push_back(new_entry);
-            else
-                data.cons_entries.push_back(new_entry);
-        }
+    std::vector<char> buf;
+    const uint64_t num_entries = entries.size();
+    append(buf, &num_entries, 1);
+    append(buf, descriptors.data(), descriptors.size());
+    for (const TROTSEntry* entry : entries)
+        append(buf, entry->get_func_params().data(), entry->get_func_params().size());
+    for (const TROTSEntry* entry : entries)
+        append(buf, entry->get_grad_nonzero_idxs().data(), entry->get_grad_nonzero_idxs().size());
+    for (const TROTSEntry* entry : entries) {
+        const std::string name = entry->get_roi_name();
+        append(buf, name.data(), name.size());
     }
+    return buf;
 }
 
+std::vector<TROTSEntry> unpack_entries(const std::vector<char>& buf) {
+    BufferReader reader{buf};
+    uint64_t num_entries = 0;
+    reader.read(&num_entries, 1);
+    std::vector<EntryDescriptor> descriptors(num_entries);
+    reader.read(descriptors.data(), num_entries);
+
+    std::vector<std::vector<double>> params(num_entries);
+    for (uint64_t i = 0; i < num_entries; ++i) {
+        params[i].resize(descriptors[i].num_params);
+        reader.read(params[i].data(), params[i].size());
+    }
+    std::vector<std::vector<int>> grad_idxs(num_entries);
+    for (uint64_t i = 0; i < num_entries; ++i) {
+        grad_idxs[i].resize(descriptors[i].num_grad_idxs);
+        reader.read(grad_idxs[i].data(), grad_idxs[i].size());
+    }
+
+    std::vector<TROTSEntry> entries;
+    entries.reserve(num_entries);
+    for (uint64_t i = 0; i < num_entries; ++i) {
+        std::string name(descriptors[i].name_len, '\0');
+        reader.read(&name[0], name.size());
+        entries.emplace_back(descriptors[i].info, std::move(name), std::move(params[i]), std::move(grad_idxs[i]),
+                             descriptors[i].row_part);
+    }
+    return entries;
+}
 
 void distribute_trots_entries_send(const std::vector<TROTSEntry>& obj_entries,
                                    const std::vector<TROTSEntry>& cons_entries,
@@ -73,12 +116,30 @@ void distribute_trots_entries_send(const std::vector<TROTSEntry>& obj_entries,
 
     assert(world_rank == 0);
 
-    distribute_trots_entries_comm(obj_entries, rank_distrib_obj, MPI_COMM_WORLD);
-    distribute_trots_entries_comm(cons_entries, rank_distrib_cons, MPI_COMM_WORLD);
+    //The objective entries of a rank come first, the receiver tells them apart by is_constraint
+    std::vector<std::vector<char>> buffers(rank_distrib_obj.size());
+    std::vector<MPI_Request> requests(rank_distrib_obj.size(), MPI_REQUEST_NULL);
+    for (int rank = 1; rank < rank_distrib_obj.size(); ++rank) {
+        std::vector<const TROTSEntry*> entries;
+        for (int entry_idx : rank_distrib_obj[rank])
+            entries.push_back(&obj_entries[entry_idx]);
+        for (int entry_idx : rank_distrib_cons[rank])
+            entries.push_back(&cons_entries[entry_idx]);
+        buffers[rank] = pack_entries(entries);
+        MPI_Isend(buffers[rank].data(), static_cast<int>(buffers[rank].size()), MPI_BYTE, rank,
+                  TROTS_ENTRY_TAG, MPI_COMM_WORLD, &requests[rank]);
+    }
+    MPI_Waitall(static_cast<int>(requests.size()), requests.data(), MPI_STATUSES_IGNORE);
 }
 
 void recv_trots_entries(LocalData& data) {
-    recv_entries_for_comm(data, MPI_COMM_WORLD, true);
-    recv_entries_for_comm(data, MPI_COMM_WORLD, false);
+    const int num_bytes = probe_message_size(TROTS_ENTRY_TAG, MPI_COMM_WORLD, MPI_BYTE, 0);
+    std::vector<char> buf(num_bytes);
+    MPI_Recv(buf.data(), num_bytes, MPI_BYTE, 0, TROTS_ENTRY_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    for (TROTSEntry& entry : unpack_entries(buf)) {
+        if (entry.is_constraint())
+            data.cons_entries.push_back(std::move(entry));
+        else
+            data.obj_entries.push_back(std::move(entry));
+    }
 }
-
@@ -1,10 +1,12 @@
 #ifndef TROTS_ENTRY_TRANSFERS_H
 #define TROTS_ENTRY_TRANSFERS_H
 
+#include <vector>
 
 struct LocalData;
-struct TROTSEntry;
+class TROTSEntry;
 
+//Sends the objective and constraint entries of each rank > 0 in a single message. Only called by rank 0.
 void distribute_trots_entries_send(const std::vector<TROTSEntry>& obj_entries,
                                    const std::vector<TROTSEntry>& cons_entries,
                                    const std::vector<std::vector<int>>& rank_distrib_obj,
@@ -12,4 +14,10 @@ void distribute_trots_entries_send(const std::vector<TROTSEntry>& obj_entries,
 
 void recv_trots_entries(LocalData& data);
 
-#endif
\ No newline at end of file
+//Wire format of entries: the number of entries, an EntryDescriptor per entry (see trots_entry_transfers.cpp),
+//then the function parameters, gradient sparsity patterns and names of all entries. Only the metadata is sent,
+//the received entries have no dose data and allocate their workspaces when it is set (see init_local_data).
+std::vector<char> pack_entries(const std::vector<const TROTSEntry*>& entries);
+std::vector<TROTSEntry> unpack_entries(const std::vector<char>& buf);
+
+#endif
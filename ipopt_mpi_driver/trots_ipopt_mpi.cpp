@@ -1,24 +1,92 @@
 #include "trots_ipopt_mpi.h"
 
+#include "data_distribution.h"
+#include "entry_migration.h"
 #include "globals.h"
+#include "starting_point.h"
 #include "util.h"
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <iostream>
+#include <limits>
+#include <unordered_set>
 #include <mpi.h>
 
+namespace {
+    //Adds the time from construction to destruction to seconds
+    class RoundTimer {
+    public:
+        explicit RoundTimer(double& seconds) : seconds{seconds}, start{std::chrono::steady_clock::now()} {}
+        ~RoundTimer() {
+            this->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+        }
+        RoundTimer(const RoundTimer&) = delete;
+        RoundTimer& operator=(const RoundTimer&) = delete;
+    private:
+        double& seconds;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
 TROTS_ipopt_mpi::TROTS_ipopt_mpi(
         TROTSProblem&& problem,
+        const std::vector<std::vector<int>>& obj_term_distribution,
         const std::vector<std::vector<int>>& cons_term_distribution,
-        LocalData&& data) {
+        LocalData&& data,
+        HessianMode hessian_mode) :
+    hessian_mode{hessian_mode}
+{
     this->trots_problem = std::make_unique<TROTSProblem>(std::move(problem));
+    this->obj_term_distribution = obj_term_distribution;
     this->cons_term_distribution = cons_term_distribution;
     this->local_data = std::move(data);
 
+    this->obj_eval_seconds.resize(this->trots_problem->objective_entries.size());
+    this->cons_eval_seconds.resize(this->trots_problem->constraint_entries.size());
+    this->init_gather_layouts();
+}
+
+void TROTS_ipopt_mpi::init_gather_layouts() {
+    this->stats_recv_counts.clear();
+    this->stats_recv_displacements.clear();
+    this->obj_grad_idxs.clear();
+    this->obj_grad_recv_counts.clear();
+    this->obj_grad_recv_displacements.clear();
+    this->cons_order.clear();
+    this->distrib_data = ConsDistributionData{};
+    this->combined_recv_counts.clear();
+    this->combined_recv_displacements.clear();
+
+    int cumulative_sum_stats = 0;
+    for (int i = 0; i < this->obj_term_distribution.size(); ++i) {
+        const int num_entries = this->obj_term_distribution[i].size() + this->cons_term_distribution[i].size();
+        this->stats_recv_counts.push_back(num_entries * EntryStats::num_fields);
+        this->stats_recv_displacements.push_back(cumulative_sum_stats);
+        cumulative_sum_stats += num_entries * EntryStats::num_fields;
+    }
+
+    //The ranks send the objective gradient only at the union of the non-zeros of their entries.
+    //Rank 0 has the full problem, so it finds the same unions as the ranks do in init_local_data.
+    const int num_vars = this->trots_problem->get_num_vars();
+    for (const std::vector<int>& obj_idxs : this->obj_term_distribution) {
+        std::vector<const TROTSEntry*> entries;
+        for (int idx : obj_idxs)
+            entries.push_back(&this->trots_problem->objective_entries[idx]);
+        const std::vector<int> rank_grad_idxs = grad_nonzero_union(entries, num_vars);
+        this->obj_grad_recv_counts.push_back(rank_grad_idxs.size());
+        this->obj_grad_recv_displacements.push_back(this->obj_grad_idxs.size());
+        this->obj_grad_idxs.insert(this->obj_grad_idxs.end(), rank_grad_idxs.cbegin(), rank_grad_idxs.cend());
+    }
+    this->obj_grad_recv_buffer.resize(this->obj_grad_idxs.size());
+
     int cumulative_sum_g = 0;
     int cumulative_sum_jac_g = 0;
 
     for (int i = 0; i < this->cons_term_distribution.size(); ++i) {
         const std::vector<int>& cons_idxs = this->cons_term_distribution[i];
+        this->cons_order.insert(this->cons_order.end(), cons_idxs.cbegin(), cons_idxs.cend());
         int nnz_total = 0;
         int num_cons = cons_idxs.size();
         for (int idx : cons_idxs) {
@@ -33,10 +101,19 @@ TROTS_ipopt_mpi::TROTS_ipopt_mpi(
         cumulative_sum_jac_g += nnz_total;
     }
 
-    print_vector(this->distrib_data.recv_counts_g);
-    print_vector(this->distrib_data.recv_displacements_g);
-    print_vector(this->distrib_data.recv_counts_jac);
-    print_vector(this->distrib_data.recv_displacements_jac);
+    //For EVAL_ALL_OP, each rank sends its objective value followed by what it sends in the three gathers above
+    int cumulative_sum_combined = 0;
+    for (int i = 0; i < this->obj_grad_recv_counts.size(); ++i) {
+        const int count = 1 + this->obj_grad_recv_counts[i] + this->distrib_data.recv_counts_g[i]
+                        + this->distrib_data.recv_counts_jac[i];
+        this->combined_recv_counts.push_back(count);
+        this->combined_recv_displacements.push_back(cumulative_sum_combined);
+        cumulative_sum_combined += count;
+    }
+    this->combined_recv_buffer.resize(cumulative_sum_combined);
+    this->combined.grad_f.resize(num_vars);
+    this->combined.cons_vals.resize(cumulative_sum_g);
+    this->combined.jac_vals.resize(cumulative_sum_jac_g);
 }
 
 bool TROTS_ipopt_mpi::get_nlp_info(
@@ -49,8 +126,16 @@ bool TROTS_ipopt_mpi::get_nlp_info(
     std::cout << "m: " << m << std::endl;
     nnz_jac_g = this->trots_problem->get_nnz_jac_cons();
     std::cout << "nnz_jac_g: " << nnz_jac_g << std::endl;
-    //Hessian is dense, but symmetric
-    nnz_h_lag = n * n / 2;
+    //Hessian is dense, but symmetric. Only the lower triangle is given to IPOPT, and only when it is used.
+    nnz_h_lag = 0;
+    if (this->hessian_mode != HessianMode::LimitedMemory) {
+        const long long nnz_h = this->trots_problem->get_nnz_hessian();
+        if (nnz_h > std::numeric_limits<int>::max()) {
+            std::cerr << "Too many variables to form the dense Hessian, use the limited-memory approximation\n";
+            return false;
+        }
+        nnz_h_lag = static_cast<int>(nnz_h);
+    }
     index_style = C_STYLE;
     return true;
 }
@@ -65,10 +150,13 @@ bool TROTS_ipopt_mpi::get_bounds_info(int n, double* x_l, double* x_u, int m, do
     }
 
     for (int i = 0; i < m; ++i) {
-        //Right now this only works for problems with only minimisation constraints.
-        //TODO: maybe add support for other types of constraints
-        g_l[i] = neg_inf;
-        g_u[i] = 0.0;
+        if (this->trots_problem->constraint_is_upper_bound(this->cons_order[i])) {
+            g_l[i] = neg_inf;
+            g_u[i] = 0.0;
+        } else {
+            g_l[i] = 0.0;
+            g_u[i] = pos_inf;
+        }
     }
 
     return true;
@@ -77,68 +165,130 @@ bool TROTS_ipopt_mpi::get_bounds_info(int n, double* x_l, double* x_u, int m, do
 bool TROTS_ipopt_mpi::get_starting_point(
     int n, bool init_x, double* x, bool init_z, double* z_l,
     double* z_u, int m, bool init_lambda, double* lambda) {
-    if (init_x) {
-        std::vector<TROTSEntry> LTCP_entries;
-        std::copy_if(this->trots_problem->objective_entries.cbegin(),
-                     this->trots_problem->objective_entries.cend(),
-                     std::back_inserter(LTCP_entries),
-                     [](const TROTSEntry& e){ return e.function_type() == FunctionType::LTCP; });
+    this->solve_start = std::chrono::steady_clock::now();
+    this->round_seconds = 0.0;
+    if (this->warm_start.has_value() && !this->warm_start->matches(n, m)) {
+        std::cerr << "Warm start state does not match the problem dimensions\n";
+        return false;
+    }
 
+    if (init_x && this->warm_start.has_value()) {
+        std::copy(this->warm_start->x.cbegin(), this->warm_start->x.cend(), x);
+    }
+    else if (init_x) {
+        //The initialization of the primal variables is based on the goal of
+        //making the LTCP objectives not too large to start with.
+        //We use the "simple" initialization strategy described in
+        //https://doi.org/10.1007/s10589-017-9919-4, but solve for the scale directly.
         for (int i = 0; i < n; ++i) {
             x[i] = 100.0;
         }
+        //The dose matrices are on the ranks, so they find the scale together
+        EvalCommand command = this->make_command(EVAL_LTCP_SCALE_OP);
+        command.ltcp_max_val = 1500.0;
+        double scale;
+        {
+            const RoundTimer round_timer{this->round_seconds};
+            scale = compute_vals_mpi(command, x, nullptr, nullptr, this->local_data, std::nullopt);
+        }
+        for (int i = 0; i < n; ++i) {
+            x[i] *= scale;
+        }
 
-        const auto compute_obj_val = [x](const TROTSEntry& e) -> double {
-            return e.calc_value(x);
-        };
-        std::vector<double> LTCP_vals(LTCP_entries.size());
-        std::transform(LTCP_entries.cbegin(), LTCP_entries.cend(),
-                       LTCP_vals.begin(), compute_obj_val);
-        while (std::any_of(LTCP_vals.cbegin(), LTCP_vals.cend(), [](double v){ return v > 1500.0; })) {
-            for (int i = 0; i < n; ++i) {
-                x[i] *= 1.5;
-            }
-            std::transform(LTCP_entries.cbegin(), LTCP_entries.cend(),
-                           LTCP_vals.begin(), compute_obj_val);
+        if (this->warmup_iters > 0) {
+            const auto obj = [this, n](const double* x_k) {
+                double val;
+                this->eval_f(n, x_k, true, val);
+                return val;
+            };
+            const auto grad = [this, n](const double* x_k, double* grad_k) {
+                this->eval_grad_f(n, x_k, false, grad_k);
+            };
+            projected_gradient_warmup(n, x, this->warmup_iters, obj, grad);
         }
     }
 
-    if (init_z) {
+    if (init_z && this->warm_start.has_value()) {
+        std::copy(this->warm_start->z_l.cbegin(), this->warm_start->z_l.cend(), z_l);
+        std::copy(this->warm_start->z_u.cbegin(), this->warm_start->z_u.cend(), z_u);
+    }
+    else if (init_z) {
         for (int i = 0; i < n; ++i) {
             z_l[i] = 0.0;
             z_u[i] = 0.0;
         }
     }
 
-    if (init_lambda) {
+    if (init_lambda && this->warm_start.has_value()) {
+        for (int i = 0; i < m; ++i) {
+            lambda[i] = this->warm_start->lambda[this->cons_order[i]];
+        }
+    }
+    else if (init_lambda) {
         for (int i = 0; i < m; ++i) {
             lambda[i] = 1.0;
         }
     }
 
     //this->trots_problem->clear_mat_data();
+    this->new_iterate();
     return true;
 }
 
 bool TROTS_ipopt_mpi::eval_f(int n, const double* x, bool new_x, double& obj_val) {
     //std::cout << "Calculating f\n";
-    obj_val = compute_vals_mpi(true, x, nullptr, false, nullptr,
-                               this->local_data, std::nullopt, false);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalF,
+                              !new_x && this->dose_cache.obj_doses_valid};
+    const RoundTimer round_timer{this->round_seconds};
+    if (new_x)
+        this->new_iterate();
+    if (this->combined_eval) {
+        this->update_combined(x);
+        obj_val = this->combined.obj_val;
+        return true;
+    }
+    obj_val = compute_vals_mpi(this->make_command(EVAL_OBJ_OP), x, nullptr, nullptr, this->local_data, std::nullopt);
+    this->dose_cache.obj_doses_valid = true;
     //std::cout << "Done" << std::endl;
     return true;
 }
 
 bool TROTS_ipopt_mpi::eval_grad_f(int n, const double* x, bool new_x, double* grad_f) {
     //std::cout << "Calculating grad f\n";
-    compute_vals_mpi(true, x, nullptr, true, grad_f, this->local_data, std::nullopt, false);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalGradF,
+                              !new_x && this->dose_cache.obj_doses_valid};
+    const RoundTimer round_timer{this->round_seconds};
+    if (new_x)
+        this->new_iterate();
+    if (this->combined_eval) {
+        this->update_combined(x);
+        std::copy(this->combined.grad_f.cbegin(), this->combined.grad_f.cend(), grad_f);
+        return true;
+    }
+    const ObjGradArgs grad_args{&this->obj_grad_idxs, &this->obj_grad_recv_counts,
+                                &this->obj_grad_recv_displacements, this->obj_grad_recv_buffer.data()};
+    compute_vals_mpi(this->make_command(EVAL_OBJ_OP, true), x, nullptr, grad_f, this->local_data, std::nullopt,
+                     nullptr, nullptr, &grad_args);
+    this->dose_cache.obj_doses_valid = true;
     //std::cout << "Done" << std::endl;
     return true;
 }
 
 bool TROTS_ipopt_mpi::eval_g(int n, const double* x, bool new_x, int m, double* g) {
     //std::cout << "Calculating g\n";
-    compute_vals_mpi(false, x, g, false, nullptr, this->local_data,
-                     std::make_optional(this->distrib_data), false);
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalG,
+                              !new_x && this->dose_cache.cons_doses_valid};
+    const RoundTimer round_timer{this->round_seconds};
+    if (new_x)
+        this->new_iterate();
+    if (this->combined_eval) {
+        this->update_combined(x);
+        std::copy(this->combined.cons_vals.cbegin(), this->combined.cons_vals.cend(), g);
+        return true;
+    }
+    compute_vals_mpi(this->make_command(EVAL_CONS_OP), x, g, nullptr, this->local_data,
+                     std::make_optional(this->distrib_data));
+    this->dose_cache.cons_doses_valid = true;
     //std::cout << "Done" << std::endl;
     return true;
 }
@@ -149,21 +299,14 @@ bool TROTS_ipopt_mpi::eval_jac_g(
     if (vals == nullptr) {
         assert(irow != nullptr && icol != nullptr);
         //std::cout << "Setting jacobian indexes\n";
-        //Flatten the array with constraint indices over ranks.
-        std::vector<int> flattened_cons_idxs;
-        for (const std::vector<int>& rank_idxs : this->cons_term_distribution) {
-            flattened_cons_idxs.insert(flattened_cons_idxs.end(),
-                                       rank_idxs.cbegin(), rank_idxs.cend());
-        }
+        const std::vector<int>& row_offsets = this->trots_problem->get_jac_row_offsets();
+        const std::vector<int>& col_idxs = this->trots_problem->get_jac_col_idxs();
         int idx = 0;
-        int i = 0;
-        for (int row = 0; row < flattened_cons_idxs.size(); ++row) {
-            const int cons_idx = flattened_cons_idxs[row];
-            std::vector<int> col_idxs =
-                this->trots_problem->constraint_entries[cons_idx].get_grad_nonzero_idxs();
-            for (int col : col_idxs) {
+        for (int row = 0; row < this->cons_order.size(); ++row) {
+            const int cons_idx = this->cons_order[row];
+            for (int i = row_offsets[cons_idx]; i < row_offsets[cons_idx + 1]; ++i) {
                 irow[idx] = row;
-                icol[idx] = col;
+                icol[idx] = col_idxs[i];
                 ++idx;
             }
         }
@@ -172,14 +315,60 @@ bool TROTS_ipopt_mpi::eval_jac_g(
 
     else {
         //std::cout << "Calculating jac g\n";
-        compute_vals_mpi(false, x, nullptr, true, vals,
-                         this->local_data, std::make_optional(this->distrib_data), false);
+        const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalJacG,
+                                  !new_x && this->dose_cache.cons_doses_valid};
+        const RoundTimer round_timer{this->round_seconds};
+        if (new_x)
+            this->new_iterate();
+        if (this->combined_eval) {
+            this->update_combined(x);
+            std::copy(this->combined.jac_vals.cbegin(), this->combined.jac_vals.cend(), vals);
+            return true;
+        }
+        compute_vals_mpi(this->make_command(EVAL_CONS_OP, true), x, nullptr, vals, this->local_data,
+                         std::make_optional(this->distrib_data));
+        this->dose_cache.cons_doses_valid = true;
         //std::cout << "Done" << std::endl;
     }
 
     return true;
 }
 
+bool TROTS_ipopt_mpi::eval_h(int n, const double* x, bool new_x, double obj_factor,
+                             int m, const double* lambda, bool new_lambda,
+                             int nnz_h, int* irow, int* icol, double* vals) {
+    if (this->hessian_mode == HessianMode::LimitedMemory)
+        return false;
+
+    if (vals == nullptr) {
+        assert(irow != nullptr && icol != nullptr);
+        int idx = 0;
+        for (int row = 0; row < n; ++row) {
+            for (int col = 0; col <= row; ++col) {
+                irow[idx] = row;
+                icol[idx] = col;
+                ++idx;
+            }
+        }
+        return true;
+    }
+
+    const CallbackTimer timer{this->telemetry.get(), TelemetryCallback::EvalH,
+                              !new_x && this->dose_cache.obj_doses_valid && this->dose_cache.cons_doses_valid};
+    const RoundTimer round_timer{this->round_seconds};
+    if (new_x)
+        this->new_iterate();
+    EvalCommand command = this->make_command(EVAL_HESS_OP);
+    command.obj_factor = obj_factor;
+    command.gauss_newton = this->hessian_mode == HessianMode::GaussNewton;
+    const HessianArgs hess_args{lambda, vals};
+    compute_vals_mpi(command, x, nullptr, nullptr, this->local_data, std::make_optional(this->distrib_data),
+                     &hess_args);
+    this->dose_cache.obj_doses_valid = true;
+    this->dose_cache.cons_doses_valid = true;
+    return true;
+}
+
 void TROTS_ipopt_mpi::finalize_solution(
     Ipopt::SolverReturn status, int n,
     const double* x, const double* z_l, const double* z_u,
@@ -187,40 +376,323 @@ void TROTS_ipopt_mpi::finalize_solution(
     const Ipopt::IpoptData* ip_data, Ipopt::IpoptCalculatedQuantities* ip_cq) {
 
     //Output to file: reuse code for dumping std::vector arrays to file
-    std::vector<double> x_vec;
-    x_vec.reserve(n);
-    for (int i = 0; i < n; ++i) {
-        x_vec.push_back(x[i]);
+    if (!this->output_paths.solution_path.empty()) {
+        std::vector<double> x_vec(x, x + n);
+        dump_vector_to_file(x_vec, this->output_paths.solution_path);
     }
 
-    dump_vector_to_file(x_vec, "out_mpi.bin");
+    if (!this->output_paths.state_path.empty())
+        this->make_state(x, z_l, z_u, lambda).save(this->output_paths.state_path);
 
     std::cout << "IPOPT finalize_solution called\n";
     std::cout << "Exit status: " << status << "\n";
 }
 
-double compute_vals_mpi(bool calc_obj, const double* x, double* cons_vals, bool calc_grad, double* grad,
-                        LocalData& local_data, std::optional<ConsDistributionData> distrib_data, bool done) {
-    while (true) {
-        //"Task-pool", wait here until rank 0 is requesting function values to be computed
-        MPI_Barrier(MPI_COMM_WORLD);
-        //Check if rank 0 is signalling that the optimization is done
-        int done_flag = static_cast<int>(done);
-        MPI_Bcast(&done_flag, 1, MPI_INT, 0, MPI_COMM_WORLD);
-        if (done_flag)
-            return 0.0;
-
-        int rank;
-        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-        double obj_val = 0.0;
+bool TROTS_ipopt_mpi::intermediate_callback(Ipopt::AlgorithmMode mode, int iter, double obj_value,
+                                            double inf_pr, double inf_du, double mu, double d_norm,
+                                            double regularization_size, double alpha_du, double alpha_pr,
+                                            int ls_trials, const Ipopt::IpoptData* ip_data,
+                                            Ipopt::IpoptCalculatedQuantities* ip_cq) {
+    //The ranks time their entries from the start, until the times are gathered for the rebalancing
+    const bool rebalance_now = this->rebalance_options.iter > 0 && iter == this->rebalance_options.iter
+                            && mode == Ipopt::RegularMode;
+    if (this->telemetry)
+        this->telemetry->write_iteration(iter, obj_value, inf_pr, inf_du, mu, this->gather_entry_telemetry());
+    else if (rebalance_now)
+        this->gather_entry_telemetry();
+    if (rebalance_now)
+        this->rebalance();
+
+    const SolverOutputPaths& paths = this->output_paths;
+    if (paths.checkpoint_path.empty() || paths.checkpoint_interval <= 0 ||
+        iter == 0 || iter % paths.checkpoint_interval != 0 || mode != Ipopt::RegularMode) {
+        return true;
+    }
+
+    const int n = this->trots_problem->get_num_vars();
+    const int m = this->trots_problem->get_num_constraints();
+    std::vector<double> x(n), z_l(n), z_u(n), lambda(m);
+    if (this->get_curr_iterate(ip_data, ip_cq, false, n, x.data(), z_l.data(), z_u.data(),
+                               m, nullptr, lambda.data())) {
+        this->make_state(x.data(), z_l.data(), z_u.data(), lambda.data()).save(paths.checkpoint_path);
+    }
+    return true;
+}
 
-        //Are we calculating objectives or constraints?
-        int calc_obj_flag = static_cast<int>(calc_obj);
-        MPI_Bcast(&calc_obj, 1, MPI_INT, 0, MPI_COMM_WORLD);
-        if (calc_obj) {
-            obj_val = compute_obj_vals_mpi(x, calc_grad, grad, local_data);
+void TROTS_ipopt_mpi::stop_workers() {
+    compute_vals_mpi(this->make_command(EVAL_DONE_OP), nullptr, nullptr, nullptr, this->local_data, std::nullopt);
+}
+
+void TROTS_ipopt_mpi::new_iterate() {
+    this->dose_cache.invalidate();
+    ++this->iterate_id;
+}
+
+EvalCommand TROTS_ipopt_mpi::make_command(EvalOp op, bool calc_grad) const {
+    EvalCommand command;
+    command.op = op;
+    command.calc_grad = calc_grad;
+    command.iterate_id = this->iterate_id;
+    return command;
+}
+
+void TROTS_ipopt_mpi::update_combined(const double* x) {
+    if (this->combined.iterate_id == this->iterate_id)
+        return;
+    const ObjGradArgs grad_args{&this->obj_grad_idxs, &this->obj_grad_recv_counts,
+                                &this->obj_grad_recv_displacements, this->obj_grad_recv_buffer.data()};
+    const CombinedEvalArgs combined_args{&grad_args, &this->distrib_data,
+                                         &this->combined_recv_counts, &this->combined_recv_displacements,
+                                         this->combined_recv_buffer.data(), this->combined.grad_f.data(),
+                                         this->combined.cons_vals.data(), this->combined.jac_vals.data()};
+    this->combined.obj_val = compute_vals_mpi(this->make_command(EVAL_ALL_OP), x, nullptr, nullptr,
+                                              this->local_data, std::nullopt, nullptr, nullptr, nullptr,
+                                              &combined_args);
+    this->combined.iterate_id = this->iterate_id;
+    this->dose_cache.obj_doses_valid = true;
+    this->dose_cache.cons_doses_valid = true;
+}
+
+void TROTS_ipopt_mpi::rebalance() {
+    const int num_ranks = static_cast<int>(this->obj_term_distribution.size());
+    //Outside the evaluation rounds, rank 0 runs IPOPT while the other ranks wait for the next round. The share of
+    //rank 0 is the fraction of its time that is left for the rounds, measured over the same evaluations as the entries.
+    const double solve_seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - this->solve_start).count();
+    double rank0_share = 1.0;
+    if (num_ranks > 1 && solve_seconds > 0.0)
+        rank0_share = std::clamp(this->round_seconds / solve_seconds, 0.0, 1.0);
+    std::cout << "Rebalancing: rank 0 spent " << solve_seconds - this->round_seconds << " s of " << solve_seconds
+              << " s outside the evaluations, share " << rank0_share << "\n";
+
+    //The constraints stay where they are, since IPOPT has them in the order of their distribution.
+    //Their time is work the ranks have before the objective entries are placed, and an objective preferably
+    //goes to a rank that has its dose matrix for a constraint.
+    std::vector<double> cons_loads(num_ranks, 0.0);
+    std::vector<std::unordered_set<int>> cons_data(num_ranks);
+    for (int rank = 0; rank < num_ranks; ++rank) {
+        for (int idx : this->cons_term_distribution[rank]) {
+            cons_loads[rank] += this->cons_eval_seconds[idx];
+            cons_data[rank].insert(this->trots_problem->constraint_entries[idx].get_id());
+        }
+    }
+    std::vector<int> obj_data_ids;
+    for (const TROTSEntry& entry : this->trots_problem->objective_entries)
+        obj_data_ids.push_back(entry.get_id());
+    std::vector<std::vector<int>> new_distribution =
+        distribute_costs_by_data(this->obj_eval_seconds, obj_data_ids, num_ranks, rank0_share, cons_loads, cons_data);
+
+    //Time of the rank that finishes last, relative to the capacities used by distribute_costs
+    const auto max_load = [&](const std::vector<std::vector<int>>& distribution) {
+        double max_val = 0.0;
+        for (int rank = 0; rank < num_ranks; ++rank) {
+            const double capacity = rank == 0 ? rank0_share : 1.0;
+            double load = cons_loads[rank];
+            for (int idx : distribution[rank])
+                load += this->obj_eval_seconds[idx];
+            if (capacity > 0.0)
+                max_val = std::max(max_val, load / capacity);
+        }
+        return max_val;
+    };
+    const double old_load = max_load(this->obj_term_distribution);
+    const double new_load = max_load(new_distribution);
+    std::cout << "Rebalancing: largest relative rank load " << old_load << " s, "
+              << new_load << " s with the new distribution\n";
+
+    //Moving entries costs about as much as a few evaluations, so small gains are not worth it
+    if (new_load < 0.95 * old_load) {
+        const RebalanceArgs rebalance_args{&this->obj_term_distribution, &new_distribution};
+        compute_vals_mpi(this->make_command(EVAL_REBALANCE_OP), nullptr, nullptr, nullptr, this->local_data,
+                         std::nullopt, nullptr, nullptr, nullptr, nullptr, &rebalance_args);
+        this->obj_term_distribution = std::move(new_distribution);
+        this->init_gather_layouts();
+        this->dose_cache.obj_doses_valid = false;
+        std::cout << "Rebalancing: objective entries per rank";
+        for (const std::vector<int>& rank_entries : this->obj_term_distribution)
+            std::cout << " " << rank_entries.size();
+        std::cout << "\n";
+    }
+
+    if (!this->rebalance_options.cost_model_path.empty()) {
+        std::vector<const TROTSEntry*> entries;
+        std::vector<double> seconds;
+        for (size_t i = 0; i < this->trots_problem->objective_entries.size(); ++i) {
+            entries.push_back(&this->trots_problem->objective_entries[i]);
+            seconds.push_back(this->obj_eval_seconds[i]);
+        }
+        for (size_t i = 0; i < this->trots_problem->constraint_entries.size(); ++i) {
+            entries.push_back(&this->trots_problem->constraint_entries[i]);
+            seconds.push_back(this->cons_eval_seconds[i]);
+        }
+        CostModel::fit(entries, seconds).save(this->rebalance_options.cost_model_path);
+    }
+}
+
+SolverState TROTS_ipopt_mpi::make_state(const double* x, const double* z_l, const double* z_u,
+                                        const double* lambda) const {
+    const int n = this->trots_problem->get_num_vars();
+    const int m = this->trots_problem->get_num_constraints();
+    SolverState state{{x, x + n}, {z_l, z_l + n}, {z_u, z_u + n}, std::vector<double>(m)};
+    for (int i = 0; i < m; ++i)
+        state.lambda[this->cons_order[i]] = lambda[i];
+    return state;
+}
+
+std::vector<EntryTelemetry> TROTS_ipopt_mpi::gather_entry_telemetry() {
+    const int total = this->stats_recv_displacements.back() + this->stats_recv_counts.back();
+    std::vector<double> entry_stats(total);
+    const StatsArgs stats_args{entry_stats.data(), &this->stats_recv_counts, &this->stats_recv_displacements};
+    compute_vals_mpi(this->make_command(EVAL_STATS_OP), nullptr, nullptr, nullptr, this->local_data,
+                     std::nullopt, nullptr, &stats_args);
+
+    //The entries of each rank arrive in the order of the distribution, objectives first
+    std::vector<EntryTelemetry> entries;
+    const double* stats_ptr = entry_stats.data();
+    for (int rank = 0; rank < this->obj_term_distribution.size(); ++rank) {
+        for (int idx : this->obj_term_distribution[rank]) {
+            entries.push_back(make_entry_telemetry(this->trots_problem->objective_entries[idx],
+                                                   EntryStats::unpack(stats_ptr)));
+            this->obj_eval_seconds[idx] += entries.back().stats.eval_seconds;
+            stats_ptr += EntryStats::num_fields;
+        }
+        for (int idx : this->cons_term_distribution[rank]) {
+            entries.push_back(make_entry_telemetry(this->trots_problem->constraint_entries[idx],
+                                                   EntryStats::unpack(stats_ptr)));
+            this->cons_eval_seconds[idx] += entries.back().stats.eval_seconds;
+            stats_ptr += EntryStats::num_fields;
+        }
+    }
+    return entries;
+}
+
+namespace {
+    //The parts of a split gEUD entry need the power sum over all of its voxels, which are spread over the ranks.
+    //Computes the doses of the local parts and sums their power sums over all ranks. Called by every rank at the
+    //start of an objective evaluation, afterwards the doses of the parts are current, see obj_dose_cached.
+    void sync_split_sums(const double* x, bool cached_dose, LocalData& local_data) {
+        if (local_data.num_split_groups == 0)
+            return;
+        local_data.split_sums.assign(local_data.num_split_groups, 0.0);
+        for (const TROTSEntry& entry : local_data.obj_entries) {
+            if (entry.get_split_group() >= 0)
+                local_data.split_sums[entry.get_split_group()] += entry.calc_gEUD_partial_sum(x, cached_dose);
+        }
+        MPI_Allreduce(MPI_IN_PLACE, local_data.split_sums.data(), local_data.num_split_groups, MPI_DOUBLE,
+                      MPI_SUM, MPI_COMM_WORLD);
+        for (const TROTSEntry& entry : local_data.obj_entries) {
+            if (entry.get_split_group() >= 0)
+                entry.set_split_sum(local_data.split_sums[entry.get_split_group()]);
+        }
+    }
+
+    bool obj_dose_cached(const TROTSEntry& entry, bool cached_dose) {
+        return cached_dose || entry.get_split_group() >= 0;
+    }
+
+    //The weighted sum of the gradients of the local objective entries at LocalData::obj_grad_idxs
+    void calc_local_obj_grad(const double* x, bool cached_dose, LocalData& local_data, double* grad_buf) {
+        std::fill(grad_buf, grad_buf + local_data.obj_grad_idxs.size(), 0.0);
+        for (int i = 0; i < local_data.obj_entries.size(); ++i) {
+            const TROTSEntry& entry = local_data.obj_entries[i];
+            const std::vector<int>& positions = local_data.obj_grad_positions[i];
+            entry.calc_sparse_grad(x, local_data.entry_grad_buffer.data(), &local_data.grad_tmp[0],
+                                   obj_dose_cached(entry, cached_dose));
+            for (int j = 0; j < positions.size(); ++j) {
+                grad_buf[positions[j]] += local_data.entry_grad_buffer[j] * entry.get_weight();
+            }
+        }
+    }
+
+    //The local rows of the constraint Jacobian, local_data.local_jac_nnz values
+    void calc_local_jac(const double* x, bool cached_dose, LocalData& local_data, double* jac_buf) {
+        int start_idx = 0;
+        for (const TROTSEntry& entry : local_data.cons_entries) {
+            entry.calc_sparse_grad(x, jac_buf + start_idx, &local_data.grad_tmp[0], cached_dose);
+            start_idx += entry.get_grad_nnz();
+        }
+    }
+}
+
+void EvalCommand::pack(double* out) const {
+    out[0] = static_cast<double>(this->op);
+    out[1] = static_cast<double>(this->calc_grad);
+    out[2] = static_cast<double>(this->gauss_newton);
+    out[3] = static_cast<double>(this->iterate_id);
+    out[4] = this->obj_factor;
+    out[5] = this->ltcp_max_val;
+}
+
+EvalCommand EvalCommand::unpack(const double* in) {
+    EvalCommand command;
+    command.op = static_cast<EvalOp>(static_cast<int>(in[0]));
+    command.calc_grad = in[1] != 0.0;
+    command.gauss_newton = in[2] != 0.0;
+    command.iterate_id = static_cast<long long>(in[3]);
+    command.obj_factor = in[4];
+    command.ltcp_max_val = in[5];
+    return command;
+}
+
+double compute_vals_mpi(const EvalCommand& command, const double* x, double* cons_vals, double* grad,
+                        LocalData& local_data, std::optional<ConsDistributionData> distrib_data,
+                        const HessianArgs* hess_args, const StatsArgs* stats_args,
+                        const ObjGradArgs* grad_args, const CombinedEvalArgs* combined_args,
+                        const RebalanceArgs* rebalance_args) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    double* command_buffer = local_data.command_buffer.data();
+    const int command_size = static_cast<int>(local_data.command_buffer.size());
+    while (true) {
+        if (rank == 0) {
+            //The previous broadcast has to be complete before its buffer is reused.
+            MPI_Wait(&local_data.command_request, MPI_STATUS_IGNORE);
+            command.pack(command_buffer);
+            if (x != nullptr)
+                std::copy(x, x + local_data.num_vars, command_buffer + EvalCommand::num_fields);
+            //Rank 0 does not wait for the broadcast to reach everyone, but goes on to its own part of the request.
+            //Since MPI-3, a buffer may be read while it is being sent.
+            MPI_Ibcast(command_buffer, command_size, MPI_DOUBLE, 0, MPI_COMM_WORLD, &local_data.command_request);
         } else {
-            compute_cons_vals_mpi(x, cons_vals, calc_grad, grad, local_data, distrib_data);
+            //"Task-pool", wait here until rank 0 is requesting function values to be computed.
+            //Non-blocking collectives only match other non-blocking collectives, so this is an Ibcast as well.
+            MPI_Request request;
+            MPI_Ibcast(command_buffer, command_size, MPI_DOUBLE, 0, MPI_COMM_WORLD, &request);
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+        }
+        //Rank 0 runs the command it was given, the other ranks the one they received
+        const EvalCommand local_command = rank == 0 ? command : EvalCommand::unpack(command_buffer);
+
+        double obj_val = 0.0;
+        switch (local_command.op) {
+            case EVAL_OBJ_OP:
+                obj_val = compute_obj_vals_mpi(local_command, grad, local_data, grad_args);
+                break;
+            case EVAL_CONS_OP:
+                compute_cons_vals_mpi(local_command, cons_vals, grad, local_data, distrib_data);
+                break;
+            case EVAL_HESS_OP:
+                compute_hess_vals_mpi(local_command, hess_args, local_data, distrib_data);
+                break;
+            case EVAL_STATS_OP:
+                gather_entry_stats_mpi(stats_args, local_data);
+                break;
+            case EVAL_LTCP_SCALE_OP:
+                obj_val = compute_LTCP_scale_mpi(local_command, local_data);
+                break;
+            case EVAL_ALL_OP:
+                obj_val = compute_all_vals_mpi(local_command, local_data, combined_args);
+                break;
+            case EVAL_REBALANCE_OP:
+                if (rank == 0)
+                    migrate_obj_entries(local_data, rebalance_args->old_distribution,
+                                        rebalance_args->new_distribution);
+                else
+                    migrate_obj_entries(local_data, nullptr, nullptr);
+                break;
+            case EVAL_DONE_OP:
+                MPI_Wait(&local_data.command_request, MPI_STATUS_IGNORE);
+                return 0.0;
         }
 
         //Rank 0 returns to the optimization solver to continue to the next iteration / step
@@ -229,92 +701,236 @@ double compute_vals_mpi(bool calc_obj, const double* x, double* cons_vals, bool
     }
 }
 
-double compute_obj_vals_mpi(const double* x, bool calc_grad, double* grad, LocalData& local_data) {
-    MPI_Barrier(MPI_COMM_WORLD);
+double compute_obj_vals_mpi(const EvalCommand& command, double* grad, LocalData& local_data,
+                            const ObjGradArgs* grad_args) {
     int rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    if (rank == 0) {
-        std::copy(x, x + local_data.num_vars, local_data.x_buffer.begin());
-        assert(local_data.obj_entries.empty());
-    }
-    int grad_flag_local = static_cast<int>(calc_grad);
-    MPI_Bcast(&grad_flag_local, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&local_data.x_buffer[0], local_data.num_vars, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    const double* x = local_data.command_x();
+    const bool cached_dose = local_data.obj_dose_iterate == command.iterate_id;
+    local_data.obj_dose_iterate = command.iterate_id;
+    sync_split_sums(x, cached_dose, local_data);
 
     double obj_val_local = 0.0;
     double obj_val = 0.0;
-    if (!grad_flag_local) {
+    if (!command.calc_grad) {
         for (const TROTSEntry& entry : local_data.obj_entries) {
-            obj_val_local += entry.calc_value(&local_data.x_buffer[0]) * entry.get_weight();
+            obj_val_local += entry.calc_value(x, obj_dose_cached(entry, cached_dose)) * entry.get_weight();
         }
         MPI_Reduce(&obj_val_local, &obj_val, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
     } else {
-        double* grad_buf = new double[local_data.num_vars];
-        std::fill(grad_buf, grad_buf + local_data.num_vars, 0.0);
-        for (const TROTSEntry& entry : local_data.obj_entries) {
-            entry.calc_gradient(&local_data.x_buffer[0], &local_data.grad_tmp[0]);
-            for (int i = 0; i < local_data.num_vars; ++i) {
-                grad_buf[i] += local_data.grad_tmp[i] * entry.get_weight();
+        //Each rank only sends the gradient at the non-zeros of its own entries, and rank 0 adds them up.
+        //The volume then follows the sparsity of the dose matrices instead of being num_vars per rank.
+        std::vector<double>& grad_buf = local_data.obj_grad_buffer;
+        calc_local_obj_grad(x, cached_dose, local_data, grad_buf.data());
+        if (rank == 0) {
+            assert(grad_args != nullptr);
+            MPI_Gatherv(grad_buf.data(), grad_buf.size(), MPI_DOUBLE, grad_args->recv_buffer,
+                        grad_args->recv_counts->data(), grad_args->recv_displacements->data(),
+                        MPI_DOUBLE, 0, MPI_COMM_WORLD);
+            std::fill(grad, grad + local_data.num_vars, 0.0);
+            const std::vector<int>& grad_idxs = *grad_args->grad_idxs;
+            for (int i = 0; i < grad_idxs.size(); ++i) {
+                grad[grad_idxs[i]] += grad_args->recv_buffer[i];
             }
+        } else {
+            MPI_Gatherv(grad_buf.data(), grad_buf.size(), MPI_DOUBLE,
+                        nullptr, nullptr, nullptr, MPI_DOUBLE, 0, MPI_COMM_WORLD);
         }
-        MPI_Reduce(grad_buf, grad, local_data.num_vars, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-        delete[] grad_buf;
     }
     return obj_val;
 }
 
 
-void compute_cons_vals_mpi(const double* x, double* cons_vals,
-                           bool calc_grad, double* grad, LocalData& local_data,
+void compute_cons_vals_mpi(const EvalCommand& command, double* cons_vals, double* grad, LocalData& local_data,
                            std::optional<ConsDistributionData> distrib_data) {
-    MPI_Barrier(MPI_COMM_WORLD);
     int rank;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    if (rank == 0) {
+    if (rank == 0)
         assert(distrib_data.has_value());
-        std::copy(x, x + local_data.num_vars, local_data.x_buffer.begin());
-    }
-
-    int grad_flag_local = static_cast<int>(calc_grad);
-    MPI_Bcast(&grad_flag_local, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&local_data.x_buffer[0], local_data.num_vars, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    const double* x = local_data.command_x();
+    const bool cached_dose = local_data.cons_dose_iterate == command.iterate_id;
+    local_data.cons_dose_iterate = command.iterate_id;
 
-    if (!grad_flag_local) {
+    if (!command.calc_grad) {
         std::vector<double> local_vals(local_data.cons_entries.size());
         int i = 0;
         for (const TROTSEntry& entry : local_data.cons_entries) {
-            local_vals[i] = entry.calc_value(&local_data.x_buffer[0]);
+            local_vals[i] = entry.calc_value(x, cached_dose);
             ++i;
         }
         if (rank == 0) {
             ConsDistributionData& dist_data = distrib_data.value();
-            MPI_Gatherv(&local_vals[0], 0, MPI_DOUBLE,
+            MPI_Gatherv(local_vals.data(), local_vals.size(), MPI_DOUBLE,
                         cons_vals, &dist_data.recv_counts_g[0], &dist_data.recv_displacements_g[0],
                         MPI_DOUBLE, 0, MPI_COMM_WORLD);
         } else {
-            MPI_Gatherv(&local_vals[0], local_vals.size(), MPI_DOUBLE,
+            MPI_Gatherv(local_vals.data(), local_vals.size(), MPI_DOUBLE,
                         nullptr, nullptr, nullptr, MPI_DOUBLE, 0, MPI_COMM_WORLD);
         }
 
     } else {
-        double* local_buf = new double[local_data.local_jac_nnz];
-        int start_idx = 0;
-        for (const TROTSEntry& entry : local_data.cons_entries) {
-            std::vector<double> vals = entry.calc_sparse_grad(&local_data.x_buffer[0]);
-            std::copy(vals.cbegin(), vals.cend(), local_buf + start_idx);
-            start_idx += vals.size();
-        }
+        double* local_buf = local_data.jac_buffer.data();
+        calc_local_jac(x, cached_dose, local_data, local_buf);
         if (rank == 0) {
             ConsDistributionData& dist_data = distrib_data.value();
-            MPI_Gatherv(local_buf, 0, MPI_DOUBLE, grad,
+            MPI_Gatherv(local_buf, local_data.local_jac_nnz, MPI_DOUBLE, grad,
                         &dist_data.recv_counts_jac[0], &dist_data.recv_displacements_jac[0],
                         MPI_DOUBLE, 0, MPI_COMM_WORLD);
         } else {
             MPI_Gatherv(local_buf, local_data.local_jac_nnz, MPI_DOUBLE, nullptr,
                         nullptr, nullptr, MPI_DOUBLE, 0, MPI_COMM_WORLD);
         }
+    }
+}
+
+void compute_hess_vals_mpi(const EvalCommand& command, const HessianArgs* hess_args, LocalData& local_data,
+                           std::optional<ConsDistributionData> distrib_data) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank == 0)
+        assert(hess_args != nullptr && distrib_data.has_value());
+    const double* x = local_data.command_x();
+    const bool obj_cached = local_data.obj_dose_iterate == command.iterate_id;
+    const bool cons_cached = local_data.cons_dose_iterate == command.iterate_id;
+    local_data.obj_dose_iterate = command.iterate_id;
+    local_data.cons_dose_iterate = command.iterate_id;
+
+    //Each rank only needs the multipliers of its own constraints
+    local_data.cons_lambda.resize(local_data.cons_entries.size());
+    if (rank == 0) {
+        ConsDistributionData& dist_data = distrib_data.value();
+        MPI_Scatterv(hess_args->lambda, &dist_data.recv_counts_g[0], &dist_data.recv_displacements_g[0], MPI_DOUBLE,
+                     local_data.cons_lambda.data(), local_data.cons_lambda.size(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    } else {
+        MPI_Scatterv(nullptr, nullptr, nullptr, MPI_DOUBLE,
+                     local_data.cons_lambda.data(), local_data.cons_lambda.size(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    }
+
+    //Rank 0 accumulates its own terms directly into IPOPT's array and reduces in place
+    const long long nnz_h = static_cast<long long>(local_data.num_vars) * (local_data.num_vars + 1) / 2;
+    double* hess_local = nullptr;
+    if (rank == 0) {
+        hess_local = hess_args->hess_vals;
+    } else {
+        local_data.hess_buffer.resize(nnz_h);
+        hess_local = local_data.hess_buffer.data();
+    }
+    std::fill(hess_local, hess_local + nnz_h, 0.0);
+
+    for (const TROTSEntry& entry : local_data.obj_entries) {
+        entry.add_dense_hessian(x, command.obj_factor * entry.get_weight(), hess_local,
+                                command.gauss_newton, obj_cached);
+    }
+    for (int i = 0; i < local_data.cons_entries.size(); ++i) {
+        local_data.cons_entries[i].add_dense_hessian(x, local_data.cons_lambda[i], hess_local,
+                                                     command.gauss_newton, cons_cached);
+    }
+
+    //The dense triangle can have more elements than an int count allows, reduce it in pieces
+    constexpr long long max_chunk = INT_MAX / 2;
+    for (long long offset = 0; offset < nnz_h; offset += max_chunk) {
+        const int count = static_cast<int>(std::min(max_chunk, nnz_h - offset));
+        if (rank == 0)
+            MPI_Reduce(MPI_IN_PLACE, hess_local + offset, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        else
+            MPI_Reduce(hess_local + offset, nullptr, count, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+}
+
+double compute_all_vals_mpi(const EvalCommand& command, LocalData& local_data,
+                            const CombinedEvalArgs* combined_args) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    const double* x = local_data.command_x();
+    const bool obj_cached = local_data.obj_dose_iterate == command.iterate_id;
+    const bool cons_cached = local_data.cons_dose_iterate == command.iterate_id;
+    local_data.obj_dose_iterate = command.iterate_id;
+    local_data.cons_dose_iterate = command.iterate_id;
+
+    //The values are computed first, so that the derivatives can reuse their doses
+    sync_split_sums(x, obj_cached, local_data);
+    double* buf = local_data.combined_buffer.data();
+    double obj_val_local = 0.0;
+    for (const TROTSEntry& entry : local_data.obj_entries) {
+        obj_val_local += entry.calc_value(x, obj_dose_cached(entry, obj_cached)) * entry.get_weight();
+    }
+    buf[0] = obj_val_local;
+    double* cons_buf = buf + 1 + local_data.obj_grad_idxs.size();
+    for (int i = 0; i < local_data.cons_entries.size(); ++i) {
+        cons_buf[i] = local_data.cons_entries[i].calc_value(x, cons_cached);
+    }
+    calc_local_obj_grad(x, true, local_data, buf + 1);
+    calc_local_jac(x, true, local_data, cons_buf + local_data.cons_entries.size());
+
+    if (rank != 0) {
+        MPI_Gatherv(buf, local_data.combined_buffer.size(), MPI_DOUBLE,
+                    nullptr, nullptr, nullptr, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        return 0.0;
+    }
+
+    assert(combined_args != nullptr);
+    MPI_Gatherv(buf, local_data.combined_buffer.size(), MPI_DOUBLE, combined_args->recv_buffer,
+                combined_args->recv_counts->data(), combined_args->recv_displacements->data(),
+                MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    //Split the message of each rank into the four results
+    const ObjGradArgs& grad_args = *combined_args->grad_args;
+    const ConsDistributionData& dist_data = *combined_args->distrib_data;
+    const std::vector<int>& grad_idxs = *grad_args.grad_idxs;
+    double obj_val = 0.0;
+    std::fill(combined_args->grad_f, combined_args->grad_f + local_data.num_vars, 0.0);
+    for (int r = 0; r < combined_args->recv_counts->size(); ++r) {
+        const double* rank_buf = combined_args->recv_buffer + (*combined_args->recv_displacements)[r];
+        obj_val += rank_buf[0];
+        rank_buf += 1;
+
+        const int grad_offset = (*grad_args.recv_displacements)[r];
+        for (int i = 0; i < (*grad_args.recv_counts)[r]; ++i) {
+            combined_args->grad_f[grad_idxs[grad_offset + i]] += rank_buf[i];
+        }
+        rank_buf += (*grad_args.recv_counts)[r];
+
+        std::copy(rank_buf, rank_buf + dist_data.recv_counts_g[r],
+                  combined_args->cons_vals + dist_data.recv_displacements_g[r]);
+        rank_buf += dist_data.recv_counts_g[r];
 
-        delete[] local_buf;
+        std::copy(rank_buf, rank_buf + dist_data.recv_counts_jac[r],
+                  combined_args->jac_vals + dist_data.recv_displacements_jac[r]);
     }
+    return obj_val;
+}
+
+double compute_LTCP_scale_mpi(const EvalCommand& command, LocalData& local_data) {
+    //The scale is computed from the doses at x, which is not an iterate of the solver
+    const double local_scale = calc_LTCP_scale_factor(local_data.obj_entries, local_data.command_x(),
+                                                      command.ltcp_max_val);
+    local_data.obj_dose_iterate = -1;
+    double scale = 1.0;
+    MPI_Reduce(&local_scale, &scale, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    return scale;
 }
 
+void gather_entry_stats_mpi(const StatsArgs* stats_args, LocalData& local_data) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    std::vector<double> local_stats;
+    local_stats.reserve((local_data.obj_entries.size() + local_data.cons_entries.size()) * EntryStats::num_fields);
+    for (const auto* entries : {&local_data.obj_entries, &local_data.cons_entries}) {
+        for (const TROTSEntry& entry : *entries) {
+            double packed[EntryStats::num_fields];
+            entry.get_stats().pack(packed);
+            local_stats.insert(local_stats.end(), packed, packed + EntryStats::num_fields);
+            entry.reset_stats();
+        }
+    }
+
+    if (rank == 0) {
+        assert(stats_args != nullptr);
+        MPI_Gatherv(local_stats.data(), local_stats.size(), MPI_DOUBLE, stats_args->entry_stats,
+                    stats_args->recv_counts->data(), stats_args->recv_displacements->data(),
+                    MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    } else {
+        MPI_Gatherv(local_stats.data(), local_stats.size(), MPI_DOUBLE,
+                    nullptr, nullptr, nullptr, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    }
+}
@@ -1,12 +1,16 @@
 #ifndef TROTS_IPOPT_MPI_H
 #define TROTS_IPOPT_MPI_H
 
+#include <chrono>
 #include <memory>
 #include <optional>
 
 #include "coin-or/IpTNLP.hpp"
 
+#include "globals.h"
 #include "rank_local_data.h"
+#include "solver_state.h"
+#include "telemetry.h"
 #include "trots.h"
 
 //Structure with data on the distribution of the constraints over the different ranks
@@ -18,11 +22,95 @@ struct ConsDistributionData {
     std::vector<int> recv_displacements_jac;
 };
 
+//A request from rank 0 to the other ranks. Each request is sent as a single broadcast of the packed
+//command followed by x, so that an evaluation costs one collective before the work starts.
+struct EvalCommand {
+    EvalOp op = EVAL_DONE_OP;
+    bool calc_grad = false;
+    bool gauss_newton = false;
+    //Changes whenever x does. The ranks compare it to the iterate their doses were computed for,
+    //instead of being told whether the doses are still valid.
+    long long iterate_id = 0;
+    //For EVAL_HESS_OP
+    double obj_factor = 0.0;
+    //For EVAL_LTCP_SCALE_OP
+    double ltcp_max_val = 0.0;
+
+    //Flat representation. The integer fields are stored exactly as doubles.
+    static constexpr int num_fields = 6;
+    void pack(double* out) const;
+    static EvalCommand unpack(const double* in);
+};
+
+//Inputs and output of a distributed evaluation of the Lagrangian Hessian, only used on rank 0.
+struct HessianArgs {
+    const double* lambda;
+    double* hess_vals;
+};
+
+//Output of gathering the entry statistics of all ranks, only used on rank 0.
+//Each rank sends EntryStats::num_fields values per entry, objectives before constraints.
+struct StatsArgs {
+    double* entry_stats;
+    const std::vector<int>* recv_counts;
+    const std::vector<int>* recv_displacements;
+};
+
+//Layout of the objective gradient gathered on rank 0, only used on rank 0. Each rank sends the gradient
+//at the sorted union of the non-zeros of its objective entries (see LocalData::obj_grad_idxs),
+//grad_idxs holds these unions for all ranks one after the other.
+struct ObjGradArgs {
+    const std::vector<int>* grad_idxs;
+    const std::vector<int>* recv_counts;
+    const std::vector<int>* recv_displacements;
+    double* recv_buffer;
+};
+
+//Layout and outputs of EVAL_ALL_OP, only used on rank 0. Each rank sends its objective value, its part of the
+//objective gradient (as for ObjGradArgs), its constraint values and its Jacobian values in one message of
+//recv_counts[rank] values.
+struct CombinedEvalArgs {
+    const ObjGradArgs* grad_args;
+    const ConsDistributionData* distrib_data;
+    const std::vector<int>* recv_counts;
+    const std::vector<int>* recv_displacements;
+    double* recv_buffer;
+    double* grad_f;
+    double* cons_vals;
+    double* jac_vals;
+};
+
+//The objective distribution before and after EVAL_REBALANCE_OP, only used on rank 0.
+struct RebalanceArgs {
+    const std::vector<std::vector<int>>* old_distribution;
+    const std::vector<std::vector<int>>* new_distribution;
+};
+
+//When the objective entries are redistributed based on the evaluation times measured during the solve.
+struct RebalanceOptions {
+    //IPOPT iteration at which the entries are redistributed, 0 to keep the initial distribution.
+    //The share of rank 0 (see get_rank_distribution) is then measured, see TROTS_ipopt_mpi::rebalance.
+    int iter = 0;
+    //Where the cost model fitted from the measured times is saved, empty to not save it
+    std::string cost_model_path;
+};
+
+//Everything rank 0 has from one EVAL_ALL_OP, kept until x changes.
+struct CombinedEvalResults {
+    long long iterate_id = -1;
+    double obj_val = 0.0;
+    std::vector<double> grad_f;
+    std::vector<double> cons_vals;
+    std::vector<double> jac_vals;
+};
+
 class TROTS_ipopt_mpi : public Ipopt::TNLP {
 public:
     TROTS_ipopt_mpi(TROTSProblem&& problem,
+                    const std::vector<std::vector<int>>& obj_term_distribution,
                     const std::vector<std::vector<int>>& cons_term_distribution,
-                    LocalData&& data);
+                    LocalData&& data,
+                    HessianMode hessian_mode = HessianMode::LimitedMemory);
     bool get_nlp_info(
         int& n, int& m, int& nnz_jac_g, int& nnz_h_lag,
         Ipopt::TNLP::IndexStyleEnum& index_style) override;
@@ -36,27 +124,111 @@ public:
     bool eval_g(int n, const double* x, bool new_x, int m, double* g) override;
     bool eval_jac_g(int n, const double* x, bool new_x,
                     int m, int nnz_jac, int* irow, int* icol, double* vals) override;
+    bool eval_h(int n, const double* x, bool new_x, double obj_factor,
+                int m, const double* lambda, bool new_lambda,
+                int nnz_h, int* irow, int* icol, double* vals) override;
     void finalize_solution(Ipopt::SolverReturn status, int n,
                            const double* x, const double* z_l, const double* z_u,
                            int m, const double* g, const double* lambda, double obj,
                            const Ipopt::IpoptData* ip_data, Ipopt::IpoptCalculatedQuantities* ip_cq) override;
+    bool intermediate_callback(Ipopt::AlgorithmMode mode, int iter, double obj_value,
+                               double inf_pr, double inf_du, double mu, double d_norm,
+                               double regularization_size, double alpha_du, double alpha_pr,
+                               int ls_trials, const Ipopt::IpoptData* ip_data,
+                               Ipopt::IpoptCalculatedQuantities* ip_cq) override;
+
+    //Start from a previously saved primal-dual state instead of the heuristic starting point.
+    void set_warm_start(SolverState state) { this->warm_start = std::move(state); }
+    void set_output_paths(SolverOutputPaths paths) { this->output_paths = std::move(paths); }
+    //Number of projected gradient iterations run on the heuristic starting point before IPOPT takes over.
+    void set_warmup_iters(int iters) { this->warmup_iters = iters; }
+    //Write per-iteration performance data, see telemetry.h.
+    void set_telemetry(std::unique_ptr<Telemetry> telemetry) { this->telemetry = std::move(telemetry); }
+    //With combined evaluation (the default), the first of eval_f, eval_grad_f, eval_g and eval_jac_g at a new x
+    //has the ranks compute all four at once, and the others are answered from rank 0. This saves communication
+    //rounds and sparse products at accepted iterates, at the cost of unneeded derivatives at rejected trial points.
+    void set_combined_eval(bool combined) { this->combined_eval = combined; }
+    void set_rebalance_options(RebalanceOptions options) { this->rebalance_options = std::move(options); }
+    //Sends EVAL_DONE_OP, after which the other ranks return from compute_vals_mpi.
+    void stop_workers();
 private:
+    //Saved states keep the multipliers in the order of TROTSProblem::constraint_entries,
+    //which is not the order IPOPT sees here. Converts multipliers from IPOPT's order to the problem order.
+    SolverState make_state(const double* x, const double* z_l, const double* z_u, const double* lambda) const;
+    //Gathers the statistics of the entries from the ranks where they are evaluated,
+    //and adds their evaluation times to obj_eval_seconds and cons_eval_seconds.
+    std::vector<EntryTelemetry> gather_entry_telemetry();
+    //Sets up the layouts of the gathers from the ranks, which follow from the distributions of the entries.
+    void init_gather_layouts();
+    //Finds a distribution of the objective entries from the measured times, moves the entries if it is
+    //sufficiently better and saves the fitted cost model.
+    void rebalance();
+
     //The bulk of the data associated with the problem will be distributed across MPI ranks
     //in this version. We keep this reference to a TROTSProblem instance here for
     //some of the basic info about the problem, such as number of variables and constraints.
     std::unique_ptr<TROTSProblem> trots_problem;
-    //A vector with information about how the constraint terms are distributed over ranks
+    //Vectors with information about how the objective and constraint terms are distributed over ranks
+    std::vector<std::vector<int>> obj_term_distribution;
     std::vector<std::vector<int>> cons_term_distribution;
+    //The constraints are ordered by rank for IPOPT, cons_order[i] is the index in
+    //TROTSProblem::constraint_entries of the constraint IPOPT has at index i.
+    std::vector<int> cons_order;
     LocalData local_data;
     ConsDistributionData distrib_data;
+    //Whether the doses on the ranks belong to the current iterate, only used for the telemetry here.
+    //The ranks themselves go by iterate_id, which is advanced by new_iterate() whenever x changes.
+    DoseCacheState dose_cache;
+    long long iterate_id = 0;
+    void new_iterate();
+    EvalCommand make_command(EvalOp op, bool calc_grad = false) const;
+    //Runs EVAL_ALL_OP at x, unless the results for the current iterate are there already.
+    void update_combined(const double* x);
+    HessianMode hessian_mode;
+    std::optional<SolverState> warm_start;
+    SolverOutputPaths output_paths;
+    int warmup_iters = 0;
+    std::unique_ptr<Telemetry> telemetry;
+    std::vector<int> stats_recv_counts;
+    std::vector<int> stats_recv_displacements;
+    std::vector<int> obj_grad_idxs;
+    std::vector<int> obj_grad_recv_counts;
+    std::vector<int> obj_grad_recv_displacements;
+    std::vector<double> obj_grad_recv_buffer;
+    bool combined_eval = true;
+    CombinedEvalResults combined;
+    std::vector<int> combined_recv_counts;
+    std::vector<int> combined_recv_displacements;
+    std::vector<double> combined_recv_buffer;
+    RebalanceOptions rebalance_options;
+    //Evaluation time of each entry since the start, by index in the problem
+    std::vector<double> obj_eval_seconds;
+    std::vector<double> cons_eval_seconds;
+    //Time of rank 0 in the evaluation rounds since the start of the solve in get_starting_point
+    double round_seconds = 0.0;
+    std::chrono::steady_clock::time_point solve_start = std::chrono::steady_clock::now();
 };
 
-double compute_vals_mpi(bool calc_obj, const double* x, double* cons_vals, bool calc_grad, double* grad,
-                    LocalData& local_data, std::optional<ConsDistributionData>, bool done);
+//On rank 0, broadcasts the command and computes the result together with the other ranks.
+//On the other ranks, the arguments are ignored, and commands are served until rank 0 sends EVAL_DONE_OP.
+double compute_vals_mpi(const EvalCommand& command, const double* x, double* cons_vals, double* grad,
+                        LocalData& local_data, std::optional<ConsDistributionData>,
+                        const HessianArgs* hess_args = nullptr, const StatsArgs* stats_args = nullptr,
+                        const ObjGradArgs* grad_args = nullptr, const CombinedEvalArgs* combined_args = nullptr,
+                        const RebalanceArgs* rebalance_args = nullptr);
 
-double compute_obj_vals_mpi(const double* x, bool calc_grad, double* grad, LocalData& local_data);
-void compute_cons_vals_mpi(const double* x, double* cons_vals,
-                           bool calc_grad, double* grad, LocalData& local_data,
+//The parts of a request, run on all ranks after the command has arrived in local_data.command_buffer
+double compute_obj_vals_mpi(const EvalCommand& command, double* grad, LocalData& local_data,
+                            const ObjGradArgs* grad_args);
+void compute_cons_vals_mpi(const EvalCommand& command, double* cons_vals, double* grad, LocalData& local_data,
+                           std::optional<ConsDistributionData> distrib_data);
+void compute_hess_vals_mpi(const EvalCommand& command, const HessianArgs* hess_args, LocalData& local_data,
                            std::optional<ConsDistributionData> distrib_data);
+double compute_all_vals_mpi(const EvalCommand& command, LocalData& local_data,
+                            const CombinedEvalArgs* combined_args);
+void gather_entry_stats_mpi(const StatsArgs* stats_args, LocalData& local_data);
+//The factor x has to be scaled by for the LTCP objectives to be at most command.ltcp_max_val,
+//as calc_LTCP_scale_factor, over the objectives of all ranks.
+double compute_LTCP_scale_mpi(const EvalCommand& command, LocalData& local_data);
 
 #endif
\ No newline at end of file
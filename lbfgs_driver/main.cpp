@@ -0,0 +1,76 @@
+#include "augmented_lagrangian.h"
+#include "solver_state.h"
+#include "starting_point.h"
+#include "trots.h"
+#include "util.h"
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+
+//Approximate solutions of TROTS problems with the projected L-BFGS-B / augmented Lagrangian solver in trots_lib,
+//for when a good plan is needed quickly rather than a tightly converged one.
+//The saved states use the conventions of the IPOPT drivers, so a plan from here can be refined with IPOPT
+//by passing it as --warm_start.
+int main(int argc, char* argv[]) {
+    const CommandLineArgs args = parse_command_line(argc, argv);
+    if (args.positional.empty() || args.positional.size() > 2) {
+        std::cerr << "Usage: ./lbfgs_main <mat_file> [options]\n"
+                  << "\t./lbfgs_main <mat_file> <max_iters> [options]\n"
+                  << "Options:\n"
+                  << "\t--outer_iters=<iters> (default 20)\n"
+                  << "\t--memory=<pairs> (default 10)\n"
+                  << "\t--pg_tol=<value> (default 1e-6)\n"
+                  << "\t--cons_tol=<value> (default 1e-4)\n"
+                  << "\t--output=<file> (default lbfgs_out.bin)\n"
+                  << "\t--save_state=<file>\n"
+                  << "\t--warm_start=<state_file>\n"
+                  << "\t--cache=<file>\n";
+        return -1;
+    }
+
+    AugmentedLagrangianOptions options;
+    if (args.positional.size() == 2)
+        options.inner.max_iters = std::stoi(args.positional[1]);
+    options.max_outer_iters = args.get_int("outer_iters", options.max_outer_iters);
+    options.inner.memory = args.get_int("memory", options.inner.memory);
+    options.inner.pg_tol = args.get_double("pg_tol", options.inner.pg_tol);
+    options.cons_tol = args.get_double("cons_tol", options.cons_tol);
+
+    const TROTSProblem problem = load_trots_problem(args.positional[0], args.get("cache", ""));
+    const int n = problem.get_num_vars();
+    const int m = problem.get_num_constraints();
+
+    std::vector<double> x(n, 100.0);
+    std::vector<double> lambda;
+    if (args.has("warm_start")) {
+        SolverState state = SolverState::load(args.get("warm_start", ""));
+        if (!state.matches(n, m)) {
+            std::cerr << "Warm start state does not match the problem dimensions\n";
+            return -1;
+        }
+        x = std::move(state.x);
+        lambda = std::move(state.lambda);
+    } else {
+        const double scale = calc_LTCP_scale_factor(problem.objective_entries, x.data(), 1500.0);
+        for (double& x_i : x)
+            x_i *= scale;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const AugmentedLagrangianResult result = solve_augmented_lagrangian(problem, x.data(), lambda, options);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << (result.converged ? "Converged" : "Not converged") << " after " << result.outer_iterations
+              << " outer and " << result.inner_iterations << " inner iterations in " << elapsed.count() << " s\n";
+    std::cout << "Objective: " << result.objective << ", max constraint violation: " << result.max_violation << "\n";
+
+    dump_vector_to_file(x, args.get("output", "lbfgs_out.bin"));
+    if (args.has("save_state")) {
+        //There are no bound multipliers here, IPOPT computes its own when warm started from this.
+        SolverState state{x, std::vector<double>(n, 0.0), std::vector<double>(n, 0.0), lambda};
+        state.save(args.get("save_state", ""));
+    }
+
+    return result.converged ? 0 : 1;
+}
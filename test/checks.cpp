@@ -0,0 +1,551 @@
+#include "augmented_lagrangian.h"
+#include "lbfgsb.h"
+#include "trots.h"
+#include "util.h"
+
+#ifdef USE_MKL
+#include "MKL_sparse_matrix.h"
+#else
+#include "EigenSparseMat.h"
+#endif
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+//Deterministic checks of the numerical kernels and the problem cache on small synthetic problems.
+//Prints a line for every failed check, the exit code is the number of failures.
+
+int num_failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        ++num_failures;
+        std::cout << "FAILED: " << what << "\n";
+    }
+}
+
+//Largest difference between a and b relative to the magnitude of b, but at least 1
+double max_rel_diff(const std::vector<double>& a, const std::vector<double>& b) {
+    double max_diff = 0.0;
+    double max_abs = 1.0;
+    for (size_t i = 0; i < a.size(); ++i) {
+        max_diff = std::max(max_diff, std::abs(a[i] - b[i]));
+        max_abs = std::max(max_abs, std::abs(b[i]));
+    }
+    return max_diff / max_abs;
+}
+
+std::unique_ptr<SparseMatrix<double>> make_matrix(const std::vector<double>& vals, const std::vector<int>& col_idxs,
+                                                  const std::vector<int>& row_ptrs, int cols) {
+    const int rows = static_cast<int>(row_ptrs.size()) - 1;
+#ifdef USE_MKL
+    return MKL_sparse_matrix<double>::from_CSR_mat(vals.size(), rows, cols,
+                                                   vals.data(), col_idxs.data(), row_ptrs.data());
+#else
+    return EigenSparseMat<double>::from_CSR_mat(static_cast<int>(vals.size()), rows, cols,
+                                                vals.data(), col_idxs.data(), row_ptrs.data());
+#endif
+}
+
+//A dose matrix with values in (0, 1], where about a third of the elements and at least one per row is non-zero
+std::unique_ptr<SparseMatrix<double>> random_dose_matrix(int rows, int cols, std::mt19937& rng) {
+    std::uniform_real_distribution<double> uniform{0.0, 1.0};
+    std::vector<double> vals;
+    std::vector<int> col_idxs;
+    std::vector<int> row_ptrs{0};
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            if (uniform(rng) < 0.3 || col == row % cols) {
+                col_idxs.push_back(col);
+                vals.push_back(1.0 - uniform(rng));
+            }
+        }
+        row_ptrs.push_back(static_cast<int>(col_idxs.size()));
+    }
+    return make_matrix(vals, col_idxs, row_ptrs, cols);
+}
+
+constexpr int test_num_vars = 12;
+
+TROTSEntry make_entry(const TROTSProblem::DoseMatrixStore& matrices, int id, FunctionType type,
+                      std::vector<double> func_params, double rhs, bool is_cons, bool minimise,
+                      double weight = 1.0) {
+    const auto& data = matrices[id - 1];
+    std::vector<int> grad_nonzero_idxs;
+    if (type == FunctionType::Mean) {
+        const auto& mean_vec = std::get<std::vector<double>>(data);
+        for (int i = 0; i < mean_vec.size(); ++i) {
+            if (mean_vec[i] != 0.0)
+                grad_nonzero_idxs.push_back(i);
+        }
+    }
+    else {
+        const SparseMatrix<double>& mat = *std::get<std::unique_ptr<SparseMatrix<double>>>(data);
+        grad_nonzero_idxs.assign(mat.get_col_inds(), mat.get_col_inds() + mat.get_nnz());
+        std::sort(grad_nonzero_idxs.begin(), grad_nonzero_idxs.end());
+        grad_nonzero_idxs.erase(std::unique(grad_nonzero_idxs.begin(), grad_nonzero_idxs.end()),
+                                grad_nonzero_idxs.end());
+    }
+
+    TROTSEntryInfo info{};
+    info.id = id;
+    info.num_vars = test_num_vars;
+    info.type = static_cast<int32_t>(type);
+    info.active = 1;
+    info.minimise = minimise;
+    info.is_cons = is_cons;
+    info.rhs = rhs;
+    info.weight = weight;
+    return TROTSEntry{info, "roi_" + std::to_string(id), std::move(func_params),
+                      std::move(grad_nonzero_idxs), matrices};
+}
+
+//A problem with Max, Min, LTCP, gEUD and Mean objectives and Max, Min and gEUD constraints.
+//The doses at x = 1 are around 2, so that the penalties with right hand sides near 2 are partly active.
+TROTSProblem make_test_problem(unsigned seed, double geud_weight = 0.5, double max_cons_rhs = 2.2,
+                               double min_cons_rhs = 1.5) {
+    std::mt19937 rng{seed};
+    TROTSProblem::DoseMatrixStore matrices;
+    for (int i = 0; i < 7; ++i)
+        matrices.emplace_back(random_dose_matrix(20 + 5 * i, test_num_vars, rng));
+    std::vector<double> mean_vec(test_num_vars);
+    std::uniform_real_distribution<double> uniform{0.0, 1.0};
+    for (double& val : mean_vec)
+        val = uniform(rng) < 0.5 ? uniform(rng) : 0.0;
+    matrices.emplace_back(std::move(mean_vec));
+
+    std::vector<TROTSEntry> obj_entries{
+        make_entry(matrices, 1, FunctionType::Max, {}, 2.0, false, true),
+        make_entry(matrices, 2, FunctionType::Min, {}, 2.0, false, false),
+        make_entry(matrices, 3, FunctionType::LTCP, {2.0, 0.8}, 0.0, false, true),
+        make_entry(matrices, 4, FunctionType::gEUD, {6.0}, 0.0, false, true, geud_weight),
+        make_entry(matrices, 8, FunctionType::Mean, {}, 0.0, false, true),
+    };
+    std::vector<TROTSEntry> cons_entries{
+        make_entry(matrices, 5, FunctionType::Max, {}, max_cons_rhs, true, true),
+        make_entry(matrices, 6, FunctionType::Min, {}, min_cons_rhs, true, false),
+        make_entry(matrices, 7, FunctionType::gEUD, {8.0}, 2.0, true, true),
+    };
+    return TROTSProblem{test_num_vars, std::move(matrices), std::move(obj_entries), std::move(cons_entries)};
+}
+
+std::vector<double> test_point(unsigned seed) {
+    std::mt19937 rng{seed};
+    std::uniform_real_distribution<double> uniform{0.5, 1.5};
+    std::vector<double> x(test_num_vars);
+    for (double& val : x)
+        val = uniform(rng);
+    return x;
+}
+
+//obj_factor * grad f(x) + sum_j lambda_j * grad g_j(x)
+std::vector<double> lagrangian_gradient(const TROTSProblem& problem, const std::vector<double>& x,
+                                        double obj_factor, const std::vector<double>& lambda) {
+    std::vector<double> grad(problem.get_num_vars());
+    problem.calc_obj_gradient(x.data(), grad.data());
+    for (double& val : grad)
+        val *= obj_factor;
+
+    std::vector<double> jac_vals(problem.get_nnz_jac_cons());
+    problem.calc_jacobian_vals(x.data(), jac_vals.data());
+    int k = 0;
+    for (int j = 0; j < problem.get_num_constraints(); ++j) {
+        for (const int col : problem.constraint_entries[j].get_grad_nonzero_idxs())
+            grad[col] += lambda[j] * jac_vals[k++];
+    }
+    return grad;
+}
+
+std::vector<double> dense_hessian(const TROTSProblem& problem, const std::vector<double>& x, double obj_factor,
+                                  const std::vector<double>& lambda, HessianMode mode) {
+    std::vector<double> hess_lower(problem.get_nnz_hessian());
+    problem.calc_dense_hessian(x.data(), obj_factor, lambda.data(), hess_lower.data(), mode);
+    return hess_lower;
+}
+
+//TROTSEntry::add_dense_hessian through calc_dense_hessian, against central differences of the gradients
+void check_dense_hessian() {
+    const TROTSProblem problem = make_test_problem(1);
+    const std::vector<double> x = test_point(2);
+    const double obj_factor = 0.8;
+    const std::vector<double> lambda{0.7, 0.3, 1.1};
+    const int n = problem.get_num_vars();
+
+    const std::vector<double> exact = dense_hessian(problem, x, obj_factor, lambda, HessianMode::Exact);
+    std::vector<double> finite_diff(exact.size());
+    const double h = 1e-6;
+    for (int j = 0; j < n; ++j) {
+        std::vector<double> x_plus = x;
+        std::vector<double> x_minus = x;
+        x_plus[j] += h;
+        x_minus[j] -= h;
+        const std::vector<double> grad_plus = lagrangian_gradient(problem, x_plus, obj_factor, lambda);
+        const std::vector<double> grad_minus = lagrangian_gradient(problem, x_minus, obj_factor, lambda);
+        for (int i = j; i < n; ++i)
+            finite_diff[i * (i + 1) / 2 + j] = (grad_plus[i] - grad_minus[i]) / (2 * h);
+    }
+    check(max_rel_diff(exact, finite_diff) < 1e-5, "exact Hessian matches finite differences of the gradient");
+}
+
+//A gEUD with a = 2 at a point where some voxels get no dose. Their term of the Hessian, with y^(a - 2) = 1,
+//is as large as that of the other voxels, so it has to be kept.
+void check_geud_hessian_at_zero_dose() {
+    std::mt19937 rng{14};
+    TROTSProblem::DoseMatrixStore matrices;
+    matrices.emplace_back(random_dose_matrix(40, test_num_vars, rng));
+    std::vector<TROTSEntry> obj_entries{make_entry(matrices, 1, FunctionType::gEUD, {2.0}, 0.0, false, true)};
+    const TROTSProblem problem{test_num_vars, std::move(matrices), std::move(obj_entries), {}};
+    std::vector<double> x(test_num_vars, 0.0);
+    x[test_num_vars - 2] = 1.0;
+    x[test_num_vars - 1] = 0.5;
+
+    const std::vector<double> exact = dense_hessian(problem, x, 1.0, {}, HessianMode::Exact);
+    std::vector<double> finite_diff(exact.size());
+    const double h = 1e-6;
+    for (int j = 0; j < test_num_vars; ++j) {
+        std::vector<double> x_plus = x;
+        std::vector<double> x_minus = x;
+        x_plus[j] += h;
+        x_minus[j] -= h;
+        const std::vector<double> grad_plus = lagrangian_gradient(problem, x_plus, 1.0, {});
+        const std::vector<double> grad_minus = lagrangian_gradient(problem, x_minus, 1.0, {});
+        for (int i = j; i < test_num_vars; ++i)
+            finite_diff[i * (i + 1) / 2 + j] = (grad_plus[i] - grad_minus[i]) / (2 * h);
+    }
+    check(max_rel_diff(exact, finite_diff) < 1e-5, "gEUD Hessian keeps the voxels without dose for a >= 2");
+}
+
+//Without gEUD terms the Gauss-Newton Hessian is the exact one, with them it is still positive semi-definite
+void check_gauss_newton_hessian() {
+    const TROTSProblem problem = make_test_problem(3, 0.0);
+    const std::vector<double> x = test_point(4);
+    std::vector<double> lambda{0.5, 1.5, 0.0};
+    const int n = problem.get_num_vars();
+
+    const std::vector<double> exact = dense_hessian(problem, x, 1.0, lambda, HessianMode::Exact);
+    const std::vector<double> gauss_newton = dense_hessian(problem, x, 1.0, lambda, HessianMode::GaussNewton);
+    check(max_rel_diff(gauss_newton, exact) < 1e-12, "Gauss-Newton Hessian equals the exact one without gEUD terms");
+
+    const TROTSProblem geud_problem = make_test_problem(3);
+    lambda[2] = 2.0;
+    const std::vector<double> hess_lower = dense_hessian(geud_problem, x, 1.0, lambda, HessianMode::GaussNewton);
+    std::mt19937 rng{5};
+    std::normal_distribution<double> normal;
+    double min_curvature = 0.0;
+    for (int trial = 0; trial < 100; ++trial) {
+        std::vector<double> v(n);
+        for (double& val : v)
+            val = normal(rng);
+        double curvature = 0.0;
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < i; ++j)
+                curvature += 2 * v[i] * hess_lower[i * (i + 1) / 2 + j] * v[j];
+            curvature += v[i] * hess_lower[i * (i + 1) / 2 + i] * v[i];
+        }
+        min_curvature = std::min(min_curvature, curvature);
+    }
+    check(min_curvature > -1e-10, "Gauss-Newton Hessian is positive semi-definite");
+}
+
+//The row parts of split_objective_rows sum to the values and gradients of the entries they replace.
+//The gEUD parts get the power sum over their split group as the MPI ranks would exchange it.
+void check_row_split() {
+    const TROTSProblem whole = make_test_problem(6);
+    TROTSProblem split = make_test_problem(6);
+    const std::vector<double> x = test_point(7);
+    const size_t num_objectives = split.objective_entries.size();
+    split.split_objective_rows(0, 3, -1);
+    split.split_objective_rows(1, 2, -1);
+    split.split_objective_rows(2, 4, -1);
+    split.split_objective_rows(3, 3, 0);
+    check(split.objective_entries.size() == num_objectives + 8, "row split adds the parts as objectives");
+
+    double split_sum = 0.0;
+    for (const TROTSEntry& entry : split.objective_entries) {
+        if (entry.get_split_group() == 0)
+            split_sum += entry.calc_gEUD_partial_sum(x.data());
+    }
+    for (const TROTSEntry& entry : split.objective_entries) {
+        if (entry.get_split_group() == 0)
+            entry.set_split_sum(split_sum);
+    }
+
+    const double whole_obj = whole.calc_objective(x.data());
+    const double split_obj = split.calc_objective(x.data());
+    check(std::abs(split_obj - whole_obj) < 1e-12 * std::abs(whole_obj), "row parts sum to the objective");
+
+    std::vector<double> whole_grad(test_num_vars);
+    std::vector<double> split_grad(test_num_vars);
+    whole.calc_obj_gradient(x.data(), whole_grad.data());
+    split.calc_obj_gradient(x.data(), split_grad.data());
+    check(max_rel_diff(split_grad, whole_grad) < 1e-12, "row parts sum to the objective gradient");
+
+    std::vector<double> whole_cons(whole.get_num_constraints());
+    std::vector<double> split_cons(split.get_num_constraints());
+    whole.calc_constraints(x.data(), whole_cons.data());
+    split.calc_constraints(x.data(), split_cons.data());
+    check(max_rel_diff(split_cons, whole_cons) < 1e-12, "row split leaves the constraints unchanged");
+
+    //All non-zeros in the last row: every part still gets a row of its own
+    const auto make_skewed_problem = []() {
+        std::vector<int> col_idxs(10);
+        for (int col = 0; col < 10; ++col)
+            col_idxs[col] = col;
+        TROTSProblem::DoseMatrixStore matrices;
+        matrices.emplace_back(make_matrix(std::vector<double>(10, 0.5), col_idxs, {0, 0, 0, 10}, test_num_vars));
+        std::vector<TROTSEntry> obj_entries{make_entry(matrices, 1, FunctionType::Max, {}, 1.0, false, true)};
+        return TROTSProblem{test_num_vars, std::move(matrices), std::move(obj_entries), {}};
+    };
+    const TROTSProblem whole_skewed = make_skewed_problem();
+    TROTSProblem split_skewed = make_skewed_problem();
+    split_skewed.split_objective_rows(0, 3, -1);
+    check(split_skewed.objective_entries.size() == 3, "row split of a skewed matrix gives all parts");
+    const std::vector<double> x_skewed(test_num_vars, 3.0);
+    const double whole_skewed_obj = whole_skewed.calc_objective(x_skewed.data());
+    check(std::abs(split_skewed.calc_objective(x_skewed.data()) - whole_skewed_obj)
+          < 1e-12 * std::abs(whole_skewed_obj), "row parts of a skewed matrix sum to the objective");
+
+    const TROTSProblem view = split.make_view();
+    bool refused = false;
+    try {
+        split.split_objective_rows(4, 2, -1);
+    }
+    catch (const std::runtime_error&) {
+        refused = true;
+    }
+    check(refused, "row split is refused while a view shares the dose matrices");
+}
+
+//minimize_lbfgsb on a convex quadratic 0.5 * x^T Q x - b^T x over x >= 0, where some of the bounds are active.
+//The result has to satisfy the optimality conditions: zero gradient in the free variables, and a non-negative
+//gradient in the variables at the bound. The Rosenbrock function has its minimum (1, 1) inside the feasible set.
+void check_lbfgsb() {
+    const int n = 20;
+    std::mt19937 rng{8};
+    std::normal_distribution<double> normal;
+    std::vector<double> B(n * n);
+    std::vector<double> b(n);
+    for (double& val : B)
+        val = normal(rng);
+    for (double& val : b)
+        val = normal(rng);
+    //Q = B^T B / n + I
+    std::vector<double> Q(n * n);
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            for (int k = 0; k < n; ++k)
+                Q[i * n + j] += B[k * n + i] * B[k * n + j] / n;
+        }
+        Q[i * n + i] += 1.0;
+    }
+    const ValueGradFunc quadratic = [&](const double* x, double* grad) {
+        double val = 0.0;
+        for (int i = 0; i < n; ++i) {
+            grad[i] = -b[i];
+            for (int j = 0; j < n; ++j)
+                grad[i] += Q[i * n + j] * x[j];
+            val += 0.5 * x[i] * (grad[i] - b[i]);
+        }
+        return val;
+    };
+
+    LBFGSBOptions options;
+    options.pg_tol = 1e-8;
+    options.rel_f_tol = 0.0;
+    std::vector<double> x(n, 1.0);
+    const LBFGSBResult result = minimize_lbfgsb(n, x.data(), quadratic, options);
+    std::vector<double> grad(n);
+    quadratic(x.data(), grad.data());
+    double max_violation = 0.0;
+    int num_at_bound = 0;
+    for (int i = 0; i < n; ++i) {
+        check(x[i] >= 0.0, "L-BFGS-B keeps x >= 0");
+        if (x[i] > 0.0) {
+            max_violation = std::max(max_violation, std::abs(grad[i]));
+        }
+        else {
+            max_violation = std::max(max_violation, -grad[i]);
+            ++num_at_bound;
+        }
+    }
+    check(result.status == LBFGSBStatus::Converged, "L-BFGS-B converges on a bound constrained quadratic");
+    check(num_at_bound > 0 && num_at_bound < n, "bound constrained quadratic has active and inactive bounds");
+    check(max_violation < 1e-6, "L-BFGS-B result satisfies the optimality conditions");
+
+    const ValueGradFunc rosenbrock = [](const double* x, double* grad) {
+        const double a = x[1] - x[0] * x[0];
+        grad[0] = -400.0 * a * x[0] - 2.0 * (1.0 - x[0]);
+        grad[1] = 200.0 * a;
+        return 100.0 * a * a + (1.0 - x[0]) * (1.0 - x[0]);
+    };
+    std::vector<double> y{0.1, 2.0};
+    minimize_lbfgsb(2, y.data(), rosenbrock, options);
+    check(std::abs(y[0] - 1.0) < 1e-5 && std::abs(y[1] - 1.0) < 1e-5, "L-BFGS-B finds the Rosenbrock minimum");
+}
+
+//solve_augmented_lagrangian ends at a point that satisfies the constraints of the test problem within cons_tol.
+//The Max and Min constraints are relaxed until only the gEUD constraint is active. The random matrices may not
+//allow all of them at once, and the quadratic penalties of Max and Min have no gradient at their bound.
+void check_augmented_lagrangian() {
+    const TROTSProblem problem = make_test_problem(9, 0.5, 4.0, 0.0);
+    std::vector<double> x(test_num_vars, 1.0);
+    std::vector<double> lambda;
+    AugmentedLagrangianOptions options;
+    const AugmentedLagrangianResult result = solve_augmented_lagrangian(problem, x.data(), lambda, options);
+    check(result.converged, "augmented Lagrangian converges on the test problem");
+    check(lambda.size() == problem.get_num_constraints(), "augmented Lagrangian returns a multiplier per constraint");
+
+    std::vector<double> cons_vals(problem.get_num_constraints());
+    problem.calc_constraints(x.data(), cons_vals.data());
+    double max_violation = 0.0;
+    for (int j = 0; j < problem.get_num_constraints(); ++j) {
+        const double violation = problem.constraint_is_upper_bound(j) ? cons_vals[j] : -cons_vals[j];
+        max_violation = std::max(max_violation, violation);
+    }
+    check(max_violation <= options.cons_tol, "augmented Lagrangian result satisfies the constraints");
+}
+
+//A matrix using CSR arrays in place (from_mapped_CSR) computes the same products as one with its own copy
+void check_mapped_csr() {
+    std::mt19937 rng{10};
+    const std::unique_ptr<SparseMatrix<double>> owned = random_dose_matrix(30, test_num_vars, rng);
+    const int nnz = owned->get_nnz();
+    const int rows = owned->get_rows();
+    auto arrays = std::make_shared<std::tuple<std::vector<double>, std::vector<int>, std::vector<int>>>(
+        std::vector<double>(owned->get_data_ptr(), owned->get_data_ptr() + nnz),
+        std::vector<int>(owned->get_col_inds(), owned->get_col_inds() + nnz),
+        std::vector<int>(owned->get_row_ptrs(), owned->get_row_ptrs() + rows + 1));
+    const auto& [vals, col_idxs, row_ptrs] = *arrays;
+#ifdef USE_MKL
+    const std::unique_ptr<SparseMatrix<double>> mapped = MKL_sparse_matrix<double>::from_mapped_CSR(
+        nnz, rows, test_num_vars, vals.data(), col_idxs.data(), row_ptrs.data(), arrays);
+#else
+    const std::unique_ptr<SparseMatrix<double>> mapped = EigenSparseMat<double>::from_mapped_CSR(
+        nnz, rows, test_num_vars, vals.data(), col_idxs.data(), row_ptrs.data(), arrays);
+#endif
+    arrays.reset();
+    check(mapped->get_nnz() == nnz && mapped->get_rows() == rows && mapped->get_cols() == test_num_vars,
+          "mapped CSR matrix has the given dimensions");
+
+    const std::vector<double> x = test_point(11);
+    std::vector<double> owned_y(rows);
+    std::vector<double> mapped_y(rows);
+    owned->vec_mul(x.data(), owned_y.data());
+    mapped->vec_mul(x.data(), mapped_y.data());
+    check(max_rel_diff(mapped_y, owned_y) < 1e-14, "mapped CSR matrix vector product");
+
+    std::vector<double> owned_xt(test_num_vars);
+    std::vector<double> mapped_xt(test_num_vars);
+    owned->vec_mul_transpose(owned_y.data(), owned_xt.data());
+    mapped->vec_mul_transpose(owned_y.data(), mapped_xt.data());
+    check(max_rel_diff(mapped_xt, owned_xt) < 1e-14, "mapped CSR transposed matrix vector product");
+}
+
+//The CSC to CSR conversion split over several threads gives the same arrays as the serial one.
+//The matrix has enough non-zeros that four threads are actually started.
+void check_parallel_csc_to_csr() {
+    constexpr int rows = 4000;
+    constexpr int cols = 600;
+    std::mt19937 rng{15};
+    std::uniform_real_distribution<double> uniform{0.0, 1.0};
+    std::vector<double> vals;
+    std::vector<int> row_idxs;
+    std::vector<int> col_ptrs{0};
+    for (int col = 0; col < cols; ++col) {
+        for (int row = 0; row < rows; ++row) {
+            if (uniform(rng) < 0.5) {
+                row_idxs.push_back(row);
+                vals.push_back(uniform(rng));
+            }
+        }
+        col_ptrs.push_back(static_cast<int>(row_idxs.size()));
+    }
+    const int nnz = col_ptrs.back();
+    check(nnz >= 4 * (1 << 18), "parallel CSC to CSR test matrix is above the threading threshold");
+
+    const auto convert = [&](int num_threads) {
+        std::tuple<std::vector<double>, std::vector<int>, std::vector<int>> csr{
+            std::vector<double>(nnz), std::vector<int>(nnz), std::vector<int>(rows + 1)};
+        auto& [data_csr, col_idxs_csr, row_ptrs_csr] = csr;
+        csc_to_csr(rows, cols, vals.data(), row_idxs.data(), col_ptrs.data(),
+                   data_csr.data(), col_idxs_csr.data(), row_ptrs_csr.data(), num_threads);
+        return csr;
+    };
+    check(convert(4) == convert(1), "parallel CSC to CSR conversion matches the serial one");
+}
+
+//A problem read back from its cache evaluates like the problem it was written from,
+//and the cache is stale once the source file changes.
+void check_problem_cache() {
+    namespace fs = std::filesystem;
+    const fs::path dir = fs::temp_directory_path() / ("trots_checks_" + std::to_string(::getpid()));
+    fs::create_directories(dir);
+    const fs::path source_path = dir / "problem.mat";
+    const fs::path cache_path = dir / "problem.trotscache";
+    std::ofstream{source_path} << "source";
+
+    const TROTSProblem problem = make_test_problem(12);
+    problem.write_cache(cache_path, source_path);
+    check(TROTSProblem::cache_is_current(cache_path, source_path), "cache is current after writing it");
+    {
+        const TROTSProblem cached = TROTSProblem::from_cache(cache_path);
+        const std::vector<double> x = test_point(13);
+        check(cached.get_num_vars() == problem.get_num_vars()
+              && cached.objective_entries.size() == problem.objective_entries.size()
+              && cached.get_num_constraints() == problem.get_num_constraints()
+              && cached.get_jac_row_offsets() == problem.get_jac_row_offsets()
+              && cached.get_jac_col_idxs() == problem.get_jac_col_idxs(),
+              "cached problem has the same structure");
+        for (size_t i = 0; i < problem.objective_entries.size(); ++i) {
+            const TROTSEntry& entry = problem.objective_entries[i];
+            const TROTSEntry& cached_entry = cached.objective_entries[i];
+            check(cached_entry.get_roi_name() == entry.get_roi_name()
+                  && cached_entry.function_type() == entry.function_type()
+                  && cached_entry.get_func_params() == entry.get_func_params()
+                  && cached_entry.get_grad_nonzero_idxs() == entry.get_grad_nonzero_idxs(),
+                  "cached objective " + std::to_string(i) + " has the same fields");
+        }
+
+        const double obj = problem.calc_objective(x.data());
+        check(std::abs(cached.calc_objective(x.data()) - obj) < 1e-14 * std::abs(obj),
+              "cached problem has the same objective");
+        const std::vector<double> lambda{0.4, 0.9, 1.3};
+        check(max_rel_diff(lagrangian_gradient(cached, x, 1.0, lambda), lagrangian_gradient(problem, x, 1.0, lambda))
+              < 1e-14, "cached problem has the same gradients");
+        std::vector<double> cons_vals(problem.get_num_constraints());
+        std::vector<double> cached_cons_vals(problem.get_num_constraints());
+        problem.calc_constraints(x.data(), cons_vals.data());
+        cached.calc_constraints(x.data(), cached_cons_vals.data());
+        check(max_rel_diff(cached_cons_vals, cons_vals) < 1e-14, "cached problem has the same constraint values");
+    }
+
+    std::ofstream{source_path, std::ios::app} << " changed";
+    check(!TROTSProblem::cache_is_current(cache_path, source_path), "cache is stale after the source changes");
+    fs::remove_all(dir);
+}
+
+int main() {
+    check_dense_hessian();
+    check_geud_hessian_at_zero_dose();
+    check_gauss_newton_hessian();
+    check_row_split();
+    check_lbfgsb();
+    check_augmented_lagrangian();
+    check_mapped_csr();
+    check_parallel_csc_to_csr();
+    check_problem_cache();
+
+    if (num_failures == 0)
+        std::cout << "All checks passed\n";
+    return num_failures;
+}
@@ -4,46 +4,14 @@
 #include <Eigen/Sparse>
 #include <Eigen/Core>
 
+#include <algorithm>
 #include <memory>
 #include <tuple>
 #include <vector>
 #include <type_traits>
 
 #include "SparseMat.h"
-
-namespace {
-    template <typename T>
-    std::vector<Eigen::Triplet<T, int>>
-    csc_to_triplet(int rows, int cols,
-                   const T* vals, const int* row_idxs, const int* col_ptrs) {
-        const int nnz = col_ptrs[cols];
-        std::vector<Eigen::Triplet<T>> triplets;
-        triplets.reserve(nnz);
-
-        for (int col = 0; col < cols; ++col)
-            for (int idx = col_ptrs[col]; idx < col_ptrs[col + 1]; ++idx) {
-                triplets.push_back(Eigen::Triplet<double, int>(row_idxs[idx], col, vals[idx]));
-            }
-
-        return triplets;
-    }
-
-    template <typename T>
-    std::vector<Eigen::Triplet<T, int>>
-    csr_to_triplet(int rows, int cols,
-                   const T* vals, const int* col_idxs, const int* row_ptrs) {
-        const int nnz = row_ptrs[rows];
-        std::vector<Eigen::Triplet<T>> triplets;
-        triplets.reserve(nnz);
-
-        for (int row = 0; row < rows; ++row)
-            for (int idx = row_ptrs[row]; idx < row_ptrs[row + 1]; ++idx) {
-                triplets.push_back(Eigen::Triplet<double, int>(row, col_idxs[idx], vals[idx]));
-            }
-
-        return triplets;
-    }
-}
+#include "util.h"
 
 template <typename T>
 class EigenSparseMat : public SparseMatrix<T> {
@@ -51,55 +19,73 @@ public:
     template <typename IdxType>
     static std::unique_ptr<SparseMatrix<T>>
     from_CSC_mat(int nnz, int rows, int cols,
-                 const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs);
+                 const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs,
+                 int num_threads = 1);
 
     template <typename IdxType>
     static std::unique_ptr<SparseMatrix<T>>
     from_CSR_mat(int nnz, int rows, int cols,
                  const T* vals, const IdxType* col_idxs, const IdxType* row_ptrs);
 
+    //Uses the CSR arrays in place instead of copying them. They have to stay valid as long as owner is alive.
+    static std::unique_ptr<SparseMatrix<T>>
+    from_mapped_CSR(int nnz, int rows, int cols,
+                    const T* vals, const int* col_idxs, const int* row_ptrs,
+                    std::shared_ptr<const void> owner);
+
     explicit EigenSparseMat(int rows, int cols) : mat(rows, cols) {
         Eigen::setNbThreads(28);
     }
 
+    //The view of a mapped matrix points into this->mat otherwise, so copies would be wrong.
+    EigenSparseMat(const EigenSparseMat&) = delete;
+    EigenSparseMat& operator=(const EigenSparseMat&) = delete;
+
     int get_rows() const override { return this->mat.rows(); }
     int get_cols() const override { return this->mat.cols(); }
-    int get_nnz() const override { return this->mat.nonZeros(); }
-    const int* get_col_inds() const override { return this->mat.innerIndexPtr(); }
-    const int* get_row_ptrs() const override { return this->mat.outerIndexPtr(); }
-    const T* get_data_ptr() const override { return this->mat.valuePtr(); }
+    int get_nnz() const override { return this->view().nonZeros(); }
+    const int* get_col_inds() const override { return this->view().innerIndexPtr(); }
+    const int* get_row_ptrs() const override { return this->view().outerIndexPtr(); }
+    const T* get_data_ptr() const override { return this->view().valuePtr(); }
 
     void vec_mul(const T* x, T* y) const override;
     void vec_mul_transpose(const T* x, T* y) const override;
     T quad_mul(const T* x, T* y) const override;
 private:
-    Eigen::SparseMatrix<T, Eigen::RowMajor, int> mat;
+    using MatrixType = Eigen::SparseMatrix<T, Eigen::RowMajor, int>;
+    //The matrix data, either owned by this->mat or in the arrays given to from_mapped_CSR
+    Eigen::Map<const MatrixType> view() const;
+
+    //Holds the data of owned matrices, and only the dimensions of mapped ones
+    MatrixType mat;
+    const T* external_vals = nullptr;
+    const int* external_col_idxs = nullptr;
+    const int* external_row_ptrs = nullptr;
+    int external_nnz = 0;
+    std::shared_ptr<const void> external_owner;
 };
 
+//Both conversions write straight into the storage of the Eigen matrix, which is in compressed (CSR) form.
 template <typename T>
 template <typename IdxType>
 std::unique_ptr<SparseMatrix<T>>
 EigenSparseMat<T>::from_CSC_mat(
     int nnz, int rows, int cols,
-    const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs) {
+    const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs,
+    int num_threads) {
 
     static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>);
     EigenSparseMat<T>* mat_ptr = new EigenSparseMat<T>(rows, cols);
 
-    std::vector<int> row_idxs_int;
-    std::vector<int> col_ptrs_int;
-    row_idxs_int.reserve(nnz);
-    col_ptrs_int.reserve(cols + 1);
-
-    std::transform(row_idxs, row_idxs + nnz, std::back_inserter(row_idxs_int),
-                   [](IdxType i) { return static_cast<int>(i); });
-    std::transform(col_ptrs, col_ptrs + cols + 1, std::back_inserter(col_ptrs_int),
-                   [](IdxType i) { return static_cast<int>(i); });
-
-    std::vector<Eigen::Triplet<T>> triplets =
-        csc_to_triplet(rows, cols, vals, &row_idxs_int[0], &col_ptrs_int[0]);
+    std::vector<int> row_idxs_storage;
+    std::vector<int> col_ptrs_storage;
+    const int* row_idxs_int = as_int_idxs(row_idxs, nnz, row_idxs_storage);
+    const int* col_ptrs_int = as_int_idxs(col_ptrs, cols + 1, col_ptrs_storage);
 
-    mat_ptr->mat.setFromTriplets(triplets.cbegin(), triplets.cend());
+    mat_ptr->mat.resizeNonZeros(nnz);
+    csc_to_csr(rows, cols, vals, row_idxs_int, col_ptrs_int,
+               mat_ptr->mat.valuePtr(), mat_ptr->mat.innerIndexPtr(), mat_ptr->mat.outerIndexPtr(),
+               num_threads);
     return std::unique_ptr<EigenSparseMat<T>>(mat_ptr);
 }
 
@@ -112,29 +98,48 @@ EigenSparseMat<T>::from_CSR_mat(
 
     static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>);
     EigenSparseMat<T>* mat_ptr = new EigenSparseMat<T>(rows, cols);
-    std::vector<int> col_idxs_int;
-    std::vector<int> row_ptrs_int;
-    col_idxs_int.reserve(nnz);
-    row_ptrs_int.reserve(cols + 1);
 
-    std::transform(col_idxs, col_idxs + nnz, std::back_inserter(col_idxs_int),
+    mat_ptr->mat.resizeNonZeros(nnz);
+    std::copy(vals, vals + nnz, mat_ptr->mat.valuePtr());
+    std::transform(col_idxs, col_idxs + nnz, mat_ptr->mat.innerIndexPtr(),
                    [](IdxType i) { return static_cast<int>(i); });
-    std::transform(row_ptrs, row_ptrs + rows + 1, std::back_inserter(row_ptrs_int),
+    std::transform(row_ptrs, row_ptrs + rows + 1, mat_ptr->mat.outerIndexPtr(),
                    [](IdxType i) { return static_cast<int>(i); });
+    return std::unique_ptr<EigenSparseMat<T>>(mat_ptr);
+}
 
-    std::vector<Eigen::Triplet<T>> triplets =
-        csc_to_triplet(rows, cols, vals, &col_idxs_int[0], &row_ptrs_int[0]);
+template <typename T>
+std::unique_ptr<SparseMatrix<T>>
+EigenSparseMat<T>::from_mapped_CSR(
+    int nnz, int rows, int cols,
+    const T* vals, const int* col_idxs, const int* row_ptrs,
+    std::shared_ptr<const void> owner) {
 
-    mat_ptr->mat.setFromTriplets(triplets.cbegin(), triplets.cend());
+    EigenSparseMat<T>* mat_ptr = new EigenSparseMat<T>(rows, cols);
+    mat_ptr->external_vals = vals;
+    mat_ptr->external_col_idxs = col_idxs;
+    mat_ptr->external_row_ptrs = row_ptrs;
+    mat_ptr->external_nnz = nnz;
+    mat_ptr->external_owner = std::move(owner);
     return std::unique_ptr<EigenSparseMat<T>>(mat_ptr);
 }
 
+template <typename T>
+Eigen::Map<const typename EigenSparseMat<T>::MatrixType> EigenSparseMat<T>::view() const {
+    if (this->external_owner) {
+        return Eigen::Map<const MatrixType>(this->mat.rows(), this->mat.cols(), this->external_nnz,
+                                            this->external_row_ptrs, this->external_col_idxs, this->external_vals);
+    }
+    return Eigen::Map<const MatrixType>(this->mat.rows(), this->mat.cols(), this->mat.nonZeros(),
+                                        this->mat.outerIndexPtr(), this->mat.innerIndexPtr(), this->mat.valuePtr());
+}
+
 template <typename T>
 void EigenSparseMat<T>::vec_mul(const T* x, T* y) const {
     Eigen::Map<const Eigen::VectorXd> x_mp(x, this->get_cols());
     Eigen::Map<Eigen::VectorXd> y_mp(y, this->get_rows());
 
-    y_mp = this->mat * x_mp;
+    y_mp = this->view() * x_mp;
 }
 
 template <typename T>
@@ -142,14 +147,14 @@ void EigenSparseMat<T>::vec_mul_transpose(const T* x, T* y) const {
     Eigen::Map<const Eigen::VectorXd> x_mp(x, this->get_rows());
     Eigen::Map<Eigen::VectorXd> y_mp(y, this->get_cols());
 
-    y_mp = this->mat.transpose() * x_mp;
+    y_mp = this->view().transpose() * x_mp;
 }
 
 template <typename T>
 T EigenSparseMat<T>::quad_mul(const T* x, T* y) const {
     Eigen::Map<const Eigen::VectorXd> x_mp(x, this->get_rows());
 
-    const T val = x_mp.transpose() * this->mat * x_mp;
+    const T val = x_mp.transpose() * this->view() * x_mp;
     return val;
 }
 
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <numeric>
 #include <memory>
+#include <mutex>
 
 #include <mkl.h>
 
@@ -55,12 +56,21 @@ public:
     template <typename IdxType>
     static std::unique_ptr<SparseMatrix<T>>
     from_CSC_mat(int nnz, int rows, int cols,
-                 const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs);
+                 const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs,
+                 int num_threads = 1);
 
     static std::unique_ptr<SparseMatrix<T>>
     from_CSR_mat(int nnz, int rows, int cols,
                  const T* vals, const int* col_idxs, const int* row_ptrs);
 
+    //Uses the CSR arrays in place instead of copying them. They have to stay valid as long as owner is alive.
+    //The MKL handle is only created by the first product, since its optimization reads all of the arrays,
+    //which are e.g. mapped from a file and may never be used by this process.
+    static std::unique_ptr<SparseMatrix<T>>
+    from_mapped_CSR(int nnz, int rows, int cols,
+                    const T* vals, const int* col_idxs, const int* row_ptrs,
+                    std::shared_ptr<const void> owner);
+
     MKL_sparse_matrix() = default;
 
     MKL_sparse_matrix(const MKL_sparse_matrix& rhs);
@@ -98,6 +108,8 @@ public:
         std::swap(m1.indptrs, m2.indptrs);
         std::swap(m1.sp_type, m2.sp_type);
         std::swap(m1.mkl_handle, m2.mkl_handle);
+        std::swap(m1.lazy_handle, m2.lazy_handle);
+        std::swap(m1.external_owner, m2.external_owner);
         std::swap(m1.nnz, m2.nnz);
         std::swap(m1.rows, m2.rows);
         std::swap(m1.cols, m2.cols);
@@ -117,12 +129,21 @@ public:
 
 private:
     void vec_mul_impl(const T* x, T* y, bool transpose = false) const;
-    void init_mkl_handle();
-    MKL_mat_handle mkl_handle;
+    void init_mkl_handle() const;
+    //Creates the handle of a mapped matrix on first use, see from_mapped_CSR
+    MKL_mat_handle get_mkl_handle() const {
+        if (this->lazy_handle)
+            std::call_once(*this->lazy_handle, [this] { this->init_mkl_handle(); });
+        return this->mkl_handle;
+    }
+    mutable MKL_mat_handle mkl_handle = nullptr;
+    std::unique_ptr<std::once_flag> lazy_handle;
     int nnz, rows, cols;
     T* data;
     int* indices;
     int* indptrs;
+    //Set if the arrays above are not owned by this matrix, see from_mapped_CSR
+    std::shared_ptr<const void> external_owner;
 };
 
 template <typename T>
@@ -155,6 +176,8 @@ MKL_sparse_matrix<T>::MKL_sparse_matrix(MKL_sparse_matrix&& other) {
     this->rows = other.rows;
     this->cols = other.cols;
     this->mkl_handle = other.mkl_handle;
+    this->lazy_handle = std::move(other.lazy_handle);
+    this->external_owner = std::move(other.external_owner);
 
     this->data = other.data;
     this->indices = other.indices;
@@ -168,32 +191,34 @@ MKL_sparse_matrix<T>::MKL_sparse_matrix(MKL_sparse_matrix&& other) {
 
 template <typename T>
 MKL_sparse_matrix<T>::~MKL_sparse_matrix() {
-    delete[] this->data;
-    delete[] this->indices;
-    delete[] this->indptrs;
-    mkl_sparse_destroy(this->mkl_handle);
+    if (!this->external_owner) {
+        delete[] this->data;
+        delete[] this->indices;
+        delete[] this->indptrs;
+    }
+    if (this->mkl_handle != nullptr)
+        mkl_sparse_destroy(this->mkl_handle);
 }
 
 template <typename T>
 template <typename IdxType>
 std::unique_ptr<SparseMatrix<T>>
-MKL_sparse_matrix<T>::from_CSC_mat(int nnz, int rows, int cols, const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs) {
+MKL_sparse_matrix<T>::from_CSC_mat(int nnz, int rows, int cols, const T* vals, const IdxType* row_idxs, const IdxType* col_ptrs,
+                                   int num_threads) {
     static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>);
 
     MKL_sparse_matrix<T>* mat = new MKL_sparse_matrix<T>();
 
-    std::vector<int> row_idxs_int;
-    std::vector<int> col_ptrs_int;
-    row_idxs_int.reserve(nnz);
-    col_ptrs_int.reserve(cols + 1);
-    //Assuming here that the narrowing cast to int32_t from things like uint32_t will fit.
-    std::transform(row_idxs, row_idxs + nnz, std::back_inserter(row_idxs_int), [](auto x) { return static_cast<int>(x); });
-    std::transform(col_ptrs, col_ptrs + cols + 1, std::back_inserter(col_ptrs_int), [](auto x) { return static_cast<int>(x); });
+    std::vector<int> row_idxs_storage;
+    std::vector<int> col_ptrs_storage;
+    const int* row_idxs_int = as_int_idxs(row_idxs, nnz, row_idxs_storage);
+    const int* col_ptrs_int = as_int_idxs(col_ptrs, cols + 1, col_ptrs_storage);
 
     mat->rows = rows;
     mat->cols = cols;
     mat->nnz = nnz;
-    std::tie(mat->data, mat->indices, mat->indptrs) = csc_to_csr(rows, cols, vals, &row_idxs_int[0], &col_ptrs_int[0]);
+    std::tie(mat->data, mat->indices, mat->indptrs) = csc_to_csr(rows, cols, vals, row_idxs_int, col_ptrs_int,
+                                                                  num_threads);
 
     mat->init_mkl_handle();
     return std::unique_ptr<MKL_sparse_matrix<T>>(mat);
@@ -221,7 +246,26 @@ MKL_sparse_matrix<T>::from_CSR_mat(int nnz, int rows, int cols,
 }
 
 template <typename T>
-void MKL_sparse_matrix<T>::init_mkl_handle() {
+std::unique_ptr<SparseMatrix<T>>
+MKL_sparse_matrix<T>::from_mapped_CSR(int nnz, int rows, int cols,
+                                      const T* vals, const int* col_idxs, const int* row_ptrs,
+                                      std::shared_ptr<const void> owner) {
+    MKL_sparse_matrix<T>* mat = new MKL_sparse_matrix<T>();
+    mat->rows = rows;
+    mat->cols = cols;
+    mat->nnz = nnz;
+
+    //MKL takes non-const pointers, but does not write to the arrays of the matrix.
+    mat->data = const_cast<T*>(vals);
+    mat->indices = const_cast<int*>(col_idxs);
+    mat->indptrs = const_cast<int*>(row_ptrs);
+    mat->external_owner = std::move(owner);
+    mat->lazy_handle = std::make_unique<std::once_flag>();
+    return std::unique_ptr<MKL_sparse_matrix<T>>(mat);
+}
+
+template <typename T>
+void MKL_sparse_matrix<T>::init_mkl_handle() const {
     static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>);
     sparse_status_t status = SPARSE_STATUS_SUCCESS;
     if constexpr (std::is_same_v<T, double>) {
@@ -270,9 +314,9 @@ void MKL_sparse_matrix<T>::vec_mul_impl(const T* x, T* y, bool transpose) const
     const sparse_operation_t trans_op = transpose ? SPARSE_OPERATION_TRANSPOSE : SPARSE_OPERATION_NON_TRANSPOSE;
 
     if constexpr (std::is_same_v<T, double>)
-        status = mkl_sparse_d_mv(trans_op, 1.0, this->mkl_handle, desc, x, 0.0, y);
+        status = mkl_sparse_d_mv(trans_op, 1.0, this->get_mkl_handle(), desc, x, 0.0, y);
     else
-        status = mkl_sparse_s_mv(trans_op, 1.0, this->mkl_handle, desc, x, 0.0, y);
+        status = mkl_sparse_s_mv(trans_op, 1.0, this->get_mkl_handle(), desc, x, 0.0, y);
 
     assert(check_MKL_status(status));
 }
@@ -284,9 +328,9 @@ T MKL_sparse_matrix<T>::quad_mul(const T* x, T* y) const {
     T val = 0.0;
 
     if constexpr (std::is_same_v<T, double>)
-        status = mkl_sparse_d_dotmv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, this->mkl_handle, desc, x, 0.0, y, &val);
+        status = mkl_sparse_d_dotmv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, this->get_mkl_handle(), desc, x, 0.0, y, &val);
     else
-        status = mkl_sparse_s_dotmv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, this->mkl_handle, desc, x, 0.0, y, &val);
+        status = mkl_sparse_s_dotmv(SPARSE_OPERATION_NON_TRANSPOSE, 1.0, this->get_mkl_handle(), desc, x, 0.0, y, &val);
 
     assert(check_MKL_status(status));
 
@@ -307,10 +351,10 @@ void MKL_sparse_matrix<T>::check_consistency() const {
     sparse_status_t status = SPARSE_STATUS_SUCCESS;
     if constexpr (std::is_same_v<T, double>) {
         double* data;
-        status = mkl_sparse_d_export_csr(this->mkl_handle, &idx_base, &rows_mkl, &cols_mkl, &rows_start, &rows_end, &col_idxs, &data);
+        status = mkl_sparse_d_export_csr(this->get_mkl_handle(), &idx_base, &rows_mkl, &cols_mkl, &rows_start, &rows_end, &col_idxs, &data);
     } else {
         float* data;
-        status = mkl_sparse_s_export_csr(this->mkl_handle, &idx_base, &rows_mkl, &cols_mkl, &rows_start, &rows_end, &col_idxs, &data);
+        status = mkl_sparse_s_export_csr(this->get_mkl_handle(), &idx_base, &rows_mkl, &cols_mkl, &rows_start, &rows_end, &col_idxs, &data);
     }
 
     const int nnz_mkl = rows_end[this->rows-1];
@@ -1,6 +1,8 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <limits>
 #include <memory>
 #include <numeric>
 #include <unordered_set>
@@ -12,11 +14,35 @@
 #include "MKL_sparse_matrix.h"
 #endif
 #include "TROTSEntry.h"
+#include "dose_data_reader.h"
 #include "util.h"
 
 namespace {
     const char* func_type_names[] = {"Min", "Max", "Mean", "Quadratic", "gEUD", "LTCP", "DVH", "Chain"};
 
+    //Lower bound on the memory traffic of one product with a CSR matrix:
+    //values and column indexes once, row pointers, input and output vectors.
+    double estimate_spmv_bytes(const SparseMatrix<double>& mat) {
+        return static_cast<double>(mat.get_nnz()) * (sizeof(double) + sizeof(int))
+             + static_cast<double>(mat.get_rows() + 1) * sizeof(int)
+             + static_cast<double>(mat.get_rows() + mat.get_cols()) * sizeof(double);
+    }
+
+    //Adds the time from construction to destruction to EntryStats::eval_seconds
+    class EvalTimer {
+    public:
+        explicit EvalTimer(EntryStats& stats) : stats{stats}, start{std::chrono::steady_clock::now()} {}
+        ~EvalTimer() {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->start;
+            this->stats.eval_seconds += elapsed.count();
+        }
+        EvalTimer(const EvalTimer&) = delete;
+        EvalTimer& operator=(const EvalTimer&) = delete;
+    private:
+        EntryStats& stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
 
     /*FunctionType get_linear_function_type(int dataID, bool minimise, const std::string& roi_name, matvar_t* matrix_struct) {
         const int zero_indexed_dataID = dataID - 1;
@@ -37,7 +63,31 @@ namespace {
     }
 }
 
-TROTSEntry::TROTSEntry(matvar_t* problem_struct_entry, matvar_t* matrix_struct,
+const char* function_type_name(FunctionType type) {
+    return func_type_names[static_cast<int>(type)];
+}
+
+void EntryStats::pack(double* out) const {
+    out[0] = static_cast<double>(this->spmv_count);
+    out[1] = static_cast<double>(this->dose_cache_hits);
+    out[2] = this->spmv_seconds;
+    out[3] = this->spmv_bytes;
+    out[4] = this->last_value;
+    out[5] = this->eval_seconds;
+}
+
+EntryStats EntryStats::unpack(const double* in) {
+    EntryStats stats;
+    stats.spmv_count = static_cast<long long>(in[0]);
+    stats.dose_cache_hits = static_cast<long long>(in[1]);
+    stats.spmv_seconds = in[2];
+    stats.spmv_bytes = in[3];
+    stats.last_value = in[4];
+    stats.eval_seconds = in[5];
+    return stats;
+}
+
+TROTSEntry::TROTSEntry(matvar_t* problem_struct_entry, const DoseDataReader& dose_data,
                        const std::vector<std::variant<std::unique_ptr<SparseMatrix<double>>,
                                          std::vector<double>>
                                          >& mat_refs) :
@@ -132,15 +182,15 @@ TROTSEntry::TROTSEntry(matvar_t* problem_struct_entry, matvar_t* matrix_struct,
         this->y_vec.resize(num_rows);
         this->grad_tmp.resize(num_rows);
         this->num_vars = num_cols;
+        this->nnz = this->matrix_ref->get_nnz();
     } else {
         const auto num_cols = this->mean_vec_ref->size();
         this->num_vars = num_cols;
+        this->nnz = static_cast<int>(num_cols);
     }
 
     if (this->type == FunctionType::Quadratic) {
-        matvar_t* c_var = Mat_VarGetStructFieldByName(matrix_struct, "c", this->id - 1);
-        assert(c_var->data_type == MAT_T_SINGLE);
-        this->c = static_cast<double>(*static_cast<float*>(c_var->data));
+        this->c = dose_data.get_matrix_c(this->id - 1);
     }
 
     this->grad_nonzero_idxs = this->calc_grad_nonzero_idxs();
@@ -150,19 +200,100 @@ TROTSEntry::TROTSEntry(matvar_t* problem_struct_entry, matvar_t* matrix_struct,
         || (this->type != FunctionType::Mean && this->mean_vec_ref == nullptr));
 }
 
-std::vector<double> TROTSEntry::calc_sparse_grad(const double* x, bool cached_dose) const {
-    std::vector<double> dense_grad(this->num_vars);
-    this->calc_gradient(x, &dense_grad[0], cached_dose);
-    std::vector<double> sparse_grad;
-    sparse_grad.reserve(this->grad_nonzero_idxs.size());
-    for (int idx : this->grad_nonzero_idxs) {
-        sparse_grad.push_back(dense_grad[idx]);
+TROTSEntry::TROTSEntry(const TROTSEntryInfo& info, std::string roi_name_, std::vector<double> func_params_,
+                       std::vector<int> grad_nonzero_idxs_,
+                       const std::vector<std::variant<std::unique_ptr<SparseMatrix<double>>,
+                                         std::vector<double>>
+                                         >& mat_refs) :
+    TROTSEntry(info, std::move(roi_name_), std::move(func_params_), std::move(grad_nonzero_idxs_))
+{
+    if (this->type == FunctionType::Mean) {
+        this->mean_vec_ref = &std::get<std::vector<double>>(mat_refs[this->id - 1]);
+        this->nnz = static_cast<int>(this->mean_vec_ref->size());
+    } else {
+        this->matrix_ref = std::get<std::unique_ptr<SparseMatrix<double>>>(mat_refs[this->id - 1]).get();
+        this->nnz = this->matrix_ref->get_nnz();
+        this->y_vec.resize(this->matrix_ref->get_rows());
+        this->grad_tmp.resize(this->matrix_ref->get_rows());
+    }
+}
+
+TROTSEntry::TROTSEntry(const TROTSEntryInfo& info, std::string roi_name_, std::vector<double> func_params_,
+                       std::vector<int> grad_nonzero_idxs_, const RowPartInfo& row_part) :
+    num_vars{info.num_vars},
+    id{info.id},
+    roi_name{std::move(roi_name_)},
+    func_params{std::move(func_params_)},
+    grad_nonzero_idxs{std::move(grad_nonzero_idxs_)},
+    active{info.active != 0},
+    minimise{info.minimise != 0},
+    is_cons{info.is_cons != 0},
+    type{static_cast<FunctionType>(info.type)},
+    rhs{info.rhs},
+    weight{info.weight},
+    c{info.c},
+    matrix_ref{nullptr},
+    mean_vec_ref{nullptr},
+    total_voxels{row_part.total_voxels},
+    split_group{row_part.split_group}
+{
+}
+
+TROTSEntryInfo TROTSEntry::get_info() const {
+    TROTSEntryInfo info{};
+    info.id = this->id;
+    info.num_vars = this->num_vars;
+    info.type = static_cast<int32_t>(this->type);
+    info.active = this->active;
+    info.minimise = this->minimise;
+    info.is_cons = this->is_cons;
+    info.rhs = this->rhs;
+    info.weight = this->weight;
+    info.c = this->c;
+    return info;
+}
+
+TROTSEntry TROTSEntry::make_row_part(int part_id, const SparseMatrix<double>* rows, int row_begin,
+                                     int split_group) const {
+    assert(this->type == FunctionType::Max || this->type == FunctionType::Min
+        || this->type == FunctionType::LTCP || this->type == FunctionType::gEUD);
+    assert(!this->is_row_part());
+    TROTSEntry part = *this;
+    part.id = part_id;
+    part.roi_name = this->roi_name + " [rows " + std::to_string(row_begin) + "-"
+                  + std::to_string(row_begin + rows->get_rows()) + ")";
+    part.matrix_ref = rows;
+    part.nnz = rows->get_nnz();
+    part.total_voxels = this->matrix_ref->get_rows();
+    part.split_group = this->type == FunctionType::gEUD ? split_group : -1;
+    part.y_vec.assign(rows->get_rows(), 0.0);
+    part.grad_tmp.assign(rows->get_rows(), 0.0);
+    part.hess_tmp.clear();
+    part.stats = EntryStats{};
+    part.grad_nonzero_idxs = part.calc_grad_nonzero_idxs();
+    return part;
+}
+
+void TROTSEntry::calc_sparse_grad(const double* x, double* sparse_grad, double* dense_workspace,
+                                  bool cached_dose) const {
+    const auto nnz = this->grad_nonzero_idxs.size();
+    //The gradient of the mean is the mean vector itself, so gather it directly
+    if (this->type == FunctionType::Mean) {
+        const EvalTimer timer{this->stats};
+        for (size_t i = 0; i < nnz; ++i) {
+            sparse_grad[i] = (*this->mean_vec_ref)[this->grad_nonzero_idxs[i]];
+        }
+        return;
     }
 
-    return sparse_grad;
+    this->calc_gradient(x, dense_workspace, cached_dose);
+    for (size_t i = 0; i < nnz; ++i) {
+        sparse_grad[i] = dense_workspace[this->grad_nonzero_idxs[i]];
+    }
 }
 
 double TROTSEntry::calc_value(const double* x, bool cached_dose) const {
+    const EvalTimer timer{this->stats};
     double val = 0.0;
     switch (this->type) {
         case FunctionType::Quadratic:
@@ -197,22 +328,26 @@ double TROTSEntry::calc_value(const double* x, bool cached_dose) const {
         val = val - rhs_val;
     }
 
+    this->stats.last_value = val;
     return val;
 }
 
 double TROTSEntry::calc_quadratic(const double* x) const {
-    return 0.5 * this->matrix_ref->quad_mul(x, &this->y_vec[0]) + this->c;
+    const auto start = std::chrono::steady_clock::now();
+    const double val = 0.5 * this->matrix_ref->quad_mul(x, &this->y_vec[0]) + this->c;
+    this->record_spmv(start);
+    return val;
 }
 
 double TROTSEntry::calc_max(const double* x) const {
-    this->matrix_ref->vec_mul(x, &this->y_vec[0]);
+    this->update_dose(x, false);
 
     const double max_elem = *std::max_element(this->y_vec.cbegin(), this->y_vec.cend());
     return max_elem;
 }
 
 double TROTSEntry::calc_min(const double* x) const {
-    this->matrix_ref->vec_mul(x, &this->y_vec[0]);
+    this->update_dose(x, false);
 
     const double min_elem = *std::min_element(this->y_vec.cbegin(), this->y_vec.cend());
     return min_elem;
@@ -232,8 +367,7 @@ double TROTSEntry::calc_mean(const double* x) const {
 }
 
 double TROTSEntry::calc_LTCP(const double* x, bool cached_dose) const {
-    if (!cached_dose)
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
+    this->update_dose(x, cached_dose);
 
     const double prescribed_dose = this->func_params[0];
     const double alpha = this->func_params[1];
@@ -243,24 +377,39 @@ double TROTSEntry::calc_LTCP(const double* x, bool cached_dose) const {
         sum += std::exp(-alpha * (this->y_vec[i] - prescribed_dose));
     }
 
-    const double val = sum / static_cast<double>(num_voxels);
+    const double val = sum / this->voxel_count();
 
     return val;
 }
 
 double TROTSEntry::calc_gEUD(const double* x, bool cached_dose) const {
-    if (!cached_dose)
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
+    this->update_dose(x, cached_dose);
 
-    const auto num_voxels = this->y_vec.size();
+    const double a = this->func_params[0];
+    const double sum = this->gEUD_power_sum();
+    if (!this->is_row_part())
+        return std::pow(sum / this->voxel_count(), 1/a);
+
+    //The value of the whole entry, (S / m)^(1/a), split between the parts in proportion to their share of S
+    if (this->split_sum <= 0.0)
+        return 0.0;
+    return std::pow(this->split_sum / this->voxel_count(), 1/a) * sum / this->split_sum;
+}
 
+double TROTSEntry::gEUD_power_sum() const {
     const double a = this->func_params[0];
     double sum = 0.0;
-    for (int i = 0; i < num_voxels; ++i) {
+    for (size_t i = 0; i < this->y_vec.size(); ++i) {
         sum += std::pow(this->y_vec[i], a);
     }
-    const double val = std::pow(sum / static_cast<double>(num_voxels), 1/a);
-    return val;
+    return sum;
+}
+
+double TROTSEntry::calc_gEUD_partial_sum(const double* x, bool cached_dose) const {
+    assert(this->type == FunctionType::gEUD);
+    const EvalTimer timer{this->stats};
+    this->update_dose(x, cached_dose);
+    return this->gEUD_power_sum();
 }
 
 /*double TROTSEntry::quadratic_penalty_mean(const double* x) const {
@@ -272,8 +421,7 @@ double TROTSEntry::calc_gEUD(const double* x, bool cached_dose) const {
 }*/
 
 double TROTSEntry::quadratic_penalty_min(const double* x, bool cached_dose) const {
-    if (!cached_dose)
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
+    this->update_dose(x, cached_dose);
 
 
     double sq_diff = 0.0;
@@ -283,12 +431,11 @@ double TROTSEntry::quadratic_penalty_min(const double* x, bool cached_dose) cons
         sq_diff += clamped_diff * clamped_diff;
     }
 
-    return sq_diff / static_cast<double>(num_voxels);
+    return sq_diff / this->voxel_count();
 }
 
 double TROTSEntry::quadratic_penalty_max(const double* x, bool cached_dose) const {
-    if (!cached_dose)
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
+    this->update_dose(x, cached_dose);
 
     double sq_diff = 0.0;
     const size_t num_voxels = this->y_vec.size();
@@ -297,10 +444,11 @@ double TROTSEntry::quadratic_penalty_max(const double* x, bool cached_dose) cons
         sq_diff += clamped_diff * clamped_diff;
     }
 
-    return sq_diff / static_cast<double>(num_voxels);
+    return sq_diff / this->voxel_count();
 }
 
 void TROTSEntry::calc_gradient(const double* x, double* grad, bool cached_dose) const {
+    const EvalTimer timer{this->stats};
     switch (this->type) {
         case FunctionType::Quadratic:
             quad_grad(x, grad);
@@ -371,72 +519,277 @@ void TROTSEntry::mean_grad(const double* x, double* grad) const {
 
 void TROTSEntry::LTCP_grad(const double* x, double* grad, bool cached_dose) const {
     const auto num_voxels = this->matrix_ref->get_rows();
-    if (!cached_dose) {
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
-    }
+    this->update_dose(x, cached_dose);
 
     const double prescribed_dose = this->func_params[0];
     const double alpha = this->func_params[1];
     for (int i = 0; i < num_voxels; ++i) {
         this->grad_tmp[i] =
-            -alpha / static_cast<double>(num_voxels) * std::exp(-alpha * (this->y_vec[i] - prescribed_dose));
+            -alpha / this->voxel_count() * std::exp(-alpha * (this->y_vec[i] - prescribed_dose));
     }
 
-    this->matrix_ref->vec_mul_transpose(&this->grad_tmp[0], grad);
+    this->spmv_transpose(&this->grad_tmp[0], grad);
 }
 
 void TROTSEntry::gEUD_grad(const double* x, double* grad, bool cached_dose) const {
     const auto num_voxels = this->matrix_ref->get_rows();
-    if (!cached_dose) {
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
-    }
+    this->update_dose(x, cached_dose);
     const double a = this->func_params[0];
 
     //Calculate the factor that all entries have in common, namely m^a * (\sum d_i(x)^a)^(1/a - 1)
-    double common_factor = 0.0;
-    for (int i = 0; i < num_voxels; ++i) {
-        common_factor += std::pow(this->y_vec[i], a);
-    }
+    //A row part has the same factor as the whole entry, with the sum over all parts
+    double common_factor = this->is_row_part() ? this->split_sum : this->gEUD_power_sum();
     common_factor = std::pow(common_factor, (1 / a) - 1);
-    common_factor *= std::pow(num_voxels, -1/a);
+    common_factor *= std::pow(this->voxel_count(), -1/a);
 
     for (int i = 0; i < this->grad_tmp.size(); ++i) {
         this->grad_tmp[i] = std::pow(this->y_vec[i], a - 1) * common_factor;
     }
 
-    this->matrix_ref->vec_mul_transpose(&this->grad_tmp[0], grad);
+    this->spmv_transpose(&this->grad_tmp[0], grad);
 }
 
 void TROTSEntry::quad_min_grad(const double* x, double* grad, bool cached_dose) const {
     //Sometimes, this->y_vec will already contain the current dose vector, no need to recompute in this case
-    if (!cached_dose) {
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
-    }
+    this->update_dose(x, cached_dose);
 
     const auto num_vars = this->grad_tmp.size();
     for (int i = 0; i < num_vars; ++i) {
         this->grad_tmp[i] = 2 * std::min(this->y_vec[i] - this->rhs, 0.0)
-                                / static_cast<double>(num_vars);
+                                / this->voxel_count();
     }
 
-    this->matrix_ref->vec_mul_transpose(&this->grad_tmp[0], grad);
+    this->spmv_transpose(&this->grad_tmp[0], grad);
 }
 
 void TROTSEntry::quad_max_grad(const double* x, double* grad, bool cached_dose) const {
     //Sometimes, this->y_vec will already contain the current dose vector, no need to recompute in this case
-    if (!cached_dose) {
-        this->matrix_ref->vec_mul(x, &this->y_vec[0]);
-    }
+    this->update_dose(x, cached_dose);
 
     const auto num_vars = this->grad_tmp.size();
     for (int i = 0; i < num_vars; ++i) {
         this->grad_tmp[i] = 2 * std::max(this->y_vec[i] - this->rhs, 0.0)
-                                / static_cast<double>(num_vars);
+                                / this->voxel_count();
     }
 
-    this->matrix_ref->vec_mul_transpose(&this->grad_tmp[0], grad);
+    this->spmv_transpose(&this->grad_tmp[0], grad);
 }
 
 void TROTSEntry::quad_grad(const double* x, double* grad) const {
-    this->matrix_ref->vec_mul(x, grad);
+    this->spmv(x, grad);
+}
+
+double TROTSEntry::calc_LTCP_scale(const double* x, double max_val, bool cached_dose) const {
+    assert(this->type == FunctionType::LTCP);
+    this->update_dose(x, cached_dose);
+
+    const double prescribed_dose = this->func_params[0];
+    const double alpha = this->func_params[1];
+    const auto num_voxels = this->y_vec.size();
+    //For a row part this bounds the mean over its own voxels, so that the largest s over all parts of an entry
+    //bounds the value of the whole entry.
+    const double log_target = std::log(max_val) + std::log(static_cast<double>(num_voxels));
+
+    //With z_i(s) = -alpha * (s * y_i - prescribed_dose), the (unnormalized) log value
+    //h(s) = log(sum_i exp(z_i(s))) is convex and decreasing in s. Newton's method started left of the root
+    //then increases s monotonically towards it. Evaluate h with the max shifted out to avoid overflow.
+    const auto eval = [&](double s, double& h, double& dh) {
+        double z_max = -std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < num_voxels; ++i)
+            z_max = std::max(z_max, -alpha * (s * this->y_vec[i] - prescribed_dose));
+        double sum = 0.0;
+        double weighted_sum = 0.0;
+        for (size_t i = 0; i < num_voxels; ++i) {
+            const double e = std::exp(-alpha * (s * this->y_vec[i] - prescribed_dose) - z_max);
+            sum += e;
+            weighted_sum += -alpha * this->y_vec[i] * e;
+        }
+        h = z_max + std::log(sum);
+        dh = weighted_sum / sum;
+    };
+
+    double s = 0.0;
+    double h, dh;
+    eval(s, h, dh);
+    if (h <= log_target)
+        return 0.0;
+    for (int iter = 0; iter < 100; ++iter) {
+        //The value only tends to the contribution of the voxels without dose, which is above max_val
+        if (dh >= 0.0)
+            return std::numeric_limits<double>::infinity();
+        const double step = (h - log_target) / -dh;
+        s += step;
+        eval(s, h, dh);
+        if (step <= 1e-12 * s)
+            break;
+    }
+    return s;
+}
+
+void TROTSEntry::update_dose(const double* x, bool cached_dose) const {
+    if (cached_dose)
+        ++this->stats.dose_cache_hits;
+    else
+        this->spmv(x, &this->y_vec[0]);
+}
+
+void TROTSEntry::spmv(const double* in, double* out) const {
+    const auto start = std::chrono::steady_clock::now();
+    this->matrix_ref->vec_mul(in, out);
+    this->record_spmv(start);
+}
+
+void TROTSEntry::spmv_transpose(const double* in, double* out) const {
+    const auto start = std::chrono::steady_clock::now();
+    this->matrix_ref->vec_mul_transpose(in, out);
+    this->record_spmv(start);
+}
+
+void TROTSEntry::record_spmv(std::chrono::steady_clock::time_point start) const {
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    ++this->stats.spmv_count;
+    this->stats.spmv_seconds += elapsed.count();
+    this->stats.spmv_bytes += estimate_spmv_bytes(*this->matrix_ref);
+}
+
+double TROTSEntry::calc_voxel_hessian(const double* x, double* hess_diag, double* rank_one_vec, bool cached_dose) const {
+    //Mean is linear and Quadratic has a constant Hessian in x-space, neither has a voxel space representation.
+    assert(this->type != FunctionType::Mean && this->type != FunctionType::Quadratic);
+    //The rank one term of a gEUD row part would couple it to the other parts
+    assert(this->type != FunctionType::gEUD || !this->is_row_part());
+    this->update_dose(x, cached_dose);
+    const int num_voxels = static_cast<int>(this->y_vec.size());
+    const double m = this->voxel_count();
+    double rank_one_coeff = 0.0;
+
+    switch (this->type) {
+        case FunctionType::Max:
+            for (int i = 0; i < num_voxels; ++i)
+                hess_diag[i] = this->y_vec[i] > this->rhs ? 2.0 / m : 0.0;
+            break;
+        case FunctionType::Min:
+            for (int i = 0; i < num_voxels; ++i)
+                hess_diag[i] = this->y_vec[i] < this->rhs ? 2.0 / m : 0.0;
+            break;
+        case FunctionType::LTCP: {
+            const double prescribed_dose = this->func_params[0];
+            const double alpha = this->func_params[1];
+            for (int i = 0; i < num_voxels; ++i)
+                hess_diag[i] = alpha * alpha / m * std::exp(-alpha * (this->y_vec[i] - prescribed_dose));
+            break;
+        }
+        case FunctionType::gEUD: {
+            //With S = sum_i y_i^a, f = m^(-1/a) * S^(1/a). Differentiating the gradient
+            //m^(-1/a) * S^(1/a - 1) * y_i^(a - 1) once more gives
+            //d_i = (a - 1) * m^(-1/a) * S^(1/a - 1) * y_i^(a - 2) and c = (1 - a) * m^(-1/a) * S^(1/a - 2), u_i = y_i^(a - 1).
+            const double a = this->func_params[0];
+            double S = 0.0;
+            for (int i = 0; i < num_voxels; ++i)
+                S += std::pow(this->y_vec[i], a);
+            if (S <= 0.0) {
+                std::fill(hess_diag, hess_diag + num_voxels, 0.0);
+                std::fill(rank_one_vec, rank_one_vec + num_voxels, 0.0);
+                break;
+            }
+            const double m_factor = std::pow(m, -1.0 / a);
+            const double diag_factor = (a - 1.0) * m_factor * std::pow(S, 1.0 / a - 1.0);
+            rank_one_coeff = (1.0 - a) * m_factor * std::pow(S, 1.0 / a - 2.0);
+            for (int i = 0; i < num_voxels; ++i) {
+                const double y = this->y_vec[i];
+                //y^(a - 2) is unbounded at zero dose for a < 2, leave those voxels out then.
+                hess_diag[i] = y > 0.0 || a >= 2.0 ? diag_factor * std::pow(y, a - 2.0) : 0.0;
+                rank_one_vec[i] = std::pow(y, a - 1.0);
+            }
+            break;
+        }
+        default:
+            std::fill(hess_diag, hess_diag + num_voxels, 0.0);
+            break;
+    }
+
+    return rank_one_coeff;
+}
+
+void TROTSEntry::add_dense_hessian(const double* x, double factor, double* hess_lower,
+                                   bool gauss_newton, bool cached_dose) const {
+    if (this->type == FunctionType::Mean)
+        return;
+    const EvalTimer timer{this->stats};
+    if (factor == 0.0) {
+        //Nothing to add, but callers rely on the dose being up to date afterwards.
+        if (this->type != FunctionType::Quadratic)
+            this->update_dose(x, cached_dose);
+        return;
+    }
+
+    const int* row_ptrs = this->matrix_ref->get_row_ptrs();
+    const int* col_inds = this->matrix_ref->get_col_inds();
+    const double* vals = this->matrix_ref->get_data_ptr();
+    const int num_rows = this->matrix_ref->get_rows();
+
+    if (this->type == FunctionType::Quadratic) {
+        //The Hessian is the (symmetric) matrix itself, copy its lower triangle
+        for (int row = 0; row < num_rows; ++row) {
+            double* hess_row = hess_lower + static_cast<size_t>(row) * (row + 1) / 2;
+            for (int idx = row_ptrs[row]; idx < row_ptrs[row + 1]; ++idx) {
+                if (col_inds[idx] <= row)
+                    hess_row[col_inds[idx]] += factor * vals[idx];
+            }
+        }
+        return;
+    }
+
+    this->hess_tmp.resize(this->y_vec.size());
+    double* diag = &this->grad_tmp[0];
+    double c = this->calc_voxel_hessian(x, diag, &this->hess_tmp[0], cached_dose);
+    if (gauss_newton) {
+        std::transform(diag, diag + num_rows, diag, [](double d) { return std::max(d, 0.0); });
+        c = std::max(c, 0.0);
+    }
+
+    //A^T * diag(d) * A is the sum over voxels of d_i * a_i * a_i^T, where a_i is row i of A.
+    //Split the columns of the Hessian into blocks so that threads never write to the same row of it.
+    //The column indexes of each row are sorted, so the non-zeros of a row in a block are found by binary search,
+    //and the lower triangle part of the row of the Hessian for non-zero p is made by the non-zeros up to p.
+#ifndef NDEBUG
+    for (int row = 0; row < num_rows; ++row)
+        assert(std::is_sorted(col_inds + row_ptrs[row], col_inds + row_ptrs[row + 1]));
+#endif
+    const int num_vars = this->num_vars;
+    const int block_size = 64;
+    const int num_blocks = (num_vars + block_size - 1) / block_size;
+    #pragma omp parallel for schedule(dynamic)
+    for (int block = 0; block < num_blocks; ++block) {
+        const int col_begin = block * block_size;
+        const int col_end = std::min(col_begin + block_size, num_vars);
+        for (int row = 0; row < num_rows; ++row) {
+            const double d = factor * diag[row];
+            if (d == 0.0)
+                continue;
+            const int* row_begin = col_inds + row_ptrs[row];
+            const int* row_end = col_inds + row_ptrs[row + 1];
+            const int* block_begin = std::lower_bound(row_begin, row_end, col_begin);
+            const int* block_end = std::lower_bound(block_begin, row_end, col_end);
+            for (int p = static_cast<int>(block_begin - col_inds); p < block_end - col_inds; ++p) {
+                const int col_p = col_inds[p];
+                double* hess_row = hess_lower + static_cast<size_t>(col_p) * (col_p + 1) / 2;
+                const double scaled = d * vals[p];
+                for (int q = row_ptrs[row]; q <= p; ++q)
+                    hess_row[col_inds[q]] += scaled * vals[q];
+            }
+        }
+    }
+
+    //Rank one part: c * w * w^T with w = A^T * u
+    if (c != 0.0) {
+        std::vector<double> w(num_vars);
+        this->spmv_transpose(&this->hess_tmp[0], &w[0]);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < num_vars; ++i) {
+            double* hess_row = hess_lower + static_cast<size_t>(i) * (i + 1) / 2;
+            const double scaled = factor * c * w[i];
+            for (int j = 0; j <= i; ++j)
+                hess_row[j] += scaled * w[j];
+        }
+    }
 }
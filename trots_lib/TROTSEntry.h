@@ -1,13 +1,12 @@
 #ifndef TROTS_ENTRY_H
 #define TROTS_ENTRY_H
 
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
-
-#include <boost/serialization/string.hpp>
-#include <boost/serialization/vector.hpp>
-
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <variant>
+#include <vector>
 
 #include "SparseMat.h"
 
@@ -17,16 +16,67 @@ enum class FunctionType {
 };
 
 struct matvar_t;
+class DoseDataReader;
+
+const char* function_type_name(FunctionType type);
+
+//Work done by an entry since the last reset, collected for performance telemetry.
+struct EntryStats {
+    long long spmv_count = 0;
+    //Evaluations that reused the dose from a previous evaluation instead of computing A * x
+    long long dose_cache_hits = 0;
+    double spmv_seconds = 0.0;
+    //Estimated memory traffic of the sparse products, see TROTSEntry.cpp
+    double spmv_bytes = 0.0;
+    double last_value = 0.0;
+    //Total time of the evaluations of values and derivatives, including the sparse products
+    double eval_seconds = 0.0;
+
+    //Flat representation, e.g. for sending between MPI ranks
+    static constexpr int num_fields = 6;
+    void pack(double* out) const;
+    static EntryStats unpack(const double* in);
+};
+
+//The fixed size fields of a TROTSEntry. Trivially copyable, so it can be stored in files as is.
+struct TROTSEntryInfo {
+    int32_t id;
+    int32_t num_vars;
+    int32_t type;
+    uint8_t active;
+    uint8_t minimise;
+    uint8_t is_cons;
+    uint8_t padding;
+    double rhs;
+    double weight;
+    double c;
+};
+
+//The fields of a row part, see TROTSEntry::make_row_part. Trivially copyable like TROTSEntryInfo.
+struct RowPartInfo {
+    //Rows of the whole entry, 0 if the entry is not a row part
+    int32_t total_voxels = 0;
+    int32_t split_group = -1;
+};
 
 class TROTSEntry {
 public:
-    //The default constructor is provided to enable serialization & de-serialization to
-    //transfer between MPI ranks
     TROTSEntry() = default;
-    TROTSEntry(matvar_t* problem_struct_entry, matvar_t* data_struct,
+    TROTSEntry(matvar_t* problem_struct_entry, const DoseDataReader& dose_data,
                const std::vector<std::variant<std::unique_ptr<SparseMatrix<double>>,
                                               std::vector<double>>
                                 >& mat_refs);
+    //Reconstructs an entry from the values of get_info, get_roi_name, get_func_params and get_grad_nonzero_idxs.
+    //The dose matrix or mean vector is looked up by the id in mat_refs, as in the constructor above.
+    TROTSEntry(const TROTSEntryInfo& info, std::string roi_name, std::vector<double> func_params,
+               std::vector<int> grad_nonzero_idxs,
+               const std::vector<std::variant<std::unique_ptr<SparseMatrix<double>>,
+                                              std::vector<double>>
+                                >& mat_refs);
+    //An entry without its dose data, e.g. one received from another MPI rank. The data is set afterwards
+    //with set_matrix_ptr or set_mean_vec_ptr, which also allocate the voxel sized workspaces.
+    TROTSEntry(const TROTSEntryInfo& info, std::string roi_name, std::vector<double> func_params,
+               std::vector<int> grad_nonzero_idxs, const RowPartInfo& row_part = {});
 
     bool is_constraint() const noexcept { return this->is_cons; }
     bool is_active() const noexcept { return this->active; }
@@ -34,27 +84,75 @@ public:
     double calc_value(const double* x, bool cached_dose=false) const;
     double get_weight() const noexcept { return this->weight; }
     double get_rhs() const noexcept { return this->rhs; }
+    //Neither affects the sparsity structure, so they can be changed between solves of the same problem.
+    void set_weight(double weight) noexcept { this->weight = weight; }
+    void set_rhs(double rhs) noexcept { this->rhs = rhs; }
     int get_id() const noexcept { return this->id; }
     void calc_gradient(const double* x, double* grad, bool cached_dose=false) const;
-    int get_nnz() const {
-        assert (this->matrix_ref != nullptr || this->mean_vec_ref != nullptr);
-        if (this->matrix_ref != nullptr) {
-            return this->matrix_ref->get_nnz();
-        } else {
-            return static_cast<int>(this->mean_vec_ref->size());
+    //Non-zeros of the dose matrix, or the length of the mean vector. Still known after the matrix is released.
+    int get_nnz() const noexcept { return this->nnz; }
+
+    void set_matrix_ptr(SparseMatrix<double>* ptr) {
+        this->matrix_ref = ptr;
+        if (ptr != nullptr) {
+            this->nnz = ptr->get_nnz();
+            this->y_vec.resize(ptr->get_rows());
+            this->grad_tmp.resize(ptr->get_rows());
         }
     }
+    void set_mean_vec_ptr(std::vector<double>* ptr) {
+        this->mean_vec_ref = ptr;
+        if (ptr != nullptr)
+            this->nnz = static_cast<int>(ptr->size());
+    }
 
-    void set_matrix_ptr(SparseMatrix<double>* ptr) { this->matrix_ref = ptr; }
-    void set_mean_vec_ptr(std::vector<double>* ptr) { this->mean_vec_ref = ptr; }
-
-    std::vector<double> calc_sparse_grad(const double* x, bool cached_dose=false) const;
+    //Writes the gradient values at the indexes given by get_grad_nonzero_idxs() to sparse_grad.
+    //dense_workspace must hold num_vars elements, it is not used for the Mean type.
+    void calc_sparse_grad(const double* x, double* sparse_grad, double* dense_workspace,
+                          bool cached_dose=false) const;
+
+    //Since the dose is linear in x, the LTCP value at s * x is a function of the dose at x only.
+    //Returns the smallest s > 0 for which the LTCP value at s * x is at most max_val, or 0 if that holds for all s.
+    //Only valid for LTCP entries.
+    double calc_LTCP_scale(const double* x, double max_val, bool cached_dose=false) const;
+
+    //Second order information. Every entry is a function of the dose y = A * x, and in voxel space its Hessian
+    //has the form diag(d) + c * u * u^T, where the rank one term is only non-zero for gEUD.
+    //The Hessian with respect to x is then A^T * (diag(d) + c * u * u^T) * A (or A itself for the Quadratic type).
+    //Stores d in hess_diag and u in rank_one_vec (both of length num_voxels) and returns c.
+    double calc_voxel_hessian(const double* x, double* hess_diag, double* rank_one_vec, bool cached_dose=false) const;
+    //Adds factor times the Hessian of the entry to hess_lower, which holds the lower triangle of a dense
+    //num_vars x num_vars matrix packed row by row, i.e. element (i, j), j <= i, is at i * (i + 1) / 2 + j.
+    //With gauss_newton set, only the positive semi-definite part of the voxel space Hessian is used.
+    //The column indexes in each row of the dose matrix must be sorted, as they are in all matrices made by
+    //the sparse matrix factories, including mapped cache matrices and row block views.
+    void add_dense_hessian(const double* x, double factor, double* hess_lower,
+                           bool gauss_newton, bool cached_dose=false) const;
     FunctionType function_type() const noexcept { return this->type; }
     std::string get_roi_name() const { return this->roi_name; }
+    const std::vector<double>& get_func_params() const noexcept { return this->func_params; }
+    TROTSEntryInfo get_info() const;
+    const EntryStats& get_stats() const noexcept { return this->stats; }
+    void reset_stats() const noexcept { this->stats = EntryStats{}; }
 
     //Returns the indexes of the non-zero elements in the gradient of the entry.
-    std::vector<int> get_grad_nonzero_idxs() const { return this->grad_nonzero_idxs; }
+    const std::vector<int>& get_grad_nonzero_idxs() const { return this->grad_nonzero_idxs; }
     int get_grad_nnz() const { return this->grad_nonzero_idxs.size(); }
+
+    //An entry evaluated on a block of rows (voxels) of this entry's dose matrix, so that a large ROI can be
+    //evaluated by several MPI ranks. Summing the values and gradients of the parts gives those of the whole entry.
+    //rows is the block itself, stored under the data id part_id, and row_begin its first row in this entry.
+    //gEUD parts also need the power sum over all parts, which they share through split_group, see set_split_sum.
+    //Only Max, Min, LTCP and gEUD entries can be split.
+    TROTSEntry make_row_part(int part_id, const SparseMatrix<double>* rows, int row_begin, int split_group) const;
+    bool is_row_part() const noexcept { return this->total_voxels > 0; }
+    RowPartInfo get_row_part_info() const noexcept { return {this->total_voxels, this->split_group}; }
+    //The gEUD parts with the same split group (>= 0) together make up one entry, -1 for all other entries.
+    int get_split_group() const noexcept { return this->split_group; }
+    //sum_i y_i^a over the voxels of this part only. Updates the dose.
+    double calc_gEUD_partial_sum(const double* x, bool cached_dose=false) const;
+    //The power sum over the voxels of all parts in the split group, used by the next gEUD values and gradients.
+    void set_split_sum(double sum) const noexcept { this->split_sum = sum; }
 private:
     double calc_quadratic(const double* x) const;
     double calc_max(const double* x) const;
@@ -62,6 +160,12 @@ private:
     double calc_mean(const double* x) const;
     double calc_LTCP(const double* x, bool cached_dose=false) const;
     double calc_gEUD(const double* x, bool cached_dose=false) const;
+    //sum_i y_i^a of the current dose
+    double gEUD_power_sum() const;
+    //Number of voxels the penalties are normalized by. For a row part this is that of the whole entry.
+    double voxel_count() const noexcept {
+        return static_cast<double>(this->total_voxels > 0 ? this->total_voxels : this->y_vec.size());
+    }
     double quadratic_penalty_min(const double* x, bool cached_dose=false) const;
     double quadratic_penalty_max(const double* x, bool cached_dose=false) const;
     double quadratic_penalty_mean(const double* x) const;
@@ -73,10 +177,12 @@ private:
     void quad_min_grad(const double* x, double* grad, bool cached_dose) const;
     void quad_max_grad(const double* x, double* grad, bool cached_dose) const;
     void quad_grad(const double* x, double* grad) const;
-
-    friend class boost::serialization::access;
-    template <typename Archive>
-    void serialize(Archive& ar, const unsigned int version);
+    //Makes sure this->y_vec holds the dose A * x
+    void update_dose(const double* x, bool cached_dose) const;
+    //Products with the dose matrix, counted and timed in this->stats
+    void spmv(const double* in, double* out) const;
+    void spmv_transpose(const double* in, double* out) const;
+    void record_spmv(std::chrono::steady_clock::time_point start) const;
 
     std::vector<int> calc_grad_nonzero_idxs() const;
 
@@ -99,37 +205,20 @@ private:
     //const MKL_sparse_matrix<double>* matrix_ref;
     SparseMatrix<double> const* matrix_ref;
     std::vector<double> const* mean_vec_ref;
+    int nnz = 0;
+    //Rows of the whole entry if this is a row part, 0 otherwise
+    int total_voxels = 0;
+    int split_group = -1;
+    mutable double split_sum = 0.0;
 
     //When calculating many objective values, a temporary store for the A*x is needed. Provide it here once so it does not
     //need to be allocated every time.
     mutable std::vector<double> y_vec;
     //Gradient calculation can require more temporaries
     mutable std::vector<double> grad_tmp;
+    //Voxel sized storage for Hessian computations, only allocated if second order information is requested.
+    mutable std::vector<double> hess_tmp;
+    mutable EntryStats stats;
 };
 
-template <typename Archive>
-void TROTSEntry::serialize(Archive& ar, const unsigned int version) {
-    //this->matrix_ref = nullptr;
-    //this->mean_vec_ref = nullptr;
-    ar & num_vars;
-    ar & id;
-    ar & roi_name;
-    ar & func_params;
-    ar & grad_nonzero_idxs;
-    ar & active;
-    ar & minimise;
-    ar & is_cons;
-    ar & type;
-    ar & rhs;
-    ar & weight;
-    ar & c;
-    //These will lose their meaning when sent, but we will reset them on the other side
-    //ar & matrix_ref;
-    //ar & mean_vec_ref;
-
-    ar & y_vec;
-    ar & grad_tmp;
-}
-
-
 #endif
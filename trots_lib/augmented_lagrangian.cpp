@@ -0,0 +1,87 @@
+#include "augmented_lagrangian.h"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+AugmentedLagrangianResult solve_augmented_lagrangian(const TROTSProblem& problem, double* x,
+                                                     std::vector<double>& lambda,
+                                                     const AugmentedLagrangianOptions& options) {
+    const int n = problem.get_num_vars();
+    const int m = problem.get_num_constraints();
+    const std::vector<int>& row_offsets = problem.get_jac_row_offsets();
+    const std::vector<int>& col_idxs = problem.get_jac_col_idxs();
+
+    //c_j = sign_j * g_j, so that all constraints read c_j(x) <= 0 and the multipliers mu_j are non-negative.
+    std::vector<double> sign(m);
+    for (int j = 0; j < m; ++j)
+        sign[j] = problem.constraint_is_upper_bound(j) ? 1.0 : -1.0;
+
+    std::vector<double> mu(m, 0.0);
+    if (static_cast<int>(lambda.size()) == m) {
+        for (int j = 0; j < m; ++j)
+            mu[j] = std::max(sign[j] * lambda[j], 0.0);
+    }
+
+    std::vector<double> cons_vals(m);
+    std::vector<double> jac_vals(problem.get_nnz_jac_cons());
+    double rho = options.initial_penalty;
+
+    const ValueGradFunc augmented_lagrangian = [&](const double* x_k, double* grad) {
+        double val = problem.calc_objective(x_k);
+        problem.calc_obj_gradient(x_k, grad, true);
+        if (m == 0)
+            return val;
+
+        problem.calc_constraints(x_k, &cons_vals[0]);
+        problem.calc_jacobian_vals(x_k, &jac_vals[0], true);
+        for (int j = 0; j < m; ++j) {
+            const double shifted = std::max(mu[j] + rho * sign[j] * cons_vals[j], 0.0);
+            val += (shifted * shifted - mu[j] * mu[j]) / (2.0 * rho);
+            if (shifted == 0.0)
+                continue;
+            const double factor = shifted * sign[j];
+            for (int k = row_offsets[j]; k < row_offsets[j + 1]; ++k)
+                grad[col_idxs[k]] += factor * jac_vals[k];
+        }
+        return val;
+    };
+
+    const auto max_violation = [&]() {
+        problem.calc_constraints(x, &cons_vals[0]);
+        double violation = 0.0;
+        for (int j = 0; j < m; ++j)
+            violation = std::max(violation, sign[j] * cons_vals[j]);
+        return violation;
+    };
+
+    AugmentedLagrangianResult result{0, 0, 0.0, 0.0, false};
+    double prev_violation = std::numeric_limits<double>::infinity();
+    for (int outer = 0; outer < options.max_outer_iters; ++outer) {
+        const LBFGSBResult inner = minimize_lbfgsb(n, x, augmented_lagrangian, options.inner);
+        result.outer_iterations = outer + 1;
+        result.inner_iterations += inner.iterations;
+
+        const double violation = max_violation();
+        result.max_violation = violation;
+        std::cout << "Outer iteration " << outer << ": " << inner.iterations << " inner iterations, |pg| = "
+                  << inner.pg_norm << ", max violation = " << violation << ", penalty = " << rho << "\n";
+
+        if (violation <= options.cons_tol && inner.status == LBFGSBStatus::Converged) {
+            result.converged = true;
+            break;
+        }
+
+        for (int j = 0; j < m; ++j)
+            mu[j] = std::max(mu[j] + rho * sign[j] * cons_vals[j], 0.0);
+        if (violation > 0.25 * prev_violation)
+            rho = std::min(rho * options.penalty_growth, options.max_penalty);
+        prev_violation = violation;
+    }
+
+    result.objective = problem.calc_objective(x);
+    lambda.resize(m);
+    for (int j = 0; j < m; ++j)
+        lambda[j] = sign[j] * mu[j];
+    return result;
+}
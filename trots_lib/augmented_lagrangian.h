@@ -0,0 +1,41 @@
+#ifndef AUGMENTED_LAGRANGIAN_H
+#define AUGMENTED_LAGRANGIAN_H
+
+#include <vector>
+
+#include "lbfgsb.h"
+#include "trots.h"
+
+struct AugmentedLagrangianOptions {
+    //Options for each bound constrained subproblem
+    LBFGSBOptions inner;
+    int max_outer_iters = 20;
+    //Largest accepted violation of a constraint
+    double cons_tol = 1e-4;
+    double initial_penalty = 10.0;
+    //The penalty is multiplied by this when the violation did not decrease enough in an outer iteration
+    double penalty_growth = 10.0;
+    double max_penalty = 1e8;
+};
+
+struct AugmentedLagrangianResult {
+    int outer_iterations;
+    int inner_iterations;
+    double objective;
+    double max_violation;
+    bool converged;
+};
+
+//Solves the TROTS problem with x >= 0 and its constraints for a quick approximate plan.
+//Each outer iteration minimizes the augmented Lagrangian
+//    f(x) + sum_j (max(0, mu_j + rho * c_j(x))^2 - mu_j^2) / (2 * rho)
+//over x >= 0 with minimize_lbfgsb, where c_j(x) <= 0 is constraint j written as an upper bound.
+//The multipliers mu_j and, if needed, the penalty rho are updated in between.
+//x holds the starting point and the result on return. lambda holds the constraint multipliers in the
+//order of TROTSProblem::constraint_entries and the sign convention of IPOPT, so that they can be saved as
+//a SolverState. If lambda has one element per constraint it is used as the initial guess.
+AugmentedLagrangianResult solve_augmented_lagrangian(const TROTSProblem& problem, double* x,
+                                                     std::vector<double>& lambda,
+                                                     const AugmentedLagrangianOptions& options);
+
+#endif
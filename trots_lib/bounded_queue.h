@@ -0,0 +1,59 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+//FIFO queue for passing work between threads, holding at most capacity items.
+//push blocks while the queue is full, and pop blocks while it is empty. After close, push
+//fails and pop returns the remaining items, followed by std::nullopt once the queue is drained.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity{capacity} {}
+
+    //Returns false if the queue was closed, in which case item is dropped.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock{this->mutex};
+        this->not_full.wait(lock, [this] { return this->closed || this->items.size() < this->capacity; });
+        if (this->closed)
+            return false;
+        this->items.push_back(std::move(item));
+        lock.unlock();
+        this->not_empty.notify_one();
+        return true;
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock{this->mutex};
+        this->not_empty.wait(lock, [this] { return this->closed || !this->items.empty(); });
+        if (this->items.empty())
+            return std::nullopt;
+        T item = std::move(this->items.front());
+        this->items.pop_front();
+        lock.unlock();
+        this->not_full.notify_one();
+        return item;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock{this->mutex};
+            this->closed = true;
+        }
+        this->not_full.notify_all();
+        this->not_empty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "dose_data_reader.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "util.h"
+
+namespace {
+    class MatioDoseDataReader : public DoseDataReader {
+    public:
+        explicit MatioDoseDataReader(matvar_t* data_struct) : data_struct{data_struct} {
+            this->matrix_struct = Mat_VarGetStructFieldByName(data_struct, "matrix", 0);
+            check_null(this->matrix_struct, "Unable to read matrix field from matfile\n");
+        }
+
+        int get_num_matrices() const override {
+            return static_cast<int>(this->matrix_struct->dims[1]);
+        }
+
+        int get_num_vars() const override {
+            matvar_t* misc_struct = Mat_VarGetStructFieldByName(this->data_struct, "misc", 0);
+            check_null(misc_struct, "Unable to read misc field from matfile\n");
+            matvar_t* size_var = Mat_VarGetStructFieldByName(misc_struct, "size", 0);
+            check_null(size_var, "Unable to read misc.size from matfile\n");
+            return cast_from_double<int>(size_var);
+        }
+
+        std::string get_matrix_name(int idx) const override {
+            matvar_t* name = Mat_VarGetStructFieldByName(this->matrix_struct, "Name", idx);
+            check_null(name, "Failed to read Name from entry " + std::to_string(idx) + " in matrix.data\n");
+            return get_name_str(name);
+        }
+
+        double get_matrix_c(int idx) const override {
+            matvar_t* c_var = Mat_VarGetStructFieldByName(this->matrix_struct, "c", idx);
+            check_null(c_var, "Failed to read c from entry " + std::to_string(idx) + " in matrix.data\n");
+            assert(c_var->data_type == MAT_T_SINGLE);
+            return static_cast<double>(*static_cast<float*>(c_var->data));
+        }
+
+        RawDoseMatrix read_matrix(int idx) override {
+            matvar_t* A = Mat_VarGetStructFieldByName(this->matrix_struct, "A", idx);
+            check_null(A, "Failed to read A from entry " + std::to_string(idx) + " in matrix.data\n");
+
+            RawDoseMatrix raw;
+            raw.rows = static_cast<int>(A->dims[0]);
+            raw.cols = static_cast<int>(A->dims[1]);
+            raw.is_sparse = A->class_type == MAT_C_SPARSE;
+            if (raw.is_sparse) {
+                assert(A->data_type == MAT_T_DOUBLE);
+                const mat_sparse_t* sparse = static_cast<mat_sparse_t*>(A->data);
+                const double* vals = static_cast<double*>(sparse->data);
+                raw.vals.assign(vals, vals + sparse->ndata);
+                raw.row_idxs.assign(sparse->ir, sparse->ir + sparse->ndata);
+                raw.col_ptrs.assign(sparse->jc, sparse->jc + raw.cols + 1);
+            }
+            else {
+                //Dense matrices are stored in single precision, for whatever reason.
+                assert(A->data_type == MAT_T_SINGLE);
+                const float* vals = static_cast<float*>(A->data);
+                raw.dense_vals.assign(vals, vals + static_cast<size_t>(raw.rows) * raw.cols);
+            }
+
+            //Swap in an empty matrix, so that the matio copy of the data is freed right away.
+            size_t empty_dims[2] = {0, 0};
+            matvar_t* empty = Mat_VarCreate(nullptr, MAT_C_DOUBLE, MAT_T_DOUBLE, 2, empty_dims, nullptr, 0);
+            check_null(empty, "Failed to create an empty matrix\n");
+            Mat_VarFree(Mat_VarSetStructFieldByName(this->matrix_struct, "A", idx, empty));
+            return raw;
+        }
+
+    private:
+        matvar_t* data_struct;
+        matvar_t* matrix_struct;
+    };
+}
+
+std::unique_ptr<DoseDataReader> make_matio_dose_data_reader(matvar_t* data_struct) {
+    return std::make_unique<MatioDoseDataReader>(data_struct);
+}
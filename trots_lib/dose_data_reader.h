@@ -0,0 +1,51 @@
+#ifndef DOSE_DATA_READER_H
+#define DOSE_DATA_READER_H
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <matio.h>
+
+//data.matrix(idx + 1).A of a TROTS file, in the form it is stored in the file.
+struct RawDoseMatrix {
+    int rows = 0;
+    int cols = 0;
+    bool is_sparse = false;
+    //CSC arrays of a sparse matrix
+    std::vector<double> vals;
+    std::vector<int> row_idxs;
+    std::vector<int> col_ptrs;
+    //Column major values of a dense matrix, which TROTS stores in single precision
+    std::vector<float> dense_vals;
+};
+
+//Access to the "data" variable of a TROTS file: the elements of data.matrix, and data.misc.size.
+//Neither matio nor a serial HDF5 build is thread safe, so a reader must only be used by one thread at a time.
+class DoseDataReader {
+public:
+    virtual ~DoseDataReader() = default;
+
+    virtual int get_num_matrices() const = 0;
+    //The number of beamlets (optimization variables) of the problem
+    virtual int get_num_vars() const = 0;
+    virtual std::string get_matrix_name(int idx) const = 0;
+    //The scalar c of data.matrix(idx + 1), used by the quadratic function type
+    virtual double get_matrix_c(int idx) const = 0;
+    //Reads data.matrix(idx + 1).A. Every matrix can only be read once, since the reader
+    //does not keep any data it has handed out.
+    virtual RawDoseMatrix read_matrix(int idx) = 0;
+};
+
+//Reads from a data variable that matio has read into memory, which works for all .mat versions.
+//The memory of each matrix is released as soon as it is read.
+std::unique_ptr<DoseDataReader> make_matio_dose_data_reader(matvar_t* data_struct);
+
+#ifdef TROTS_USE_HDF5
+//Reads a version 7.3 .mat file (an HDF5 file) directly, one matrix at a time, so the file
+//never has to fit in memory.
+std::unique_ptr<DoseDataReader> make_hdf5_dose_data_reader(const std::filesystem::path& path);
+#endif
+
+#endif
@@ -0,0 +1,348 @@
+#include "dose_data_reader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+#include <hdf5.h>
+#include <zlib.h>
+
+#include "bounded_queue.h"
+
+//Version 7.3 .mat files are HDF5 files, where MATLAB stores (see the MAT-file documentation):
+//  - scalar structs as groups, with one member per field
+//  - struct arrays as groups with one dataset of object references per field, one reference per element,
+//    pointing to the values in the /#refs# group
+//  - dense arrays as datasets, with the dimensions in reverse order (the data is column major)
+//  - sparse matrices as groups holding the CSC arrays "data", "ir" and "jc", with the number
+//    of rows in the attribute MATLAB_sparse. "data" and "ir" are missing if there are no non-zeros.
+//  - empty arrays as datasets holding their dimensions, marked by the attribute MATLAB_empty
+//The class of each array is in the attribute MATLAB_class.
+namespace {
+    namespace fs = std::filesystem;
+
+    //Owns an HDF5 identifier, and closes it with close_func.
+    class H5Handle {
+    public:
+        H5Handle(hid_t id, herr_t (*close_func)(hid_t), const std::string& what) : id{id}, close_func{close_func} {
+            if (id < 0)
+                throw std::runtime_error("Could not open " + what + " in .mat file\n");
+        }
+
+        H5Handle(const H5Handle&) = delete;
+        H5Handle& operator=(const H5Handle&) = delete;
+
+        ~H5Handle() {
+            this->close_func(this->id);
+        }
+
+        hid_t get() const noexcept { return this->id; }
+
+    private:
+        hid_t id;
+        herr_t (*close_func)(hid_t);
+    };
+
+    //The element types MATLAB writes, in little endian byte order. Other is anything else, including
+    //every type on a big endian host.
+    enum class ElemType { Double, Single, Int64, UInt64, Int32, UInt32, Other };
+
+    ElemType get_elem_type(hid_t type) {
+        if (H5Tget_order(type) != H5T_ORDER_LE || H5Tget_order(H5T_NATIVE_INT) != H5T_ORDER_LE)
+            return ElemType::Other;
+        const size_t size = H5Tget_size(type);
+        switch (H5Tget_class(type)) {
+            case H5T_FLOAT:
+                return size == 8 ? ElemType::Double : size == 4 ? ElemType::Single : ElemType::Other;
+            case H5T_INTEGER: {
+                const bool is_signed = H5Tget_sign(type) == H5T_SGN_2;
+                if (size == 8)
+                    return is_signed ? ElemType::Int64 : ElemType::UInt64;
+                if (size == 4)
+                    return is_signed ? ElemType::Int32 : ElemType::UInt32;
+                return ElemType::Other;
+            }
+            default:
+                return ElemType::Other;
+        }
+    }
+
+    template <typename T>
+    ElemType elem_type_of() {
+        if constexpr (std::is_same_v<T, double>)
+            return ElemType::Double;
+        else if constexpr (std::is_same_v<T, float>)
+            return ElemType::Single;
+        else if constexpr (std::is_same_v<T, int>)
+            return ElemType::Int32;
+        else
+            return ElemType::Other;
+    }
+
+    template <typename Src, typename T>
+    void convert_values(const unsigned char* src, size_t count, T* dst) {
+        for (size_t i = 0; i < count; ++i) {
+            Src val;
+            std::memcpy(&val, src + i * sizeof(Src), sizeof(Src));
+            dst[i] = static_cast<T>(val);
+        }
+    }
+
+    template <typename T>
+    void convert_values(ElemType src_type, const unsigned char* src, size_t count, T* dst) {
+        switch (src_type) {
+            case ElemType::Double: convert_values<double>(src, count, dst); break;
+            case ElemType::Single: convert_values<float>(src, count, dst); break;
+            case ElemType::Int64: convert_values<int64_t>(src, count, dst); break;
+            case ElemType::UInt64: convert_values<uint64_t>(src, count, dst); break;
+            case ElemType::Int32: convert_values<int32_t>(src, count, dst); break;
+            case ElemType::UInt32: convert_values<uint32_t>(src, count, dst); break;
+            case ElemType::Other: throw std::logic_error("Unsupported element type\n");
+        }
+    }
+
+    //Reads a one dimensional dataset that is chunked and compressed with deflate, the way MATLAB stores the
+    //arrays of large sparse matrices. H5Dread would inflate the chunks one at a time in the calling thread.
+    //Here, the calling thread reads the compressed chunks with H5Dread_chunk, since HDF5 is not thread safe,
+    //and num_threads threads inflate them straight into values.
+    //Returns false without reading anything if the dataset is stored in any other way.
+    template <typename T>
+    bool read_deflated_chunks(hid_t dataset, T* values, size_t num_elems, int num_threads, const std::string& what) {
+        struct RawChunk {
+            size_t first;
+            uint32_t filter_mask;
+            std::vector<unsigned char> data;
+        };
+
+        const H5Handle plist{H5Dget_create_plist(dataset), H5Pclose, "creation properties of " + what};
+        if (H5Pget_layout(plist.get()) != H5D_CHUNKED || H5Pget_nfilters(plist.get()) != 1)
+            return false;
+        unsigned int flags = 0;
+        size_t num_filter_params = 0;
+        unsigned int filter_config = 0;
+        if (H5Pget_filter2(plist.get(), 0, &flags, &num_filter_params, nullptr, 0, nullptr, &filter_config)
+                != H5Z_FILTER_DEFLATE)
+            return false;
+        hsize_t chunk_len = 0;
+        if (H5Pget_chunk(plist.get(), 1, &chunk_len) != 1 || chunk_len == 0)
+            return false;
+
+        const H5Handle type{H5Dget_type(dataset), H5Tclose, "type of " + what};
+        const ElemType file_type = get_elem_type(type.get());
+        if (file_type == ElemType::Other)
+            return false;
+        //The workers make no HDF5 calls, so everything they need about the type is looked up here.
+        const size_t elem_size = H5Tget_size(type.get());
+        const size_t chunk_bytes = chunk_len * elem_size;
+
+        //Chunks that were never written hold the fill value, which only H5Dread knows about.
+        const size_t num_chunks = (num_elems + chunk_len - 1) / chunk_len;
+        std::vector<hsize_t> chunk_sizes(num_chunks);
+        for (size_t c = 0; c < num_chunks; ++c) {
+            const hsize_t offset = c * chunk_len;
+            if (H5Dget_chunk_storage_size(dataset, &offset, &chunk_sizes[c]) < 0 || chunk_sizes[c] == 0)
+                return false;
+        }
+
+        num_threads = static_cast<int>(std::min<size_t>(num_threads, num_chunks));
+        BoundedQueue<RawChunk> queue{2 * static_cast<size_t>(num_threads)};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        const auto worker = [&]() {
+            std::vector<unsigned char> scratch;
+            while (std::optional<RawChunk> chunk = queue.pop()) {
+                try {
+                    const size_t count = std::min<size_t>(chunk_len, num_elems - chunk->first);
+                    //Bit 0 of the mask is set if the deflate filter was skipped for this chunk
+                    if (chunk->filter_mask & 1u) {
+                        if (chunk->data.size() < count * elem_size)
+                            throw std::runtime_error("Chunk of " + what + " is truncated\n");
+                        convert_values(file_type, chunk->data.data(), count, values + chunk->first);
+                        continue;
+                    }
+
+                    //Full chunks of the right type are inflated in place, the rest through scratch.
+                    const bool in_place = file_type == elem_type_of<T>() && count == chunk_len;
+                    if (!in_place)
+                        scratch.resize(chunk_bytes);
+                    unsigned char* dst = in_place ? reinterpret_cast<unsigned char*>(values + chunk->first)
+                                                  : scratch.data();
+                    uLongf dst_len = chunk_bytes;
+                    if (uncompress(dst, &dst_len, chunk->data.data(), chunk->data.size()) != Z_OK
+                        || dst_len != chunk_bytes)
+                        throw std::runtime_error("Failed to inflate a chunk of " + what + "\n");
+                    if (!in_place)
+                        convert_values(file_type, scratch.data(), count, values + chunk->first);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock{error_mutex};
+                    if (!error)
+                        error = std::current_exception();
+                    queue.close();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(num_threads);
+        for (int t = 0; t < num_threads; ++t)
+            workers.emplace_back(worker);
+
+        try {
+            for (size_t c = 0; c < num_chunks; ++c) {
+                RawChunk chunk{c * chunk_len, 0, std::vector<unsigned char>(chunk_sizes[c])};
+                const hsize_t offset = chunk.first;
+                if (H5Dread_chunk(dataset, H5P_DEFAULT, &offset, &chunk.filter_mask, chunk.data.data()) < 0)
+                    throw std::runtime_error("Failed to read a chunk of " + what + " from .mat file\n");
+                //Fails only if a worker has closed the queue after an error.
+                if (!queue.push(std::move(chunk)))
+                    break;
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock{error_mutex};
+            if (!error)
+                error = std::current_exception();
+        }
+        queue.close();
+
+        for (std::thread& thread : workers)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
+        return true;
+    }
+
+    //Reads a whole dataset, converted to mem_type by HDF5. With num_threads > 1, deflated datasets
+    //are inflated in parallel by read_deflated_chunks.
+    template <typename T>
+    std::vector<T> read_dataset(hid_t dataset, hid_t mem_type, const std::string& what, int num_threads = 1) {
+        const H5Handle space{H5Dget_space(dataset), H5Sclose, "dataspace of " + what};
+        const hssize_t num_elems = H5Sget_simple_extent_npoints(space.get());
+        std::vector<T> values(num_elems > 0 ? num_elems : 0);
+        if (values.empty())
+            return values;
+        if (num_threads > 1 && H5Sget_simple_extent_ndims(space.get()) == 1
+            && read_deflated_chunks(dataset, values.data(), values.size(), num_threads, what))
+            return values;
+        if (H5Dread(dataset, mem_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values.data()) < 0)
+            throw std::runtime_error("Failed to read " + what + " from .mat file\n");
+        return values;
+    }
+
+    template <typename T>
+    std::vector<T> read_dataset(hid_t loc, const char* name, hid_t mem_type, const std::string& what,
+                                int num_threads = 1) {
+        const H5Handle dataset{H5Dopen2(loc, name, H5P_DEFAULT), H5Dclose, what};
+        return read_dataset<T>(dataset.get(), mem_type, what, num_threads);
+    }
+
+    bool is_empty_array(hid_t obj) {
+        return H5Aexists(obj, "MATLAB_empty") > 0;
+    }
+
+    class HDF5DoseDataReader : public DoseDataReader {
+    public:
+        explicit HDF5DoseDataReader(const fs::path& path) :
+            file{H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT), H5Fclose, path.string()},
+            //Inflating is what limits the loading of compressed files, so it gets all cores, even though
+            //the matrices read before are still being converted.
+            num_inflate_threads{std::max(1, static_cast<int>(std::thread::hardware_concurrency()))}
+        {
+            this->A_refs = this->read_field_refs("A");
+            this->name_refs = this->read_field_refs("Name");
+        }
+
+        int get_num_matrices() const override {
+            return static_cast<int>(this->A_refs.size());
+        }
+
+        int get_num_vars() const override {
+            const std::vector<double> size = read_dataset<double>(this->file.get(), "/data/misc/size",
+                                                                  H5T_NATIVE_DOUBLE, "data.misc.size");
+            if (size.size() != 1)
+                throw std::runtime_error("data.misc.size is not a scalar\n");
+            return static_cast<int>(size[0]);
+        }
+
+        std::string get_matrix_name(int idx) const override {
+            const H5Handle name{this->dereference(this->name_refs[idx]), H5Oclose, "data.matrix.Name"};
+            if (is_empty_array(name.get()))
+                return "";
+            //MATLAB stores characters as UTF-16 code units, the TROTS names are plain ASCII.
+            const std::vector<uint16_t> chars = read_dataset<uint16_t>(name.get(), H5T_NATIVE_USHORT, "data.matrix.Name");
+            return std::string(chars.cbegin(), chars.cend());
+        }
+
+        double get_matrix_c(int idx) const override {
+            if (this->c_refs.empty())
+                this->c_refs = this->read_field_refs("c");
+            const H5Handle c{this->dereference(this->c_refs[idx]), H5Oclose, "data.matrix.c"};
+            const std::vector<double> c_val = read_dataset<double>(c.get(), H5T_NATIVE_DOUBLE, "data.matrix.c");
+            if (c_val.size() != 1)
+                throw std::runtime_error("data.matrix.c is not a scalar\n");
+            return c_val[0];
+        }
+
+        RawDoseMatrix read_matrix(int idx) override {
+            const H5Handle A{this->dereference(this->A_refs[idx]), H5Oclose, "data.matrix.A"};
+            RawDoseMatrix raw;
+            if (H5Iget_type(A.get()) == H5I_GROUP) {
+                raw.is_sparse = true;
+                const H5Handle rows_attr{H5Aopen(A.get(), "MATLAB_sparse", H5P_DEFAULT), H5Aclose,
+                                         "number of rows of data.matrix.A"};
+                unsigned long long rows = 0;
+                H5Aread(rows_attr.get(), H5T_NATIVE_ULLONG, &rows);
+                raw.rows = static_cast<int>(rows);
+
+                //The indexes are stored as 64 bit unsigned integers, HDF5 narrows them to int while reading.
+                raw.col_ptrs = read_dataset<int>(A.get(), "jc", H5T_NATIVE_INT, "data.matrix.A.jc",
+                                                 this->num_inflate_threads);
+                raw.cols = static_cast<int>(raw.col_ptrs.size()) - 1;
+                if (raw.cols >= 0 && raw.col_ptrs.back() > 0) {
+                    raw.row_idxs = read_dataset<int>(A.get(), "ir", H5T_NATIVE_INT, "data.matrix.A.ir",
+                                                     this->num_inflate_threads);
+                    raw.vals = read_dataset<double>(A.get(), "data", H5T_NATIVE_DOUBLE, "data.matrix.A.data",
+                                                    this->num_inflate_threads);
+                }
+            }
+            else if (!is_empty_array(A.get())) {
+                const H5Handle space{H5Dget_space(A.get()), H5Sclose, "dataspace of data.matrix.A"};
+                hsize_t dims[2] = {0, 0};
+                if (H5Sget_simple_extent_ndims(space.get()) != 2)
+                    throw std::runtime_error("data.matrix.A is not a matrix\n");
+                H5Sget_simple_extent_dims(space.get(), dims, nullptr);
+                raw.cols = static_cast<int>(dims[0]);
+                raw.rows = static_cast<int>(dims[1]);
+                raw.dense_vals = read_dataset<float>(A.get(), H5T_NATIVE_FLOAT, "data.matrix.A");
+            }
+            return raw;
+        }
+
+    private:
+        std::vector<hobj_ref_t> read_field_refs(const std::string& field) const {
+            return read_dataset<hobj_ref_t>(this->file.get(), ("/data/matrix/" + field).c_str(),
+                                            H5T_STD_REF_OBJ, "data.matrix." + field);
+        }
+
+        hid_t dereference(const hobj_ref_t& ref) const {
+            return H5Rdereference2(this->file.get(), H5P_DEFAULT, H5R_OBJECT, &ref);
+        }
+
+        H5Handle file;
+        int num_inflate_threads;
+        std::vector<hobj_ref_t> A_refs;
+        std::vector<hobj_ref_t> name_refs;
+        //Only read if there are quadratic functions
+        mutable std::vector<hobj_ref_t> c_refs;
+    };
+}
+
+std::unique_ptr<DoseDataReader> make_hdf5_dose_data_reader(const fs::path& path) {
+    return std::make_unique<HDF5DoseDataReader>(path);
+}
@@ -0,0 +1,196 @@
+#include "lbfgsb.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+namespace {
+    //The last few correction pairs s = x_{k+1} - x_k, y = g_{k+1} - g_k, stored as a ring buffer.
+    class LBFGSMemory {
+    public:
+        LBFGSMemory(int n, int capacity) :
+            s(capacity, std::vector<double>(n)), y(capacity, std::vector<double>(n)),
+            rho(capacity), alpha(capacity) {}
+
+        void clear() noexcept { this->size = 0; }
+        bool empty() const noexcept { return this->size == 0; }
+
+        void push(const std::vector<double>& s_new, const std::vector<double>& y_new, double s_dot_y) {
+            const int capacity = this->s.size();
+            const int idx = (this->start + this->size) % capacity;
+            this->s[idx] = s_new;
+            this->y[idx] = y_new;
+            this->rho[idx] = 1.0 / s_dot_y;
+            if (this->size < capacity)
+                ++this->size;
+            else
+                this->start = (this->start + 1) % capacity;
+        }
+
+        //Two-loop recursion for d = -H * g with all vectors restricted to the free variables.
+        void apply(const std::vector<double>& g, const std::vector<char>& free, std::vector<double>& d) {
+            const int n = g.size();
+            const int capacity = this->s.size();
+            const auto masked_dot = [&](const std::vector<double>& a, const std::vector<double>& b) {
+                double sum = 0.0;
+                for (int i = 0; i < n; ++i) {
+                    if (free[i])
+                        sum += a[i] * b[i];
+                }
+                return sum;
+            };
+
+            for (int i = 0; i < n; ++i)
+                d[i] = free[i] ? g[i] : 0.0;
+
+            for (int k = this->size - 1; k >= 0; --k) {
+                const int idx = (this->start + k) % capacity;
+                this->alpha[idx] = this->rho[idx] * masked_dot(this->s[idx], d);
+                for (int i = 0; i < n; ++i) {
+                    if (free[i])
+                        d[i] -= this->alpha[idx] * this->y[idx][i];
+                }
+            }
+
+            //Initial Hessian approximation gamma * I from the newest pair
+            const int newest = (this->start + this->size - 1) % capacity;
+            const double y_dot_y = std::inner_product(this->y[newest].cbegin(), this->y[newest].cend(),
+                                                      this->y[newest].cbegin(), 0.0);
+            const double gamma = 1.0 / (this->rho[newest] * y_dot_y);
+            for (double& d_i : d)
+                d_i *= gamma;
+
+            for (int k = 0; k < this->size; ++k) {
+                const int idx = (this->start + k) % capacity;
+                const double beta = this->rho[idx] * masked_dot(this->y[idx], d);
+                for (int i = 0; i < n; ++i) {
+                    if (free[i])
+                        d[i] += (this->alpha[idx] - beta) * this->s[idx][i];
+                }
+            }
+
+            for (double& d_i : d)
+                d_i = -d_i;
+        }
+
+    private:
+        std::vector<std::vector<double>> s;
+        std::vector<std::vector<double>> y;
+        std::vector<double> rho;
+        std::vector<double> alpha;
+        int start = 0;
+        int size = 0;
+    };
+
+    //Infinity norm of x - P(x - g), zero exactly at the stationary points of the bound constrained problem.
+    double projected_grad_norm(int n, const double* x, const std::vector<double>& g) {
+        double norm = 0.0;
+        for (int i = 0; i < n; ++i)
+            norm = std::max(norm, std::abs(x[i] - std::max(x[i] - g[i], 0.0)));
+        return norm;
+    }
+}
+
+LBFGSBResult minimize_lbfgsb(int n, double* x, const ValueGradFunc& fg, const LBFGSBOptions& options) {
+    constexpr double armijo_c = 1e-4;
+
+    LBFGSMemory memory{n, std::max(options.memory, 1)};
+    std::vector<double> g(n), d(n), x_trial(n), g_trial(n), s(n), y(n);
+    std::vector<char> free(n);
+
+    for (int i = 0; i < n; ++i)
+        x[i] = std::max(x[i], 0.0);
+    double f = fg(x, &g[0]);
+    LBFGSBResult result{LBFGSBStatus::MaxIters, 0, 1, f, projected_grad_norm(n, x, g)};
+
+    for (int iter = 0; iter < options.max_iters; ++iter) {
+        result.iterations = iter;
+        if (result.pg_norm <= options.pg_tol) {
+            result.status = LBFGSBStatus::Converged;
+            break;
+        }
+
+        //Variables at (or numerically close to) the bound with the gradient pushing outwards are held fixed,
+        //the quasi-Newton step is only taken in the others.
+        const double eps = std::min(1e-8, result.pg_norm);
+        for (int i = 0; i < n; ++i)
+            free[i] = !(x[i] <= eps && g[i] > 0.0);
+
+        bool accepted = false;
+        double f_trial = f;
+        //If the quasi-Newton step fails, retry once along the steepest descent direction
+        for (int attempt = 0; attempt < 2 && !accepted; ++attempt) {
+            double step = 1.0;
+            if (memory.empty()) {
+                for (int i = 0; i < n; ++i)
+                    d[i] = free[i] ? -g[i] : 0.0;
+                const double d_norm = std::sqrt(std::inner_product(d.cbegin(), d.cend(), d.cbegin(), 0.0));
+                step = d_norm > 0.0 ? std::min(1.0, 1.0 / d_norm) : 1.0;
+            } else {
+                memory.apply(g, free, d);
+            }
+
+            for (int ls = 0; ls < options.max_line_search; ++ls) {
+                double decrease = 0.0;
+                for (int i = 0; i < n; ++i) {
+                    x_trial[i] = std::max(x[i] + step * d[i], 0.0);
+                    decrease += g[i] * (x_trial[i] - x[i]);
+                }
+                //Not a descent direction, which can happen with a poor Hessian approximation
+                if (decrease >= 0.0)
+                    break;
+
+                f_trial = fg(&x_trial[0], &g_trial[0]);
+                ++result.evaluations;
+                if (std::isfinite(f_trial) && f_trial <= f + armijo_c * decrease) {
+                    accepted = true;
+                    break;
+                }
+                step *= 0.5;
+            }
+
+            if (!accepted) {
+                if (memory.empty())
+                    break;
+                memory.clear();
+            }
+        }
+
+        if (!accepted) {
+            result.status = LBFGSBStatus::LineSearchFailed;
+            break;
+        }
+
+        double s_dot_y = 0.0;
+        double y_dot_y = 0.0;
+        for (int i = 0; i < n; ++i) {
+            s[i] = x_trial[i] - x[i];
+            y[i] = g_trial[i] - g[i];
+            s_dot_y += s[i] * y[i];
+            y_dot_y += y[i] * y[i];
+        }
+        //Skip updates that would make the approximation indefinite
+        if (s_dot_y > 1e-10 * y_dot_y)
+            memory.push(s, y, s_dot_y);
+
+        const double rel_decrease = (f - f_trial) / std::max({std::abs(f), std::abs(f_trial), 1.0});
+        std::copy(x_trial.cbegin(), x_trial.cend(), x);
+        std::swap(g, g_trial);
+        f = f_trial;
+        result.f = f;
+        result.pg_norm = projected_grad_norm(n, x, g);
+        result.iterations = iter + 1;
+
+        if (options.verbose)
+            std::cout << "L-BFGS-B iteration " << iter << ": f = " << f << ", |pg| = " << result.pg_norm << "\n";
+
+        if (rel_decrease <= options.rel_f_tol) {
+            result.status = LBFGSBStatus::Converged;
+            break;
+        }
+    }
+
+    return result;
+}
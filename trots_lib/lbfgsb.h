@@ -0,0 +1,40 @@
+#ifndef LBFGSB_H
+#define LBFGSB_H
+
+#include <functional>
+
+struct LBFGSBOptions {
+    //Number of correction pairs kept for the Hessian approximation
+    int memory = 10;
+    int max_iters = 1000;
+    //Converged when the infinity norm of the projected gradient is below pg_tol...
+    double pg_tol = 1e-6;
+    //...or when an iteration decreases the function by less than rel_f_tol relative to its magnitude
+    double rel_f_tol = 1e-10;
+    int max_line_search = 30;
+    bool verbose = false;
+};
+
+enum class LBFGSBStatus {
+    Converged, MaxIters, LineSearchFailed
+};
+
+struct LBFGSBResult {
+    LBFGSBStatus status;
+    int iterations;
+    int evaluations;
+    double f;
+    double pg_norm;
+};
+
+//Evaluates the function at x, stores its gradient in grad and returns the value.
+using ValueGradFunc = std::function<double(const double* x, double* grad)>;
+
+//Minimizes a smooth function over x >= 0, the only variable bounds in the TROTS problems.
+//x holds the starting point and the result on return.
+//This is the two-metric projection variant of L-BFGS-B: the quasi-Newton step is taken in the variables
+//that are not held at their bound, projected back onto the feasible set, and accepted with an Armijo backtracking
+//line search along the projected path. It needs nothing but function values and gradients.
+LBFGSBResult minimize_lbfgsb(int n, double* x, const ValueGradFunc& fg, const LBFGSBOptions& options);
+
+#endif
@@ -0,0 +1,355 @@
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trots.h"
+
+#ifdef USE_MKL
+#include "MKL_sparse_matrix.h"
+#else
+#include "EigenSparseMat.h"
+#endif
+
+namespace fs = std::filesystem;
+
+//Layout of a problem cache file. All values are stored in the native byte order, which is checked when opening.
+//
+//  CacheHeader
+//  arrays: CSR values, column indexes and row pointers of each dose matrix, mean vectors,
+//          ROI names, function parameters and gradient sparsity patterns of the entries, and the Jacobian structure
+//  MatrixRecord[num_matrices], indexed by dataID - 1
+//  EntryRecord[num_obj_entries + num_cons_entries], objective entries first
+//
+//Every array and table starts at a multiple of cache_alignment, and all offsets are from the start of the file.
+namespace {
+    constexpr char cache_magic[8] = {'T', 'R', 'O', 'T', 'S', 'B', 'C', '\0'};
+    constexpr uint32_t cache_version = 1;
+    constexpr uint32_t byte_order_mark = 0x01020304;
+    constexpr uint64_t cache_alignment = 64;
+
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        int32_t num_vars;
+        int32_t num_matrices;
+        int32_t num_obj_entries;
+        int32_t num_cons_entries;
+        //Size and modification time of the .mat file the cache was written from
+        uint64_t source_size;
+        int64_t source_mtime;
+        uint64_t matrix_table_offset;
+        uint64_t entry_table_offset;
+        uint64_t jac_row_offsets_offset;
+        uint64_t jac_col_idxs_offset;
+        uint64_t file_size;
+    };
+
+    enum class MatrixKind : int32_t {
+        Empty, Sparse, Mean
+    };
+
+    struct MatrixRecord {
+        MatrixKind kind;
+        int32_t rows;
+        int32_t cols;
+        int32_t nnz;
+        //Only vals_offset is used for mean vectors
+        uint64_t vals_offset;
+        uint64_t col_idxs_offset;
+        uint64_t row_ptrs_offset;
+    };
+
+    struct EntryRecord {
+        TROTSEntryInfo info;
+        uint32_t name_len;
+        uint32_t num_params;
+        uint32_t num_grad_idxs;
+        uint32_t padding;
+        uint64_t name_offset;
+        uint64_t params_offset;
+        uint64_t grad_idxs_offset;
+    };
+
+    static_assert(std::is_trivially_copyable_v<CacheHeader>);
+    static_assert(std::is_trivially_copyable_v<MatrixRecord>);
+    static_assert(std::is_trivially_copyable_v<EntryRecord>);
+
+    int64_t get_mtime(const fs::path& path) {
+        return static_cast<int64_t>(fs::last_write_time(path).time_since_epoch().count());
+    }
+
+    class CacheWriter {
+    public:
+        explicit CacheWriter(const fs::path& path) : out{path, std::ios::binary | std::ios::out | std::ios::trunc} {
+            if (!this->out)
+                throw std::runtime_error("Could not open " + path.string() + " for writing\n");
+        }
+
+        //Writes count elements at the next aligned position, and returns the offset of the first one.
+        template <typename T>
+        uint64_t write_array(const T* data, size_t count) {
+            static_assert(std::is_trivially_copyable_v<T>);
+            this->align();
+            const uint64_t offset = this->position;
+            this->out.write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+            this->position += sizeof(T) * count;
+            return offset;
+        }
+
+        void write_header(const CacheHeader& header) {
+            this->out.seekp(0);
+            this->out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+
+        uint64_t size() const noexcept { return this->position; }
+        bool good() const { return this->out.good(); }
+    private:
+        void align() {
+            static const char zeros[cache_alignment] = {};
+            const uint64_t padding = (cache_alignment - this->position % cache_alignment) % cache_alignment;
+            this->out.write(zeros, padding);
+            this->position += padding;
+        }
+
+        std::ofstream out;
+        uint64_t position = 0;
+    };
+
+    //Read-only view of a whole file mapped into memory. The mapping is private and writable, since MKL takes
+    //the matrix arrays as non-const pointers, but nothing is ever written to it.
+    class MappedFile {
+    public:
+        explicit MappedFile(const fs::path& path) : path{path} {
+            const int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("Could not open problem cache " + path.string() + "\n");
+
+            struct stat file_stat;
+            if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(CacheHeader))) {
+                close(fd);
+                throw std::runtime_error("Problem cache " + path.string() + " is truncated\n");
+            }
+            this->size = static_cast<size_t>(file_stat.st_size);
+            void* addr = mmap(nullptr, this->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED)
+                throw std::runtime_error("Could not map problem cache " + path.string() + "\n");
+            this->data = static_cast<const char*>(addr);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            munmap(const_cast<char*>(this->data), this->size);
+        }
+
+        //Returns the array of count elements at offset, after checking that it is inside the file and aligned.
+        template <typename T>
+        const T* array_at(uint64_t offset, uint64_t count) const {
+            if (offset % alignof(T) != 0 || offset > this->size || count > (this->size - offset) / sizeof(T))
+                throw std::runtime_error("Problem cache " + this->path.string() + " is corrupt\n");
+            return reinterpret_cast<const T*>(this->data + offset);
+        }
+
+    private:
+        fs::path path;
+        const char* data = nullptr;
+        size_t size = 0;
+    };
+
+    const CacheHeader& read_header(const MappedFile& file, const fs::path& path) {
+        const CacheHeader& header = *file.array_at<CacheHeader>(0, 1);
+        if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0)
+            throw std::runtime_error(path.string() + " is not a TROTS problem cache\n");
+        if (header.version != cache_version || header.byte_order != byte_order_mark)
+            throw std::runtime_error("Problem cache " + path.string() + " was written by an incompatible version\n");
+        return header;
+    }
+
+    void write_entry(CacheWriter& writer, const TROTSEntry& entry, std::vector<EntryRecord>& records) {
+        EntryRecord record{};
+        record.info = entry.get_info();
+
+        const std::string name = entry.get_roi_name();
+        record.name_len = name.size();
+        record.name_offset = writer.write_array(name.data(), name.size());
+
+        const std::vector<double>& params = entry.get_func_params();
+        record.num_params = params.size();
+        record.params_offset = writer.write_array(params.data(), params.size());
+
+        const std::vector<int>& grad_idxs = entry.get_grad_nonzero_idxs();
+        record.num_grad_idxs = grad_idxs.size();
+        record.grad_idxs_offset = writer.write_array(grad_idxs.data(), grad_idxs.size());
+        records.push_back(record);
+    }
+}
+
+void TROTSProblem::write_cache(const fs::path& cache_path, const fs::path& source_path) const {
+    //Write to a temporary file that then replaces cache_path, so that a failed write never leaves a partial cache.
+    fs::path tmp_path = cache_path;
+    tmp_path += ".tmp";
+
+    CacheHeader header{};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.byte_order = byte_order_mark;
+    header.num_vars = this->num_vars;
+    header.num_matrices = this->matrices->size();
+    header.num_obj_entries = this->objective_entries.size();
+    header.num_cons_entries = this->constraint_entries.size();
+    header.source_size = fs::file_size(source_path);
+    header.source_mtime = get_mtime(source_path);
+
+    {
+        CacheWriter writer{tmp_path};
+        //Reserve the space of the header, it is written last when all offsets are known.
+        writer.write_array(&header, 1);
+
+        std::vector<MatrixRecord> matrix_records(this->matrices->size());
+        for (size_t i = 0; i < this->matrices->size(); ++i) {
+            MatrixRecord& record = matrix_records[i];
+            record.kind = MatrixKind::Empty;
+            if (const auto* vec = std::get_if<std::vector<double>>(&(*this->matrices)[i])) {
+                record.kind = MatrixKind::Mean;
+                record.rows = 1;
+                record.cols = vec->size();
+                record.nnz = vec->size();
+                record.vals_offset = writer.write_array(vec->data(), vec->size());
+            }
+            else if (const SparseMatrix<double>* mat = std::get<std::unique_ptr<SparseMatrix<double>>>((*this->matrices)[i]).get()) {
+                record.kind = MatrixKind::Sparse;
+                record.rows = mat->get_rows();
+                record.cols = mat->get_cols();
+                record.nnz = mat->get_nnz();
+                record.vals_offset = writer.write_array(mat->get_data_ptr(), record.nnz);
+                record.col_idxs_offset = writer.write_array(mat->get_col_inds(), record.nnz);
+                record.row_ptrs_offset = writer.write_array(mat->get_row_ptrs(), record.rows + 1);
+            }
+        }
+
+        std::vector<EntryRecord> entry_records;
+        entry_records.reserve(this->objective_entries.size() + this->constraint_entries.size());
+        for (const TROTSEntry& entry : this->objective_entries)
+            write_entry(writer, entry, entry_records);
+        for (const TROTSEntry& entry : this->constraint_entries)
+            write_entry(writer, entry, entry_records);
+
+        header.jac_row_offsets_offset = writer.write_array(this->jac_row_offsets.data(), this->jac_row_offsets.size());
+        header.jac_col_idxs_offset = writer.write_array(this->jac_col_idxs.data(), this->jac_col_idxs.size());
+        header.matrix_table_offset = writer.write_array(matrix_records.data(), matrix_records.size());
+        header.entry_table_offset = writer.write_array(entry_records.data(), entry_records.size());
+        header.file_size = writer.size();
+        writer.write_header(header);
+
+        if (!writer.good())
+            throw std::runtime_error("Failed to write problem cache " + tmp_path.string() + "\n");
+    }
+    fs::rename(tmp_path, cache_path);
+}
+
+TROTSProblem TROTSProblem::from_cache(const fs::path& cache_path) {
+    const auto file = std::make_shared<const MappedFile>(cache_path);
+    const CacheHeader& header = read_header(*file, cache_path);
+    //Catches truncated files before any of the tables are read
+    file->array_at<char>(0, header.file_size);
+
+    TROTSProblem problem;
+    problem.num_vars = header.num_vars;
+
+    const MatrixRecord* matrix_records = file->array_at<MatrixRecord>(header.matrix_table_offset, header.num_matrices);
+    problem.matrices->resize(header.num_matrices);
+    for (int i = 0; i < header.num_matrices; ++i) {
+        const MatrixRecord& record = matrix_records[i];
+        if (record.kind == MatrixKind::Mean) {
+            //Mean vectors have one element per variable, so copying them is cheap.
+            const double* vals = file->array_at<double>(record.vals_offset, record.cols);
+            (*problem.matrices)[i].emplace<std::vector<double>>(vals, vals + record.cols);
+        }
+        else if (record.kind == MatrixKind::Sparse) {
+            const double* vals = file->array_at<double>(record.vals_offset, record.nnz);
+            const int* col_idxs = file->array_at<int>(record.col_idxs_offset, record.nnz);
+            const int* row_ptrs = file->array_at<int>(record.row_ptrs_offset, record.rows + 1);
+#ifdef USE_MKL
+            (*problem.matrices)[i].emplace<std::unique_ptr<SparseMatrix<double>>>(
+                MKL_sparse_matrix<double>::from_mapped_CSR(record.nnz, record.rows, record.cols,
+                                                           vals, col_idxs, row_ptrs, file)
+            );
+#else
+            (*problem.matrices)[i].emplace<std::unique_ptr<SparseMatrix<double>>>(
+                EigenSparseMat<double>::from_mapped_CSR(record.nnz, record.rows, record.cols,
+                                                        vals, col_idxs, row_ptrs, file)
+            );
+#endif
+        }
+    }
+
+    const int num_entries = header.num_obj_entries + header.num_cons_entries;
+    const EntryRecord* entry_records = file->array_at<EntryRecord>(header.entry_table_offset, num_entries);
+    for (int i = 0; i < num_entries; ++i) {
+        const EntryRecord& record = entry_records[i];
+        if (record.info.id < 1 || record.info.id > header.num_matrices)
+            throw std::runtime_error("Problem cache " + cache_path.string() + " is corrupt\n");
+
+        const char* name = file->array_at<char>(record.name_offset, record.name_len);
+        const double* params = file->array_at<double>(record.params_offset, record.num_params);
+        const int* grad_idxs = file->array_at<int>(record.grad_idxs_offset, record.num_grad_idxs);
+        TROTSEntry entry{record.info,
+                         std::string(name, record.name_len),
+                         std::vector<double>(params, params + record.num_params),
+                         std::vector<int>(grad_idxs, grad_idxs + record.num_grad_idxs),
+                         *problem.matrices};
+        if (i < header.num_obj_entries)
+            problem.objective_entries.push_back(std::move(entry));
+        else
+            problem.constraint_entries.push_back(std::move(entry));
+    }
+
+    const int* jac_row_offsets = file->array_at<int>(header.jac_row_offsets_offset, header.num_cons_entries + 1);
+    problem.jac_row_offsets.assign(jac_row_offsets, jac_row_offsets + header.num_cons_entries + 1);
+    const int* jac_col_idxs = file->array_at<int>(header.jac_col_idxs_offset, problem.jac_row_offsets.back());
+    problem.jac_col_idxs.assign(jac_col_idxs, jac_col_idxs + problem.jac_row_offsets.back());
+
+    problem.grad_workspace.resize(problem.num_vars);
+    return problem;
+}
+
+bool TROTSProblem::cache_is_current(const fs::path& cache_path, const fs::path& source_path) {
+    std::ifstream infile(cache_path, std::ios::binary);
+    CacheHeader header{};
+    if (!infile.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+
+    return std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0
+           && header.version == cache_version
+           && header.byte_order == byte_order_mark
+           && header.source_size == fs::file_size(source_path)
+           && header.source_mtime == get_mtime(source_path);
+}
+
+TROTSProblem load_trots_problem(const fs::path& mat_path, const fs::path& cache_path) {
+    if (cache_path.empty())
+        return TROTSProblem{TROTSMatFileData{mat_path}};
+
+    if (TROTSProblem::cache_is_current(cache_path, mat_path)) {
+        std::cerr << "Reading problem from cache " << cache_path << "\n";
+        return TROTSProblem::from_cache(cache_path);
+    }
+
+    TROTSProblem problem{TROTSMatFileData{mat_path}};
+    std::cerr << "Writing problem cache " << cache_path << "\n";
+    problem.write_cache(cache_path, mat_path);
+    return problem;
+}
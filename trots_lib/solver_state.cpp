@@ -0,0 +1,33 @@
+#include "solver_state.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#include "util.h"
+
+namespace fs = std::filesystem;
+
+void SolverState::save(const fs::path& path) const {
+    fs::path tmp_path = path;
+    tmp_path += ".tmp";
+    dump_vector_to_file(this->x, tmp_path);
+    dump_vector_to_file(this->z_l, tmp_path, true);
+    dump_vector_to_file(this->z_u, tmp_path, true);
+    dump_vector_to_file(this->lambda, tmp_path, true);
+    fs::rename(tmp_path, path);
+}
+
+SolverState SolverState::load(const fs::path& path) {
+    std::ifstream infile(path, std::ios::binary);
+    if (!infile)
+        throw std::runtime_error("Could not open solver state file " + path.string() + "\n");
+
+    SolverState state;
+    state.x = read_vector_from_stream<double>(infile);
+    state.z_l = read_vector_from_stream<double>(infile);
+    state.z_u = read_vector_from_stream<double>(infile);
+    state.lambda = read_vector_from_stream<double>(infile);
+    if (!infile)
+        throw std::runtime_error("Solver state file " + path.string() + " is truncated\n");
+    return state;
+}
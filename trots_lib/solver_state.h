@@ -0,0 +1,41 @@
+#ifndef SOLVER_STATE_H
+#define SOLVER_STATE_H
+
+#include <filesystem>
+#include <vector>
+
+//Primal-dual state of a solve: the variables x, the multipliers z_l and z_u of the variable bounds,
+//and the constraint multipliers lambda (in the order of TROTSProblem::constraint_entries).
+//Saved as four consecutive vectors in the format of dump_vector_to_file, so the first record of a state file
+//can be read by anything that reads the plain solution files.
+struct SolverState {
+    std::vector<double> x;
+    std::vector<double> z_l;
+    std::vector<double> z_u;
+    std::vector<double> lambda;
+
+    //Checks that the state belongs to a problem with n variables and m constraints.
+    bool matches(int n, int m) const noexcept {
+        return static_cast<int>(this->x.size()) == n
+               && static_cast<int>(this->z_l.size()) == n
+               && static_cast<int>(this->z_u.size()) == n
+               && static_cast<int>(this->lambda.size()) == m;
+    }
+
+    //Writes to a temporary file that then replaces path, so that a crash never leaves a partial checkpoint.
+    void save(const std::filesystem::path& path) const;
+    static SolverState load(const std::filesystem::path& path);
+};
+
+//Where a driver writes its results, and how often it checkpoints.
+struct SolverOutputPaths {
+    //Final x only (the historical output format of the drivers).
+    std::filesystem::path solution_path;
+    //Final primal-dual state, not written if empty.
+    std::filesystem::path state_path;
+    //Primal-dual state every checkpoint_interval iterations, not written if empty.
+    std::filesystem::path checkpoint_path;
+    int checkpoint_interval = 0;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "starting_point.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+
+double calc_LTCP_scale_factor(const std::vector<TROTSEntry>& entries, const double* x, double max_val) {
+    double scale = 1.0;
+    for (const TROTSEntry& entry : entries) {
+        if (entry.function_type() != FunctionType::LTCP)
+            continue;
+        const double entry_scale = entry.calc_LTCP_scale(x, max_val);
+        //Voxels without dose put a floor under the LTCP value, which may be above max_val
+        if (!std::isfinite(entry_scale)) {
+            std::cerr << "LTCP objective for " << entry.get_roi_name() << " cannot be scaled below " << max_val << "\n";
+            continue;
+        }
+        scale = std::max(scale, entry_scale);
+    }
+    return scale;
+}
+
+void projected_gradient_warmup(int n, double* x, int num_iters,
+                               const std::function<double(const double*)>& obj,
+                               const std::function<void(const double*, double*)>& grad) {
+    constexpr double armijo_c = 1e-4;
+    constexpr int max_backtracks = 30;
+
+    std::vector<double> g(n), x_trial(n), g_trial(n);
+    double f = obj(x);
+    grad(x, &g[0]);
+
+    //Without curvature information for the first step, move a hundredth of the length of x.
+    const double x_norm = std::sqrt(std::inner_product(x, x + n, x, 0.0));
+    const double g_norm = std::sqrt(std::inner_product(g.cbegin(), g.cend(), g.cbegin(), 0.0));
+    if (g_norm == 0.0)
+        return;
+    double step = 0.01 * std::max(x_norm, 1.0) / g_norm;
+
+    for (int iter = 0; iter < num_iters; ++iter) {
+        double f_trial = f;
+        bool accepted = false;
+        for (int backtrack = 0; backtrack < max_backtracks; ++backtrack) {
+            double decrease = 0.0;
+            for (int i = 0; i < n; ++i) {
+                x_trial[i] = std::max(x[i] - step * g[i], 0.0);
+                decrease += g[i] * (x_trial[i] - x[i]);
+            }
+            f_trial = obj(&x_trial[0]);
+            if (f_trial <= f + armijo_c * decrease) {
+                accepted = true;
+                break;
+            }
+            step *= 0.5;
+        }
+        if (!accepted)
+            break;
+
+        grad(&x_trial[0], &g_trial[0]);
+        //Barzilai-Borwein step: s^T s / s^T y
+        double s_dot_s = 0.0;
+        double s_dot_y = 0.0;
+        for (int i = 0; i < n; ++i) {
+            const double s_i = x_trial[i] - x[i];
+            s_dot_s += s_i * s_i;
+            s_dot_y += s_i * (g_trial[i] - g[i]);
+        }
+        std::copy(x_trial.cbegin(), x_trial.cend(), x);
+        std::swap(g, g_trial);
+        std::cout << "Warm-up iteration " << iter << ": objective " << f << " -> " << f_trial << "\n";
+        f = f_trial;
+        if (s_dot_s == 0.0)
+            break;
+        if (s_dot_y > 0.0)
+            step = s_dot_s / s_dot_y;
+    }
+}
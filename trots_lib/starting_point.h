@@ -0,0 +1,23 @@
+#ifndef STARTING_POINT_H
+#define STARTING_POINT_H
+
+#include <functional>
+#include <vector>
+
+#include "TROTSEntry.h"
+
+//Factor s >= 1 such that all LTCP entries in entries have a value of at most max_val at s * x.
+//Needs a single dose evaluation per LTCP entry, other entries are ignored.
+//This is the "simple" initialization strategy described in https://doi.org/10.1007/s10589-017-9919-4,
+//solved for directly instead of scaling x up step by step.
+double calc_LTCP_scale_factor(const std::vector<TROTSEntry>& entries, const double* x, double max_val);
+
+//A few iterations of projected gradient descent on the objective over x >= 0,
+//with Barzilai-Borwein step lengths and Armijo backtracking. Meant to move a heuristic starting point
+//to a better scaled region before handing it to the actual solver, not to solve the problem.
+//obj evaluates the objective, grad its gradient. The function always evaluates obj before grad at the same point.
+void projected_gradient_warmup(int n, double* x, int num_iters,
+                               const std::function<double(const double*)>& obj,
+                               const std::function<void(const double*, double*)>& grad);
+
+#endif
@@ -0,0 +1,178 @@
+#include "telemetry.h"
+
+#include <cmath>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "trots.h"
+
+namespace {
+    const char* callback_names[] = {"eval_f", "eval_grad_f", "eval_g", "eval_jac_g", "eval_h"};
+
+    double gb_per_s(const EntryStats& stats) {
+        return stats.spmv_seconds > 0.0 ? stats.spmv_bytes / stats.spmv_seconds * 1e-9 : 0.0;
+    }
+
+    std::string csv_quote(const std::string& str) {
+        std::string quoted = "\"";
+        for (char c : str) {
+            if (c == '"')
+                quoted += '"';
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
+    std::string json_quote(const std::string& str) {
+        std::string quoted = "\"";
+        for (char c : str) {
+            if (c == '"' || c == '\\')
+                quoted += '\\';
+            if (static_cast<unsigned char>(c) < 0x20)
+                continue;
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+
+    //JSON has no inf or nan, write those as null
+    std::string json_number(double val) {
+        if (!std::isfinite(val))
+            return "null";
+        std::ostringstream str;
+        str << val;
+        return str.str();
+    }
+
+    //Weighted objective value per function type
+    std::map<std::string, double> objective_by_type(const std::vector<EntryTelemetry>& entries) {
+        std::map<std::string, double> sums;
+        for (const EntryTelemetry& entry : entries) {
+            if (!entry.is_constraint)
+                sums[function_type_name(entry.type)] += entry.weight * entry.stats.last_value;
+        }
+        return sums;
+    }
+}
+
+EntryTelemetry make_entry_telemetry(const TROTSEntry& entry, const EntryStats& stats) {
+    return EntryTelemetry{entry.get_roi_name(), entry.function_type(), entry.is_constraint(),
+                          entry.get_id(), entry.get_weight(), stats};
+}
+
+std::vector<EntryTelemetry> collect_entry_telemetry(const TROTSProblem& problem) {
+    std::vector<EntryTelemetry> entries;
+    entries.reserve(problem.objective_entries.size() + problem.constraint_entries.size());
+    for (const auto* group : {&problem.objective_entries, &problem.constraint_entries}) {
+        for (const TROTSEntry& entry : *group) {
+            entries.push_back(make_entry_telemetry(entry, entry.get_stats()));
+            entry.reset_stats();
+        }
+    }
+    return entries;
+}
+
+Telemetry::Telemetry(const std::filesystem::path& path) :
+    out{path},
+    json{path.extension() == ".jsonl" || path.extension() == ".json"},
+    start_time{std::chrono::steady_clock::now()},
+    last_iter_time{start_time}
+{
+    if (!this->out)
+        throw std::runtime_error("Could not open telemetry file " + path.string() + "\n");
+    if (!this->json)
+        this->out << "iter,wall_time,record,name,function_type,data_id,value,calls,cache_hits,seconds,gb_per_s,eval_seconds\n";
+}
+
+void Telemetry::record_callback(TelemetryCallback callback, double seconds, bool dose_cache_hit) {
+    CallbackStats& stats = this->callbacks[static_cast<int>(callback)];
+    ++stats.calls;
+    stats.cache_hits += dose_cache_hit;
+    stats.seconds += seconds;
+}
+
+void Telemetry::write_iteration(int iter, double obj_value, double inf_pr, double inf_du, double mu,
+                                const std::vector<EntryTelemetry>& entries) {
+    const auto now = std::chrono::steady_clock::now();
+    const double elapsed = std::chrono::duration<double>(now - this->start_time).count();
+    const double iter_seconds = std::chrono::duration<double>(now - this->last_iter_time).count();
+    this->last_iter_time = now;
+
+    if (this->json)
+        this->write_json_iteration(iter, elapsed, iter_seconds, obj_value, inf_pr, inf_du, mu, entries);
+    else
+        this->write_csv_iteration(iter, elapsed, iter_seconds, obj_value, inf_pr, inf_du, mu, entries);
+    //Flush every iteration so that the data of an aborted run is still there.
+    this->out.flush();
+    this->callbacks.fill(CallbackStats{});
+}
+
+void Telemetry::write_csv_iteration(int iter, double elapsed, double iter_seconds,
+                                    double obj_value, double inf_pr, double inf_du, double mu,
+                                    const std::vector<EntryTelemetry>& entries) {
+    const auto prefix = [&](const char* record) -> std::ostream& {
+        return this->out << iter << "," << elapsed << "," << record << ",";
+    };
+    const std::pair<const char*, double> iter_vals[] = {
+        {"objective", obj_value}, {"inf_pr", inf_pr}, {"inf_du", inf_du},
+        {"mu", mu}, {"iteration_seconds", iter_seconds}
+    };
+    for (const auto& [name, val] : iter_vals)
+        prefix("iteration") << name << ",,," << val << ",,,,,\n";
+
+    for (int i = 0; i < static_cast<int>(this->callbacks.size()); ++i) {
+        const CallbackStats& stats = this->callbacks[i];
+        prefix("callback") << callback_names[i] << ",,,," << stats.calls << ","
+                           << stats.cache_hits << "," << stats.seconds << ",,\n";
+    }
+
+    for (const EntryTelemetry& entry : entries) {
+        prefix(entry.is_constraint ? "constraint" : "objective")
+            << csv_quote(entry.roi_name) << "," << function_type_name(entry.type) << ","
+            << entry.data_id << "," << entry.stats.last_value << "," << entry.stats.spmv_count << ","
+            << entry.stats.dose_cache_hits << "," << entry.stats.spmv_seconds << ","
+            << gb_per_s(entry.stats) << "," << entry.stats.eval_seconds << "\n";
+    }
+
+    for (const auto& [type, val] : objective_by_type(entries))
+        prefix("objective_by_type") << type << "," << type << ",," << val << ",,,,,\n";
+}
+
+void Telemetry::write_json_iteration(int iter, double elapsed, double iter_seconds,
+                                     double obj_value, double inf_pr, double inf_du, double mu,
+                                     const std::vector<EntryTelemetry>& entries) {
+    this->out << "{\"iter\":" << iter << ",\"wall_time\":" << json_number(elapsed)
+              << ",\"iteration_seconds\":" << json_number(iter_seconds) << ",\"objective\":" << json_number(obj_value)
+              << ",\"inf_pr\":" << json_number(inf_pr) << ",\"inf_du\":" << json_number(inf_du)
+              << ",\"mu\":" << json_number(mu);
+
+    this->out << ",\"callbacks\":{";
+    for (int i = 0; i < static_cast<int>(this->callbacks.size()); ++i) {
+        const CallbackStats& stats = this->callbacks[i];
+        this->out << (i > 0 ? "," : "") << "\"" << callback_names[i] << "\":{\"calls\":" << stats.calls
+                  << ",\"cache_hits\":" << stats.cache_hits << ",\"seconds\":" << json_number(stats.seconds) << "}";
+    }
+
+    this->out << "},\"entries\":[";
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const EntryTelemetry& entry = entries[i];
+        this->out << (i > 0 ? "," : "") << "{\"roi\":" << json_quote(entry.roi_name)
+                  << ",\"type\":\"" << function_type_name(entry.type) << "\""
+                  << ",\"constraint\":" << (entry.is_constraint ? "true" : "false")
+                  << ",\"data_id\":" << entry.data_id << ",\"weight\":" << json_number(entry.weight)
+                  << ",\"value\":" << json_number(entry.stats.last_value) << ",\"spmv\":" << entry.stats.spmv_count
+                  << ",\"cache_hits\":" << entry.stats.dose_cache_hits
+                  << ",\"spmv_seconds\":" << json_number(entry.stats.spmv_seconds)
+                  << ",\"gb_per_s\":" << json_number(gb_per_s(entry.stats))
+                  << ",\"eval_seconds\":" << json_number(entry.stats.eval_seconds) << "}";
+    }
+
+    this->out << "],\"objective_by_type\":{";
+    bool first = true;
+    for (const auto& [type, val] : objective_by_type(entries)) {
+        this->out << (first ? "" : ",") << "\"" << type << "\":" << json_number(val);
+        first = false;
+    }
+    this->out << "}}\n";
+}
@@ -0,0 +1,90 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "TROTSEntry.h"
+
+class TROTSProblem;
+
+//The solver callbacks that are timed.
+enum class TelemetryCallback {
+    EvalF, EvalGradF, EvalG, EvalJacG, EvalH,
+    NumCallbacks
+};
+
+//The statistics of an entry together with what is needed to identify it in the output.
+struct EntryTelemetry {
+    std::string roi_name;
+    FunctionType type;
+    bool is_constraint;
+    int data_id;
+    double weight;
+    EntryStats stats;
+};
+
+//Describes entry with statistics that may have been collected elsewhere, e.g. on another MPI rank.
+EntryTelemetry make_entry_telemetry(const TROTSEntry& entry, const EntryStats& stats);
+//Statistics of all entries of problem, objectives first, and resets the counters of the entries.
+std::vector<EntryTelemetry> collect_entry_telemetry(const TROTSProblem& problem);
+
+//Per-iteration performance data of a solve: time spent in each callback, sparse products and their
+//throughput per entry, dose cache hits, and the value of each entry at the last point it was evaluated.
+//One record is written per call of write_iteration, as JSON lines if the file extension is .jsonl or .json,
+//and as CSV in long format (one row per quantity) otherwise.
+class Telemetry {
+public:
+    explicit Telemetry(const std::filesystem::path& path);
+
+    void record_callback(TelemetryCallback callback, double seconds, bool dose_cache_hit);
+    //Writes the record for iteration iter and resets the callback counters.
+    void write_iteration(int iter, double obj_value, double inf_pr, double inf_du, double mu,
+                         const std::vector<EntryTelemetry>& entries);
+private:
+    struct CallbackStats {
+        long long calls = 0;
+        long long cache_hits = 0;
+        double seconds = 0.0;
+    };
+
+    void write_csv_iteration(int iter, double elapsed, double iter_seconds,
+                             double obj_value, double inf_pr, double inf_du, double mu,
+                             const std::vector<EntryTelemetry>& entries);
+    void write_json_iteration(int iter, double elapsed, double iter_seconds,
+                              double obj_value, double inf_pr, double inf_du, double mu,
+                              const std::vector<EntryTelemetry>& entries);
+
+    std::ofstream out;
+    bool json;
+    std::array<CallbackStats, static_cast<int>(TelemetryCallback::NumCallbacks)> callbacks;
+    std::chrono::steady_clock::time_point start_time;
+    std::chrono::steady_clock::time_point last_iter_time;
+};
+
+//Adds the time from construction to destruction to the given callback. Does nothing if telemetry is nullptr.
+class CallbackTimer {
+public:
+    CallbackTimer(Telemetry* telemetry, TelemetryCallback callback, bool dose_cache_hit) :
+        telemetry{telemetry}, callback{callback}, dose_cache_hit{dose_cache_hit},
+        start{std::chrono::steady_clock::now()} {}
+    ~CallbackTimer() {
+        if (this->telemetry == nullptr)
+            return;
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->start;
+        this->telemetry->record_callback(this->callback, elapsed.count(), this->dose_cache_hit);
+    }
+    CallbackTimer(const CallbackTimer&) = delete;
+    CallbackTimer& operator=(const CallbackTimer&) = delete;
+private:
+    Telemetry* telemetry;
+    TelemetryCallback callback;
+    bool dose_cache_hit;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <exception>
 #include <iostream>
 #include <memory>
 #include <map>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
+#include "bounded_queue.h"
 #include "trots.h"
 #include "util.h"
 
@@ -16,101 +21,120 @@
 
 
 namespace {
-    std::vector<double> get_mean_vector(matvar_t* matrix_entry) {
-        matvar_t* matrix_data_var = Mat_VarGetStructFieldByName(matrix_entry, "A", 0);
-        check_null(matrix_data_var, "Could not read matrix A from struct.\n");
-
-        size_t num_cols = matrix_data_var->dims[1];
-        std::vector<double> A(num_cols);
-
-        if (matrix_data_var->dims[0] != 1) {
-            if (matrix_data_var->class_type == MAT_C_SPARSE) {
-                assert(matrix_data_var->data_type == MAT_T_DOUBLE);
-                const mat_sparse_t* sparse_m_data = static_cast<mat_sparse_t*>(matrix_data_var->data);
-                const double* data_ptr = static_cast<double*>(sparse_m_data->data);
-                for (int col = 0; col < num_cols; ++col) {
-                    for (uint32_t idx = sparse_m_data->jc[col]; idx < sparse_m_data->jc[col + 1]; ++idx) {
-                        A[col] += data_ptr[idx];
-                    }
-                }
-            }
-            else {
-                assert(matrix_data_var->data_type == MAT_T_SINGLE);
-                size_t num_rows = matrix_data_var->dims[0];
-                const float* data_ptr = static_cast<float*>(matrix_data_var->data);
-                for (size_t i = 0; i < num_rows * num_cols; ++i) {
-                    const size_t col = i / num_rows;
-                    A[col] += static_cast<double>(data_ptr[i]);
+    //Mean vectors hold the column sums of A, which for some cases are stored directly as a single row.
+    std::vector<double> get_mean_vector(const RawDoseMatrix& raw) {
+        std::vector<double> A(raw.cols);
+        if (raw.is_sparse) {
+            for (int col = 0; col < raw.cols; ++col) {
+                for (int idx = raw.col_ptrs[col]; idx < raw.col_ptrs[col + 1]; ++idx) {
+                    A[col] += raw.vals[idx];
                 }
             }
         }
         else {
-            assert(matrix_data_var->dims[0] == 1); //Should be a pure column vector
-
-            //The mean vectors are stored in single precision, for whatever reason.
-            assert(matrix_data_var->data_type == MAT_T_SINGLE);
-            float* data = static_cast<float*>(matrix_data_var->data);
-            std::transform(data, data + num_cols, A.begin(), [](const float x) { return static_cast<double>(x); });
+            const size_t num_rows = raw.rows;
+            for (size_t i = 0; i < raw.dense_vals.size(); ++i) {
+                const size_t col = i / num_rows;
+                A[col] += static_cast<double>(raw.dense_vals[i]);
+            }
         }
         return A;
     }
 
-    //Reads the Matlab sparse matrix stored at idx dataID - 1 and converts it to a CSR format and MKL sparse type.
-    std::unique_ptr<SparseMatrix<double>> read_and_cvt_sparse_mat(matvar_t* matrix_entry) {
-        matvar_t* matrix_data_var = Mat_VarGetStructFieldByName(matrix_entry, "A", 0);
-        check_null(matrix_data_var, "Could not read matrix A from struct.\n");
-        assert(matrix_data_var->class_type == MAT_C_SPARSE);
-        assert(matrix_data_var->data_type == MAT_T_DOUBLE);
+    //Converts the Matlab sparse matrix A of a matrix.data entry to a CSR format and MKL sparse type.
+    //The CSC to CSR conversion is split over num_threads threads.
+    std::unique_ptr<SparseMatrix<double>> read_and_cvt_sparse_mat(const RawDoseMatrix& raw, int num_threads) {
+        assert(raw.is_sparse);
+        const int nnz = static_cast<int>(raw.vals.size());
+
+#ifdef USE_MKL
+        return MKL_sparse_matrix<double>::from_CSC_mat(nnz, raw.rows, raw.cols,
+                                                       raw.vals.data(), raw.row_idxs.data(), raw.col_ptrs.data(),
+                                                       num_threads);
+#else
+        return EigenSparseMat<double>::from_CSC_mat(nnz, raw.rows, raw.cols,
+                                                    raw.vals.data(), raw.row_idxs.data(), raw.col_ptrs.data(),
+                                                    num_threads);
+#endif
+    }
 
-        mat_sparse_t* matlab_sparse_m = static_cast<mat_sparse_t*>(matrix_data_var->data);
-        const int nnz = static_cast<int>(matlab_sparse_m->ndata);
-        const int rows = static_cast<int>(matrix_data_var->dims[0]);
-        const int cols = static_cast<int>(matrix_data_var->dims[1]);
+    //Keeps the matrix a row block was cut from alive, together with the row pointers of the block
+    struct RowBlockOwner {
+        std::shared_ptr<const SparseMatrix<double>> parent;
+        std::vector<int> row_ptrs;
+    };
 
+    //A matrix using CSR arrays that belong to owner, without copying them
+    std::unique_ptr<SparseMatrix<double>> make_csr_view(int nnz, int rows, int cols, const double* vals,
+                                                        const int* col_idxs, const int* row_ptrs,
+                                                        std::shared_ptr<const void> owner) {
 #ifdef USE_MKL
-        return MKL_sparse_matrix<double>::from_CSC_mat(nnz, rows, cols,
-                                                       static_cast<double*>(matlab_sparse_m->data),
-                                                       matlab_sparse_m->ir,
-                                                       matlab_sparse_m->jc);
+        return MKL_sparse_matrix<double>::from_mapped_CSR(nnz, rows, cols, vals, col_idxs, row_ptrs, std::move(owner));
 #else
-        return EigenSparseMat<double>::from_CSC_mat(nnz, rows, cols,
-                                                    static_cast<double*>(matlab_sparse_m->data),
-                                                    matlab_sparse_m->ir,
-                                                    matlab_sparse_m->jc);
+        return EigenSparseMat<double>::from_mapped_CSR(nnz, rows, cols, vals, col_idxs, row_ptrs, std::move(owner));
 #endif
     }
 }
 
 
+HessianMode parse_hessian_mode(const std::string& str) {
+    if (str == "limited-memory")
+        return HessianMode::LimitedMemory;
+    if (str == "exact")
+        return HessianMode::Exact;
+    if (str == "gauss-newton")
+        return HessianMode::GaussNewton;
+    throw std::invalid_argument("Unknown Hessian mode: " + str + "\n");
+}
+
 TROTSProblem::TROTSProblem(TROTSMatFileData&& trots_data_) :
     trots_data{std::move(trots_data_)}
 {
     matvar_t* problem_struct = this->trots_data.problem_struct;
     size_t num_entries = problem_struct->dims[1];
 
-    this->read_dose_matrices();
+    //Scan the problem first, so that only the dose matrices referenced by active entries are loaded.
+    //The others are loaded on demand by get_mat_by_data_id.
+    std::vector<bool> entry_active(num_entries);
+    std::vector<int> active_data_ids;
+    for (int i = 0; i < num_entries; ++i) {
+        matvar_t* active_var = Mat_VarGetStructFieldByName(problem_struct, "Active", i);
+        check_null(active_var, "Could not read Active field from struct\n");
+        entry_active[i] = cast_from_double<bool>(active_var);
+        if (!entry_active[i])
+            continue;
+
+        matvar_t* id_var = Mat_VarGetStructFieldByName(problem_struct, "dataID", i);
+        check_null(id_var, "Could not read id field from struct\n");
+        active_data_ids.push_back(cast_from_double<int>(id_var));
+    }
+    std::sort(active_data_ids.begin(), active_data_ids.end());
+    active_data_ids.erase(std::unique(active_data_ids.begin(), active_data_ids.end()), active_data_ids.end());
+
+    const DoseDataReader& dose_data = *this->trots_data.dose_data;
+    this->matrices->resize(dose_data.get_num_matrices());
+    this->read_dose_matrices(active_data_ids);
 
     int stride[] = {0, 0};
     int edge[] = {1, 1};
-    this->nnz_jac_cons = 0;
     for (int i = 0; i < num_entries; ++i) {
+        if (!entry_active[i]) {
+            matvar_t* name_var = Mat_VarGetStructFieldByName(problem_struct, "Name", i);
+            check_null(name_var, "Cannot find name variable in problem entry.");
+            std::cout << "Entry: " << get_name_str(name_var) << " skipped\n";
+            continue;
+        }
+
         std::cerr << "Reading trots entry " << i << " of " << num_entries << "...\n";
         int start[] =  {0, i};
         matvar_t* struct_elem = Mat_VarGetStructs(problem_struct, start, stride, edge, 0);
-        const TROTSEntry entry{struct_elem, this->trots_data.matrix_struct, this->matrices};
+        const TROTSEntry entry{struct_elem, dose_data, *this->matrices};
         std::cerr << "TROTSEntry read!\n\n";
 
-        if (!entry.is_active()) {
-            std::cout << "Entry: " << entry.get_roi_name() << " skipped\n";
-            continue;
-        }
-
         if (entry.is_constraint()) {
             /*if (entry.function_type() != FunctionType::Mean)
                 continue;*/
             this->constraint_entries.push_back(entry);
-            auto vec = entry.get_grad_nonzero_idxs();
-            this->nnz_jac_cons += vec.size();
         } else {
             /*if (entry.function_type() != FunctionType::Mean)
                 continue;*/
@@ -118,50 +142,231 @@ TROTSProblem::TROTSProblem(TROTSMatFileData&& trots_data_) :
         }
     }
 
-    matvar_t* misc_struct = Mat_VarGetStructFieldByName(this->trots_data.data_struct, "misc", 0);
-    matvar_t* size_var = Mat_VarGetStructFieldByName(misc_struct, "size", 0);
-    this->num_vars = cast_from_double<int>(size_var);
+    this->num_vars = dose_data.get_num_vars();
+    this->grad_workspace.resize(this->num_vars);
+    this->build_jacobian_structure();
+    print_memory_usage("Memory use after loading the problem");
 }
 
-void TROTSProblem::read_dose_matrices() {
-    int stride[] = {0, 0};
-    int edge[] = {1, 1};
+TROTSProblem TROTSProblem::make_view() const {
+    TROTSProblem view;
+    view.matrices = this->matrices;
+    view.objective_entries = this->objective_entries;
+    view.constraint_entries = this->constraint_entries;
+    for (const TROTSEntry& entry : view.objective_entries)
+        entry.reset_stats();
+    for (const TROTSEntry& entry : view.constraint_entries)
+        entry.reset_stats();
+    view.num_vars = this->num_vars;
+    view.jac_row_offsets = this->jac_row_offsets;
+    view.jac_col_idxs = this->jac_col_idxs;
+    view.grad_workspace.resize(this->num_vars);
+    return view;
+}
 
-    size_t num_matrices = this->trots_data.matrix_struct->dims[1];
-    this->matrices.reserve(num_matrices);
-    for (int i = 0; i < num_matrices; ++i) {
-        std::cerr << "Reading dose matrix " << i + 1 << " of " << num_matrices << "...\n";
-        int start[] = {0, i};
-        matvar_t* matrix_entry = Mat_VarGetStructs(this->trots_data.matrix_struct, start, stride, edge, 1);
-        check_null(matrix_entry, "Failed to read entry " + std::to_string(i) + " from matrix.data\n");
-        matvar_t* A = Mat_VarGetStructFieldByName(matrix_entry, "A", 0);
-        check_null(A, "Failed to read A from entry " + std::to_string(i) + " in matrix.data\n");
-
-        matvar_t* name = Mat_VarGetStructFieldByName(matrix_entry, "Name", 0);
-        check_null(name, "Failed to read Name from entry " + std::to_string(i) + " in matrix.data\n");
-        std::string name_str = get_name_str(name);
-
-
-        //I have not found another more reliable way to determine if the function type is mean.
-        //Usually, functions that are supposed to be avg have "(mean)" in the dose matrix name
-        const bool is_mean = name_str.find("(mean)") != std::string::npos
-                             || A->dims[0] == 1;
-
-        auto& new_variant = this->matrices.emplace_back();
-        if (is_mean) {
-            new_variant.emplace<std::vector<double>>(
-                get_mean_vector(matrix_entry)
-            );
-        }
-        else {
-            new_variant.emplace<std::unique_ptr<SparseMatrix<double>>>(
-                read_and_cvt_sparse_mat(matrix_entry)
-            );
+void TROTSProblem::split_objective_rows(int entry_idx, int num_parts, int split_group) {
+    //Growing the store moves the mean vectors, and the slot of the matrix may be emptied below,
+    //so no view may hold pointers into it.
+    if (this->matrices.use_count() > 1)
+        throw std::runtime_error("Cannot split objective rows while views share the dose matrices\n");
+    const TROTSEntry entry = this->objective_entries[entry_idx];
+    //The blocks use the arrays of the matrix in place, so only the row pointers are read here. For a cached
+    //problem the pages of the matrix are then only read by the rank that evaluates each block.
+    std::shared_ptr<const SparseMatrix<double>> mat =
+        std::move(std::get<std::unique_ptr<SparseMatrix<double>>>(this->get_mat_by_data_id(entry.get_id())));
+    const int* row_ptrs = mat->get_row_ptrs();
+    const int* col_inds = mat->get_col_inds();
+    const double* vals = mat->get_data_ptr();
+    const int num_rows = mat->get_rows();
+    num_parts = std::max(1, std::min(num_parts, num_rows));
+
+    //Cut where the running nnz count crosses each multiple of nnz / num_parts, but leave at least one row
+    //for each of the parts after the cut, which the nnz alone does not if the last rows hold most of them.
+    std::vector<int> row_cuts{0};
+    for (int part = 1; part < num_parts; ++part) {
+        const long long target = static_cast<long long>(mat->get_nnz()) * part / num_parts;
+        const int* cut = std::lower_bound(row_ptrs + row_cuts.back(), row_ptrs + num_rows, target);
+        row_cuts.push_back(std::min(std::max(static_cast<int>(cut - row_ptrs), row_cuts.back() + 1),
+                                    num_rows - (num_parts - part)));
+    }
+    row_cuts.push_back(num_rows);
+
+    std::vector<TROTSEntry> parts;
+    for (int part = 0; part < num_parts; ++part) {
+        const int row_begin = row_cuts[part];
+        const int part_rows = row_cuts[part + 1] - row_begin;
+        const int offset = row_ptrs[row_begin];
+        const int part_nnz = row_ptrs[row_cuts[part + 1]] - offset;
+        auto owner = std::make_shared<RowBlockOwner>();
+        owner->parent = mat;
+        owner->row_ptrs.resize(part_rows + 1);
+        for (int row = 0; row <= part_rows; ++row)
+            owner->row_ptrs[row] = row_ptrs[row_begin + row] - offset;
+
+        auto block = make_csr_view(part_nnz, part_rows, mat->get_cols(), vals + offset, col_inds + offset,
+                                   owner->row_ptrs.data(), owner);
+        const int part_id = static_cast<int>(this->matrices->size()) + 1;
+        parts.push_back(entry.make_row_part(part_id, block.get(), row_begin, split_group));
+        this->matrices->emplace_back(std::move(block));
+    }
+
+    this->objective_entries[entry_idx] = std::move(parts[0]);
+    for (int part = 1; part < num_parts; ++part)
+        this->objective_entries.push_back(std::move(parts[part]));
+
+    //Other entries of the matrix get a view of it, which takes its slot in the store. Otherwise the slot stays
+    //null and the matrix is freed with the blocks.
+    //Growing the store may have moved the mean vectors, which the entries point to directly.
+    std::unique_ptr<SparseMatrix<double>> shared_view;
+    for (auto* entries : {&this->objective_entries, &this->constraint_entries}) {
+        for (TROTSEntry& other : *entries) {
+            if (other.function_type() == FunctionType::Mean) {
+                other.set_mean_vec_ptr(&std::get<std::vector<double>>((*this->matrices)[other.get_id() - 1]));
+            }
+            else if (other.get_id() == entry.get_id()) {
+                if (shared_view == nullptr) {
+                    shared_view = make_csr_view(mat->get_nnz(), num_rows, mat->get_cols(), vals, col_inds,
+                                                row_ptrs, mat);
+                }
+                other.set_matrix_ptr(shared_view.get());
+            }
         }
+    }
+    if (shared_view != nullptr)
+        (*this->matrices)[entry.get_id() - 1] = std::move(shared_view);
+}
 
-        //Avoid storing the matrix data twice.
-        Mat_VarFree(matrix_entry);
+void TROTSProblem::build_jacobian_structure() {
+    this->jac_row_offsets.resize(this->constraint_entries.size() + 1);
+    this->jac_row_offsets[0] = 0;
+    for (size_t i = 0; i < this->constraint_entries.size(); ++i) {
+        this->jac_row_offsets[i + 1] = this->jac_row_offsets[i] + this->constraint_entries[i].get_grad_nnz();
     }
+
+    this->jac_col_idxs.reserve(this->jac_row_offsets.back());
+    for (const TROTSEntry& entry : this->constraint_entries) {
+        const std::vector<int>& idxs = entry.get_grad_nonzero_idxs();
+        this->jac_col_idxs.insert(this->jac_col_idxs.end(), idxs.cbegin(), idxs.cend());
+    }
+}
+
+TROTSProblem::TROTSProblem(int num_vars_, DoseMatrixStore&& matrices_, std::vector<TROTSEntry> objective_entries_,
+                           std::vector<TROTSEntry> constraint_entries_) :
+    objective_entries{std::move(objective_entries_)},
+    constraint_entries{std::move(constraint_entries_)},
+    num_vars{num_vars_},
+    matrices{std::make_shared<DoseMatrixStore>(std::move(matrices_))}
+{
+    this->grad_workspace.resize(this->num_vars);
+    this->build_jacobian_structure();
+}
+
+bool TROTSProblem::constraint_is_upper_bound(int i) const {
+    //The quadratic penalties of Min and Max are zero when satisfied, and
+    //the values of the other types have the right-hand side subtracted.
+    const TROTSEntry& entry = this->constraint_entries[i];
+    return entry.is_minimisation() ||
+           entry.function_type() == FunctionType::Min ||
+           entry.function_type() == FunctionType::Max;
+}
+
+std::variant<std::unique_ptr<SparseMatrix<double>>, std::vector<double>>&
+TROTSProblem::get_mat_by_data_id(int data_id) {
+    auto& data = (*this->matrices)[data_id - 1];
+    const auto* mat = std::get_if<std::unique_ptr<SparseMatrix<double>>>(&data);
+    if (mat != nullptr && *mat == nullptr) {
+        if (this->trots_data.dose_data == nullptr)
+            throw std::runtime_error("Dose matrix " + std::to_string(data_id) + " was not loaded, and the problem"
+                                     " has no .mat file to load it from\n");
+        this->read_dose_matrices({data_id});
+    }
+    return data;
+}
+
+//The dose matrices are loaded as a pipeline: the calling thread is the only one that reads from the file, and
+//hands one matrix at a time to a pool of workers that do the conversions to the internal formats.
+//The results are placed at their index in matrices (dataID - 1), so the order of completion does not matter.
+//A source matrix is freed as soon as it is converted, and the queue between the stages is short,
+//so apart from the converted matrices at most about 2 * num_workers source matrices are in memory.
+void TROTSProblem::read_dose_matrices(const std::vector<int>& data_ids) {
+    struct LoadItem {
+        int idx;
+        RawDoseMatrix A;
+        bool is_mean;
+    };
+
+    const auto start_time = std::chrono::steady_clock::now();
+    const int num_matrices = static_cast<int>(data_ids.size());
+
+    const int num_hw_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    const int num_workers = std::max(1, std::min(num_hw_threads, num_matrices));
+    //Threads left over when there are fewer matrices than cores go to the conversion of each matrix.
+    const int threads_per_conversion = std::max(1, num_hw_threads / num_workers);
+
+    BoundedQueue<LoadItem> queue{static_cast<size_t>(num_workers)};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    const auto worker = [&]() {
+#ifdef USE_MKL
+        //mkl_sparse_optimize would otherwise start a full set of threads in every worker.
+        mkl_set_num_threads_local(threads_per_conversion);
+#endif
+        //item, and with it the source matrix, is destroyed at the end of each iteration
+        while (std::optional<LoadItem> item = queue.pop()) {
+            try {
+                auto& variant = (*this->matrices)[item->idx];
+                if (item->is_mean)
+                    variant.emplace<std::vector<double>>(get_mean_vector(item->A));
+                else
+                    variant.emplace<std::unique_ptr<SparseMatrix<double>>>(
+                        read_and_cvt_sparse_mat(item->A, threads_per_conversion));
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock{error_mutex};
+                if (!error)
+                    error = std::current_exception();
+                queue.close();
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(num_workers);
+    for (int t = 0; t < num_workers; ++t)
+        workers.emplace_back(worker);
+
+    DoseDataReader& dose_data = *this->trots_data.dose_data;
+    try {
+        for (const int data_id : data_ids) {
+            const int i = data_id - 1;
+            const std::string name_str = dose_data.get_matrix_name(i);
+            RawDoseMatrix A = dose_data.read_matrix(i);
+
+            //I have not found another more reliable way to determine if the function type is mean.
+            //Usually, functions that are supposed to be avg have "(mean)" in the dose matrix name
+            const bool is_mean = name_str.find("(mean)") != std::string::npos
+                                 || A.rows == 1;
+
+            //Fails only if a worker has closed the queue after an error.
+            if (!queue.push(LoadItem{i, std::move(A), is_mean}))
+                break;
+        }
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock{error_mutex};
+        if (!error)
+            error = std::current_exception();
+    }
+    queue.close();
+
+    for (std::thread& thread : workers)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cerr << "Read " << num_matrices << " of " << this->matrices->size() << " dose matrices in "
+              << elapsed.count() << " s using " << num_workers << " worker threads\n";
 }
 
 
@@ -175,7 +380,7 @@ double TROTSProblem::calc_objective(const double* x, bool cached_dose) const {
 
 void TROTSProblem::calc_obj_gradient(const double* x, double* y, bool cached_dose) const {
     std::fill(y, y + this->num_vars, 0.0);
-    std::vector<double> grad_tmp(this->num_vars);
+    std::vector<double>& grad_tmp = this->grad_workspace;
 
     for (const auto& entry : this->objective_entries) {
         entry.calc_gradient(x, &grad_tmp[0], cached_dose);
@@ -189,14 +394,9 @@ void TROTSProblem::calc_obj_gradient(const double* x, double* y, bool cached_dos
     }
 }
 void TROTSProblem::calc_jacobian_vals(const double* x, double* jacobian_vals, bool cached_dose) const {
-    int idx = 0;
-    for (const auto& constraint_entry : constraint_entries) {
-        std::vector<double> grad_vals =
-            constraint_entry.calc_sparse_grad(x, cached_dose);
-        for (double v : grad_vals) {
-            jacobian_vals[idx] = v;
-            ++idx;
-        }
+    for (size_t i = 0; i < this->constraint_entries.size(); ++i) {
+        this->constraint_entries[i].calc_sparse_grad(x, jacobian_vals + this->jac_row_offsets[i],
+                                                     &this->grad_workspace[0], cached_dose);
     }
 }
 
@@ -206,6 +406,16 @@ void TROTSProblem::calc_constraints(const double* x, double* cons_vals, bool cac
     }
 }
 
-
-
-
+void TROTSProblem::calc_dense_hessian(const double* x, double obj_factor, const double* lambda, double* hess_lower,
+                                      HessianMode mode, DoseCacheState cached_doses) const {
+    assert(mode != HessianMode::LimitedMemory);
+    const bool gauss_newton = mode == HessianMode::GaussNewton;
+    std::fill(hess_lower, hess_lower + this->get_nnz_hessian(), 0.0);
+
+    for (const auto& entry : this->objective_entries)
+        entry.add_dense_hessian(x, obj_factor * entry.get_weight(), hess_lower,
+                                gauss_newton, cached_doses.obj_doses_valid);
+    for (int i = 0; i < this->constraint_entries.size(); ++i)
+        this->constraint_entries[i].add_dense_hessian(x, lambda[i], hess_lower,
+                                                      gauss_newton, cached_doses.cons_doses_valid);
+}
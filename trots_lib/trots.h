@@ -2,6 +2,7 @@
 #define TROTS_H
 
 #include <cassert>
+#include <filesystem>
 #include <memory>
 #include <string>
 #include <variant>
@@ -15,47 +16,137 @@
 #include "SparseMat.h"
 #include "TROTSEntry.h"
 
+//Tracks whether the doses (A * x) held by the TROTSEntries of a problem belong to the current iterate.
+//IPOPT signals a new iterate through the new_x argument of its callbacks, so within one iterate
+//only the first evaluation of each group of entries needs to compute the doses, the rest pass cached_dose=true.
+struct DoseCacheState {
+    bool obj_doses_valid = false;
+    bool cons_doses_valid = false;
+
+    void invalidate() noexcept {
+        this->obj_doses_valid = false;
+        this->cons_doses_valid = false;
+    }
+};
+
+//How second order information is provided to the optimization solver.
+//LimitedMemory: the solver builds a quasi-Newton approximation from gradients only.
+//Exact: the exact Hessian of the Lagrangian, formed explicitly as a dense matrix.
+//GaussNewton: as Exact, but only with the positive semi-definite part of each term's voxel space Hessian
+//             (currently this drops the negative curvature of gEUD terms), so the objective part is always convex.
+enum class HessianMode {
+    LimitedMemory, Exact, GaussNewton
+};
+
+//Parses "limited-memory", "exact" or "gauss-newton". Throws std::invalid_argument otherwise.
+HessianMode parse_hessian_mode(const std::string& str);
 
 class TROTSProblem {
 public:
+    using DoseMatrixStore = std::vector<std::variant<std::unique_ptr<SparseMatrix<double>>, std::vector<double>>>;
+
     TROTSProblem() = default;
     TROTSProblem(TROTSMatFileData&& trots_data);
+    //A problem made of the given dose matrices (data id i at index i - 1) and entries, e.g. a small synthetic one.
+    //The entries are built with matrices as mat_refs, moving the store keeps the matrices and mean vectors in place.
+    TROTSProblem(int num_vars, DoseMatrixStore&& matrices, std::vector<TROTSEntry> objective_entries,
+                 std::vector<TROTSEntry> constraint_entries);
+
+    //Binary cache of the converted problem, see problem_cache.cpp for the format.
+    //source_path is the .mat file the problem was read from, its size and modification time
+    //are stored in the cache so that stale caches can be detected.
+    void write_cache(const std::filesystem::path& cache_path, const std::filesystem::path& source_path) const;
+    //Opens a cache without any parsing or conversion. The file is mapped into memory and the dose matrices
+    //are used in place, so their pages are only read from disk when first used.
+    static TROTSProblem from_cache(const std::filesystem::path& cache_path);
+    //Checks that the cache at cache_path exists and was written from the current version of source_path.
+    static bool cache_is_current(const std::filesystem::path& cache_path, const std::filesystem::path& source_path);
 
     //TODO: Make these private
     std::vector<TROTSEntry> objective_entries;
     std::vector<TROTSEntry> constraint_entries;
     int get_num_vars() const noexcept { return this->num_vars; }
-    int get_nnz_jac_cons() const noexcept { return this->nnz_jac_cons; }
+    int get_nnz_jac_cons() const noexcept { return this->jac_col_idxs.size(); }
+    //Sparsity structure of the constraint Jacobian in CSR form. The non-zeros of row i
+    //are at [jac_row_offsets[i], jac_row_offsets[i + 1]) in jac_col_idxs and in the value array.
+    const std::vector<int>& get_jac_row_offsets() const noexcept { return this->jac_row_offsets; }
+    const std::vector<int>& get_jac_col_idxs() const noexcept { return this->jac_col_idxs; }
+    int get_num_matrices() const noexcept { return this->matrices->size(); }
     int get_num_constraints() const noexcept {
         return this->constraint_entries.size();
     }
+    //Constraint i is satisfied when its value is <= 0 if this returns true, and when it is >= 0 otherwise.
+    bool constraint_is_upper_bound(int i) const;
     double calc_objective(const double* x, bool cached_dose=false) const;
     void calc_obj_gradient(const double* x, double* y, bool cached_dose=false) const;
     void calc_constraints(const double* x, double* cons_vals, bool cached_dose=false) const;
     void calc_jacobian_vals(const double* x, double* jacobian_vals, bool cached_dose=false) const;
-    std::variant<std::unique_ptr<SparseMatrix<double>>, std::vector<double>>&
-    get_mat_by_data_id(int data_id) {
-        return matrices[data_id - 1];
+
+    //Second order information for the Lagrangian obj_factor * f(x) + sum_j lambda_j * g_j(x).
+    //lambda may be nullptr if there are no constraints.
+    //Stores the lower triangle of the Lagrangian Hessian in hess_lower, packed row by row
+    //(element (i, j), j <= i at i * (i + 1) / 2 + j). hess_lower must hold get_nnz_hessian() elements.
+    void calc_dense_hessian(const double* x, double obj_factor, const double* lambda, double* hess_lower,
+                            HessianMode mode, DoseCacheState cached_doses = {}) const;
+    long long get_nnz_hessian() const noexcept {
+        return static_cast<long long>(this->num_vars) * (this->num_vars + 1) / 2;
     }
+    //Only the matrices referenced by active entries are loaded with the problem. This overload loads
+    //any other matrix on first access, the const overload holds a null matrix for those.
+    std::variant<std::unique_ptr<SparseMatrix<double>>, std::vector<double>>&
+    get_mat_by_data_id(int data_id);
     const std::variant<std::unique_ptr<SparseMatrix<double>>, std::vector<double>>&
     get_mat_by_data_id(int data_id) const {
-        return matrices[data_id - 1];
+        return (*this->matrices)[data_id - 1];
     }
+    //Drops this problem's reference to the dose matrices, which are freed once no view uses them either.
+    //The entries of this problem can no longer be evaluated after this.
     void clear_mat_data() {
-        this->matrices.clear();
+        for (auto* entries : {&this->objective_entries, &this->constraint_entries}) {
+            for (TROTSEntry& entry : *entries) {
+                entry.set_matrix_ptr(nullptr);
+                entry.set_mean_vec_ptr(nullptr);
+            }
+        }
+        this->matrices = std::make_shared<DoseMatrixStore>();
     }
 
+    //A problem that shares the dose matrices of this one, and has its own copy of everything else:
+    //the entries with their weights and right hand sides, and all evaluation workspaces.
+    //Views can be evaluated concurrently with each other and with this problem, since the matrices are only read.
+    //A view cannot load matrices on demand, so every matrix it needs has to be loaded before.
+    TROTSProblem make_view() const;
+
+    //Replaces objective entry_idx by num_parts row parts (see TROTSEntry::make_row_part) with about equal
+    //numbers of non-zeros. The row blocks are added to the dose matrices under new data ids. They use the arrays of
+    //the matrix of the entry without copies, which is freed once neither the blocks nor other entries use it.
+    //split_group is given to the parts of a gEUD entry.
+    //The first part takes the place of the entry, the others are appended to objective_entries.
+    //The slot of the entry's data id is left null, unless other entries use the same matrix, in which case it
+    //holds a view of the matrix. Throws std::runtime_error if views of this problem share the matrices.
+    void split_objective_rows(int entry_idx, int num_parts, int split_group);
+
 
 private:
-    void read_dose_matrices();
+    //Loads and converts the given dose matrices from the .mat file
+    void read_dose_matrices(const std::vector<int>& data_ids);
+    void build_jacobian_structure();
 
     int num_vars;
-    int nnz_jac_cons;
+    std::vector<int> jac_row_offsets;
+    std::vector<int> jac_col_idxs;
+    //Dense gradient of a single entry, shared by all entries when computing gradients and Jacobian values
+    mutable std::vector<double> grad_workspace;
     TROTSMatFileData trots_data;
     //List of matrix entries, indexed by dataID.
     //If the FunctionType is mean, the value is computed using a dot product with a dense vector,
     //In other cases, the dose is calculated using a dose deposition matrix.
-    std::vector<std::variant<std::unique_ptr<SparseMatrix<double>>, std::vector<double>>> matrices;
+    //Shared with the views of the problem, the entries hold pointers into it.
+    std::shared_ptr<DoseMatrixStore> matrices = std::make_shared<DoseMatrixStore>();
 };
 
+//Reads the TROTS problem in mat_path through the cache at cache_path: the cache is used if it is current,
+//otherwise the problem is converted from mat_path and the cache is (re)written. An empty cache_path disables the cache.
+TROTSProblem load_trots_problem(const std::filesystem::path& mat_path, const std::filesystem::path& cache_path);
+
 #endif
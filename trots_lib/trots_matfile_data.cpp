@@ -16,36 +16,36 @@ TROTSMatFileData::TROTSMatFileData(TROTSMatFileData&& other) {
     this->file_fp = other.file_fp;
     this->data_struct = other.data_struct;
     this->problem_struct = other.problem_struct;
-    this->matrix_struct = other.matrix_struct;
+    this->dose_data = std::move(other.dose_data);
 
     other.file_fp = NULL;
     other.data_struct = NULL;
     other.problem_struct = NULL;
-    other.matrix_struct = NULL;
 }
 
 TROTSMatFileData& TROTSMatFileData::operator=(TROTSMatFileData&& rhs) {
     if (this != &rhs) {
+        //The reader may refer to data_struct
+        this->dose_data.reset();
         Mat_Close(this->file_fp);
         Mat_VarFree(this->data_struct);
         Mat_VarFree(this->problem_struct);
-        Mat_VarFree(this->matrix_struct);
 
         this->file_fp = rhs.file_fp;
         this->data_struct = rhs.data_struct;
         this->problem_struct = rhs.problem_struct;
-        this->matrix_struct = rhs.matrix_struct;
+        this->dose_data = std::move(rhs.dose_data);
 
         rhs.file_fp = nullptr;
         rhs.data_struct = nullptr;
         rhs.problem_struct = nullptr;
-        rhs.matrix_struct = nullptr;
     }
 
     return *this;
 }
 
 TROTSMatFileData::~TROTSMatFileData() {
+    this->dose_data.reset();
     Mat_VarFree(this->data_struct);
     Mat_VarFree(this->problem_struct);
     Mat_Close(this->file_fp);
@@ -55,9 +55,15 @@ void TROTSMatFileData::init_problem_data_structs() {
     this->problem_struct = Mat_VarRead(this->file_fp, "problem");
     check_null(this->problem_struct, "Unable to read problem struct from matfile\n.");
 
+#ifdef TROTS_USE_HDF5
+    //Reading data with matio would pull every dose matrix into memory at once,
+    //version 7.3 files are instead read one matrix at a time with HDF5.
+    if (Mat_GetVersion(this->file_fp) == MAT_FT_MAT73) {
+        this->dose_data = make_hdf5_dose_data_reader(Mat_GetFilename(this->file_fp));
+        return;
+    }
+#endif
     this->data_struct = Mat_VarRead(this->file_fp, "data");
     check_null(this->data_struct, "Unable to read data variable from matfile\n");
-
-    this->matrix_struct = Mat_VarGetStructFieldByName(this->data_struct, "matrix", 0);
-    check_null(this->matrix_struct, "Unable to read matrix field from matfile\n");
+    this->dose_data = make_matio_dose_data_reader(this->data_struct);
 }
\ No newline at end of file
@@ -3,6 +3,9 @@
 
 #include <matio.h>
 #include <filesystem>
+#include <memory>
+
+#include "dose_data_reader.h"
 
 struct TROTSMatFileData {
 public:
@@ -18,8 +21,10 @@ public:
 
     mat_t* file_fp = nullptr;
     matvar_t* problem_struct = nullptr;
+    //Only read into memory for files before version 7.3, which are not HDF5 files.
     matvar_t* data_struct = nullptr;
-    matvar_t* matrix_struct = nullptr;
+    //Reads the dose matrices and the other parts of the data variable
+    std::unique_ptr<DoseDataReader> dose_data;
 private:
     void init_problem_data_structs();
 };
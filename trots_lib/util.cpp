@@ -1,7 +1,16 @@
 #include "util.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <sstream>
+
+#ifdef USE_MKL
+#include <mkl.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 std::string get_name_str(const matvar_t* name_var) {
     assert(name_var->rank == 2 && name_var->dims[0] == 1);
@@ -10,4 +19,73 @@ std::string get_name_str(const matvar_t* name_var) {
     std::memcpy(static_cast<void*>(&null_terminated_buffer[0]), name_var->data, name_len * sizeof(char));
     null_terminated_buffer[name_len] = '\0';
     return std::string(null_terminated_buffer);
-}
\ No newline at end of file
+}
+
+MemoryUsage get_memory_usage() {
+    MemoryUsage usage;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        //The lines look like "VmRSS:     123456 kB"
+        std::istringstream fields(line);
+        std::string key;
+        long long kb = 0;
+        fields >> key >> kb;
+        if (key == "VmRSS:")
+            usage.rss_bytes = kb * 1024;
+        else if (key == "VmHWM:")
+            usage.peak_rss_bytes = kb * 1024;
+    }
+    return usage;
+}
+
+void print_memory_usage(const std::string& label) {
+    const MemoryUsage usage = get_memory_usage();
+    constexpr double mib = 1024.0 * 1024.0;
+    std::cerr << label << ": " << usage.rss_bytes / mib << " MiB resident, peak "
+              << usage.peak_rss_bytes / mib << " MiB\n";
+}
+
+CommandLineArgs parse_command_line(int argc, char* argv[]) {
+    return parse_command_line(std::vector<std::string>(argv + std::min(argc, 1), argv + argc));
+}
+
+CommandLineArgs parse_command_line(const std::vector<std::string>& arg_strs) {
+    CommandLineArgs args;
+    for (const std::string& arg : arg_strs) {
+        if (arg.rfind("--", 0) != 0) {
+            args.positional.push_back(arg);
+            continue;
+        }
+        const size_t eq_pos = arg.find('=');
+        if (eq_pos == std::string::npos)
+            args.named[arg.substr(2)] = "yes";
+        else
+            args.named[arg.substr(2, eq_pos - 2)] = arg.substr(eq_pos + 1);
+    }
+    return args;
+}
+
+std::string CommandLineArgs::get(const std::string& name, const std::string& default_val) const {
+    auto it = this->named.find(name);
+    return it != this->named.end() ? it->second : default_val;
+}
+
+int CommandLineArgs::get_int(const std::string& name, int default_val) const {
+    auto it = this->named.find(name);
+    return it != this->named.end() ? std::stoi(it->second) : default_val;
+}
+
+double CommandLineArgs::get_double(const std::string& name, double default_val) const {
+    auto it = this->named.find(name);
+    return it != this->named.end() ? std::stod(it->second) : default_val;
+}
+
+void set_local_num_threads(int num_threads) {
+#ifdef USE_MKL
+    mkl_set_num_threads_local(num_threads);
+#endif
+#ifdef _OPENMP
+    omp_set_num_threads(num_threads);
+#endif
+}
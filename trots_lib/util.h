@@ -1,12 +1,16 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <string>
 #include <iostream>
 #include <vector>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 
 #include "matio.h"
 
@@ -37,27 +41,79 @@ void dump_vector_to_file(const std::vector<T>& vec, const std::string& path, boo
     outfile.write(reinterpret_cast<const char*>(vec.data()), sizeof(T) * sz);
 }
 
-//Takes a CSC-matrix triplet and returns a CSR-matrix triplet
-//Implementation basically same as the one used in SciPy.
-template <typename ValueType>
-std::tuple<ValueType*, int*, int*>
-csc_to_csr(int rows, int cols,
-           const ValueType* data,
-           const int* row_idxs,
-           const int* col_ptrs) {
+//Reads a vector in the format written by dump_vector_to_file.
+template <typename T>
+std::vector<T> read_vector_from_stream(std::istream& infile)
+{
+    size_t sz = 0;
+    infile.read(reinterpret_cast<char*>(&sz), sizeof(sz));
+    std::vector<T> vec(infile ? sz : 0);
+    infile.read(reinterpret_cast<char*>(vec.data()), sizeof(T) * vec.size());
+    return vec;
+}
 
-    //Allocate arrays for the new CSR-matrix
+//Returns idxs as an array of ints, which is idxs itself if IdxType is int and otherwise
+//a converted copy held in storage. Matlab stores sparse matrix indexes as unsigned types.
+template <typename IdxType>
+const int* as_int_idxs(const IdxType* idxs, size_t count, std::vector<int>& storage) {
+    if constexpr (std::is_same_v<IdxType, int>) {
+        return idxs;
+    } else {
+        //Assuming here that the narrowing cast to int32_t from things like uint32_t will fit.
+        storage.resize(count);
+        std::transform(idxs, idxs + count, storage.begin(), [](IdxType i) { return static_cast<int>(i); });
+        return storage.data();
+    }
+}
+
+//Converts a CSC-matrix triplet to a CSR-matrix triplet, written to the preallocated arrays
+//data_csr, col_idxs_csr (nnz elements each) and row_ptrs_csr (rows + 1 elements).
+//Implementation basically same as the one used in SciPy, except that the rows can be split over num_threads threads.
+//Every thread owns a block of rows of the output. The row indexes within each column are sorted (as in all
+//Matlab sparse matrices), so the part of a column that falls into a block is found by binary search.
+template <typename ValueType>
+void csc_to_csr(int rows, int cols,
+                const ValueType* data,
+                const int* row_idxs,
+                const int* col_ptrs,
+                ValueType* data_csr,
+                int* col_idxs_csr,
+                int* row_ptrs_csr,
+                int num_threads = 1) {
     const int nnz = static_cast<int>(col_ptrs[cols]);
-    ValueType* data_csr = new ValueType[nnz];
-    int* col_idxs_csr = new int[nnz];
-    int* row_ptrs_csr = new int[rows + 1];
 
-    std::fill(row_ptrs_csr, row_ptrs_csr + rows, 0);
+    //Not worth starting threads for small matrices
+    constexpr int min_nnz_per_thread = 1 << 18;
+    num_threads = std::max(1, std::min({num_threads, nnz / min_nnz_per_thread, rows}));
+
+    const auto col_range = [&](int col, int row_begin, int row_end) {
+        const int* first = row_idxs + col_ptrs[col];
+        const int* last = row_idxs + col_ptrs[col + 1];
+        if (num_threads == 1)
+            return std::make_pair(first, last);
+        first = std::lower_bound(first, last, row_begin);
+        return std::make_pair(first, std::lower_bound(first, last, row_end));
+    };
+    const auto run_row_blocks = [&](const auto& func) {
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_threads; ++t) {
+            threads.emplace_back(func, static_cast<int>(static_cast<long long>(rows) * t / num_threads),
+                                 static_cast<int>(static_cast<long long>(rows) * (t + 1) / num_threads));
+        }
+        func(0, static_cast<int>(static_cast<long long>(rows) / num_threads));
+        for (std::thread& thread : threads)
+            thread.join();
+    };
 
     //Compute the number of non-zeros per row, and store in row_ptrs_csr for now
-    for (int i = 0; i < nnz; ++i) {
-        row_ptrs_csr[row_idxs[i]]++;
-    }
+    run_row_blocks([&](int row_begin, int row_end) {
+        std::fill(row_ptrs_csr + row_begin, row_ptrs_csr + row_end, 0);
+        for (int col = 0; col < cols; ++col) {
+            const auto [first, last] = col_range(col, row_begin, row_end);
+            for (const int* it = first; it != last; ++it)
+                row_ptrs_csr[*it]++;
+        }
+    });
 
     int cumulative_sum = 0;
     //Compute the cumulative sum to get the actual row_ptr values
@@ -68,25 +124,36 @@ csc_to_csr(int rows, int cols,
     }
     row_ptrs_csr[rows] = nnz;
 
-    for (int col = 0; col < cols; ++col) {
-        for (int i = col_ptrs[col]; i < col_ptrs[col + 1]; ++i) {
-            const int row = row_idxs[i];
-            const int dest_idx = row_ptrs_csr[row];
-
-            col_idxs_csr[dest_idx] = col;
-            data_csr[dest_idx] = data[i];
-
-            row_ptrs_csr[row]++;
+    //Next free position in each row
+    std::vector<int> row_pos(row_ptrs_csr, row_ptrs_csr + rows);
+    run_row_blocks([&](int row_begin, int row_end) {
+        for (int col = 0; col < cols; ++col) {
+            const auto [first, last] = col_range(col, row_begin, row_end);
+            for (const int* it = first; it != last; ++it) {
+                const int dest_idx = row_pos[*it]++;
+                col_idxs_csr[dest_idx] = col;
+                data_csr[dest_idx] = data[it - row_idxs];
+            }
         }
-    }
+    });
+}
 
-    int last = 0;
-    for (int row = 0; row <= rows; ++row) {
-        const int tmp = row_ptrs_csr[row];
-        row_ptrs_csr[row] = last;
-        last = tmp;
-    }
+//Takes a CSC-matrix triplet and returns a newly allocated CSR-matrix triplet
+template <typename ValueType>
+std::tuple<ValueType*, int*, int*>
+csc_to_csr(int rows, int cols,
+           const ValueType* data,
+           const int* row_idxs,
+           const int* col_ptrs,
+           int num_threads = 1) {
 
+    //Allocate arrays for the new CSR-matrix
+    const int nnz = static_cast<int>(col_ptrs[cols]);
+    ValueType* data_csr = new ValueType[nnz];
+    int* col_idxs_csr = new int[nnz];
+    int* row_ptrs_csr = new int[rows + 1];
+
+    csc_to_csr(rows, cols, data, row_idxs, col_ptrs, data_csr, col_idxs_csr, row_ptrs_csr, num_threads);
     return std::make_tuple(data_csr, col_idxs_csr, row_ptrs_csr);
 }
 
@@ -106,4 +173,35 @@ void print_vector(const std::vector<T>& vec) {
 
 std::string get_name_str(const matvar_t* name_var);
 
+//Resident memory of the process and its high-water mark in bytes, from /proc/self/status.
+//Both are zero where that is not available.
+struct MemoryUsage {
+    long long rss_bytes = 0;
+    long long peak_rss_bytes = 0;
+};
+
+MemoryUsage get_memory_usage();
+//Prints the current and peak resident memory to std::cerr, prefixed by label.
+void print_memory_usage(const std::string& label);
+
+//Limits the threads used by the sparse products and entry evaluations started from the calling thread,
+//so that concurrent solves can share the cores. The Eigen backend keeps its own global thread count.
+void set_local_num_threads(int num_threads);
+
+//Command line arguments of the drivers: positional arguments, followed by any number of named
+//options given as "--name=value". An option given as just "--name" has the value "yes".
+struct CommandLineArgs {
+    std::vector<std::string> positional;
+    std::unordered_map<std::string, std::string> named;
+
+    bool has(const std::string& name) const { return this->named.count(name) > 0; }
+    std::string get(const std::string& name, const std::string& default_val) const;
+    int get_int(const std::string& name, int default_val) const;
+    double get_double(const std::string& name, double default_val) const;
+};
+
+CommandLineArgs parse_command_line(int argc, char* argv[]);
+//As above, for arguments that did not come from the command line. args does not start with the program name.
+CommandLineArgs parse_command_line(const std::vector<std::string>& args);
+
 #endif